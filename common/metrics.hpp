@@ -0,0 +1,96 @@
+#ifndef __COMMON_METRICS_HPP__
+#define __COMMON_METRICS_HPP__
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <process/future.hpp>
+
+#include <process/metrics/metric.hpp>
+
+#include <stout/duration.hpp>
+#include <stout/option.hpp>
+
+namespace mesos {
+namespace modules {
+namespace common {
+
+// A metric that records arbitrary samples (e.g., batch sizes or
+// latencies). The value of the metric is the last sample recorded,
+// and when created with a `window` the `/metrics/snapshot` endpoint
+// additionally reports the percentiles of the samples recorded in
+// that window, so the metric can be used as a histogram.
+class Distribution : public process::metrics::Metric
+{
+public:
+  explicit Distribution(
+      const std::string& name,
+      const Option<Duration>& window = Hours(1))
+    : process::metrics::Metric(name, window),
+      data(new Data()) {}
+
+  virtual ~Distribution() {}
+
+  virtual process::Future<double> value() const
+  {
+    return data->value.load();
+  }
+
+  void set(double value)
+  {
+    data->value.store(value);
+    push(value);
+  }
+
+private:
+  struct Data
+  {
+    Data() : value(0) {}
+
+    std::atomic<double> value;
+  };
+
+  std::shared_ptr<Data> data;
+};
+
+
+// A metric whose value is the current level of something (e.g., the
+// depth of a queue), as set by its owner. Unlike a `Distribution`,
+// it keeps no samples, so the `/metrics/snapshot` endpoint reports
+// no percentiles for it.
+class Gauge : public process::metrics::Metric
+{
+public:
+  explicit Gauge(const std::string& name)
+    : process::metrics::Metric(name, None()),
+      data(new Data()) {}
+
+  virtual ~Gauge() {}
+
+  virtual process::Future<double> value() const
+  {
+    return data->value.load();
+  }
+
+  void set(double value)
+  {
+    data->value.store(value);
+  }
+
+private:
+  struct Data
+  {
+    Data() : value(0) {}
+
+    std::atomic<double> value;
+  };
+
+  std::shared_ptr<Data> data;
+};
+
+} // namespace common {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __COMMON_METRICS_HPP__
@@ -1,136 +1,473 @@
-#ifndef __OVERLAY_UTILS_HPP__
-#define __OVERLAY_UTILS_HPP__
+#ifndef __COMMON_SHELL_HPP__
+#define __COMMON_SHELL_HPP__
 
+#include <signal.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <tuple>
 #include <vector>
 
+#include <process/clock.hpp>
 #include <process/collect.hpp>
-#include <process/io.hpp>
+#include <process/defer.hpp>
+#include <process/dispatch.hpp>
 #include <process/future.hpp>
+#include <process/id.hpp>
+#include <process/io.hpp>
+#include <process/owned.hpp>
+#include <process/process.hpp>
 #include <process/subprocess.hpp>
+#include <process/time.hpp>
+
+#include <process/metrics/counter.hpp>
+#include <process/metrics/metrics.hpp>
+
+#include <stout/bytes.hpp>
+#include <stout/duration.hpp>
+#include <stout/lambda.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/fcntl.hpp>
+
+#include "common/metrics.hpp"
 
 namespace mesos {
 namespace modules {
 namespace common {
 
-// Run `command` as a shell script. This is useful when wanting to
-// chain shell commands.
-inline process::Future<std::string> runScriptCommand(
-    const std::string& command)
+// Maximum number of commands of the overlay modules running at the
+// same time. The other commands wait for a running command to exit.
+constexpr size_t MAX_CONCURRENT_COMMANDS = 16;
+
+// Maximum size of the stdout, and of the stderr, of a command. The
+// largest output we read is the `nat` table of `iptables-save`.
+const Bytes MAX_COMMAND_OUTPUT = Megabytes(64);
+
+// Time after which a command, e.g., a `docker` CLI waiting on a hung
+// Docker daemon, is killed.
+const Duration DEFAULT_COMMAND_TIMEOUT = Minutes(2);
+
+
+// Metrics of the commands run by a `Shell`, exposed on
+// `/metrics/snapshot`.
+struct ShellMetrics
 {
-  Try<process::Subprocess> s = process::subprocess(
-      command,
-      process::Subprocess::PATH("/dev/null"),
-      process::Subprocess::PIPE(),
-      process::Subprocess::PIPE());
+  ShellMetrics()
+    : commands("overlay/shell/commands"),
+      succeeded("overlay/shell/succeeded"),
+      failed("overlay/shell/failed"),
+      timed_out("overlay/shell/timed_out"),
+      output_exceeded("overlay/shell/output_exceeded"),
+      queue_wait_ms("overlay/shell/queue_wait_ms"),
+      latency_ms("overlay/shell/latency_ms")
+  {
+    process::metrics::add(commands);
+    process::metrics::add(succeeded);
+    process::metrics::add(failed);
+    process::metrics::add(timed_out);
+    process::metrics::add(output_exceeded);
+    process::metrics::add(queue_wait_ms);
+    process::metrics::add(latency_ms);
+  }
 
-  if (s.isError()) {
-    return process::Failure(
-        "Unable to execute '" + command + "': " + s.error());
+  ~ShellMetrics()
+  {
+    process::metrics::remove(commands);
+    process::metrics::remove(succeeded);
+    process::metrics::remove(failed);
+    process::metrics::remove(timed_out);
+    process::metrics::remove(output_exceeded);
+    process::metrics::remove(queue_wait_ms);
+    process::metrics::remove(latency_ms);
   }
 
-  return await(
-      s->status(),
-      process::io::read(s->out().get()),
-      process::io::read(s->err().get()))
-    .then([command](
-          const std::tuple<process::Future<Option<int>>,
-          process::Future<std::string>,
-          process::Future<std::string>>& t) -> process::Future<std::string> {
-        process::Future<Option<int>> status = std::get<0>(t);
-        if (!status.isReady()) {
-          return process::Failure(
-            "Failed to get the exit status of '" + command +"': " +
-            (status.isFailed() ? status.failure() : "discarded"));
-        }
+  // Number of commands started. Every command that completes is
+  // counted in exactly one of `succeeded`, `failed`, `timed_out` and
+  // `output_exceeded`.
+  process::metrics::Counter commands;
 
-        if (status->isNone()) {
-          return process::Failure("Failed to reap the subprocess");
-        }
+  // Number of commands that exited with a zero status.
+  process::metrics::Counter succeeded;
 
-        process::Future<std::string> out = std::get<1>(t);
-        if (!out.isReady()) {
-          return process::Failure(
-            "Failed to read stderr from the subprocess: " +
-            (out.isFailed() ? out.failure() : "discarded"));
-        }
+  // Number of commands that could not be started or reaped, or exited
+  // with a non-zero status.
+  process::metrics::Counter failed;
 
-        process::Future<std::string> err = std::get<2>(t);
-        if (!err.isReady()) {
-          return process::Failure(
-              "Failed to read stderr from the subprocess: " +
-              (err.isFailed() ? err.failure() : "discarded"));
-        }
+  // Number of commands killed because they ran past their timeout.
+  process::metrics::Counter timed_out;
 
-        if (status.get() != 0) {
-          return process::Failure(
-              "Failed to execute '" + command + "': " + err.get());
-        }
+  // Number of commands whose stdout or stderr exceeded the limit.
+  process::metrics::Counter output_exceeded;
 
-        return out.get();
-    });
+  // Time spent by the commands waiting for a running command to exit.
+  Distribution queue_wait_ms;
+
+  // Time taken by the commands, from their start to their exit.
+  Distribution latency_ms;
 };
 
 
-// Exec's a command.
-inline process::Future<std::string> runCommand(
-    const std::string& command,
-    const std::vector<std::string>& argv)
+class ShellProcess : public process::Process<ShellProcess>
 {
-  Try<process::Subprocess> s = process::subprocess(
-      command,
-      argv,
-      process::Subprocess::PATH("/dev/null"),
-      process::Subprocess::PIPE(),
-      process::Subprocess::PIPE());
-
-  if (s.isError()) {
-    return process::Failure("Unable to execute '" + command + "': " + s.error());
+public:
+  ShellProcess(size_t _maxConcurrent, const Bytes& _maxOutput)
+    : ProcessBase(process::ID::generate("overlay-shell")),
+      maxConcurrent(_maxConcurrent),
+      maxOutput(_maxOutput),
+      running(0) {}
+
+  process::Future<std::string> run(
+      const std::string& command,
+      const Option<std::vector<std::string>>& argv,
+      const Duration& timeout)
+  {
+    process::Owned<Command> _command(new Command());
+    _command->command = command;
+    _command->argv = argv;
+    _command->timeout = timeout;
+    _command->queued = process::Clock::now();
+
+    queue.push_back(_command);
+
+    schedule();
+
+    return _command->promise.future();
+  }
+
+private:
+  struct Command
+  {
+    Command() : timedOut(false), outputExceeded(false) {}
+
+    std::string command;
+
+    // The arguments the command is exec'd with, if it is not run as a
+    // shell script.
+    Option<std::vector<std::string>> argv;
+
+    Duration timeout;
+    process::Time queued;
+    process::Promise<std::string> promise;
+
+    // Why the command failed, if it timed out or exceeded the output
+    // limit, so that it is only counted once.
+    bool timedOut;
+    bool outputExceeded;
+  };
+
+  // The output of a command, of which at most `maxOutput` is kept.
+  struct Output
+  {
+    Output() : exceeded(false) {}
+
+    std::string data;
+    bool exceeded;
+  };
+
+  typedef std::tuple<
+      process::Future<Option<int>>,
+      process::Future<Output>,
+      process::Future<Output>> Outcome;
+
+  // Starts the queued commands, in order, while fewer than
+  // `maxConcurrent` commands are running.
+  void schedule()
+  {
+    while (running < maxConcurrent && !queue.empty()) {
+      process::Owned<Command> command = queue.front();
+      queue.pop_front();
+
+      // The caller no longer waits for the command.
+      if (command->promise.future().hasDiscard()) {
+        command->promise.discard();
+        continue;
+      }
+
+      ++running;
+      ++metrics.commands;
+
+      const process::Time started = process::Clock::now();
+      metrics.queue_wait_ms.set((started - command->queued).ms());
+
+      execute(command)
+        .onAny(process::defer(
+            self(),
+            [=](const process::Future<std::string>& result) {
+              --running;
+
+              metrics.latency_ms.set((process::Clock::now() - started).ms());
+
+              if (result.isReady()) {
+                ++metrics.succeeded;
+              } else if (command->timedOut) {
+                ++metrics.timed_out;
+              } else if (command->outputExceeded) {
+                ++metrics.output_exceeded;
+              } else {
+                ++metrics.failed;
+              }
+
+              command->promise.associate(result);
+
+              schedule();
+            }));
+    }
+  }
+
+  process::Future<std::string> execute(
+      const process::Owned<Command>& command)
+  {
+    // The command runs in a session of its own, hence in a process
+    // group of its own, so that the children it forks are killed with
+    // it when it times out.
+    const std::vector<process::Subprocess::ParentHook> parentHooks;
+    const std::vector<process::Subprocess::ChildHook> childHooks = {
+      process::Subprocess::ChildHook::SETSID()
+    };
+
+    Try<process::Subprocess> s = command->argv.isSome()
+      ? process::subprocess(
+            command->command,
+            command->argv.get(),
+            process::Subprocess::PATH("/dev/null"),
+            process::Subprocess::PIPE(),
+            process::Subprocess::PIPE(),
+            nullptr,
+            None(),
+            None(),
+            parentHooks,
+            childHooks)
+      : process::subprocess(
+            command->command,
+            process::Subprocess::PATH("/dev/null"),
+            process::Subprocess::PIPE(),
+            process::Subprocess::PIPE(),
+            None(),
+            None(),
+            parentHooks,
+            childHooks);
+
+    if (s.isError()) {
+      return process::Failure(
+          "Unable to execute '" + command->command + "': " + s.error());
+    }
+
+    const process::Subprocess subprocess = s.get();
+
+    process::Future<Outcome> outcome = process::await(
+        subprocess.status(),
+        read(subprocess.out().get(), maxOutput.bytes()),
+        read(subprocess.err().get(), maxOutput.bytes()));
+
+    // NOTE: The pipes of the subprocess are closed once the last copy
+    // of the `Subprocess` is gone, so we keep one until the pipes have
+    // been read, even if the command times out before.
+    outcome.onAny([subprocess]() {});
+
+    return outcome
+      .after(
+          command->timeout,
+          process::defer(
+              self(),
+              &ShellProcess::timedOut,
+              command,
+              subprocess,
+              lambda::_1))
+      .then(process::defer(
+          self(),
+          &ShellProcess::_execute,
+          command,
+          lambda::_1));
+  }
+
+  process::Future<Outcome> timedOut(
+      const process::Owned<Command>& command,
+      const process::Subprocess& subprocess,
+      const process::Future<Outcome>& outcome)
+  {
+    command->timedOut = true;
+
+    // NOTE: We only kill the process group while the command has not
+    // been reaped, since its PID could have been reused otherwise.
+    if (subprocess.status().isPending()) {
+      ::killpg(subprocess.pid(), SIGKILL);
+    }
+
+    return process::Failure(
+        "'" + command->command + "' timed out after " +
+        stringify(command->timeout));
   }
 
-  return await(
-      s->status(),
-      process::io::read(s->out().get()),
-      process::io::read(s->err().get()))
-    .then([command](
-          const std::tuple<process::Future<Option<int>>,
-          process::Future<std::string>,
-          process::Future<std::string>>& t) -> process::Future<std::string> {
-        process::Future<Option<int>> status = std::get<0>(t);
-        if (!status.isReady()) {
-        return process::Failure(
-          "Failed to get the exit status of '" + command +"': " +
+  process::Future<std::string> _execute(
+      const process::Owned<Command>& command,
+      const Outcome& outcome)
+  {
+    const std::string& name = command->command;
+
+    process::Future<Option<int>> status = std::get<0>(outcome);
+    if (!status.isReady()) {
+      return process::Failure(
+          "Failed to get the exit status of '" + name + "': " +
           (status.isFailed() ? status.failure() : "discarded"));
-        }
+    }
 
-        if (status->isNone()) {
-        return process::Failure("Failed to reap the subprocess");
-        }
+    if (status->isNone()) {
+      return process::Failure("Failed to reap the subprocess");
+    }
 
-        process::Future<std::string> out = std::get<1>(t);
-        if (!out.isReady()) {
-        return process::Failure(
-          "Failed to read stderr from the subprocess: " +
+    process::Future<Output> out = std::get<1>(outcome);
+    if (!out.isReady()) {
+      return process::Failure(
+          "Failed to read stdout from the subprocess: " +
           (out.isFailed() ? out.failure() : "discarded"));
-        }
+    }
+
+    process::Future<Output> err = std::get<2>(outcome);
+    if (!err.isReady()) {
+      return process::Failure(
+          "Failed to read stderr from the subprocess: " +
+          (err.isFailed() ? err.failure() : "discarded"));
+    }
 
-        process::Future<std::string> err = std::get<2>(t);
-        if (!err.isReady()) {
-          return process::Failure(
-              "Failed to read stderr from the subprocess: " +
-              (err.isFailed() ? err.failure() : "discarded"));
+    if (out->exceeded || err->exceeded) {
+      command->outputExceeded = true;
+
+      return process::Failure(
+          "The output of '" + name + "' exceeds " + stringify(maxOutput));
+    }
+
+    if (status.get() != 0) {
+      return process::Failure(
+          "Failed to execute '" + name + "': " + err->data);
+    }
+
+    return out->data;
+  }
+
+  // Reads `fd` until EOF, keeping at most `limit` bytes. The rest of
+  // the output is drained, so that the command does not block on a
+  // full pipe.
+  static process::Future<Output> read(int_fd fd, size_t limit)
+  {
+    Try<Nothing> nonblock = os::nonblock(fd);
+    if (nonblock.isError()) {
+      return process::Failure(
+          "Failed to make the pipe non-blocking: " + nonblock.error());
+    }
+
+    std::shared_ptr<Output> output(new Output());
+    std::shared_ptr<std::vector<char>> buffer(new std::vector<char>(65536));
+
+    return _read(fd, limit, output, buffer);
+  }
+
+  static process::Future<Output> _read(
+      int_fd fd,
+      size_t limit,
+      const std::shared_ptr<Output>& output,
+      const std::shared_ptr<std::vector<char>>& buffer)
+  {
+    return process::io::read(fd, buffer->data(), buffer->size())
+      .then([=](size_t length) -> process::Future<Output> {
+        if (length == 0) {
+          return *output;
         }
 
-        if (status.get() != 0) {
-          return process::Failure(
-              "Failed to execute '" + command + "': " + err.get());
+        if (output->data.size() + length > limit) {
+          output->exceeded = true;
+        } else {
+          output->data.append(buffer->data(), length);
         }
 
-        return out.get();
-    });
+        return _read(fd, limit, output, buffer);
+      });
+  }
+
+  const size_t maxConcurrent;
+  const Bytes maxOutput;
+
+  size_t running;
+  std::deque<process::Owned<Command>> queue;
+
+  ShellMetrics metrics;
 };
 
+
+// Runs the commands of the overlay modules as subprocesses, at most
+// `maxConcurrent` at a time, in the order they are submitted. A
+// command that runs past its timeout is killed with its process
+// group, and a command whose stdout or stderr exceeds `maxOutput`
+// fails.
+class Shell
+{
+public:
+  // Returns the `Shell` shared by the overlay modules, which is never
+  // destroyed, like the other singletons of libprocess.
+  static Shell* instance()
+  {
+    static Shell* shell =
+      new Shell(MAX_CONCURRENT_COMMANDS, MAX_COMMAND_OUTPUT);
+
+    return shell;
+  }
+
+  Shell(size_t maxConcurrent, const Bytes& maxOutput)
+    : process(new ShellProcess(maxConcurrent, maxOutput))
+  {
+    process::spawn(process.get());
+  }
+
+  ~Shell()
+  {
+    process::terminate(process.get());
+    process::wait(process.get());
+  }
+
+  // Runs `command` with `argv`, or as a shell script if `argv` is
+  // not set, and returns its stdout.
+  process::Future<std::string> run(
+      const std::string& command,
+      const Option<std::vector<std::string>>& argv,
+      const Duration& timeout)
+  {
+    return process::dispatch(
+        process.get(),
+        &ShellProcess::run,
+        command,
+        argv,
+        timeout);
+  }
+
+private:
+  process::Owned<ShellProcess> process;
+};
+
+
+// Run `command` as a shell script. This is useful when wanting to
+// chain shell commands.
+inline process::Future<std::string> runScriptCommand(
+    const std::string& command,
+    const Duration& timeout = DEFAULT_COMMAND_TIMEOUT)
+{
+  return Shell::instance()->run(command, None(), timeout);
+}
+
+
+// Exec's a command.
+inline process::Future<std::string> runCommand(
+    const std::string& command,
+    const std::vector<std::string>& argv,
+    const Duration& timeout = DEFAULT_COMMAND_TIMEOUT)
+{
+  return Shell::instance()->run(command, argv, timeout);
+}
+
 } // namespace common {
 } // namespace modules {
 } // namespace mesos {
 
-#endif // __OVERLAY_UTILS_HPP__
+#endif // __COMMON_SHELL_HPP__
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <functional>
 #include <list>
 #include <sstream>
 #include <set>
@@ -10,15 +12,22 @@
 #include <stout/json.hpp>
 #include <stout/jsonify.hpp>
 #include <stout/os.hpp>
+#include <stout/os/close.hpp>
 #include <stout/os/exists.hpp>
+#include <stout/os/open.hpp>
+#include <stout/os/read.hpp>
+#include <stout/os/rename.hpp>
+#include <stout/os/rm.hpp>
 #include <stout/os/write.hpp>
 #include <stout/protobuf.hpp>
 #include <stout/strings.hpp>
 #include <stout/try.hpp>
 
+#include <process/clock.hpp>
 #include <process/collect.hpp>
 #include <process/defer.hpp>
 #include <process/delay.hpp>
+#include <process/dispatch.hpp>
 #include <process/future.hpp>
 #include <process/help.hpp>
 #include <process/http.hpp>
@@ -27,7 +36,6 @@
 #include <process/pid.hpp>
 #include <process/process.hpp>
 #include <process/protobuf.hpp>
-#include <process/subprocess.hpp>
 
 #include <mesos/http.hpp>
 #include <mesos/master/detector.hpp>
@@ -53,18 +61,18 @@ typedef mesos::modules::overlay::AgentOverlayInfo::State OverlayState;
 
 using std::list;
 using std::string;
-using std::tuple;
 using std::vector;
 
 using process::delay;
 
+using process::Clock;
 using process::DESCRIPTION;
 using process::Future;
 using process::Failure;
 using process::HELP;
 using process::Owned;
 using process::Promise;
-using process::Subprocess;
+using process::Time;
 using process::TLDR;
 using process::UPID;
 using process::USAGE;
@@ -73,6 +81,8 @@ using mesos::Parameters;
 
 using mesos::master::detector::MasterDetector;
 
+using mesos::modules::common::DEFAULT_COMMAND_TIMEOUT;
+using mesos::modules::common::runCommand;
 using mesos::modules::common::runScriptCommand;
 
 using mesos::modules::Anonymous;
@@ -82,11 +92,18 @@ using mesos::modules::overlay::AgentInfo;
 using mesos::modules::overlay::BridgeInfo;
 using mesos::modules::overlay::MESOS_MASTER;
 using mesos::modules::overlay::MESOS_ZK;
+using mesos::modules::overlay::ReconciliationInfo;
+using mesos::modules::overlay::internal::AgentCheckpoint;
 using mesos::modules::overlay::internal::AgentConfig;
 using mesos::modules::overlay::internal::AgentNetworkConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
+using mesos::modules::overlay::internal::MasterReadyMessage;
+using mesos::modules::overlay::internal::PeerInfo;
+using mesos::modules::overlay::internal::PeerSnapshotRequestMessage;
+using mesos::modules::overlay::internal::PeerUpdateMessage;
 using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RegisterAgentNackMessage;
 using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
 
 namespace mesos {
@@ -104,7 +121,39 @@ static string OVERLAY_HELP()
       TLDR(
           "Show the agent network overlay information."),
       DESCRIPTION(
-          "Shows the Agent IP, Agent subnet, VTEP IP, VTEP MAC and bridges."));
+          "Shows the Agent IP, Agent subnet, VTEP IP, VTEP MAC and bridges.",
+          "",
+          "The response carries an ETag. A request whose 'If-None-Match'",
+          "header holds the ETag of the current information is answered",
+          "with '304 Not Modified'."));
+}
+
+
+static string STREAM_HELP()
+{
+  return HELP(
+      TLDR(
+          "Stream the status transitions of the overlays."),
+      DESCRIPTION(
+          "Streams a JSON object per line for every status transition of",
+          "the overlays configured on the Agent, with the 'name' of the",
+          "overlay, its 'status', and the 'error' of a 'STATUS_FAILED'",
+          "overlay. The stream starts with the current status of every",
+          "overlay."));
+}
+
+
+static string RECONCILIATION_HELP()
+{
+  return HELP(
+      TLDR(
+          "Show the last reconciliation of the overlays."),
+      DESCRIPTION(
+          "Shows the number of overlays configured by the last",
+          "reconciliation of the overlays with the host network state,",
+          "and the time spent in every phase of the reconciliation.",
+          "Answered with '404 Not Found' until a reconciliation has",
+          "completed."));
 }
 
 
@@ -149,6 +198,23 @@ Try<Owned<ManagerProcess>> ManagerProcess::create(
       networkConfig.CopyFrom(agentConfig.network_config());
   }
 
+  // NOTE: The subnets allocated to the Agent are split in two for the
+  // Mesos and Docker bridges.
+  if (networkConfig.has_subnet_prefix() &&
+      (networkConfig.subnet_prefix() == 0 ||
+       networkConfig.subnet_prefix() > 31)) {
+    return Error(
+        "Invalid subnet prefix " + stringify(networkConfig.subnet_prefix()));
+  }
+
+  if (networkConfig.has_subnet_prefix6() &&
+      (networkConfig.subnet_prefix6() == 0 ||
+       networkConfig.subnet_prefix6() > 127)) {
+    return Error(
+        "Invalid IPv6 subnet prefix " +
+        stringify(networkConfig.subnet_prefix6()));
+  }
+
   // It is imperative that MASQUERADE rules are not enforced on
   // overlay traffic. To ensure that overlay traffic is not NATed,
   // the Agent module disables masquerade on Docker and Mesos
@@ -194,12 +260,65 @@ Try<Owned<ManagerProcess>> ManagerProcess::create(
     }
   }
 
+  Try<Owned<Netfilter>> netfilter =
+    Netfilter::create(agentConfig.netfilter_backend());
+
+  if (netfilter.isError()) {
+    return Error(
+        "Unable to create the netfilter backend: " + netfilter.error());
+  }
+
+  Owned<DatapathProcess> datapath;
+  if (agentConfig.configure_vtep()) {
+    if (agentConfig.vtep_port() == 0 ||
+        agentConfig.vtep_port() > UINT16_MAX) {
+      return Error(
+          "Invalid VTEP port " + stringify(agentConfig.vtep_port()));
+    }
+
+    datapath.reset(new DatapathProcess(agentConfig.vtep_port()));
+  }
+
+  Owned<DockerClient> docker;
+  if (!agentConfig.docker_socket().empty()) {
+    Try<Owned<DockerClient>> _docker =
+      DockerClient::create(agentConfig.docker_socket());
+
+    if (_docker.isError()) {
+      return Error(
+          "Unable to create the Docker client: " + _docker.error());
+    }
+
+    docker = _docker.get();
+  }
+
+  Owned<Ipam> ipam;
+  if (agentConfig.has_ipam_socket()) {
+    Try<Owned<Ipam>> _ipam =
+      Ipam::create(agentConfig.ipam_dir(), agentConfig.ipam_socket());
+
+    if (_ipam.isError()) {
+      return Error("Unable to create the IPAM: " + _ipam.error());
+    }
+
+    ipam = _ipam.get();
+  }
+
   return Owned<ManagerProcess>(
       new ManagerProcess(
         agentConfig.cni_dir(),
         networkConfig,
         agentConfig.max_configuration_attempts(),
-        Owned<MasterDetector>(detector.get())));
+        Owned<MasterDetector>(detector.get()),
+        netfilter.get(),
+        datapath,
+        docker,
+        ipam,
+        agentConfig.ipam_socket(),
+        agentConfig.has_checkpoint_path()
+          ? Option<string>(agentConfig.checkpoint_path())
+          : None(),
+        Seconds(agentConfig.drift_check_interval_secs())));
 }
 
 
@@ -209,16 +328,42 @@ Future<Nothing> ManagerProcess::ready()
 }
 
 
+ManagerProcess::~ManagerProcess()
+{
+  if (datapath.get() != nullptr) {
+    process::terminate(datapath.get());
+    process::wait(datapath.get());
+  }
+}
+
+
 void ManagerProcess::initialize()
 {
   LOG(INFO) << "Initializing overlay agent manager";
 
+  if (datapath.get() != nullptr) {
+    process::spawn(datapath.get());
+  }
+
   route("/overlay",
       OVERLAY_HELP(),
       &ManagerProcess::overlay);
 
+  route("/overlay/stream",
+      STREAM_HELP(),
+      &ManagerProcess::stream);
+
+  route("/overlay/reconciliation",
+      RECONCILIATION_HELP(),
+      &ManagerProcess::reconciliation);
+
   state = REGISTERING;
 
+  // NOTE: We recover the overlays before detecting the master, so
+  // that the first registration asks for the overlays assigned since
+  // the checkpointed generation.
+  recover();
+
   detector->detect()
     .onAny(defer(self(), &ManagerProcess::detected, lambda::_1));
 
@@ -228,6 +373,18 @@ void ManagerProcess::initialize()
 
   install<AgentRegisteredAcknowledgement>(
       &ManagerProcess::agentRegisteredAcknowledgement);
+
+  install<PeerUpdateMessage>(&ManagerProcess::updatePeers);
+
+  // A master that is processing too many registrations defers ours,
+  // and tells us when it is ready to process it.
+  install<RegisterAgentNackMessage>(&ManagerProcess::registrationDeferred);
+
+  install<MasterReadyMessage>(&ManagerProcess::masterReady);
+
+  if (driftCheckInterval > Duration::zero()) {
+    delay(driftCheckInterval, self(), &ManagerProcess::checkDrift);
+  }
 }
 
 
@@ -246,19 +403,105 @@ void ManagerProcess::exited(const UPID& pid)
   doReliableRegistration(INITIAL_BACKOFF_PERIOD);
 }
 
+// Returns whether `overlay` is configured like `configured`, i.e.,
+// with the same subnets and VTEP, which are the parts of the
+// configuration of an overlay that the master changes.
+static bool sameConfiguration(
+    const AgentOverlayInfo& configured,
+    const AgentOverlayInfo& overlay)
+{
+  return configured.info().subnet() == overlay.info().subnet() &&
+    configured.info().subnet6() == overlay.info().subnet6() &&
+    configured.backend().vxlan().vtep_name() ==
+      overlay.backend().vxlan().vtep_name();
+}
+
+
 void ManagerProcess::updateAgentOverlays(
     const UPID& from,
     const UpdateAgentOverlaysMessage& message)
 {
   LOG(INFO) << "Received 'UpdateAgentOverlaysMessage' from " << from;
 
+  // Once we are registered, the master sends us the overlays added,
+  // resized or removed at runtime, which we configure like the
+  // overlays of a registration.
+  if (state == REGISTERED &&
+      overlayMaster.isSome() &&
+      from == overlayMaster.get()) {
+    bool changed = false;
+
+    foreach (const string& name, message.removed_overlays()) {
+      changed = changed || overlays.contains(name);
+    }
+
+    foreach (const AgentOverlayInfo& overlay, message.overlays()) {
+      const string& name = overlay.info().name();
+      changed = changed ||
+        !overlays.contains(name) ||
+        !sameConfiguration(overlays.at(name), overlay);
+    }
+
+    if (!changed) {
+      VLOG(1) << "Ignored 'UpdateAgentOverlaysMessage' from " << from
+              << " since the overlays have not changed";
+      return;
+    }
+
+    LOG(INFO) << "Overlay master " << from << " changed the overlays, "
+              << "moving to `REGISTERING` state";
+
+    state = REGISTERING;
+    configAttempts = 0;
+
+    // Register again if the master does not acknowledge the overlays
+    // we configure.
+    if (registrationTimer.isSome()) {
+      Clock::cancel(registrationTimer.get());
+    }
+
+    registrationTimer = delay(
+        INITIAL_BACKOFF_PERIOD,
+        self(),
+        &ManagerProcess::doReliableRegistration,
+        INITIAL_BACKOFF_PERIOD);
+  }
+
   if (state != REGISTERING) {
     LOG(WARNING) << "Ignored 'UpdateAgentOverlaysMessage' from " << from
                  << " because overlay agent is not in DISCONNECTED state";
     return;
   }
 
+  hashset<string> configuring;
+  foreachpair (const string& name, const AgentOverlayInfo& overlay, overlays) {
+    if (overlay.has_state() &&
+        overlay.state().status() == OverlayState::STATUS_CONFIGURING) {
+      configuring.insert(name);
+    }
+  }
+
+  // NOTE: While overlays are being configured, we only apply a delta
+  // that removes other overlays, since the reconciliation in progress
+  // expects its overlays to exist. We drop any other update, which
+  // the master sends again when we register again.
+  if (!configuring.empty()) {
+    bool removals = message.overlays_size() == 0;
+    foreach (const string& name, message.removed_overlays()) {
+      removals = removals && !configuring.contains(name);
+    }
+
+    if (!removals) {
+      LOG(INFO) << "Dropping 'UpdateAgentOverlaysMessage' from " << from
+                << " since overlay networks "
+                << stringify(configuring) << " are in "
+                << "'STATUS_CONFIGURING'";
+      return;
+    }
+  }
+
   list<Future<Nothing>> futures;
+  vector<string> names;
   foreach (const AgentOverlayInfo& overlay, message.overlays()) {
     const string name = overlay.info().name();
 
@@ -269,23 +512,12 @@ void ManagerProcess::updateAgentOverlays(
         overlays.at(name).state().has_status() ) {
       OverlayState::Status status = overlays.at(name).state().status();
 
-      // Even if a single overlay network is in `STATUS_CONFIGURING`
-      // we need to drop processing of this message since a network
-      // configuration is in progress and we can't update the master
-      // till all network configuration has been attempted.
-      if (status == OverlayState::STATUS_CONFIGURING) {
-        LOG(INFO) << "Since overlay network '"
-                  << name << "' is in 'STATUS_CONFIGURING' dropping"
-                  << " this `UpdateAgentOverlaysMessage', since an overlay"
-                  << " network configuration is pending.";
-
-          return;
-      }
-
-      // Here, we assume that the overlay configuration never changes.
-      // Therefore, if the overlay is in `STATUS_OK`, we will skip the
-      // configuration.
-      if (status == OverlayState::STATUS_OK) {
+      // Here, we assume that the overlay configuration never changes,
+      // except for the VNI of its VTEP and its subnets. Therefore, if
+      // the overlay is in `STATUS_OK` with the same configuration, we
+      // will skip the configuration.
+      if (status == OverlayState::STATUS_OK &&
+          sameConfiguration(overlays.at(name), overlay)) {
         LOG(INFO) << "Skipping configuration for overlay network '"
                   << name << "' as it has been configured.";
 
@@ -305,8 +537,73 @@ void ManagerProcess::updateAgentOverlays(
     CHECK(!overlay.has_state());
 
     overlays[name] = overlay;
+    names.push_back(name);
+
+    snapshot = None();
+  }
+
+  // We stop configuring the overlays that have been removed, and
+  // remove their CNI configs so that no container joins them.
+  //
+  // NOTE: The bridges, the Docker networks and the netfilter rules of
+  // the overlays are left in place for the containers still running
+  // on them. Their VTEP is left in place until the next reconciliation
+  // of the datapath, unless other overlays still use it.
+  foreach (const string& name, message.removed_overlays()) {
+    if (!overlays.contains(name)) {
+      continue;
+    }
+
+    LOG(INFO) << "Removing overlay network '" << name << "'";
+
+    overlays.erase(name);
+    snapshot = None();
+
+    if (ipam.get() != nullptr) {
+      ipam->remove(name)
+        .onFailed([name](const string& failure) {
+          LOG(ERROR) << "Unable to remove the IPs of overlay '" << name
+                     << "': " << failure;
+        });
+    }
+
+    const string config = path::join(cniDir, name + ".conf");
+    if (os::exists(config)) {
+      Try<Nothing> rm = os::rm(config);
+      if (rm.isError()) {
+        LOG(ERROR) << "Unable to remove the CNI config " << config
+                   << " of overlay '" << name << "': " << rm.error();
+      }
+    }
+  }
 
-    futures.push_back(configure(name));
+  // The overlays are configured together, so that the host network
+  // state they share is programmed once for all of them.
+  if (!names.empty()) {
+    futures.push_back(reconcile(names));
+  }
+
+  if (message.has_generation()) {
+    generation = message.generation();
+  }
+
+  // The master is told about the overlays left once the overlays
+  // being configured are configured.
+  if (!configuring.empty()) {
+    LOG(INFO) << "Removed overlays while overlay networks "
+              << stringify(configuring) << " are being configured";
+    return;
+  }
+
+  // An empty delta means that we have already applied the
+  // configuration of the master, so we just need to report the state
+  // of our overlays.
+  if (futures.empty() && message.delta()) {
+    LOG(INFO) << "Overlay configuration is up to date at generation "
+              << message.generation();
+
+    _updateAgentOverlays(list<Future<Nothing>>());
+    return;
   }
 
   // If we don't have any `Futures` setup that means this was a
@@ -352,6 +649,8 @@ void ManagerProcess::_updateAgentOverlays(
                << strings::join("\n", messages);
   }
 
+  checkpoint();
+
   if (state != REGISTERING) {
     LOG(WARNING) << "Ignored sending registered message because "
                  << "agent is not in REGISTERING state";
@@ -432,6 +731,11 @@ void ManagerProcess::detected(const Future<Option<MasterInfo>>& mesosMaster)
   configAttempts = 0;
   state = REGISTERING;
 
+  // The new master sends us a snapshot of its peer table once we
+  // have registered with it.
+  peerVersion = None();
+  peerSnapshotRequested = false;
+
   Option<MasterInfo> latestMesosMaster = None();
 
   if (mesosMaster.isDiscarded()) {
@@ -469,6 +773,14 @@ void ManagerProcess::detected(const Future<Option<MasterInfo>>& mesosMaster)
 
 void ManagerProcess::doReliableRegistration(Duration maxBackoff)
 {
+  // NOTE: We might be called before the pending attempt is due, e.g.,
+  // when a new master is detected, in which case the pending attempt
+  // is superseded by this one.
+  if (registrationTimer.isSome()) {
+    Clock::cancel(registrationTimer.get());
+    registrationTimer = None();
+  }
+
   if (state == REGISTERED) {
     LOG(INFO) << "Overlay agent is already in REGISTERED state";
     return;
@@ -482,6 +794,24 @@ void ManagerProcess::doReliableRegistration(Duration maxBackoff)
   RegisterAgentMessage registerMessage;
   registerMessage.mutable_network_config()->CopyFrom(networkConfig);
 
+  // Only ask for the overlays assigned since the generation we have
+  // applied if all our overlays have been configured. Otherwise we
+  // need the complete configuration to retry the failed overlays.
+  if (generation.isSome()) {
+    bool configured = true;
+    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+      if (!overlay.has_state() ||
+          overlay.state().status() != OverlayState::STATUS_OK) {
+        configured = false;
+        break;
+      }
+    }
+
+    if (configured) {
+      registerMessage.set_generation(generation.get());
+    }
+  }
+
   // Send registration to the overlay master.
   LOG(INFO) << "Sending registration message to master: "
             << overlayMaster.get();
@@ -497,310 +827,1295 @@ void ManagerProcess::doReliableRegistration(Duration maxBackoff)
 
   VLOG(1) << "Will retry registration in " << backoff << " if necessary";
 
-  delay(backoff,
+  registrationTimer = delay(
+      backoff,
       self(),
       &ManagerProcess::doReliableRegistration,
       maxBackoff * 2);
 }
 
 
-Future<http::Response> ManagerProcess::overlay(const http::Request& request)
+void ManagerProcess::registrationDeferred(
+    const UPID& from,
+    const RegisterAgentNackMessage& message)
 {
-  AgentInfo agent;
-  agent.set_ip(stringify(self().address.ip));
+  if (overlayMaster.isNone() || from != overlayMaster.get()) {
+    LOG(WARNING) << "Ignored 'RegisterAgentNackMessage' from " << from
+                 << " since it is not the overlay master";
+    return;
+  }
 
-  foreachvalue (const AgentOverlayInfo& overlay, overlays) {
-    agent.add_overlays()->CopyFrom(overlay);
+  if (state == REGISTERED) {
+    return;
   }
 
-  if (request.acceptsMediaType(APPLICATION_JSON)) {
-    return http::OK(
-        JSON::protobuf(agent),
-        request.url.query.get("jsonp"));
-  } else if (request.acceptsMediaType(APPLICATION_PROTOBUF)){
-    ContentType responseContentType = ContentType::PROTOBUF;
+  // Rather than backing off blindly, retry when the master expects
+  // to be able to process our registration. The master is likely to
+  // tell us earlier with a `MasterReadyMessage`, so this attempt only
+  // matters if that message is lost.
+  const Duration retryAfter = std::min(
+      Milliseconds(message.retry_after_ms()),
+      REGISTRATION_RETRY_INTERVAL_MAX);
 
-    http::OK ok(agent.SerializeAsString());
-    ok.headers["Content-Type"] = stringify(responseContentType);
+  LOG(INFO) << "Overlay master " << from << " deferred our registration"
+            << (message.has_reason() ? ": " + message.reason() : "")
+            << ", retrying in " << retryAfter;
 
-    return ok;
-  } else {
-    return http::UnsupportedMediaType(
-        string("Client needs to support either ") +
-        APPLICATION_JSON + " or " + APPLICATION_PROTOBUF);
+  if (registrationTimer.isSome()) {
+    Clock::cancel(registrationTimer.get());
   }
+
+  registrationTimer = delay(
+      retryAfter,
+      self(),
+      &ManagerProcess::doReliableRegistration,
+      INITIAL_BACKOFF_PERIOD);
 }
 
 
-Future<Nothing> ManagerProcess::configure(const string& name)
+void ManagerProcess::masterReady(const UPID& from)
 {
-  CHECK(overlays.contains(name));
+  if (overlayMaster.isNone() || from != overlayMaster.get()) {
+    LOG(WARNING) << "Ignored 'MasterReadyMessage' from " << from
+                 << " since it is not the overlay master";
+    return;
+  }
 
-  overlays[name].mutable_state()->set_status(
-      OverlayState::STATUS_CONFIGURING);
+  if (state == REGISTERED) {
+    return;
+  }
 
-  return await(configureMesosNetwork(name),
-      configureDockerNetwork(name))
-    .then(defer(self(),
-          &Self::_configure,
-          name,
-          lambda::_1));
+  LOG(INFO) << "Overlay master " << from << " is ready for our registration";
+
+  doReliableRegistration(INITIAL_BACKOFF_PERIOD);
 }
 
 
-Future<Nothing> ManagerProcess::_configure(
-    const string& name,
-    const tuple<Future<Nothing>, Future<Nothing>>& t)
+void ManagerProcess::updatePeers(
+    const UPID& from,
+    const PeerUpdateMessage& message)
 {
-  CHECK(overlays.contains(name));
-
-  Future<Nothing> mesos = std::get<0>(t);
-  Future<Nothing> docker = std::get<1>(t);
+  if (overlayMaster.isNone() || from != overlayMaster.get()) {
+    LOG(WARNING) << "Ignored 'PeerUpdateMessage' from " << from
+                 << " since it is not the overlay master";
+    return;
+  }
 
-  vector<string> errors;
+  if (message.snapshot()) {
+    peers.clear();
+    peerSnapshotRequested = false;
+  } else if (peerVersion.isNone() || peerVersion.get() != message.base()) {
+    // We have missed an update, so we can't apply this one.
+    if (!peerSnapshotRequested) {
+      LOG(INFO) << "Requesting a snapshot of the peer table from " << from
+                << " since the update of version " << message.version()
+                << " does not apply to version "
+                << (peerVersion.isSome() ? stringify(peerVersion.get())
+                                         : "none");
+
+      peerSnapshotRequested = true;
+      send(from, PeerSnapshotRequestMessage());
+    }
 
-  if (!mesos.isReady()) {
-    errors.push_back((mesos.isFailed() ? mesos.failure() : "discarded"));
+    return;
   }
 
-  if (!docker.isReady()) {
-    errors.push_back((docker.isFailed() ? docker.failure() : "discarded"));
+  foreach (const PeerInfo& peer, message.peers()) {
+    peers[peer.agent_ip()] = peer;
   }
 
-  auto overlaySuccess = [=](const Future<string>& result) -> Future<Nothing> {
-    CHECK(overlays.contains(name));
-    overlays[name].mutable_state()->set_status(OverlayState::STATUS_OK);
-
-    return Nothing();
-  };
+  peerVersion = message.version();
 
-  auto overlayFailure = [=](const string& error) {
-    CHECK(overlays.contains(name));
+  VLOG(1) << "Updated the peer table to version " << message.version()
+          << " with " << message.peers_size() << " peers, "
+          << peers.size() << " peers in total";
 
-    OverlayState* state = overlays[name].mutable_state();
-    state->set_status(OverlayState::STATUS_FAILED);
-    state->set_error(error);
-  };
+  programPeers();
+}
 
-  if (!errors.empty()) {
-    overlayFailure(strings::join(";", errors));
 
-    return Failure(strings::join(";", errors));
+void ManagerProcess::programPeers()
+{
+  // Without a `Datapath` the FDB and neighbor entries of the peers
+  // are programmed outside of the module.
+  if (datapath.get() == nullptr) {
+    return;
   }
 
-  // The Mesos and Docker Networks have been configured. Setup the
-  // ipset rule in `IPSET_OVERLAY`. If the ipset rule succeeds
-  // proceed to check the iptables rule exists for masquerading
-  // traffic from the overlay subnet. If the iptables rule does not
-  // exist insert one in the POSTROUTING chain of the NAT table.
-  // The below command is a script consisting of three commands:
-  // <set ipset> && <check iptables rule exists> ||
-  // <insert iptables rule>
-  if (!networkConfig.mesos_bridge() &&
-      !networkConfig.docker_bridge()) {
-    return overlaySuccess("");
-  } else {
-    Try<string> command = strings::format("");
-
-    if (overlays[name].info().has_subnet()) {
-      const string overlaySubnet = overlays[name].info().subnet();
-
-      command = strings::format(
-          "ipset add -exist %s %s" " nomatch &&"
-          " iptables -t nat -C POSTROUTING -s %s -m set"
-          " --match-set %s dst -j MASQUERADE ||"
-          " iptables -t nat -A POSTROUTING -s %s -m"
-          " set --match-set %s dst -j MASQUERADE",
-          IPSET_OVERLAY,
-          overlaySubnet,
-          overlaySubnet,
-          IPSET_OVERLAY,
-          overlaySubnet,
-          IPSET_OVERLAY);
-
-      if (command.isError()) {
-        overlayFailure(command.error());
-
-        return Failure(
-            "Unable to create iptables rule for overlay " +
-            name + ": " + command.error());
-      }
+  const string agentIP = stringify(self().address.ip);
+
+  vector<Peer> _peers;
+  foreachvalue (const PeerInfo& info, peers) {
+    if (info.agent_ip() == agentIP) {
+      continue;
+    }
 
-      LOG(INFO) << "Insert following iptables rule for overlay " << name
-                << ": " << command.get();
+    Try<Peer> peer = Peer::parse(info.agent_ip(), info.vxlan());
+    if (peer.isError()) {
+      LOG(WARNING) << "Ignoring peer " << info.agent_ip() << ": "
+                   << peer.error();
+      continue;
     }
 
-    // We have to explicitly chain the `onFailed` and `onDiscarded`
-    // events since we need to update the `State` of the overlay
-    // network on failure to execute the iptables script.
-    //
-    // NOTE: If we use `onAny` instead of `onFailed` and
-    // `onDiscarded`, and handle all conditions (success as well as
-    // failure) in the `onAny` callback, it causes a race with the
-    // callback setup in the `await` which listens to this future
-    // (checkout `updateAgentOverlays` method). Reason being that
-    // when a future is READY, all the READY callbacks are invoked
-    // before the `onAny` callbacks are invoked. This can result in
-    // the callback setup by `await` being invoked before the
-    // `onAny` call we seutp in this `Future`. This can cause
-    // problems since we check the overlay `State` in
-    // `_updateAgentOverlays`, which might not be set if this race
-    // were to occur, even though the overlay configuration went
-    // through fine.
-    return runScriptCommand(command.get())
-      .then(defer(self(), overlaySuccess))
-      .onFailed(defer(self(), overlayFailure))
-      .onDiscarded(defer(self(), lambda::bind(overlayFailure, "discarded")));
+    _peers.push_back(peer.get());
   }
-  return Nothing();
-}
 
+  // NOTE: The `DatapathProcess` only programs the peers once a VTEP
+  // has been configured, and the peers are programmed again once the
+  // datapath has been reconciled.
+  const size_t count = _peers.size();
 
-Future<Nothing> ManagerProcess::configureMesosNetwork(const string& name)
-{
-  CHECK(overlays.contains(name));
+  process::dispatch(datapath.get(), &DatapathProcess::update, _peers)
+    .onFailed([count](const string& failure) {
+      LOG(ERROR) << "Unable to program the " << count << " peers: "
+                 << failure;
+    });
+}
 
-  const AgentOverlayInfo& overlay = overlays[name];
 
-  if (!networkConfig.mesos_bridge()) {
-    LOG(INFO) << "Not configuring Mesos network for '" << name
-              << "' since operator has disallowed `mesos_bridge`.";
+void ManagerProcess::checkDrift()
+{
+  vector<string> names;
+  foreachpair (const string& name, const AgentOverlayInfo& overlay, overlays) {
+    if (!overlay.has_state()) {
+      continue;
+    }
 
-    if (overlay.has_mesos_bridge()) {
-      LOG(WARNING) << " We are ignoring request from Master to configure "
-                   << "`mesos_bridge` for " << name
-                   << " since operator has not configured agent to configure "
-                   << "`mesos_bridge`.";
+    // The host network state changes while overlays are being
+    // configured, so we check it once they have been configured.
+    if (overlay.state().status() == OverlayState::STATUS_CONFIGURING) {
+      delay(driftCheckInterval, self(), &Self::checkDrift);
+      return;
     }
-    return Nothing();
-  }
 
-  if (!overlay.has_subnet()) {
-    LOG(WARNING) << "IPv4 address not present for mesos bridge."
-                 << " Skipping... "<< name;
-    return Nothing();
+    if (overlay.state().status() == OverlayState::STATUS_OK) {
+      names.push_back(name);
+    }
   }
 
-  Try<Network> subnet = Network::parse(
-      overlay.mesos_bridge().ip(),
-      AF_INET);
-
-  if (subnet.isError()) {
-    return Failure("Failed to parse bridge ip: " + subnet.error());
+  if (names.empty()) {
+    delay(driftCheckInterval, self(), &Self::checkDrift);
+    return;
   }
 
-  AgentNetworkConfig _networkConfig;
-  _networkConfig.CopyFrom(networkConfig);
+  VLOG(1) << "Checking the host network state of " << names.size()
+          << " overlays";
 
-  auto config = [name, subnet, overlay, _networkConfig](
-      JSON::ObjectWriter* writer) {
-    writer->field("name", name);
-    writer->field("type", "mesos-cni-port-mapper");
-    writer->field("excludeDevices", 
-      [overlay](JSON::ArrayWriter* writer) { 
-        writer->element(overlay.mesos_bridge().name());
-    });
-    writer->field("chain", strings::upper(overlay.mesos_bridge().name())),
-    writer->field("delegate", 
-      [subnet, overlay, _networkConfig](JSON::ObjectWriter* writer) {
-        writer->field("type", "bridge");
-        writer->field("bridge", overlay.mesos_bridge().name());
-        writer->field("isGateway", true);
-        writer->field("ipMasq", false);
-        writer->field("mtu", _networkConfig.overlay_mtu());
+  ++metrics.drift_checks;
 
-        writer->field("ipam", [subnet](JSON::ObjectWriter* writer) {
-          writer->field("type", "host-local");
-          writer->field("subnet", stringify(subnet.get()));
+  repair(names)
+    .onAny(defer(self(), &Self::_checkDrift, lambda::_1));
+}
 
-          writer->field("routes", [](JSON::ArrayWriter* writer) {
-            writer->element([](JSON::ObjectWriter* writer) {
-              writer->field("dst", "0.0.0.0/0");
-            });
-          });
-        });
-      });
-  };
 
-  Try<Nothing> write = os::write(
-      path::join(cniDir, name + ".conf"),
-      jsonify(config));
+Future<list<Future<Nothing>>> ManagerProcess::repair(
+    const vector<string>& names)
+{
+  list<Future<Nothing>> futures;
 
-  if (write.isError()) {
-    return Failure("Failed to write CNI config: " + write.error());
+  // The VTEP, the bridges, and the entries of the peers.
+  if (datapath.get() != nullptr) {
+    futures.push_back(
+        process::dispatch(datapath.get(), &DatapathProcess::repair)
+          .then(defer(self(), [=](const Datapath::Drift& drift) {
+            metrics.drifted_links += drift.links;
+            metrics.drifted_peers += drift.entries;
+            metrics.repairs += drift.links + drift.entries;
+
+            return Nothing();
+          })));
   }
 
-  return Nothing();
-}
+  // The CNI configs of the Mesos networks, which are only written if
+  // they are missing or have been modified.
+  if (networkConfig.mesos_bridge()) {
+    hashset<string> written;
+    Reconciliation::Errors errors = configureMesosNetworks(names, &written);
 
+    if (!written.empty()) {
+      LOG(WARNING) << "Wrote the missing or modified CNI configs of "
+                   << stringify(written);
+    }
 
-Future<Nothing> ManagerProcess::configureDockerNetwork(const string& name)
-{
-  CHECK(overlays.contains(name));
+    metrics.drifted_cni_configs += written.size();
+    metrics.repairs += written.size();
 
-  if (!networkConfig.docker_bridge()) {
-    LOG(INFO) << "Not configuring Docker network for '" << name
-              << "' since operator has disallowed `docker_bridge`.";
+    foreachpair (const string& name, const string& error, errors) {
+      LOG(ERROR) << "Unable to repair the CNI config of overlay '" << name
+                 << "': " << error;
 
-    if (overlays[name].has_docker_bridge()) {
-      LOG(WARNING) << " We are ignoring request from Master to configure "
-                   << "`docker_bridge` for " << name
-                   << " since operator has not configured agent to configure "
-                   << "`docker_bridge`.";
+      ++metrics.repair_failures;
     }
-    return Nothing();
   }
 
-  return checkDockerNetwork(name)
-    .then(defer(self(),
-          &Self::_configureDockerNetwork,
-          name,
-          lambda::_1));
-}
+  // The Docker networks, which the `DockerClient` lists with a single
+  // request. We don't check them with the `docker` CLI, which would
+  // fork for every overlay.
+  if (docker.get() != nullptr && networkConfig.docker_bridge()) {
+    list<Future<bool>> created;
+    foreach (const string& name, names) {
+      if (overlays[name].has_docker_bridge()) {
+        created.push_back(createDockerNetwork(name));
+      }
+    }
 
+    futures.push_back(collect(created)
+      .then(defer(self(), [=](const list<bool>& results) -> Future<Nothing> {
+        const size_t count = std::count(results.begin(), results.end(), true);
+        if (count == 0) {
+          return Nothing();
+        }
 
-Future<bool> ManagerProcess::checkDockerNetwork(const string& name)
-{
-  vector<string> argv = {
-    "docker",
-    "network",
-    "inspect",
-    name
+        metrics.drifted_docker_networks += count;
+        metrics.repairs += count;
+
+        return bypassDockerIsolation();
+      })));
+  }
+
+  // The ipset entries and the iptables rules of the overlay subnets.
+  if (networkConfig.mesos_bridge() || networkConfig.docker_bridge()) {
+    vector<string> subnets;
+    foreach (const string& name, names) {
+      if (overlays[name].info().has_subnet()) {
+        subnets.push_back(overlays[name].info().subnet());
+      }
+    }
+
+    futures.push_back(netfilter->repair(subnets)
+      .then(defer(self(), [=](const vector<string>& drifted) {
+        metrics.drifted_netfilter_rules += drifted.size();
+        metrics.repairs += drifted.size();
+
+        return Nothing();
+      })));
+  }
+
+  return await(futures);
+}
+
+
+void ManagerProcess::_checkDrift(const Future<list<Future<Nothing>>>& results)
+{
+  if (results.isReady()) {
+    foreach (const Future<Nothing>& result, results.get()) {
+      if (!result.isReady()) {
+        LOG(ERROR) << "Unable to repair the host network state: "
+                   << (result.isFailed() ? result.failure() : "discarded");
+
+        ++metrics.repair_failures;
+      }
+    }
+  }
+
+  delay(driftCheckInterval, self(), &Self::checkDrift);
+}
+
+
+void ManagerProcess::checkpoint()
+{
+  if (checkpointPath.isNone()) {
+    return;
+  }
+
+  AgentCheckpoint checkpoint;
+  checkpoint.mutable_network_config()->CopyFrom(networkConfig);
+
+  if (generation.isSome()) {
+    checkpoint.set_generation(generation.get());
+  }
+
+  foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+    if (!overlay.has_state() ||
+        overlay.state().status() != OverlayState::STATUS_OK) {
+      if (os::exists(checkpointPath.get())) {
+        Try<Nothing> rm = os::rm(checkpointPath.get());
+        if (rm.isError()) {
+          LOG(ERROR) << "Unable to remove the checkpoint "
+                     << checkpointPath.get() << ": " << rm.error();
+        }
+      }
+
+      return;
+    }
+
+    checkpoint.add_overlays()->CopyFrom(overlay);
+  }
+
+  // The checkpoint is written to a temporary file, synced, and renamed
+  // over the checkpoint, so that a crash never leaves a partially
+  // written checkpoint.
+  const string temporary = checkpointPath.get() + ".tmp";
+
+  Try<int_fd> fd = os::open(
+      temporary,
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      S_IRUSR | S_IWUSR);
+
+  if (fd.isError()) {
+    LOG(ERROR) << "Unable to open " << temporary << ": " << fd.error();
+    return;
+  }
+
+  Try<Nothing> write = ::protobuf::write(fd.get(), checkpoint);
+  if (write.isSome() && ::fsync(fd.get()) < 0) {
+    write = ErrnoError();
+  }
+
+  os::close(fd.get());
+
+  if (write.isSome()) {
+    write = os::rename(temporary, checkpointPath.get());
+  }
+
+  if (write.isError()) {
+    LOG(ERROR) << "Unable to checkpoint the overlays to "
+               << checkpointPath.get() << ": " << write.error();
+
+    os::rm(temporary);
+    return;
+  }
+
+  VLOG(1) << "Checkpointed " << checkpoint.overlays_size()
+          << " overlays to " << checkpointPath.get();
+}
+
+
+void ManagerProcess::recover()
+{
+  if (checkpointPath.isNone() || !os::exists(checkpointPath.get())) {
+    return;
+  }
+
+  Result<AgentCheckpoint> checkpoint =
+    ::protobuf::read<AgentCheckpoint>(checkpointPath.get());
+
+  if (!checkpoint.isSome()) {
+    LOG(WARNING) << "Unable to read the checkpoint " << checkpointPath.get()
+                 << ": "
+                 << (checkpoint.isError() ? checkpoint.error() : "empty");
+    return;
+  }
+
+  // The subnets and bridges of the overlays depend on the network
+  // config, so the master needs to configure the overlays again.
+  if (checkpoint->network_config().SerializeAsString() !=
+      networkConfig.SerializeAsString()) {
+    LOG(INFO) << "Ignoring the checkpointed overlays since the network "
+              << "config of the agent has changed";
+    return;
+  }
+
+  vector<string> names;
+  foreach (const AgentOverlayInfo& overlay, checkpoint->overlays()) {
+    const string& name = overlay.info().name();
+
+    overlays[name] = overlay;
+    names.push_back(name);
+  }
+
+  if (checkpoint->has_generation()) {
+    generation = checkpoint->generation();
+  }
+
+  snapshot = None();
+
+  LOG(INFO) << "Recovered " << names.size() << " overlays from "
+            << checkpointPath.get() << ", repairing their host network state";
+
+  // The VTEPs only live in the memory of the `Datapath`, so we need to
+  // configure them again before the host network state can be
+  // repaired and the peers programmed.
+  Owned<Reconciliation> reconciliation(new Reconciliation());
+  reconciliation->names = names;
+  reconciliation->overlays = names;
+  reconciliation->started = Clock::now();
+
+  phase(reconciliation, "datapath", &Self::reconcileDatapath)
+    .then(defer(self(), &Self::repair, names))
+    .onAny(defer(self(), &Self::_recover, names, lambda::_1));
+}
+
+
+void ManagerProcess::_recover(
+    const vector<string>& names,
+    const Future<list<Future<Nothing>>>& results)
+{
+  Option<string> error;
+
+  if (!results.isReady()) {
+    error = results.isFailed() ? results.failure() : "discarded";
+  } else {
+    foreach (const Future<Nothing>& result, results.get()) {
+      if (!result.isReady()) {
+        error = result.isFailed() ? result.failure() : "discarded";
+      }
+    }
+  }
+
+  foreach (const string& name, names) {
+    if (error.isNone() &&
+        overlays.contains(name) &&
+        overlays.at(name).state().status() == OverlayState::STATUS_FAILED) {
+      error = overlays.at(name).state().error();
+    }
+  }
+
+  // The overlays that are not ready are configured again once the
+  // agent has registered with the master, since an agent with failed
+  // overlays asks for its complete configuration.
+  if (error.isSome()) {
+    LOG(ERROR) << "Unable to recover the checkpointed overlays: "
+               << error.get();
+
+    foreach (const string& name, names) {
+      if (overlays.contains(name) &&
+          overlays.at(name).state().status() == OverlayState::STATUS_OK) {
+        updateStatus(name, OverlayState::STATUS_FAILED, error.get());
+      }
+    }
+
+    return;
+  }
+
+  LOG(INFO) << "Repaired the host network state of " << names.size()
+            << " recovered overlays";
+
+  connected.set(Nothing());
+}
+
+
+Future<http::Response> ManagerProcess::overlay(const http::Request& request)
+{
+  if (snapshot.isNone()) {
+    AgentInfo agent;
+    agent.set_ip(stringify(self().address.ip));
+
+    foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+      agent.add_overlays()->CopyFrom(overlay);
+    }
+
+    Snapshot _snapshot;
+    _snapshot.json = stringify(JSON::protobuf(agent));
+    _snapshot.protobuf = agent.SerializeAsString();
+    _snapshot.etag = stringify(std::hash<string>()(_snapshot.protobuf));
+
+    snapshot = _snapshot;
+  }
+
+  string body;
+  string contentType;
+  string etag;
+
+  if (request.acceptsMediaType(APPLICATION_JSON)) {
+    body = snapshot->json;
+    contentType = APPLICATION_JSON;
+    etag = "\"" + snapshot->etag + "-json\"";
+
+    // NOTE: JSONP responses are not cached by the clients, hence we
+    // don't send an ETag for them.
+    Option<string> jsonp = request.url.query.get("jsonp");
+    if (jsonp.isSome()) {
+      http::OK ok(jsonp.get() + "(" + body + ");");
+      ok.headers["Content-Type"] = "text/javascript";
+
+      return ok;
+    }
+  } else if (request.acceptsMediaType(APPLICATION_PROTOBUF)) {
+    body = snapshot->protobuf;
+    contentType = stringify(ContentType::PROTOBUF);
+    etag = "\"" + snapshot->etag + "-protobuf\"";
+  } else {
+    return http::UnsupportedMediaType(
+        string("Client needs to support either ") +
+        APPLICATION_JSON + " or " + APPLICATION_PROTOBUF);
+  }
+
+  Option<string> ifNoneMatch = request.headers.get("If-None-Match");
+  if (ifNoneMatch.isSome()) {
+    foreach (const string& tag, strings::tokenize(ifNoneMatch.get(), ", ")) {
+      if (tag == etag || tag == "*") {
+        http::Response response(http::Status::NOT_MODIFIED);
+        response.headers["ETag"] = etag;
+
+        return response;
+      }
+    }
+  }
+
+  http::OK ok(body);
+  ok.headers["Content-Type"] = contentType;
+  ok.headers["ETag"] = etag;
+
+  return ok;
+}
+
+
+// Returns the line sent to the readers of the `/overlay/stream`
+// endpoint for the status `state` of the overlay `name`.
+static string statusEvent(const string& name, const OverlayState& state)
+{
+  JSON::Object event;
+  event.values["name"] = name;
+  event.values["status"] = OverlayState::Status_Name(state.status());
+
+  if (state.status() == OverlayState::STATUS_FAILED && state.has_error()) {
+    event.values["error"] = state.error();
+  }
+
+  return stringify(event) + "\n";
+}
+
+
+Future<http::Response> ManagerProcess::stream(const http::Request& request)
+{
+  if (!request.acceptsMediaType(APPLICATION_JSON)) {
+    return http::UnsupportedMediaType(
+        string("Client needs to support ") + APPLICATION_JSON);
+  }
+
+  http::Pipe pipe;
+  http::Pipe::Writer writer = pipe.writer();
+
+  // The stream starts with the current status of every overlay, so
+  // that the reader doesn't miss the transitions that happened before
+  // it subscribed.
+  foreachpair (const string& name, const AgentOverlayInfo& overlay, overlays) {
+    if (overlay.has_state() && overlay.state().has_status()) {
+      writer.write(statusEvent(name, overlay.state()));
+    }
+  }
+
+  subscribers.push_back(writer);
+
+  http::OK ok;
+  ok.type = http::Response::PIPE;
+  ok.reader = pipe.reader();
+  ok.headers["Content-Type"] = APPLICATION_JSON;
+
+  return ok;
+}
+
+
+Future<http::Response> ManagerProcess::reconciliation(
+    const http::Request& request)
+{
+  if (lastReconciliation.isNone()) {
+    return http::NotFound("No reconciliation has completed yet");
+  }
+
+  return http::OK(JSON::protobuf(lastReconciliation.get()));
+}
+
+
+void ManagerProcess::updateStatus(
+    const string& name,
+    const OverlayState::Status& status,
+    const Option<string>& error)
+{
+  CHECK(overlays.contains(name));
+
+  OverlayState* state = overlays[name].mutable_state();
+  state->set_status(status);
+
+  if (error.isSome()) {
+    state->set_error(error.get());
+  }
+
+  snapshot = None();
+
+  if (subscribers.empty()) {
+    return;
+  }
+
+  const string event = statusEvent(name, *state);
+
+  // The writes fail once the readers have closed the stream, hence
+  // we drop their writers.
+  list<http::Pipe::Writer> _subscribers;
+  foreach (http::Pipe::Writer& writer, subscribers) {
+    if (writer.write(event)) {
+      _subscribers.push_back(writer);
+    }
+  }
+
+  subscribers = _subscribers;
+}
+
+
+// Writes the CNI `configs` of the overlays, keyed by name, to
+// `<directory>/<name>.conf`, and adds the names of the configs that
+// have been written to `written`, if set. Configs whose content is already on
+// disk are skipped, so that configuring an overlay again does not
+// touch its config. Returns the errors keyed by name.
+//
+// Every config is written to a temporary file, synced, and renamed
+// over the config, so that the CNI isolator never reads a partially
+// written config. The temporary files live in a sub-directory, since
+// the isolator ignores directories but would try to parse any file
+// of `directory`. The directory is synced once after all the renames.
+static Reconciliation::Errors writeConfigs(
+    const string& directory,
+    const hashmap<string, string>& configs,
+    hashset<string>* written)
+{
+  Reconciliation::Errors errors;
+  vector<string> renames;
+
+  const string temporary = path::join(directory, ".tmp");
+
+  foreachpair (const string& name, const string& config, configs) {
+    const string target = path::join(directory, name + ".conf");
+
+    if (os::exists(target)) {
+      Try<string> current = os::read(target);
+      if (current.isSome() && current.get() == config) {
+        continue;
+      }
+    }
+
+    Try<Nothing> mkdir = os::mkdir(temporary);
+    if (mkdir.isError()) {
+      errors[name] = "Failed to create " + temporary + ": " + mkdir.error();
+      continue;
+    }
+
+    const string file = path::join(temporary, name + ".conf");
+
+    Try<int_fd> fd = os::open(
+        file,
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (fd.isError()) {
+      errors[name] = "Failed to open " + file + ": " + fd.error();
+      continue;
+    }
+
+    Try<Nothing> write = os::write(fd.get(), config);
+    if (write.isSome() && ::fsync(fd.get()) < 0) {
+      write = ErrnoError();
+    }
+
+    os::close(fd.get());
+
+    if (write.isError()) {
+      errors[name] = "Failed to write " + file + ": " + write.error();
+      os::rm(file);
+      continue;
+    }
+
+    renames.push_back(name);
+  }
+
+  foreach (const string& name, renames) {
+    const string file = path::join(temporary, name + ".conf");
+    const string target = path::join(directory, name + ".conf");
+
+    Try<Nothing> rename = os::rename(file, target);
+    if (rename.isError()) {
+      errors[name] = "Failed to rename " + file + ": " + rename.error();
+      os::rm(file);
+      continue;
+    }
+
+    LOG(INFO) << "Wrote CNI config " << target;
+
+    if (written != nullptr) {
+      written->insert(name);
+    }
+  }
+
+  // Make the renames durable.
+  if (!renames.empty()) {
+    Try<int_fd> fd = os::open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd.isSome()) {
+      if (::fsync(fd.get()) < 0) {
+        PLOG(WARNING) << "Failed to sync " << directory;
+      }
+
+      os::close(fd.get());
+    }
+  }
+
+  return errors;
+}
+
+
+// We want all overlay instances to talk to each other. However,
+// Docker disallows this. So we will install a de-funct rule in the
+// DOCKER-ISOLATION chain to bypass any isolation docker might be
+// trying to enforce.
+static Future<Nothing> bypassDockerIsolation()
+{
+  const string iptablesCommand = "iptables -D DOCKER-ISOLATION -j RETURN; "
+    "iptables -I DOCKER-ISOLATION 1 -j RETURN";
+
+  return runScriptCommand(iptablesCommand)
+    .then([]() { return Nothing(); });
+}
+
+
+// Waits for the `futures` configuring the overlays `names`, and
+// returns the errors of the overlays whose future failed.
+static Future<Reconciliation::Errors> collectErrors(
+    const vector<string>& names,
+    const list<Future<Nothing>>& futures)
+{
+  return await(futures)
+    .then([names](const list<Future<Nothing>>& results) {
+      Reconciliation::Errors errors;
+
+      size_t i = 0;
+      foreach (const Future<Nothing>& result, results) {
+        const string& name = names[i++];
+
+        if (!result.isReady()) {
+          errors[name] = result.isFailed() ? result.failure() : "discarded";
+        }
+      }
+
+      return errors;
+    });
+}
+
+
+Future<Nothing> ManagerProcess::reconcile(const vector<string>& names)
+{
+  Owned<Reconciliation> reconciliation(new Reconciliation());
+  reconciliation->names = names;
+  reconciliation->overlays = names;
+  reconciliation->started = Clock::now();
+  reconciliation->info.set_overlays(names.size());
+
+  foreach (const string& name, names) {
+    CHECK(overlays.contains(name));
+
+    updateStatus(name, OverlayState::STATUS_CONFIGURING);
+  }
+
+  LOG(INFO) << "Reconciling " << names.size() << " overlays";
+
+  // The bridges need to exist before the Mesos and Docker networks
+  // are attached to them, and the DOCKER-ISOLATION chain can only be
+  // fixed once Docker has created the networks.
+  return phase(reconciliation, "datapath", &Self::reconcileDatapath)
+    .then(defer(self(), [=]() {
+      return phase(reconciliation, "mesos", &Self::reconcileMesosNetworks);
+    }))
+    .then(defer(self(), [=]() {
+      return phase(reconciliation, "docker", &Self::reconcileDockerNetworks);
+    }))
+    .then(defer(self(), [=]() {
+      return phase(
+          reconciliation,
+          "docker_isolation",
+          &Self::reconcileDockerIsolation);
+    }))
+    .then(defer(self(), [=]() {
+      return phase(reconciliation, "netfilter", &Self::reconcileNetfilter);
+    }))
+    .then(defer(self(), &Self::_reconcile, reconciliation));
+}
+
+
+Future<Nothing> ManagerProcess::_reconcile(
+    const Owned<Reconciliation>& reconciliation)
+{
+  foreach (const string& name, reconciliation->overlays) {
+    CHECK(overlays.contains(name));
+    updateStatus(name, OverlayState::STATUS_OK);
+  }
+
+  const Duration duration = Clock::now() - reconciliation->started;
+
+  reconciliation->info.set_duration_ms(duration.ms());
+  lastReconciliation = reconciliation->info;
+
+  LOG(INFO) << "Configured " << reconciliation->overlays.size() << " of "
+            << reconciliation->names.size() << " overlays in " << duration;
+
+  vector<string> errors;
+  foreach (const string& name, reconciliation->names) {
+    const OverlayState& state = overlays[name].state();
+
+    if (state.status() == OverlayState::STATUS_FAILED) {
+      errors.push_back("'" + name + "': " + state.error());
+    }
+  }
+
+  if (!errors.empty()) {
+    return Failure(strings::join("; ", errors));
+  }
+
+  return Nothing();
+}
+
+
+Future<Nothing> ManagerProcess::phase(
+    const Owned<Reconciliation>& reconciliation,
+    const string& name,
+    Phase f)
+{
+  if (reconciliation->overlays.empty()) {
+    return Nothing();
+  }
+
+  const Time started = Clock::now();
+
+  // A phase that fails as a whole fails all the overlays it was
+  // configuring.
+  return (this->*f)(reconciliation)
+    .repair(defer(self(), [=](const Future<Reconciliation::Errors>& result) {
+      Reconciliation::Errors errors;
+      foreach (const string& overlay, reconciliation->overlays) {
+        errors[overlay] = result.failure();
+      }
+
+      return errors;
+    }))
+    .then(defer(self(), [=](const Reconciliation::Errors& errors) {
+      const Duration duration = Clock::now() - started;
+
+      ReconciliationInfo::Phase* _phase = reconciliation->info.add_phases();
+      _phase->set_name(name);
+      _phase->set_duration_ms(duration.ms());
+
+      VLOG(1) << "Reconciled " << reconciliation->overlays.size()
+              << " overlays in phase '" << name << "' in " << duration;
+
+      // The overlays that failed this phase are skipped by the next
+      // phases.
+      vector<string> remaining;
+      foreach (const string& overlay, reconciliation->overlays) {
+        if (!errors.contains(overlay)) {
+          remaining.push_back(overlay);
+          continue;
+        }
+
+        LOG(ERROR) << "Failed to configure overlay '" << overlay
+                   << "' in phase '" << name << "': " << errors.at(overlay);
+
+        updateStatus(
+            overlay,
+            OverlayState::STATUS_FAILED,
+            errors.at(overlay));
+      }
+
+      reconciliation->overlays = remaining;
+
+      return Nothing();
+    }));
+}
+
+
+Future<Reconciliation::Errors> ManagerProcess::reconcileDatapath(
+    const Owned<Reconciliation>& reconciliation)
+{
+  if (datapath.get() == nullptr) {
+    return Reconciliation::Errors();
+  }
+
+  // The overlays that share a VNI share a VTEP, so the VTEP and the
+  // bridges of all its overlays are configured in a single batch.
+  struct Vtep
+  {
+    VxLANInfo vxlan;
+    vector<string> names;
+    vector<string> bridges;
   };
 
-  Try<Subprocess> s = subprocess(
-      "docker",
-      argv,
-      Subprocess::PATH("/dev/null"),
-      Subprocess::PATH("/dev/null"),
-      Subprocess::PATH("/dev/null"));
+  hashmap<string, Vtep> vteps;
+
+  foreach (const string& name, reconciliation->overlays) {
+    const AgentOverlayInfo& overlay = overlays[name];
+
+    if (!overlay.backend().has_vxlan()) {
+      continue;
+    }
+
+    const VxLANInfo& vxlan = overlay.backend().vxlan();
+
+    Vtep& vtep = vteps[vxlan.vtep_name()];
+    vtep.vxlan = vxlan;
+    vtep.names.push_back(name);
+
+    if (networkConfig.mesos_bridge() && overlay.has_mesos_bridge()) {
+      vtep.bridges.push_back(overlay.mesos_bridge().name());
+    }
+
+    if (networkConfig.docker_bridge() && overlay.has_docker_bridge()) {
+      vtep.bridges.push_back(overlay.docker_bridge().name());
+    }
+  }
+
+  if (vteps.empty()) {
+    return Reconciliation::Errors();
+  }
+
+  // NOTE: The VTEPs are configured one after the other on the actor
+  // of the `DatapathProcess`, in the order of `names`.
+  vector<vector<string>> names;
+  list<Future<Nothing>> futures;
 
-  if (s.isError()) {
-    return Failure("Unable to execute docker network inspect: " + s.error());
+  foreachvalue (const Vtep& vtep, vteps) {
+    LOG(INFO) << "Configuring VTEP " << vtep.vxlan.vtep_name()
+              << " and bridges " << stringify(vtep.bridges);
+
+    names.push_back(vtep.names);
+    futures.push_back(process::dispatch(
+        datapath.get(),
+        &DatapathProcess::configure,
+        vtep.vxlan,
+        vtep.bridges,
+        networkConfig.overlay_mtu()));
   }
 
-  return s->status()
-    .then([](const Option<int>& status) -> Future<bool> {
-        if (status.isNone()) {
-        return Failure("Failed to reap the subprocess");
+  return await(futures)
+    .then(defer(self(), [=](const list<Future<Nothing>>& configured) {
+      Reconciliation::Errors errors;
+
+      size_t i = 0;
+      foreach (const Future<Nothing>& future, configured) {
+        if (!future.isReady()) {
+          foreach (const string& name, names[i]) {
+            errors[name] =
+              future.isFailed() ? future.failure() : "discarded";
+          }
         }
 
-        if (status.get() != 0) {
-        return false;
+        i++;
+      }
+
+      // The VTEPs of the VNIs that no overlay uses anymore, e.g.,
+      // since their overlays moved to another VNI, are deleted.
+      hashset<string> used;
+      foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+        if (overlay.backend().has_vxlan()) {
+          used.insert(overlay.backend().vxlan().vtep_name());
         }
+      }
+
+      process::dispatch(datapath.get(), &DatapathProcess::prune, used);
+
+      // The peers can only be programmed once the VTEPs exist.
+      programPeers();
+
+      return errors;
+    }));
+}
+
+
+Future<Reconciliation::Errors> ManagerProcess::reconcileMesosNetworks(
+    const Owned<Reconciliation>& reconciliation)
+{
+  // The configs of all the overlays are written together.
+  return configureMesosNetworks(reconciliation->overlays);
+}
+
+
+Future<Reconciliation::Errors> ManagerProcess::reconcileDockerNetworks(
+    const Owned<Reconciliation>& reconciliation)
+{
+  // NOTE: The `DockerClient` creates the networks requested in the
+  // same round of events with a single connection to Docker.
+  list<Future<Nothing>> futures;
+  foreach (const string& name, reconciliation->overlays) {
+    futures.push_back(configureDockerNetwork(name)
+      .then(defer(self(), [=](bool created) {
+        if (created) {
+          reconciliation->created.insert(name);
+        }
+
+        return Nothing();
+      })));
+  }
+
+  return collectErrors(reconciliation->overlays, futures);
+}
+
+
+Future<Reconciliation::Errors> ManagerProcess::reconcileDockerIsolation(
+    const Owned<Reconciliation>& reconciliation)
+{
+  if (reconciliation->created.empty()) {
+    return Reconciliation::Errors();
+  }
+
+  // NOTE: Docker reinstates its isolation rules whenever it creates
+  // a network, so the rule is installed once, after all the networks
+  // of this reconciliation have been created.
+  const hashset<string> created = reconciliation->created;
+
+  return bypassDockerIsolation()
+    .then([]() { return Reconciliation::Errors(); })
+    .repair([created](const Future<Reconciliation::Errors>& result) {
+      Reconciliation::Errors errors;
+      foreach (const string& name, created) {
+        errors[name] =
+          "Unable to bypass the DOCKER-ISOLATION chain: " + result.failure();
+      }
+
+      return errors;
+    });
+}
+
+
+Future<Reconciliation::Errors> ManagerProcess::reconcileNetfilter(
+    const Owned<Reconciliation>& reconciliation)
+{
+  if (!networkConfig.mesos_bridge() &&
+      !networkConfig.docker_bridge()) {
+    return Reconciliation::Errors();
+  }
+
+  // Add the overlay subnets to `IPSET_OVERLAY`, and make sure the
+  // iptables rule that masquerades traffic from the overlay subnets
+  // exists in the POSTROUTING chain of the NAT table. The `Netfilter`
+  // programs the subnets added in the same round of events in a
+  // single batch.
+  vector<string> names;
+  list<Future<Nothing>> futures;
+
+  foreach (const string& name, reconciliation->overlays) {
+    const AgentOverlayInfo& overlay = overlays[name];
+
+    if (overlay.info().has_subnet()) {
+      names.push_back(name);
+      futures.push_back(netfilter->add(overlay.info().subnet()));
+    }
+  }
+
+  return collectErrors(names, futures);
+}
+
+
+Try<Option<string>> ManagerProcess::renderMesosNetwork(const string& name)
+{
+  CHECK(overlays.contains(name));
+
+  const AgentOverlayInfo& overlay = overlays[name];
+
+  if (!networkConfig.mesos_bridge()) {
+    LOG(INFO) << "Not configuring Mesos network for '" << name
+              << "' since operator has disallowed `mesos_bridge`.";
+
+    if (overlay.has_mesos_bridge()) {
+      LOG(WARNING) << " We are ignoring request from Master to configure "
+                   << "`mesos_bridge` for " << name
+                   << " since operator has not configured agent to configure "
+                   << "`mesos_bridge`.";
+    }
+    return None();
+  }
+
+  if (!overlay.has_subnet()) {
+    LOG(WARNING) << "IPv4 address not present for mesos bridge."
+                 << " Skipping... "<< name;
+    return None();
+  }
+
+  Try<Network> subnet = Network::parse(
+      overlay.mesos_bridge().ip(),
+      AF_INET);
+
+  if (subnet.isError()) {
+    return Error("Failed to parse bridge ip: " + subnet.error());
+  }
 
-        return true;
+  AgentNetworkConfig _networkConfig;
+  _networkConfig.CopyFrom(networkConfig);
+
+  // The IPs of the containers are allocated by the `Ipam` of the
+  // Agent, if any, rather than by the `host-local` plugin.
+  const Option<string> _ipamSocket =
+    ipam.get() != nullptr ? Option<string>(ipamSocket) : None();
+
+  auto config = [name, subnet, overlay, _networkConfig, _ipamSocket](
+      JSON::ObjectWriter* writer) {
+    writer->field("name", name);
+    writer->field("type", "mesos-cni-port-mapper");
+    writer->field("excludeDevices", 
+      [overlay](JSON::ArrayWriter* writer) { 
+        writer->element(overlay.mesos_bridge().name());
+    });
+    writer->field("chain", strings::upper(overlay.mesos_bridge().name())),
+    writer->field("delegate", 
+      [name, subnet, overlay, _networkConfig, _ipamSocket](
+          JSON::ObjectWriter* writer) {
+        writer->field("type", "bridge");
+        writer->field("bridge", overlay.mesos_bridge().name());
+        writer->field("isGateway", true);
+        writer->field("ipMasq", false);
+        writer->field("mtu", _networkConfig.overlay_mtu());
+
+        writer->field("ipam", [name, subnet, _ipamSocket](
+            JSON::ObjectWriter* writer) {
+          if (_ipamSocket.isSome()) {
+            writer->field("type", IPAM_PLUGIN);
+            writer->field("socket", _ipamSocket.get());
+            writer->field("network", name);
+          } else {
+            writer->field("type", "host-local");
+          }
+
+          writer->field("subnet", stringify(subnet.get()));
+
+          writer->field("routes", [](JSON::ArrayWriter* writer) {
+            writer->element([](JSON::ObjectWriter* writer) {
+              writer->field("dst", "0.0.0.0/0");
+            });
+          });
         });
+      });
+  };
+
+  return jsonify(config);
 }
 
 
-Future<Nothing> ManagerProcess::_configureDockerNetwork(
+Reconciliation::Errors ManagerProcess::configureMesosNetworks(
+    const vector<string>& names,
+    hashset<string>* written)
+{
+  Reconciliation::Errors errors;
+  hashmap<string, string> configs;
+
+  foreach (const string& name, names) {
+    CHECK(overlays.contains(name));
+
+    Try<Option<string>> config = renderMesosNetwork(name);
+    if (config.isError()) {
+      errors[name] = config.error();
+    } else if (config->isSome()) {
+      configs[name] = config->get();
+    }
+  }
+
+  foreachpair (const string& name,
+               const string& error,
+               writeConfigs(cniDir, configs, written)) {
+    errors[name] = "Failed to write CNI config: " + error;
+  }
+
+  return errors;
+}
+
+
+Future<bool> ManagerProcess::configureDockerNetwork(const string& name)
+{
+  CHECK(overlays.contains(name));
+
+  if (!networkConfig.docker_bridge()) {
+    LOG(INFO) << "Not configuring Docker network for '" << name
+              << "' since operator has disallowed `docker_bridge`.";
+
+    if (overlays[name].has_docker_bridge()) {
+      LOG(WARNING) << " We are ignoring request from Master to configure "
+                   << "`docker_bridge` for " << name
+                   << " since operator has not configured agent to configure "
+                   << "`docker_bridge`.";
+    }
+    return false;
+  }
+
+  if (docker.get() != nullptr) {
+    return createDockerNetwork(name);
+  }
+
+  return checkDockerNetwork(name)
+    .then(defer(self(),
+          &Self::_configureDockerNetwork,
+          name,
+          lambda::_1));
+}
+
+
+Future<bool> ManagerProcess::checkDockerNetwork(const string& name)
+{
+  // NOTE: We list the networks rather than inspecting the network,
+  // since `docker network inspect` also fails when the Docker daemon
+  // does not respond, which is not a missing network. The filter
+  // matches the networks whose names contain `name`.
+  vector<string> argv = {
+    "docker",
+    "network",
+    "ls",
+    "--filter", "name=" + name,
+    "--format", "{{.Name}}"
+  };
+
+  return runCommand("docker", argv, DEFAULT_COMMAND_TIMEOUT)
+    .then([name](const string& output) -> Future<bool> {
+      foreach (const string& network, strings::tokenize(output, "\n")) {
+        if (strings::trim(network) == name) {
+          return true;
+        }
+      }
+
+      return false;
+    });
+}
+
+
+Future<bool> ManagerProcess::createDockerNetwork(const string& name)
+{
+  CHECK(overlays.contains(name));
+  CHECK_NOTNULL(docker.get());
+
+  const AgentOverlayInfo& overlay = overlays[name];
+
+  if (!overlay.has_docker_bridge()) {
+    return Failure("Missing Docker bridge info");
+  }
+
+  DockerNetwork network;
+  network.name = name;
+  network.bridge = overlay.docker_bridge().name();
+  network.mtu = networkConfig.overlay_mtu();
+
+  if (overlay.docker_bridge().has_ip()) {
+    Try<Network> subnet = Network::parse(
+        overlay.docker_bridge().ip(),
+        AF_INET);
+
+    if (subnet.isError()) {
+      return Failure("Failed to parse bridge ip: " + subnet.error());
+    }
+
+    network.subnet = stringify(subnet.get());
+  }
+
+  if (overlay.docker_bridge().has_ip6()) {
+    Try<Network> subnet6 = Network::parse(
+        overlay.docker_bridge().ip6(),
+        AF_INET6);
+
+    if (subnet6.isError()) {
+      return Failure("Failed to parse bridge ipv6: " + subnet6.error());
+    }
+
+    network.subnet6 = stringify(subnet6.get());
+  }
+
+  return docker->ensure(network)
+    .then([name](bool created) {
+      if (!created) {
+        LOG(INFO) << "Docker network '" << name << "' already exists";
+      }
+
+      return created;
+    });
+}
+
+
+Future<bool> ManagerProcess::_configureDockerNetwork(
     const string& name,
     bool exists)
 {
   if (exists) {
     LOG(INFO) << "Docker network '" << name << "' already exists";
-    return Nothing();
+    return false;
   }
 
   CHECK(overlays.contains(name));
@@ -862,7 +2177,7 @@ Future<Nothing> ManagerProcess::_configureDockerNetwork(
           lambda::_1));
 }
 
-Future<Nothing> ManagerProcess::__configureDockerNetwork(
+Future<bool> ManagerProcess::__configureDockerNetwork(
     const string& name,
     const Future<string> &result)
 {
@@ -874,29 +2189,35 @@ Future<Nothing> ManagerProcess::__configureDockerNetwork(
         (result.isDiscarded() ? "discarded" : result.failure()));
   }
 
-  // We want all overlay instances to talk to each other.
-  // However, Docker disallows this. So we will install a de-funct
-  // rule in the DOCKER-ISOLATION chain to bypass any isolation
-  // docker might be trying to enforce.
-  const string iptablesCommand = "iptables -D DOCKER-ISOLATION -j RETURN; "
-    "iptables -I DOCKER-ISOLATION 1 -j RETURN";
-
-  return runScriptCommand(iptablesCommand)
-    .then([]() -> Future<Nothing> {
-        return Nothing();
-        });
+  return true;
 }
 
+
 ManagerProcess::ManagerProcess(
     const string& _cniDir,
     const AgentNetworkConfig _networkConfig,
     const uint32_t _maxConfigAttempts,
-    Owned<MasterDetector> _detector)
+    Owned<MasterDetector> _detector,
+    Owned<Netfilter> _netfilter,
+    Owned<DatapathProcess> _datapath,
+    Owned<DockerClient> _docker,
+    Owned<Ipam> _ipam,
+    const string& _ipamSocket,
+    const Option<string>& _checkpointPath,
+    const Duration& _driftCheckInterval)
 : ProcessBase(AGENT_MANAGER_PROCESS_ID),
   cniDir(_cniDir),
   networkConfig(_networkConfig),
   maxConfigAttempts(_maxConfigAttempts),
-  detector(_detector)
+  detector(_detector),
+  netfilter(_netfilter),
+  datapath(_datapath),
+  docker(_docker),
+  ipam(_ipam),
+  ipamSocket(_ipamSocket),
+  checkpointPath(_checkpointPath),
+  driftCheckInterval(_driftCheckInterval),
+  peerSnapshotRequested(false)
 {
   configAttempts = 0;
 
@@ -1,22 +1,128 @@
 #ifndef __AGENT_OVERLAY_MANAGER_HPP__
 #define __AGENT_OVERLAY_MANAGER_HPP__
 
+#include <list>
+#include <string>
+#include <vector>
+
+#include <stout/duration.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/hashset.hpp>
+
 #include <process/future.hpp>
 #include <process/http.hpp>
+#include <process/owned.hpp>
 #include <process/process.hpp>
 #include <process/protobuf.hpp>
+#include <process/time.hpp>
+#include <process/timer.hpp>
+
+#include <process/metrics/counter.hpp>
+#include <process/metrics/metrics.hpp>
 
 #include <mesos/master/detector.hpp>
 #include <mesos/mesos.hpp>
 #include <mesos/module/anonymous.hpp>
 
+#include <overlay/datapath.hpp>
+#include <overlay/docker.hpp>
+#include <overlay/ipam.hpp>
 #include <overlay/messages.hpp>
+#include <overlay/netfilter.hpp>
 
 namespace mesos {
 namespace modules {
 namespace overlay {
 namespace agent {
 
+// A reconciliation of the overlays being configured on the Agent with
+// the host network state. The reconciliation runs in phases, and every
+// phase configures all the overlays at once, so that the state shared
+// by the overlays (the VTEP, the DOCKER-ISOLATION chain and the ipset)
+// is programmed once per reconciliation rather than once per overlay.
+struct Reconciliation
+{
+  // The errors of the overlays that failed a phase, keyed by name.
+  typedef hashmap<std::string, std::string> Errors;
+
+  // The overlays being configured.
+  std::vector<std::string> names;
+
+  // The overlays that have not failed any phase yet.
+  std::vector<std::string> overlays;
+
+  // The Docker networks created by this reconciliation.
+  hashset<std::string> created;
+
+  process::Time started;
+
+  ReconciliationInfo info;
+};
+
+
+// Metrics exposed by the overlay agent on `/metrics/snapshot`.
+struct Metrics
+{
+  Metrics()
+    : drift_checks("overlay/agent/drift/checks"),
+      drifted_links("overlay/agent/drift/links"),
+      drifted_peers("overlay/agent/drift/peers"),
+      drifted_cni_configs("overlay/agent/drift/cni_configs"),
+      drifted_docker_networks("overlay/agent/drift/docker_networks"),
+      drifted_netfilter_rules("overlay/agent/drift/netfilter_rules"),
+      repairs("overlay/agent/drift/repairs"),
+      repair_failures("overlay/agent/drift/repair_failures")
+  {
+    process::metrics::add(drift_checks);
+    process::metrics::add(drifted_links);
+    process::metrics::add(drifted_peers);
+    process::metrics::add(drifted_cni_configs);
+    process::metrics::add(drifted_docker_networks);
+    process::metrics::add(drifted_netfilter_rules);
+    process::metrics::add(repairs);
+    process::metrics::add(repair_failures);
+  }
+
+  ~Metrics()
+  {
+    process::metrics::remove(drift_checks);
+    process::metrics::remove(drifted_links);
+    process::metrics::remove(drifted_peers);
+    process::metrics::remove(drifted_cni_configs);
+    process::metrics::remove(drifted_docker_networks);
+    process::metrics::remove(drifted_netfilter_rules);
+    process::metrics::remove(repairs);
+    process::metrics::remove(repair_failures);
+  }
+
+  // Number of times the host network state has been checked.
+  process::metrics::Counter drift_checks;
+
+  // Number of links (VTEP and bridges) found missing or down.
+  process::metrics::Counter drifted_links;
+
+  // Number of peers whose FDB or neighbor entries were missing.
+  process::metrics::Counter drifted_peers;
+
+  // Number of CNI configs of Mesos networks found missing.
+  process::metrics::Counter drifted_cni_configs;
+
+  // Number of Docker networks found missing.
+  process::metrics::Counter drifted_docker_networks;
+
+  // Number of overlay subnets whose ipset entry or iptables rule was
+  // missing.
+  process::metrics::Counter drifted_netfilter_rules;
+
+  // Number of drifted links, entries, configs, networks and rules
+  // that have been repaired.
+  process::metrics::Counter repairs;
+
+  // Number of repairs that failed.
+  process::metrics::Counter repair_failures;
+};
+
+
 class ManagerProcess : public ProtobufProcess<ManagerProcess>
 {
 public:
@@ -25,6 +131,8 @@ public:
 
   process::Future<Nothing> ready();
 
+  ~ManagerProcess();
+
 protected:
   void agentRegisteredAcknowledgement(const process::UPID& from);
 
@@ -32,6 +140,12 @@ protected:
 
   void doReliableRegistration(Duration maxBackoff);
 
+  void registrationDeferred(
+      const process::UPID& from,
+      const overlay::internal::RegisterAgentNackMessage& message);
+
+  void masterReady(const process::UPID& from);
+
   virtual void exited(const process::UPID& pid);
 
   virtual void initialize();
@@ -39,24 +153,72 @@ protected:
   process::Future<process::http::Response> overlay(
       const process::http::Request& request);
 
-  process::Future<Nothing> configure(const std::string& name);
+  process::Future<process::http::Response> stream(
+      const process::http::Request& request);
+
+  process::Future<process::http::Response> reconciliation(
+      const process::http::Request& request);
+
+  // Sets the status of the overlay `name`, and sends the transition
+  // to the readers of the `/overlay/stream` endpoint.
+  void updateStatus(
+      const std::string& name,
+      const overlay::AgentOverlayInfo::State::Status& status,
+      const Option<std::string>& error = None());
+
+  process::Future<Nothing> reconcile(const std::vector<std::string>& names);
+
+  process::Future<Nothing> _reconcile(
+      const process::Owned<Reconciliation>& reconciliation);
 
-  process::Future<Nothing> _configure(
+  typedef process::Future<Reconciliation::Errors> (ManagerProcess::*Phase)(
+      const process::Owned<Reconciliation>& reconciliation);
+
+  process::Future<Nothing> phase(
+      const process::Owned<Reconciliation>& reconciliation,
       const std::string& name,
-      const std::tuple<process::Future<Nothing>, process::Future<Nothing>>& t);
+      Phase f);
+
+  process::Future<Reconciliation::Errors> reconcileDatapath(
+      const process::Owned<Reconciliation>& reconciliation);
+
+  process::Future<Reconciliation::Errors> reconcileMesosNetworks(
+      const process::Owned<Reconciliation>& reconciliation);
+
+  process::Future<Reconciliation::Errors> reconcileDockerNetworks(
+      const process::Owned<Reconciliation>& reconciliation);
+
+  process::Future<Reconciliation::Errors> reconcileDockerIsolation(
+      const process::Owned<Reconciliation>& reconciliation);
 
-  process::Future<Nothing> configureMesosNetwork(const std::string& name);
+  process::Future<Reconciliation::Errors> reconcileNetfilter(
+      const process::Owned<Reconciliation>& reconciliation);
 
-  process::Future<Nothing> configureDockerNetwork(const std::string& name);
+  // Returns the CNI config of the Mesos network of the overlay, if
+  // the overlay has one.
+  Try<Option<std::string>> renderMesosNetwork(const std::string& name);
 
-  process::Future<Nothing> _configureDockerNetwork(const std::string& name, bool exists);
+  // Writes the CNI configs of the Mesos networks of the overlays
+  // `names`, adding the names of the configs that have changed to
+  // `written`, if set, and returns the errors keyed by name.
+  Reconciliation::Errors configureMesosNetworks(
+      const std::vector<std::string>& names,
+      hashset<std::string>* written = nullptr);
 
-  process::Future<Nothing> __configureDockerNetwork(
+  process::Future<bool> configureDockerNetwork(const std::string& name);
+
+  process::Future<bool> _configureDockerNetwork(
+      const std::string& name,
+      bool exists);
+
+  process::Future<bool> __configureDockerNetwork(
       const std::string& name,
       const process::Future<std::string> &result);
 
   process::Future<bool> checkDockerNetwork(const std::string& name);
 
+  process::Future<bool> createDockerNetwork(const std::string& name);
+
   void updateAgentOverlays(
       const process::UPID& from,
       const overlay::internal::UpdateAgentOverlaysMessage& message);
@@ -64,6 +226,35 @@ protected:
   void _updateAgentOverlays(
       const process::Future<std::list<process::Future<Nothing>>>& results);
 
+  void updatePeers(
+      const process::UPID& from,
+      const overlay::internal::PeerUpdateMessage& message);
+
+  void programPeers();
+
+  void checkDrift();
+
+  void _checkDrift(
+      const process::Future<std::list<process::Future<Nothing>>>& results);
+
+  // Repairs the host network state of the overlays `names`, counting
+  // what has drifted in the metrics.
+  process::Future<std::list<process::Future<Nothing>>> repair(
+      const std::vector<std::string>& names);
+
+  // Writes the overlays to `checkpointPath`, if all of them have been
+  // configured. Otherwise removes the checkpoint, so that a restarted
+  // agent waits for the master to configure them again.
+  void checkpoint();
+
+  // Recovers the overlays from `checkpointPath`, and repairs their
+  // host network state before reporting that the agent is ready.
+  void recover();
+
+  void _recover(
+      const std::vector<std::string>& names,
+      const process::Future<std::list<process::Future<Nothing>>>& results);
+
 private:
   enum State
   {
@@ -76,7 +267,14 @@ private:
       const std::string& _cniDir,
       const overlay::internal::AgentNetworkConfig _networkConfig,
       const uint32_t _maxConfigAttempts,
-      process::Owned<master::detector::MasterDetector> _detector);
+      process::Owned<master::detector::MasterDetector> _detector,
+      process::Owned<Netfilter> _netfilter,
+      process::Owned<DatapathProcess> _datapath,
+      process::Owned<DockerClient> _docker,
+      process::Owned<Ipam> _ipam,
+      const std::string& _ipamSocket,
+      const Option<std::string>& _checkpointPath,
+      const Duration& _driftCheckInterval);
 
   const std::string cniDir;
 
@@ -88,13 +286,72 @@ private:
 
   Option<process::UPID> overlayMaster;
 
+  // The timer of the next registration attempt, which is cancelled
+  // when the master tells us when to register.
+  Option<process::Timer> registrationTimer;
+
   hashmap<std::string, overlay::AgentOverlayInfo> overlays;
 
+  // The configuration generation of the last update received from
+  // the master.
+  Option<uint64_t> generation;
+
   const uint32_t maxConfigAttempts;
 
   uint32_t configAttempts;
 
   process::Owned<master::detector::MasterDetector> detector;
+
+  process::Owned<Netfilter> netfilter;
+
+  // Only set if the agent configures the VTEP and the bridges, which
+  // it does on the actor of the `DatapathProcess`.
+  process::Owned<DatapathProcess> datapath;
+
+  // Only set if the agent uses the Docker Engine API, rather than the
+  // `docker` CLI, to create the Docker networks.
+  process::Owned<DockerClient> docker;
+
+  // Only set if the agent allocates the IPs of the containers of the
+  // Mesos networks, rather than the `host-local` CNI plugin. The CNI
+  // plugin reaches it on `ipamSocket`.
+  process::Owned<Ipam> ipam;
+  const std::string ipamSocket;
+
+  // Only set if the agent checkpoints its overlays.
+  const Option<std::string> checkpointPath;
+
+  // Interval between the checks of the host network state, if any.
+  const Duration driftCheckInterval;
+
+  Metrics metrics;
+
+  // The version of the peer table received from the master, and the
+  // peers in the table keyed by Agent IP.
+  Option<uint64_t> peerVersion;
+  hashmap<std::string, overlay::internal::PeerInfo> peers;
+
+  // The last reconciliation, reported by the `/overlay/reconciliation`
+  // endpoint.
+  Option<ReconciliationInfo> lastReconciliation;
+
+  // The serialized `AgentInfo` served by the `/overlay` endpoint,
+  // which is only regenerated once `overlays` have changed. The ETag is a digest of the serialized `AgentInfo`.
+  struct Snapshot
+  {
+    std::string json;
+    std::string protobuf;
+    std::string etag;
+  };
+
+  Option<Snapshot> snapshot;
+
+  // The readers of the `/overlay/stream` endpoint.
+  std::list<process::http::Pipe::Writer> subscribers;
+
+  // Set while we wait for the snapshot of the peer table that we
+  // asked for after missing an update.
+  bool peerSnapshotRequested;
 };
 
 
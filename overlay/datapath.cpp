@@ -0,0 +1,1079 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#include <linux/fib_rules.h>
+#include <linux/if_addr.h>
+#include <linux/if_link.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+#include <stout/os/strerror.hpp>
+
+#include <process/id.hpp>
+
+#include "datapath.hpp"
+#include "netlink.hpp"
+#include "network.hpp"
+
+using std::string;
+using std::vector;
+
+using process::Failure;
+using process::Future;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// The VTEPs of the overlays with a VNI of their own route the VTEP
+// subnet in a table of their own, numbered after their VNI above the
+// tables reserved by the kernel.
+constexpr uint32_t VTEP_ROUTE_TABLE_BASE = 1 << 24;
+
+// The priority of the rules sending the packets received on the
+// bridges of such overlays to the table of their VTEP, ahead of the
+// main table (32766).
+constexpr uint32_t VTEP_RULE_PRIORITY = 1000;
+
+
+static Try<net::MAC> parseMAC(const string& value)
+{
+  vector<string> tokens = strings::split(value, ":");
+  if (tokens.size() != 6) {
+    return Error("Invalid MAC address '" + value + "'");
+  }
+
+  uint8_t bytes[6];
+  for (size_t i = 0; i < tokens.size(); i++) {
+    if (sscanf(tokens[i].c_str(), "%hhx", &bytes[i]) != 1) {
+      return Error("Invalid MAC address '" + value + "'");
+    }
+  }
+
+  return net::MAC(bytes);
+}
+
+
+static void addAddress(
+    netlink::Request* request,
+    uint16_t type,
+    const net::IP& ip)
+{
+  if (ip.family() == AF_INET) {
+    request->scalar(type, ip.in().get());
+  } else {
+    request->scalar(type, ip.in6().get());
+  }
+}
+
+
+static void addMAC(
+    netlink::Request* request,
+    uint16_t type,
+    const net::MAC& mac)
+{
+  uint8_t bytes[6];
+  for (size_t i = 0; i < sizeof(bytes); i++) {
+    bytes[i] = mac[i];
+  }
+
+  request->attribute(type, bytes, sizeof(bytes));
+}
+
+
+// Adds a message creating the link `name` of `kind`.
+static size_t addLink(
+    netlink::Request* request,
+    const string& name,
+    const string& kind)
+{
+  struct ifinfomsg info;
+  memset(&info, 0, sizeof(info));
+  info.ifi_family = AF_UNSPEC;
+
+  request->message(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, info);
+  request->attribute(IFLA_IFNAME, name);
+
+  const size_t linkinfo = request->nest(IFLA_LINKINFO);
+  request->attribute(IFLA_INFO_KIND, kind);
+
+  return linkinfo;
+}
+
+
+// Adds a message bringing up the link at `index`.
+static void addLinkUp(netlink::Request* request, int index)
+{
+  struct ifinfomsg info;
+  memset(&info, 0, sizeof(info));
+  info.ifi_family = AF_UNSPEC;
+  info.ifi_index = index;
+  info.ifi_flags = IFF_UP;
+  info.ifi_change = IFF_UP;
+
+  request->message(RTM_NEWLINK, 0, info);
+}
+
+
+// Adds a message deleting the link at `index`, as with `ip link del`.
+static void addLinkDelete(netlink::Request* request, int index)
+{
+  struct ifinfomsg info;
+  memset(&info, 0, sizeof(info));
+  info.ifi_family = AF_UNSPEC;
+  info.ifi_index = index;
+
+  request->message(RTM_DELLINK, 0, info);
+}
+
+
+// Adds a message assigning `network` to the link at `index`, as with
+// `ip addr replace`. Unless `prefixRoute` is set, the kernel does not
+// add a route to `network` in the main table, as with `noprefixroute`.
+static void addNetwork(
+    netlink::Request* request,
+    int index,
+    const Network& network,
+    bool prefixRoute = true)
+{
+  struct ifaddrmsg address;
+  memset(&address, 0, sizeof(address));
+  address.ifa_family = network.address().family();
+  address.ifa_prefixlen = network.prefix();
+  address.ifa_scope = RT_SCOPE_UNIVERSE;
+  address.ifa_index = index;
+
+  request->message(RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, address);
+  addAddress(request, IFA_LOCAL, network.address());
+  addAddress(request, IFA_ADDRESS, network.address());
+
+  if (!prefixRoute) {
+    request->scalar(IFA_FLAGS, (uint32_t) IFA_F_NOPREFIXROUTE);
+  }
+}
+
+
+// Adds a message adding (`RTM_NEWROUTE`) or removing (`RTM_DELROUTE`)
+// the route to `network` through the link at `index` in `table`, as
+// with `ip route replace <network> dev <link> scope link table
+// <table>`.
+static void addRoute(
+    netlink::Request* request,
+    uint16_t type,
+    int index,
+    const Network& network,
+    uint32_t table)
+{
+  struct rtmsg route;
+  memset(&route, 0, sizeof(route));
+  route.rtm_family = network.address().family();
+  route.rtm_dst_len = network.prefix();
+  route.rtm_table = RT_TABLE_UNSPEC;
+  route.rtm_type = RTN_UNICAST;
+
+  // NOTE: The kernel only removes the routes of the given protocol
+  // and scope, so that the routes it adds for the addresses of the
+  // links, e.g., can be removed.
+  if (type == RTM_NEWROUTE) {
+    route.rtm_protocol = RTPROT_BOOT;
+    route.rtm_scope = RT_SCOPE_LINK;
+  } else {
+    route.rtm_protocol = RTPROT_UNSPEC;
+    route.rtm_scope = RT_SCOPE_NOWHERE;
+  }
+
+  request->message(
+      type,
+      type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+      route);
+
+  addAddress(request, RTA_DST, network.begin());
+  request->scalar(RTA_OIF, (uint32_t) index);
+  request->scalar(RTA_TABLE, table);
+}
+
+
+// Adds a message adding (`RTM_NEWRULE`) or removing (`RTM_DELRULE`)
+// the rule looking up the `family` routes of the packets received on
+// `link` in `table`, as with `ip rule add iif <link> lookup <table>`.
+static void addRule(
+    netlink::Request* request,
+    uint16_t type,
+    int family,
+    const string& link,
+    uint32_t table)
+{
+  struct fib_rule_hdr rule;
+  memset(&rule, 0, sizeof(rule));
+  rule.family = family;
+  rule.action = FR_ACT_TO_TBL;
+
+  // NOTE: Unlike routes, rules are not replaced: without
+  // `NLM_F_EXCL` the kernel adds the same rule again.
+  request->message(
+      type,
+      type == RTM_NEWRULE ? NLM_F_CREATE | NLM_F_EXCL : 0,
+      rule);
+
+  request->attribute(FRA_IIFNAME, link);
+  request->scalar(FRA_PRIORITY, VTEP_RULE_PRIORITY);
+  request->scalar(FRA_TABLE, table);
+}
+
+
+// Adds a message adding (`RTM_NEWNEIGH`) or removing (`RTM_DELNEIGH`)
+// the FDB entry of `peer` on the VTEP at `index`, as with `bridge fdb
+// replace <vtep MAC> dev <vtep> dst <agent IP> self permanent`.
+static void addFDB(
+    netlink::Request* request,
+    uint16_t type,
+    int index,
+    const Peer& peer)
+{
+  struct ndmsg neighbor;
+  memset(&neighbor, 0, sizeof(neighbor));
+  neighbor.ndm_family = AF_BRIDGE;
+  neighbor.ndm_ifindex = index;
+  neighbor.ndm_state = NUD_PERMANENT;
+  neighbor.ndm_flags = NTF_SELF;
+
+  request->message(
+      type,
+      type == RTM_NEWNEIGH ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+      neighbor);
+
+  addMAC(request, NDA_LLADDR, peer.vtepMAC);
+  addAddress(request, NDA_DST, peer.agent);
+}
+
+
+// Adds a message adding (`RTM_NEWNEIGH`) or removing (`RTM_DELNEIGH`)
+// the neighbor entry of `ip` on the VTEP at `index`, as with `ip neigh
+// replace <ip> lladdr <mac> dev <vtep> nud permanent`.
+static void addNeighbor(
+    netlink::Request* request,
+    uint16_t type,
+    int index,
+    const net::IP& ip,
+    const net::MAC& mac)
+{
+  struct ndmsg neighbor;
+  memset(&neighbor, 0, sizeof(neighbor));
+  neighbor.ndm_family = ip.family();
+  neighbor.ndm_ifindex = index;
+  neighbor.ndm_state = NUD_PERMANENT;
+
+  request->message(
+      type,
+      type == RTM_NEWNEIGH ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+      neighbor);
+
+  addAddress(request, NDA_DST, ip);
+
+  if (type == RTM_NEWNEIGH) {
+    addMAC(request, NDA_LLADDR, mac);
+  }
+}
+
+
+// Sends `request`, where `descriptions` describes every message of
+// the request, and returns the errors of the messages that failed
+// with an errno other than `ignored`.
+static Try<Nothing> send(
+    netlink::Request* request,
+    const vector<string>& descriptions,
+    int ignored = 0)
+{
+  CHECK_EQ(request->size(), descriptions.size());
+
+  if (request->size() == 0) {
+    return Nothing();
+  }
+
+  Try<vector<int>> results = request->send(NETLINK_ROUTE);
+  if (results.isError()) {
+    return Error("Failed to send rtnetlink request: " + results.error());
+  }
+
+  vector<string> errors;
+  for (size_t i = 0; i < descriptions.size(); i++) {
+    const int error = -results.get()[i];
+    if (error != 0 && error != ignored) {
+      errors.push_back(
+          "Failed to " + descriptions[i] + ": " + os::strerror(error));
+    }
+  }
+
+  if (!errors.empty()) {
+    return Error(strings::join("; ", errors));
+  }
+
+  return Nothing();
+}
+
+
+// Adds the messages adding (`RTM_NEWNEIGH`) or removing
+// (`RTM_DELNEIGH`) the FDB and neighbor entries of `peer` on the VTEP
+// at `index`.
+static void addPeer(
+    netlink::Request* request,
+    vector<string>* descriptions,
+    uint16_t type,
+    int index,
+    const Peer& peer)
+{
+  const string action = type == RTM_NEWNEIGH ? "add" : "remove";
+
+  addFDB(request, type, index, peer);
+  descriptions->push_back(
+      action + " FDB entry of " + stringify(peer.vtepMAC) + " to " +
+      stringify(peer.agent));
+
+  if (peer.vtepIP.isSome()) {
+    addNeighbor(request, type, index, peer.vtepIP.get(), peer.vtepMAC);
+    descriptions->push_back(
+        action + " neighbor entry of " + stringify(peer.vtepIP.get()));
+  }
+
+  if (peer.vtepIP6.isSome()) {
+    addNeighbor(request, type, index, peer.vtepIP6.get(), peer.vtepMAC);
+    descriptions->push_back(
+        action + " neighbor entry of " + stringify(peer.vtepIP6.get()));
+  }
+}
+
+
+// Returns the flags of every link, keyed by name.
+static Try<hashmap<string, unsigned int>> dumpLinks()
+{
+  struct ifinfomsg info;
+  memset(&info, 0, sizeof(info));
+  info.ifi_family = AF_UNSPEC;
+
+  netlink::Request request;
+  request.message(RTM_GETLINK, NLM_F_DUMP, info);
+
+  Try<vector<string>> messages = request.dump(NETLINK_ROUTE);
+  if (messages.isError()) {
+    return Error(messages.error());
+  }
+
+  hashmap<string, unsigned int> links;
+  foreach (const string& message, messages.get()) {
+    if (message.size() < sizeof(struct ifinfomsg)) {
+      continue;
+    }
+
+    const struct ifinfomsg* link = (struct ifinfomsg*) message.data();
+
+    Option<string> name = netlink::find(
+        netlink::parse(message, NLMSG_ALIGN(sizeof(struct ifinfomsg))),
+        IFLA_IFNAME);
+
+    if (name.isSome()) {
+      links[name->c_str()] = link->ifi_flags;
+    }
+  }
+
+  return links;
+}
+
+
+static Option<net::IP> parseIP(const string& value)
+{
+  if (value.size() == sizeof(struct in_addr)) {
+    return net::IP(*(struct in_addr*) value.data());
+  } else if (value.size() == sizeof(struct in6_addr)) {
+    return net::IP(*(struct in6_addr*) value.data());
+  }
+
+  return None();
+}
+
+
+static Option<net::MAC> parseLLAddr(const string& value)
+{
+  uint8_t bytes[6];
+  if (value.size() != sizeof(bytes)) {
+    return None();
+  }
+
+  memcpy(bytes, value.data(), sizeof(bytes));
+
+  return net::MAC(bytes);
+}
+
+
+// Dumps the neighbor entries of `family`, and returns the link layer
+// address and the destination of every permanent entry of the link at
+// `index`, as strings.
+static Try<vector<std::pair<string, string>>> dumpEntries(
+    uint8_t family,
+    int index)
+{
+  struct ndmsg neighbor;
+  memset(&neighbor, 0, sizeof(neighbor));
+  neighbor.ndm_family = family;
+
+  netlink::Request request;
+  request.message(RTM_GETNEIGH, NLM_F_DUMP, neighbor);
+
+  Try<vector<string>> messages = request.dump(NETLINK_ROUTE);
+  if (messages.isError()) {
+    return Error(messages.error());
+  }
+
+  vector<std::pair<string, string>> entries;
+  foreach (const string& message, messages.get()) {
+    if (message.size() < sizeof(struct ndmsg)) {
+      continue;
+    }
+
+    const struct ndmsg* entry = (struct ndmsg*) message.data();
+    if (entry->ndm_ifindex != index ||
+        !(entry->ndm_state & NUD_PERMANENT)) {
+      continue;
+    }
+
+    const vector<netlink::Attribute> attributes =
+      netlink::parse(message, NLMSG_ALIGN(sizeof(struct ndmsg)));
+
+    Option<string> lladdr = netlink::find(attributes, NDA_LLADDR);
+    Option<string> dst = netlink::find(attributes, NDA_DST);
+
+    if (lladdr.isNone() || dst.isNone()) {
+      continue;
+    }
+
+    Option<net::MAC> mac = parseLLAddr(lladdr.get());
+    Option<net::IP> ip = parseIP(dst.get());
+
+    if (mac.isSome() && ip.isSome()) {
+      entries.push_back(
+          std::make_pair(stringify(mac.get()), stringify(ip.get())));
+    }
+  }
+
+  return entries;
+}
+
+
+// Returns the destination of every permanent FDB entry of the VTEP
+// at `index`, keyed by MAC.
+static Try<hashmap<string, string>> dumpFDB(int index)
+{
+  Try<vector<std::pair<string, string>>> entries =
+    dumpEntries(AF_BRIDGE, index);
+
+  if (entries.isError()) {
+    return Error(entries.error());
+  }
+
+  hashmap<string, string> fdb;
+  foreach (const auto& entry, entries.get()) {
+    fdb[entry.first] = entry.second;
+  }
+
+  return fdb;
+}
+
+
+// Returns the MAC of every permanent IPv4 and IPv6 neighbor entry of
+// the VTEP at `index`, keyed by IP.
+static Try<hashmap<string, string>> dumpNeighbors(int index)
+{
+  Try<vector<std::pair<string, string>>> entries =
+    dumpEntries(AF_UNSPEC, index);
+
+  if (entries.isError()) {
+    return Error(entries.error());
+  }
+
+  hashmap<string, string> neighbors;
+  foreach (const auto& entry, entries.get()) {
+    neighbors[entry.second] = entry.first;
+  }
+
+  return neighbors;
+}
+
+
+static bool operator==(const Peer& left, const Peer& right)
+{
+  return left.agent == right.agent &&
+    left.vtepIP == right.vtepIP &&
+    left.vtepIP6 == right.vtepIP6 &&
+    left.vtepMAC == right.vtepMAC;
+}
+
+
+Try<Peer> Peer::parse(const string& agentIP, const VxLANInfo& vxlan)
+{
+  Try<net::IP> agent = net::IP::parse(agentIP, AF_UNSPEC);
+  if (agent.isError()) {
+    return Error("Unable to parse the Agent IP: " + agent.error());
+  }
+
+  Option<net::IP> vtepIP;
+  if (vxlan.has_vtep_ip()) {
+    Try<Network> _vtepIP = Network::parse(vxlan.vtep_ip(), AF_INET);
+    if (_vtepIP.isError()) {
+      return Error("Unable to parse the VTEP IP: " + _vtepIP.error());
+    }
+
+    vtepIP = _vtepIP->address();
+  }
+
+  Option<net::IP> vtepIP6;
+  if (vxlan.has_vtep_ip6()) {
+    Try<Network> _vtepIP6 = Network::parse(vxlan.vtep_ip6(), AF_INET6);
+    if (_vtepIP6.isError()) {
+      return Error("Unable to parse the VTEP IPv6: " + _vtepIP6.error());
+    }
+
+    vtepIP6 = _vtepIP6->address();
+  }
+
+  Try<net::MAC> vtepMAC = parseMAC(vxlan.vtep_mac());
+  if (vtepMAC.isError()) {
+    return Error("Unable to parse the VTEP MAC: " + vtepMAC.error());
+  }
+
+  if (vtepIP.isNone() && vtepIP6.isNone()) {
+    return Error("The VTEP has neither an IP nor an IPv6");
+  }
+
+  return Peer{agent.get(), vtepIP, vtepIP6, vtepMAC.get()};
+}
+
+
+Datapath::Datapath(uint16_t _port)
+  : port(_port),
+    mtu(0) {}
+
+
+Try<Nothing> Datapath::configure(
+    const VxLANInfo& vxlan,
+    const vector<string>& bridges,
+    uint32_t mtu)
+{
+  Option<Network> vtepIP;
+  if (vxlan.has_vtep_ip()) {
+    Try<Network> _vtepIP = Network::parse(vxlan.vtep_ip(), AF_INET);
+    if (_vtepIP.isError()) {
+      return Error("Unable to parse the VTEP IP: " + _vtepIP.error());
+    }
+
+    vtepIP = _vtepIP.get();
+  }
+
+  Option<Network> vtepIP6;
+  if (vxlan.has_vtep_ip6()) {
+    Try<Network> _vtepIP6 = Network::parse(vxlan.vtep_ip6(), AF_INET6);
+    if (_vtepIP6.isError()) {
+      return Error("Unable to parse the VTEP IPv6: " + _vtepIP6.error());
+    }
+
+    vtepIP6 = _vtepIP6.get();
+  }
+
+  Try<net::MAC> vtepMAC = parseMAC(vxlan.vtep_mac());
+  if (vtepMAC.isError()) {
+    return Error("Unable to parse the VTEP MAC: " + vtepMAC.error());
+  }
+
+  // Create the links that don't exist yet.
+  //
+  // NOTE: We don't modify the links that already exist, since they
+  // might be in use by containers, and the kernel does not allow
+  // changing most of the attributes of a VXLAN link.
+  netlink::Request create;
+  vector<string> creations;
+
+  if (if_nametoindex(vxlan.vtep_name().c_str()) == 0) {
+    const size_t linkinfo = addLink(&create, vxlan.vtep_name(), "vxlan");
+
+    const size_t data = create.nest(IFLA_INFO_DATA);
+    create.scalar(IFLA_VXLAN_ID, (uint32_t) vxlan.vni());
+    create.scalar(IFLA_VXLAN_PORT, htons(port));
+
+    // The FDB and neighbor entries of the peers are all programmed
+    // statically, so the VTEP must not learn entries from the packets
+    // it receives, which could override them.
+    create.scalar(IFLA_VXLAN_LEARNING, (uint8_t) 0);
+
+    // NOTE: A VTEP without an IPv4 VTEP IP belongs to an IPv6-only
+    // cluster, where the peers are reached over IPv6. The kernel opens
+    // an IPv6 socket for the VXLAN link only if its remote (or local)
+    // address is an IPv6 address, hence the unspecified IPv6 remote.
+    if (vtepIP.isNone()) {
+      create.scalar(IFLA_VXLAN_GROUP6, in6addr_any);
+    }
+    create.unnest(data);
+
+    create.unnest(linkinfo);
+
+    addMAC(&create, IFLA_ADDRESS, vtepMAC.get());
+
+    creations.push_back("create VTEP " + vxlan.vtep_name());
+  }
+
+  foreach (const string& bridge, bridges) {
+    if (if_nametoindex(bridge.c_str()) == 0) {
+      const size_t linkinfo = addLink(&create, bridge, "bridge");
+      create.unnest(linkinfo);
+
+      create.scalar(IFLA_MTU, mtu);
+
+      creations.push_back("create bridge " + bridge);
+    }
+  }
+
+  // Another process might have created a link since we have looked
+  // for it, in which case we use that link.
+  Try<Nothing> created = send(&create, creations, EEXIST);
+  if (created.isError()) {
+    return created;
+  }
+
+  // Bring the links up, and assign the VTEP IPs to the VTEP.
+  netlink::Request setup;
+  vector<string> setups;
+
+  const int vtepIndex = if_nametoindex(vxlan.vtep_name().c_str());
+  if (vtepIndex == 0) {
+    return ErrnoError("Unable to find VTEP " + vxlan.vtep_name());
+  }
+
+  addLinkUp(&setup, vtepIndex);
+  setups.push_back("bring up VTEP " + vxlan.vtep_name());
+
+  // Every VTEP gets the same VTEP IPs, so only the VTEP of the
+  // default VNI routes the VTEP subnet in the main table. The VTEP of
+  // an overlay with a VNI of its own routes it in a table of its own,
+  // which the packets received on the bridges of its overlays look
+  // up first, so that they reach the peers through the VTEP of their
+  // VNI rather than through whichever VTEP owns the main route.
+  const bool isolated = vxlan.vni() != DEFAULT_VNI;
+  const uint32_t table = VTEP_ROUTE_TABLE_BASE + vxlan.vni();
+
+  vector<Network> networks;
+  if (vtepIP.isSome()) {
+    networks.push_back(vtepIP.get());
+  }
+
+  if (vtepIP6.isSome()) {
+    networks.push_back(vtepIP6.get());
+  }
+
+  foreach (const Network& network, networks) {
+    addNetwork(&setup, vtepIndex, network, !isolated);
+    setups.push_back(
+        "assign " + stringify(network) + " to VTEP " + vxlan.vtep_name());
+  }
+
+  foreach (const string& bridge, bridges) {
+    const int index = if_nametoindex(bridge.c_str());
+    if (index == 0) {
+      return ErrnoError("Unable to find bridge " + bridge);
+    }
+
+    addLinkUp(&setup, index);
+    setups.push_back("bring up bridge " + bridge);
+  }
+
+  Try<Nothing> configured = send(&setup, setups);
+  if (configured.isError()) {
+    return configured;
+  }
+
+  if (isolated) {
+    netlink::Request routes;
+    vector<string> routings;
+
+    foreach (const Network& network, networks) {
+      // The VTEP might have been configured with the main route by a
+      // previous version of the Agent.
+      addRoute(&routes, RTM_DELROUTE, vtepIndex, network, RT_TABLE_MAIN);
+      routings.push_back(
+          "remove the main route to " + stringify(network) + " via VTEP " +
+          vxlan.vtep_name());
+
+      addRoute(&routes, RTM_NEWROUTE, vtepIndex, network, table);
+      routings.push_back(
+          "route " + stringify(network) + " via VTEP " + vxlan.vtep_name() +
+          " in table " + stringify(table));
+    }
+
+    Try<Nothing> routed = send(&routes, routings, ESRCH);
+    if (routed.isError()) {
+      return routed;
+    }
+
+    netlink::Request rules;
+    vector<string> descriptions;
+
+    foreach (const string& bridge, bridges) {
+      foreach (const Network& network, networks) {
+        addRule(
+            &rules,
+            RTM_NEWRULE,
+            network.address().family(),
+            bridge,
+            table);
+
+        descriptions.push_back(
+            "add rule from bridge " + bridge + " to table " +
+            stringify(table));
+      }
+    }
+
+    Try<Nothing> ruled = send(&rules, descriptions, EEXIST);
+    if (ruled.isError()) {
+      return ruled;
+    }
+  }
+
+  vteps[vxlan.vtep_name()] = vxlan;
+  this->bridges[vxlan.vtep_name()].insert(bridges.begin(), bridges.end());
+  this->mtu = mtu;
+
+  return Nothing();
+}
+
+
+Try<Nothing> Datapath::update(const vector<Peer>& _peers)
+{
+  if (vteps.empty()) {
+    return Error("The VTEP has not been configured");
+  }
+
+  hashmap<string, Peer> updated;
+  foreach (const Peer& peer, _peers) {
+    updated.put(stringify(peer.vtepMAC), peer);
+  }
+
+  netlink::Request request;
+  vector<string> descriptions;
+
+  // Every VTEP reaches the same peers, since the VTEPs of an Agent
+  // only differ by the VNI of their overlays.
+  foreachkey (const string& vtep, vteps) {
+    const int index = if_nametoindex(vtep.c_str());
+    if (index == 0) {
+      return ErrnoError("Unable to find VTEP " + vtep);
+    }
+
+    const hashmap<string, Peer>& programmed = peers[vtep];
+
+    // Remove the entries of the peers that are gone or have changed
+    // first, since a changed peer might not reuse all of its entries.
+    foreachpair (const string& mac, const Peer& peer, programmed) {
+      if (updated.contains(mac) && updated.at(mac) == peer) {
+        continue;
+      }
+
+      addPeer(&request, &descriptions, RTM_DELNEIGH, index, peer);
+    }
+
+    foreachpair (const string& mac, const Peer& peer, updated) {
+      if (programmed.contains(mac) && programmed.at(mac) == peer) {
+        continue;
+      }
+
+      addPeer(&request, &descriptions, RTM_NEWNEIGH, index, peer);
+    }
+  }
+
+  VLOG(1) << "Programming " << request.size() << " FDB and neighbor "
+          << "entries for " << updated.size() << " peers on "
+          << vteps.size() << " VTEPs";
+
+  // The entries to remove might have been removed by someone else.
+  Try<Nothing> programmed = send(&request, descriptions, ENOENT);
+  if (programmed.isError()) {
+    // We keep the peers programmed by the previous update, so that
+    // the next update programs all the entries of this update again.
+    return programmed;
+  }
+
+  foreachkey (const string& vtep, vteps) {
+    peers[vtep] = updated;
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> Datapath::remove(const string& vtep)
+{
+  if (!vteps.contains(vtep)) {
+    return Nothing();
+  }
+
+  const VxLANInfo& vxlan = vteps.at(vtep);
+
+  netlink::Request request;
+  vector<string> descriptions;
+
+  // The routes of the VTEP are removed along with it, but the rules
+  // of its bridges are not, since they refer to the bridges by name.
+  if (vxlan.vni() != DEFAULT_VNI) {
+    const uint32_t table = VTEP_ROUTE_TABLE_BASE + vxlan.vni();
+
+    vector<int> families;
+    if (vxlan.has_vtep_ip()) {
+      families.push_back(AF_INET);
+    }
+
+    if (vxlan.has_vtep_ip6()) {
+      families.push_back(AF_INET6);
+    }
+
+    foreach (const string& bridge, bridges[vtep]) {
+      foreach (int family, families) {
+        addRule(&request, RTM_DELRULE, family, bridge, table);
+        descriptions.push_back(
+            "remove rule from bridge " + bridge + " to table " +
+            stringify(table));
+      }
+    }
+  }
+
+  const int index = if_nametoindex(vtep.c_str());
+  if (index != 0) {
+    addLinkDelete(&request, index);
+    descriptions.push_back("delete VTEP " + vtep);
+  }
+
+  // The VTEP and the rules might have been removed by someone else.
+  Try<Nothing> removed = send(&request, descriptions, ENOENT);
+  if (removed.isError()) {
+    return removed;
+  }
+
+  vteps.erase(vtep);
+  bridges.erase(vtep);
+  peers.erase(vtep);
+
+  return Nothing();
+}
+
+
+Try<Datapath::Drift> Datapath::repair()
+{
+  if (vteps.empty()) {
+    return Error("The VTEP has not been configured");
+  }
+
+  Drift drift;
+
+  Try<hashmap<string, unsigned int>> links = dumpLinks();
+  if (links.isError()) {
+    return Error("Unable to dump the links: " + links.error());
+  }
+
+  // NOTE: `configure` only creates the links that don't exist, and
+  // brings up the VTEP and the given bridges. The missing bridges are
+  // configured along with their VTEP.
+  //
+  // NOTE: A copy, since repairing the links configures `vteps` again.
+  const hashmap<string, VxLANInfo> _vteps = vteps;
+
+  foreachpair (const string& vtep, const VxLANInfo& vxlan, _vteps) {
+    vector<string> missing;
+
+    foreach (const string& bridge, bridges[vtep]) {
+      if (!links->contains(bridge) || !(links->at(bridge) & IFF_UP)) {
+        LOG(WARNING) << "Bridge " << bridge << " is missing or down";
+        missing.push_back(bridge);
+        drift.links++;
+      }
+    }
+
+    const bool down = !links->contains(vtep) || !(links->at(vtep) & IFF_UP);
+    if (down) {
+      LOG(WARNING) << "VTEP " << vtep << " is missing or down";
+      drift.links++;
+    }
+
+    if (down || !missing.empty()) {
+      Try<Nothing> configured = configure(vxlan, missing, mtu);
+      if (configured.isError()) {
+        return Error("Unable to repair the links: " + configured.error());
+      }
+    }
+  }
+
+  netlink::Request request;
+  vector<string> descriptions;
+
+  foreachkey (const string& vtep, _vteps) {
+    Try<size_t> entries = repair(vtep, &request, &descriptions);
+    if (entries.isError()) {
+      return Error(entries.error());
+    }
+
+    drift.entries += entries.get();
+  }
+
+  if (drift.entries > 0) {
+    LOG(WARNING) << "Programming the entries of " << drift.entries
+                 << " peers missing from the VTEPs";
+
+    Try<Nothing> programmed = send(&request, descriptions);
+    if (programmed.isError()) {
+      return Error("Unable to repair the peers: " + programmed.error());
+    }
+  }
+
+  return drift;
+}
+
+
+Try<size_t> Datapath::repair(
+    const string& vtep,
+    netlink::Request* request,
+    vector<string>* descriptions)
+{
+  const int index = if_nametoindex(vtep.c_str());
+  if (index == 0) {
+    return ErrnoError("Unable to find VTEP " + vtep);
+  }
+
+  Try<hashmap<string, string>> fdb = dumpFDB(index);
+  if (fdb.isError()) {
+    return Error(
+        "Unable to dump the FDB of VTEP " + vtep + ": " + fdb.error());
+  }
+
+  Try<hashmap<string, string>> neighbors = dumpNeighbors(index);
+  if (neighbors.isError()) {
+    return Error(
+        "Unable to dump the neighbors of VTEP " + vtep + ": " +
+        neighbors.error());
+  }
+
+  size_t drifted = 0;
+
+  foreachpair (const string& mac, const Peer& peer, peers[vtep]) {
+    bool _drifted =
+      !fdb->contains(mac) ||
+      fdb->at(mac) != stringify(peer.agent);
+
+    if (peer.vtepIP.isSome()) {
+      const string vtepIP = stringify(peer.vtepIP.get());
+
+      _drifted = _drifted ||
+        !neighbors->contains(vtepIP) ||
+        neighbors->at(vtepIP) != mac;
+    }
+
+    if (peer.vtepIP6.isSome()) {
+      const string vtepIP6 = stringify(peer.vtepIP6.get());
+
+      _drifted = _drifted ||
+        !neighbors->contains(vtepIP6) ||
+        neighbors->at(vtepIP6) != mac;
+    }
+
+    if (_drifted) {
+      addPeer(request, descriptions, RTM_NEWNEIGH, index, peer);
+      drifted++;
+    }
+  }
+
+  return drifted;
+}
+
+
+
+DatapathProcess::DatapathProcess(uint16_t port)
+  : ProcessBase(process::ID::generate("overlay-datapath")),
+    datapath(port) {}
+
+
+Future<Nothing> DatapathProcess::configure(
+    const VxLANInfo& vxlan,
+    const vector<string>& bridges,
+    uint32_t mtu)
+{
+  Try<Nothing> configured = datapath.configure(vxlan, bridges, mtu);
+  if (configured.isError()) {
+    return Failure(configured.error());
+  }
+
+  return Nothing();
+}
+
+
+Future<Nothing> DatapathProcess::update(const vector<Peer>& peers)
+{
+  if (!datapath.configured()) {
+    return Nothing();
+  }
+
+  Try<Nothing> updated = datapath.update(peers);
+  if (updated.isError()) {
+    return Failure(updated.error());
+  }
+
+  return Nothing();
+}
+
+
+Future<Nothing> DatapathProcess::prune(const hashset<string>& used)
+{
+  foreach (const string& vtep, datapath.names()) {
+    if (used.contains(vtep)) {
+      continue;
+    }
+
+    LOG(INFO) << "Deleting VTEP " << vtep << " which no overlay uses";
+
+    Try<Nothing> removed = datapath.remove(vtep);
+    if (removed.isError()) {
+      LOG(ERROR) << "Unable to delete VTEP " << vtep << ": "
+                 << removed.error();
+    }
+  }
+
+  return Nothing();
+}
+
+
+Future<Datapath::Drift> DatapathProcess::repair()
+{
+  if (!datapath.configured()) {
+    return Datapath::Drift();
+  }
+
+  Try<Datapath::Drift> drift = datapath.repair();
+  if (drift.isError()) {
+    return Failure(drift.error());
+  }
+
+  return drift.get();
+}
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
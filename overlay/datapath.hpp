@@ -0,0 +1,186 @@
+#ifndef __OVERLAY_DATAPATH_HPP__
+#define __OVERLAY_DATAPATH_HPP__
+
+#include <string>
+#include <vector>
+
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/hashset.hpp>
+#include <stout/ip.hpp>
+#include <stout/mac.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+#include <process/future.hpp>
+#include <process/process.hpp>
+
+#include <overlay/overlay.hpp>
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+
+namespace netlink {
+class Request;
+} // namespace netlink {
+
+namespace agent {
+
+// The VTEP of another Agent. Traffic sent to the VTEP IP of the peer
+// is tunneled to the Agent IP of the peer.
+struct Peer
+{
+  // Parses the VTEP described by `vxlan` of the Agent at `agentIP`.
+  static Try<Peer> parse(const std::string& agentIP, const VxLANInfo& vxlan);
+
+  // The IP of the Agent, which is the remote end of the tunnel.
+  net::IP agent;
+
+  // The VTEP IPs of the Agent. An IPv6-only cluster has no IPv4
+  // VTEP IPs.
+  Option<net::IP> vtepIP;
+  Option<net::IP> vtepIP6;
+  net::MAC vtepMAC;
+};
+
+
+// Configures the VXLAN datapath of the overlays on the Agent with
+// rtnetlink: the VTEPs, the bridges of the overlays, and the FDB and
+// neighbor entries of the peer VTEPs. The overlays that share a VNI
+// share a VTEP.
+//
+// All the VTEPs get the VTEP IPs of the Agent, but only the VTEP of
+// the `DEFAULT_VNI` routes the VTEP subnet in the main table. Every
+// other VTEP routes it in a table of its own, which a rule selects
+// for the packets received on the bridges of its overlays.
+//
+// Every method sends its messages as a single batch on a netlink
+// socket, rather than running `ip` and `bridge` for every link or
+// peer, so that an Agent with thousands of peers is configured in a
+// few netlink round trips.
+class Datapath
+{
+public:
+  // `port` is the UDP destination port of the VXLAN tunnels.
+  explicit Datapath(uint16_t port);
+
+  // Creates the VTEP described by `vxlan`, and the `bridges` with the
+  // given `mtu`, unless they exist, and brings them up. The VTEP gets
+  // the VTEP MAC and VTEP IPs of the Agent, and the bridges get the
+  // rules selecting the route table of the VTEP.
+  //
+  // NOTE: The IPs of the bridges are assigned by the CNI bridge plugin
+  // and by Docker, which use the bridges as the gateways of the
+  // containers.
+  Try<Nothing> configure(
+      const VxLANInfo& vxlan,
+      const std::vector<std::string>& bridges,
+      uint32_t mtu);
+
+  // Programs a permanent FDB entry, pointing the VTEP MAC of every
+  // peer at its Agent IP, and a permanent neighbor entry for every
+  // VTEP IP of every peer, on every VTEP, so that the VTEPs never
+  // need to flood or learn. Only the entries of new or changed peers
+  // are programmed, and the entries of the peers that are no longer
+  // in `peers` are removed.
+  Try<Nothing> update(const std::vector<Peer>& peers);
+
+  // Deletes the VTEP `vtep` and the rules of its bridges, e.g., once
+  // its VNI is no longer used by any overlay. The bridges are left
+  // alone, since they might belong to overlays that moved to another
+  // VTEP.
+  Try<Nothing> remove(const std::string& vtep);
+
+  // Whether a VTEP has been configured, which is required before
+  // the peers can be programmed.
+  bool configured() const { return !vteps.empty(); }
+
+  // The names of the VTEPs that have been configured.
+  hashset<std::string> names() const
+  {
+    hashset<std::string> result;
+    foreachkey (const std::string& vtep, vteps) {
+      result.insert(vtep);
+    }
+
+    return result;
+  }
+
+  // The links and entries found missing or modified by `repair`.
+  struct Drift
+  {
+    Drift() : links(0), entries(0) {}
+
+    size_t links;
+    size_t entries;
+  };
+
+  // Compares the links configured by `configure` and the entries of
+  // the peers programmed by `update` with the links and the FDB and
+  // neighbor entries dumped from the kernel, and configures or
+  // programs again only the ones that have drifted, e.g., because
+  // someone deleted a bridge or flushed the FDB of the VTEP.
+  Try<Drift> repair();
+
+private:
+  // Adds the entries of the peers programmed on `vtep` that have
+  // drifted to `request`. Returns the number of drifted peers.
+  Try<size_t> repair(
+      const std::string& vtep,
+      netlink::Request* request,
+      std::vector<std::string>* descriptions);
+
+  const uint16_t port;
+
+  // The VTEPs that have been configured, keyed by name, the bridges
+  // configured along with every VTEP, and the MTU of the last call
+  // to `configure`. The overlays with a VNI of their own get a VTEP
+  // of their own.
+  hashmap<std::string, VxLANInfo> vteps;
+  hashmap<std::string, hashset<std::string>> bridges;
+  uint32_t mtu;
+
+  // The peers that have been programmed on every VTEP, keyed by VTEP
+  // name and VTEP MAC.
+  hashmap<std::string, hashmap<std::string, Peer>> peers;
+};
+
+
+// Runs a `Datapath` on an actor of its own, so that the netlink
+// round trips of a reconciliation or of a repair don't hold the actor
+// of the Agent, which keeps answering the master and its endpoints
+// meanwhile.
+class DatapathProcess : public process::Process<DatapathProcess>
+{
+public:
+  explicit DatapathProcess(uint16_t port);
+
+  process::Future<Nothing> configure(
+      const VxLANInfo& vxlan,
+      const std::vector<std::string>& bridges,
+      uint32_t mtu);
+
+  // Programs the `peers` on the VTEPs. The peers are only programmed
+  // once a VTEP has been configured, so this does nothing before.
+  process::Future<Nothing> update(const std::vector<Peer>& peers);
+
+  // Deletes the VTEPs that are not in `used`. A VTEP that can't be
+  // deleted is logged and deleted again by the next call.
+  process::Future<Nothing> prune(const hashset<std::string>& used);
+
+  // Repairs the datapath, which has not drifted before a VTEP has
+  // been configured.
+  process::Future<Datapath::Drift> repair();
+
+private:
+  Datapath datapath;
+};
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_DATAPATH_HPP__
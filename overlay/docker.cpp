@@ -0,0 +1,348 @@
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stout/duration.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/hashset.hpp>
+#include <stout/json.hpp>
+#include <stout/jsonify.hpp>
+#include <stout/lambda.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+#include <process/address.hpp>
+#include <process/collect.hpp>
+#include <process/defer.hpp>
+#include <process/dispatch.hpp>
+#include <process/http.hpp>
+#include <process/id.hpp>
+#include <process/process.hpp>
+
+#include "docker.hpp"
+
+using std::list;
+using std::pair;
+using std::string;
+using std::vector;
+
+using process::Failure;
+using process::Future;
+using process::Owned;
+using process::Process;
+using process::Promise;
+
+namespace http = process::http;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// The result of the creation of a network: whether the network has
+// been created, or the error that prevented its creation.
+typedef hashmap<string, Try<bool>> Results;
+
+// Time after which a batch that is still being reconciled, e.g., by a
+// hung Docker daemon, fails.
+constexpr Duration RECONCILIATION_TIMEOUT = Minutes(2);
+
+
+class DockerClientProcess : public Process<DockerClientProcess>
+{
+public:
+  explicit DockerClientProcess(const network::unix::Address& _address)
+    : ProcessBase(process::ID::generate("overlay-docker")),
+      address(_address),
+      reconciling(false) {}
+
+  Future<bool> ensure(const DockerNetwork& network)
+  {
+    Owned<Promise<bool>> promise(new Promise<bool>());
+    pending.push_back(std::make_pair(network, promise));
+
+    // Let the overlays that are configured in the same round of
+    // events join this batch before reconciling it.
+    if (!reconciling) {
+      reconciling = true;
+      dispatch(self(), &DockerClientProcess::reconcile);
+    }
+
+    return promise->future();
+  }
+
+private:
+  void reconcile()
+  {
+    list<pair<DockerNetwork, Owned<Promise<bool>>>> requests;
+    requests.swap(pending);
+
+    vector<DockerNetwork> networks;
+    foreach (const auto& request, requests) {
+      networks.push_back(request.first);
+    }
+
+    VLOG(1) << "Reconciling " << networks.size() << " Docker networks";
+
+    Future<http::Connection> connection = http::connect(address);
+
+    connection
+      .then(defer(self(), &Self::listNetworks, networks, lambda::_1))
+      .after(RECONCILIATION_TIMEOUT,
+             defer(self(), &Self::timedOut, connection, lambda::_1))
+      .onAny(defer(self(), &Self::_reconcile, requests, lambda::_1));
+  }
+
+  // Fails the batch, and closes its connection so that the requests
+  // still in flight fail instead of holding on to the connection.
+  Future<Results> timedOut(
+      Future<http::Connection> connection,
+      Future<Results> results)
+  {
+    results.discard();
+    connection.discard();
+
+    // The connection might only be established later on.
+    connection.onReady([](http::Connection connection) {
+      connection.disconnect();
+    });
+
+    return Failure(
+        "Timed out after " + stringify(RECONCILIATION_TIMEOUT) +
+        " waiting for the Docker daemon");
+  }
+
+  void _reconcile(
+      const list<pair<DockerNetwork, Owned<Promise<bool>>>>& requests,
+      const Future<Results>& results)
+  {
+    foreach (const auto& request, requests) {
+      const string& name = request.first.name;
+
+      if (!results.isReady()) {
+        request.second->fail(
+            "Unable to reconcile the Docker networks: " +
+            (results.isFailed() ? results.failure() : "discarded"));
+      } else if (!results->contains(name)) {
+        // The network already existed.
+        request.second->set(false);
+      } else if (results->at(name).isError()) {
+        request.second->fail(results->at(name).error());
+      } else {
+        request.second->set(results->at(name).get());
+      }
+    }
+
+    reconciling = false;
+
+    if (!pending.empty()) {
+      reconciling = true;
+      dispatch(self(), &DockerClientProcess::reconcile);
+    }
+  }
+
+  Future<Results> listNetworks(
+      const vector<DockerNetwork>& networks,
+      http::Connection connection)
+  {
+    return connection.send(request("GET", "/networks"))
+      .then(defer(self(),
+                  &Self::createNetworks,
+                  networks,
+                  connection,
+                  lambda::_1))
+      .onAny([connection]() mutable { connection.disconnect(); });
+  }
+
+  // Creates the `networks` that are not in the list of networks in
+  // `response`, pipelining the requests on `connection`.
+  Future<Results> createNetworks(
+      const vector<DockerNetwork>& networks,
+      http::Connection connection,
+      const http::Response& response)
+  {
+    if (response.code != http::Status::OK) {
+      return Failure(
+          "Failed to list the Docker networks: " + response.status +
+          ": " + response.body);
+    }
+
+    Try<JSON::Array> all = JSON::parse<JSON::Array>(response.body);
+    if (all.isError()) {
+      return Failure("Failed to parse the Docker networks: " + all.error());
+    }
+
+    hashset<string> existing;
+    foreach (const JSON::Value& value, all->values) {
+      if (!value.is<JSON::Object>()) {
+        continue;
+      }
+
+      Result<JSON::String> name =
+        value.as<JSON::Object>().find<JSON::String>("Name");
+
+      if (name.isSome()) {
+        existing.insert(name->value);
+      }
+    }
+
+    vector<string> names;
+    list<Future<http::Response>> responses;
+
+    foreach (const DockerNetwork& network, networks) {
+      if (existing.contains(network.name)) {
+        continue;
+      }
+
+      existing.insert(network.name);
+
+      LOG(INFO) << "Creating Docker network '" << network.name << "'";
+
+      names.push_back(network.name);
+      responses.push_back(connection.send(
+          request("POST", "/networks/create", body(network))));
+    }
+
+    return collect(responses)
+      .then([names](const list<http::Response>& responses) {
+        Results results;
+
+        size_t i = 0;
+        foreach (const http::Response& response, responses) {
+          const string& name = names[i++];
+
+          if (response.code == http::Status::CREATED) {
+            results.put(name, true);
+          } else if (response.code == http::Status::CONFLICT) {
+            // Someone else has created the network since we listed
+            // the networks.
+            results.put(name, false);
+          } else {
+            results.put(
+                name,
+                Error(
+                    "Failed to create Docker network '" + name + "': " +
+                    response.status + ": " + response.body));
+          }
+        }
+
+        return results;
+      });
+  }
+
+  http::Request request(
+      const string& method,
+      const string& path,
+      const Option<string>& body = None())
+  {
+    http::Request request;
+    request.method = method;
+    request.url = http::URL("http", "docker", 80, path);
+    request.keepAlive = true;
+
+    if (body.isSome()) {
+      request.headers["Content-Type"] = "application/json";
+      request.body = body.get();
+    }
+
+    return request;
+  }
+
+  // Returns the body of the `POST /networks/create` request for
+  // `network`, which is equivalent to:
+  //
+  //   docker network create --driver=bridge
+  //     --opt=com.docker.network.bridge.name=<bridge>
+  //     --opt=com.docker.network.bridge.enable_ip_masquerade=false
+  //     --opt=com.docker.network.driver.mtu=<mtu>
+  //     [--subnet=<subnet>] [--ipv6 --subnet=<subnet6>]
+  //     <name>
+  static string body(const DockerNetwork& network)
+  {
+    auto body = [&network](JSON::ObjectWriter* writer) {
+      writer->field("Name", network.name);
+      writer->field("Driver", "bridge");
+      writer->field("CheckDuplicate", true);
+      writer->field("EnableIPv6", network.subnet6.isSome());
+
+      writer->field("IPAM", [&network](JSON::ObjectWriter* writer) {
+        writer->field("Driver", "default");
+        writer->field("Config", [&network](JSON::ArrayWriter* writer) {
+          if (network.subnet.isSome()) {
+            writer->element([&network](JSON::ObjectWriter* writer) {
+              writer->field("Subnet", network.subnet.get());
+            });
+          }
+
+          if (network.subnet6.isSome()) {
+            writer->element([&network](JSON::ObjectWriter* writer) {
+              writer->field("Subnet", network.subnet6.get());
+            });
+          }
+        });
+      });
+
+      writer->field("Options", [&network](JSON::ObjectWriter* writer) {
+        writer->field("com.docker.network.bridge.name", network.bridge);
+        writer->field(
+            "com.docker.network.bridge.enable_ip_masquerade",
+            "false");
+        writer->field(
+            "com.docker.network.driver.mtu",
+            stringify(network.mtu));
+      });
+    };
+
+    return jsonify(body);
+  }
+
+  const network::unix::Address address;
+
+  // Set while a batch is scheduled or being reconciled.
+  bool reconciling;
+
+  // Networks waiting for the next batch.
+  list<pair<DockerNetwork, Owned<Promise<bool>>>> pending;
+};
+
+
+Try<Owned<DockerClient>> DockerClient::create(const string& socket)
+{
+  Try<network::unix::Address> address =
+    network::unix::Address::create(socket);
+
+  if (address.isError()) {
+    return Error(
+        "Invalid Docker socket '" + socket + "': " + address.error());
+  }
+
+  return Owned<DockerClient>(new DockerClient(
+      Owned<DockerClientProcess>(new DockerClientProcess(address.get()))));
+}
+
+
+DockerClient::DockerClient(Owned<DockerClientProcess> _process)
+  : process(_process)
+{
+  spawn(process.get());
+}
+
+
+DockerClient::~DockerClient()
+{
+  terminate(process.get());
+  wait(process.get());
+}
+
+
+Future<bool> DockerClient::ensure(const DockerNetwork& network)
+{
+  return dispatch(process.get(), &DockerClientProcess::ensure, network);
+}
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
@@ -0,0 +1,66 @@
+#ifndef __OVERLAY_DOCKER_HPP__
+#define __OVERLAY_DOCKER_HPP__
+
+#include <string>
+
+#include <process/future.hpp>
+#include <process/owned.hpp>
+
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// The Docker network of an overlay, attached to the Docker bridge of
+// the overlay.
+struct DockerNetwork
+{
+  std::string name;
+  std::string bridge;
+  uint32_t mtu;
+
+  // The subnets of the bridge, in CIDR notation.
+  Option<std::string> subnet;
+  Option<std::string> subnet6;
+};
+
+
+class DockerClientProcess;
+
+
+// A client of the Docker Engine API that creates the Docker networks
+// of the overlays through the Unix socket of the Docker daemon,
+// instead of forking the `docker` CLI for every overlay.
+//
+// Networks requested while other networks are being reconciled are
+// reconciled together in the next batch: a single `GET /networks`
+// lists all the networks, and the missing networks are created with
+// `POST /networks/create` requests pipelined on the same connection.
+// A batch that is not reconciled in time, e.g., by a hung Docker
+// daemon, fails so that the next batch can be reconciled.
+class DockerClient
+{
+public:
+  static Try<process::Owned<DockerClient>> create(const std::string& socket);
+
+  ~DockerClient();
+
+  // Creates `network` unless a Docker network with the same name
+  // exists. Returns whether the network has been created.
+  process::Future<bool> ensure(const DockerNetwork& network);
+
+private:
+  explicit DockerClient(process::Owned<DockerClientProcess> process);
+
+  process::Owned<DockerClientProcess> process;
+};
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_DOCKER_HPP__
@@ -0,0 +1,797 @@
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/json.hpp>
+#include <stout/lambda.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/strings.hpp>
+
+#include <stout/os/chmod.hpp>
+#include <stout/os/rm.hpp>
+#include <stout/os/write.hpp>
+
+#include <process/address.hpp>
+#include <process/defer.hpp>
+#include <process/delay.hpp>
+#include <process/dispatch.hpp>
+#include <process/http.hpp>
+#include <process/id.hpp>
+#include <process/process.hpp>
+#include <process/socket.hpp>
+
+#include "ipam.hpp"
+
+using std::deque;
+using std::string;
+using std::vector;
+
+using process::Failure;
+using process::Future;
+using process::Owned;
+using process::Process;
+
+namespace http = process::http;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// The types of the records of a journal. A journal starts with the
+// subnet of the network, followed by the allocations and releases of
+// its IPs, in order.
+constexpr char RECORD_SUBNET = 'S';
+constexpr char RECORD_ALLOCATE = 'A';
+constexpr char RECORD_RELEASE = 'R';
+
+// A journal is compacted once it holds this many records more than
+// twice the number of allocated IPs.
+constexpr size_t JOURNAL_SLACK = 1024;
+
+// The bitmap of the allocated IPs of a network grows by this many
+// IPs at a time, as the IPs are allocated, so that a large subnet
+// only takes the memory of the IPs it has handed out.
+constexpr uint32_t BITMAP_CHUNK = 65536;
+
+
+static string encodeOffset(uint32_t offset)
+{
+  const uint32_t value = htonl(offset);
+  return string((const char*) &value, sizeof(value));
+}
+
+
+static uint32_t decodeOffset(const string& data, size_t position)
+{
+  uint32_t value;
+  memcpy(&value, data.data() + position, sizeof(value));
+  return ntohl(value);
+}
+
+
+// Returns the IP at `offset` in `subnet`, with the prefix length of
+// `subnet`.
+static Network nth(const Network& subnet, uint32_t offset)
+{
+  const uint32_t begin = ntohl(subnet.begin().in().get().s_addr);
+  return Network(IP(begin + offset), subnet.prefix());
+}
+
+
+static string encodeAllocation(uint32_t offset, const string& interface)
+{
+  const uint16_t length = htons(interface.size());
+
+  return RECORD_ALLOCATE + encodeOffset(offset) +
+    string((const char*) &length, sizeof(length)) + interface;
+}
+
+
+// The IPs of a Mesos network, as offsets in its subnet. Offset 0 is
+// the network address, offset 1 the gateway, and the last offset the
+// broadcast address, none of which are allocated.
+struct Pool
+{
+  explicit Pool(const Network& _subnet)
+    : subnet(Network(_subnet.begin(), _subnet.prefix())),
+      size(uint64_t(1) << (32 - subnet.prefix())),
+      next(2),
+      records(0) {}
+
+  // Returns the offset of a free IP, if any: the IPs that have never
+  // been allocated first, then the released IPs in the order they
+  // have been released.
+  Option<uint32_t> take()
+  {
+    if (next < size - 1) {
+      return next++;
+    }
+
+    if (!free.empty()) {
+      const uint32_t offset = free.front();
+      free.pop_front();
+      return offset;
+    }
+
+    return None();
+  }
+
+  bool isAllocated(uint32_t offset) const
+  {
+    return offset < allocated.size() && allocated[offset];
+  }
+
+  void setAllocated(uint32_t offset, bool value)
+  {
+    if (offset >= allocated.size()) {
+      if (!value) {
+        return;
+      }
+
+      const uint64_t chunks = offset / BITMAP_CHUNK + 1;
+      allocated.resize(std::min(size, chunks * BITMAP_CHUNK), false);
+    }
+
+    allocated[offset] = value;
+  }
+
+  Network subnet;
+
+  // Number of IPs in `subnet`.
+  uint64_t size;
+
+  // Whether the IP at every offset below the size of the bitmap is
+  // allocated. The IPs above are not.
+  vector<bool> allocated;
+
+  // The released IPs below `next`, in the order they are reused.
+  deque<uint32_t> free;
+
+  // The lowest offset that has never been allocated.
+  uint32_t next;
+
+  // The offset allocated to every interface, keyed by container ID
+  // and interface name.
+  hashmap<string, uint32_t> interfaces;
+
+  // Number of records in the journal.
+  size_t records;
+};
+
+
+class IpamProcess : public Process<IpamProcess>
+{
+public:
+  IpamProcess(const string& _directory, const network::Socket& _socket)
+    : ProcessBase(process::ID::generate("overlay-ipam")),
+      directory(_directory),
+      socket(_socket) {}
+
+  Future<Network> allocate(
+      const string& network,
+      const Network& subnet,
+      const string& containerId,
+      const string& ifname)
+  {
+    Try<Network> ip = _allocate(network, subnet, containerId, ifname);
+    if (ip.isError()) {
+      return Failure(ip.error());
+    }
+
+    return ip.get();
+  }
+
+  Future<Nothing> release(
+      const string& network,
+      const string& containerId,
+      const string& ifname)
+  {
+    Try<Nothing> released = _release(network, containerId, ifname);
+    if (released.isError()) {
+      return Failure(released.error());
+    }
+
+    return Nothing();
+  }
+
+  Future<Nothing> remove(const string& network)
+  {
+    close(network);
+
+    const string journal = path::join(directory, network);
+    if (os::exists(journal)) {
+      Try<Nothing> rm = os::rm(journal);
+      if (rm.isError()) {
+        return Failure(
+            "Unable to remove the journal of network '" + network +
+            "': " + rm.error());
+      }
+    }
+
+    return Nothing();
+  }
+
+protected:
+  virtual void initialize()
+  {
+    accept();
+  }
+
+  virtual void finalize()
+  {
+    foreachvalue (int_fd fd, journals) {
+      os::close(fd);
+    }
+
+    journals.clear();
+  }
+
+private:
+  void accept()
+  {
+    socket.accept()
+      .onAny(defer(self(), &Self::_accept, lambda::_1));
+  }
+
+  void _accept(const Future<network::Socket>& client)
+  {
+    if (!client.isReady()) {
+      LOG(ERROR) << "Unable to accept an IPAM connection: "
+                 << (client.isFailed() ? client.failure() : "discarded");
+
+      delay(Seconds(1), self(), &Self::accept);
+      return;
+    }
+
+    const process::PID<IpamProcess> pid = self();
+
+    http::serve(client.get(), [pid](const http::Request& request) {
+      return dispatch(pid, &IpamProcess::handle, request);
+    });
+
+    accept();
+  }
+
+  Future<http::Response> handle(const http::Request& request)
+  {
+    if (request.method != "POST") {
+      return http::MethodNotAllowed({"POST"}, request.method);
+    }
+
+    Try<JSON::Object> body = JSON::parse<JSON::Object>(request.body);
+    if (body.isError()) {
+      return http::BadRequest("Invalid request: " + body.error());
+    }
+
+    Result<JSON::String> network = body->find<JSON::String>("network");
+    Result<JSON::String> containerId =
+      body->find<JSON::String>("container_id");
+    Result<JSON::String> ifname = body->find<JSON::String>("ifname");
+
+    if (!network.isSome() || !containerId.isSome() || !ifname.isSome()) {
+      return http::BadRequest(
+          "Expecting 'network', 'container_id' and 'ifname'");
+    }
+
+    if (request.url.path == "/allocate") {
+      Result<JSON::String> subnet = body->find<JSON::String>("subnet");
+      if (!subnet.isSome()) {
+        return http::BadRequest("Expecting 'subnet'");
+      }
+
+      Try<Network> _subnet = Network::parse(subnet->value, AF_INET);
+      if (_subnet.isError()) {
+        return http::BadRequest(
+            "Invalid subnet '" + subnet->value + "': " + _subnet.error());
+      }
+
+      Try<Network> ip = _allocate(
+          network->value,
+          _subnet.get(),
+          containerId->value,
+          ifname->value);
+
+      if (ip.isError()) {
+        return http::InternalServerError(ip.error());
+      }
+
+      const Network gateway = nth(_subnet.get(), 1);
+
+      JSON::Object result;
+      result.values["ip"] = stringify(ip.get());
+      result.values["gateway"] = stringify(gateway.address());
+
+      return http::OK(result);
+    }
+
+    if (request.url.path == "/release") {
+      Try<Nothing> released = _release(
+          network->value,
+          containerId->value,
+          ifname->value);
+
+      if (released.isError()) {
+        return http::InternalServerError(released.error());
+      }
+
+      return http::OK();
+    }
+
+    return http::NotFound();
+  }
+
+  Try<Network> _allocate(
+      const string& network,
+      const Network& subnet,
+      const string& containerId,
+      const string& ifname)
+  {
+    if (subnet.address().family() != AF_INET) {
+      return Error("Only IPv4 subnets are supported");
+    }
+
+    if (subnet.prefix() > 30) {
+      return Error(
+          "Invalid subnet " + stringify(subnet) + " for network '" +
+          network + "'");
+    }
+
+    Try<Pool*> pool = open(network);
+    if (pool.isError()) {
+      return Error(pool.error());
+    }
+
+    // The subnet of the network has changed, so the containers that
+    // got an IP from the previous subnet are gone.
+    if (pool.get() == nullptr ||
+        pool.get()->subnet != Network(subnet.begin(), subnet.prefix())) {
+      if (pool.get() != nullptr) {
+        LOG(INFO) << "Dropping the IPs of network '" << network
+                  << "' allocated from " << pool.get()->subnet;
+      }
+
+      close(network);
+
+      pools.put(network, Pool(subnet));
+
+      Try<Nothing> compacted = compact(network);
+      if (compacted.isError()) {
+        pools.erase(network);
+        return Error(compacted.error());
+      }
+
+      pool = &pools.at(network);
+    }
+
+    const string interface = containerId + "/" + ifname;
+
+    if (pool.get()->interfaces.contains(interface)) {
+      return nth(pool.get()->subnet, pool.get()->interfaces.at(interface));
+    }
+
+    Option<uint32_t> offset = pool.get()->take();
+    if (offset.isNone()) {
+      return Error("No free IPs in network '" + network + "'");
+    }
+
+    Try<Nothing> write = append(network, encodeAllocation(
+        offset.get(),
+        interface));
+
+    if (write.isError()) {
+      pool.get()->free.push_front(offset.get());
+      return Error(write.error());
+    }
+
+    pool.get()->setAllocated(offset.get(), true);
+    pool.get()->interfaces.put(interface, offset.get());
+
+    return nth(pool.get()->subnet, offset.get());
+  }
+
+  Try<Nothing> _release(
+      const string& network,
+      const string& containerId,
+      const string& ifname)
+  {
+    Try<Pool*> pool = open(network);
+    if (pool.isError()) {
+      return Error(pool.error());
+    }
+
+    const string interface = containerId + "/" + ifname;
+
+    // NOTE: The CNI plugins can be asked to release an interface more
+    // than once, or an interface they did not set up.
+    if (pool.get() == nullptr ||
+        !pool.get()->interfaces.contains(interface)) {
+      return Nothing();
+    }
+
+    const uint32_t offset = pool.get()->interfaces.at(interface);
+
+    Try<Nothing> write = append(
+        network,
+        RECORD_RELEASE + encodeOffset(offset));
+
+    if (write.isError()) {
+      return Error(write.error());
+    }
+
+    pool.get()->interfaces.erase(interface);
+    pool.get()->setAllocated(offset, false);
+    pool.get()->free.push_back(offset);
+
+    if (pool.get()->records >
+          2 * pool.get()->interfaces.size() + JOURNAL_SLACK) {
+      Try<Nothing> compacted = compact(network);
+      if (compacted.isError()) {
+        LOG(WARNING) << "Unable to compact the journal of network '"
+                     << network << "': " << compacted.error();
+      }
+    }
+
+    return Nothing();
+  }
+
+  // Returns the pool of `network`, recovering it from its journal if
+  // needed, or `nullptr` if the network has no IPs allocated.
+  Try<Pool*> open(const string& network)
+  {
+    if (pools.contains(network)) {
+      return &pools.at(network);
+    }
+
+    // The name of the network is used as the name of its journal.
+    if (network.empty() ||
+        strings::startsWith(network, ".") ||
+        strings::contains(network, "/")) {
+      return Error("Invalid network '" + network + "'");
+    }
+
+    const string journal = path::join(directory, network);
+    if (!os::exists(journal)) {
+      return static_cast<Pool*>(nullptr);
+    }
+
+    Try<string> data = os::read(journal);
+    if (data.isError()) {
+      return Error(
+          "Unable to read the journal of network '" + network + "': " +
+          data.error());
+    }
+
+    Try<Pool> pool = recover(data.get());
+    if (pool.isError()) {
+      return Error(
+          "Unable to recover the journal of network '" + network + "': " +
+          pool.error());
+    }
+
+    LOG(INFO) << "Recovered " << pool->interfaces.size()
+              << " IPs of network '" << network << "' from "
+              << pool->subnet;
+
+    pools.put(network, pool.get());
+
+    // Rewrite the journal, dropping a record that was partially
+    // written when the Agent stopped, if any.
+    Try<Nothing> compacted = compact(network);
+    if (compacted.isError()) {
+      pools.erase(network);
+      return Error(compacted.error());
+    }
+
+    return &pools.at(network);
+  }
+
+  static Try<Pool> recover(const string& data)
+  {
+    if (data.size() < 2 || data[0] != RECORD_SUBNET) {
+      return Error("Missing subnet");
+    }
+
+    const size_t length = data[1];
+    if (data.size() < 2 + length) {
+      return Error("Truncated subnet");
+    }
+
+    Try<Network> subnet = Network::decode(data.substr(2, length));
+    if (subnet.isError()) {
+      return Error("Invalid subnet: " + subnet.error());
+    }
+
+    if (subnet->address().family() != AF_INET || subnet->prefix() > 30) {
+      return Error("Invalid subnet " + stringify(subnet.get()));
+    }
+
+    Pool pool(subnet.get());
+
+    // The interface every IP is allocated to.
+    hashmap<uint32_t, string> owners;
+
+    size_t position = 2 + length;
+    while (position < data.size()) {
+      const char type = data[position];
+
+      if (type == RECORD_ALLOCATE) {
+        if (data.size() < position + 7) {
+          break;
+        }
+
+        const uint32_t offset = decodeOffset(data, position + 1);
+
+        uint16_t length;
+        memcpy(&length, data.data() + position + 5, sizeof(length));
+        length = ntohs(length);
+
+        if (data.size() < position + 7 + length) {
+          break;
+        }
+
+        if (offset < 2 || offset >= pool.size - 1) {
+          return Error("Invalid offset " + stringify(offset));
+        }
+
+        const string interface = data.substr(position + 7, length);
+
+        owners.put(offset, interface);
+        pool.interfaces.put(interface, offset);
+
+        position += 7 + length;
+      } else if (type == RECORD_RELEASE) {
+        if (data.size() < position + 5) {
+          break;
+        }
+
+        const uint32_t offset = decodeOffset(data, position + 1);
+
+        if (owners.contains(offset)) {
+          const string& interface = owners.at(offset);
+
+          if (pool.interfaces.contains(interface) &&
+              pool.interfaces.at(interface) == offset) {
+            pool.interfaces.erase(interface);
+          }
+
+          owners.erase(offset);
+        }
+
+        position += 5;
+      } else {
+        return Error("Invalid record type " + stringify((int) type));
+      }
+    }
+
+    foreachvalue (uint32_t offset, pool.interfaces) {
+      pool.setAllocated(offset, true);
+      pool.next = std::max(pool.next, offset + 1);
+    }
+
+    for (uint32_t offset = 2; offset < pool.next; offset++) {
+      if (!pool.isAllocated(offset)) {
+        pool.free.push_back(offset);
+      }
+    }
+
+    return pool;
+  }
+
+  Try<Nothing> append(const string& network, const string& record)
+  {
+    CHECK(journals.contains(network));
+
+    Try<Nothing> write = os::write(journals.at(network), record);
+    if (write.isError()) {
+      return Error(
+          "Unable to write the journal of network '" + network + "': " +
+          write.error());
+    }
+
+    pools.at(network).records++;
+
+    return Nothing();
+  }
+
+  // Rewrites the journal of `network` with its allocated IPs only.
+  // The journal is written to a temporary file, synced, and renamed
+  // over the journal.
+  Try<Nothing> compact(const string& network)
+  {
+    Pool& pool = pools.at(network);
+
+    const string subnet = pool.subnet.encode();
+
+    string data = RECORD_SUBNET + string(1, (char) subnet.size()) + subnet;
+    foreachpair (const string& interface, uint32_t offset, pool.interfaces) {
+      data += encodeAllocation(offset, interface);
+    }
+
+    Try<Nothing> mkdir = os::mkdir(directory);
+    if (mkdir.isError()) {
+      return Error("Failed to create " + directory + ": " + mkdir.error());
+    }
+
+    const string journal = path::join(directory, network);
+    const string temporary = path::join(directory, "." + network);
+
+    Try<int_fd> fd = os::open(
+        temporary,
+        O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+        S_IRUSR | S_IWUSR);
+
+    if (fd.isError()) {
+      return Error("Failed to open " + temporary + ": " + fd.error());
+    }
+
+    Try<Nothing> write = os::write(fd.get(), data);
+    if (write.isSome() && ::fsync(fd.get()) < 0) {
+      write = ErrnoError();
+    }
+
+    if (write.isSome()) {
+      write = os::rename(temporary, journal);
+    }
+
+    if (write.isError()) {
+      os::close(fd.get());
+      os::rm(temporary);
+      return Error("Failed to write " + journal + ": " + write.error());
+    }
+
+    if (journals.contains(network)) {
+      os::close(journals.at(network));
+    }
+
+    journals.put(network, fd.get());
+    pool.records = 1 + pool.interfaces.size();
+
+    return Nothing();
+  }
+
+  void close(const string& network)
+  {
+    if (journals.contains(network)) {
+      os::close(journals.at(network));
+      journals.erase(network);
+    }
+
+    pools.erase(network);
+  }
+
+  const string directory;
+
+  network::Socket socket;
+
+  hashmap<string, Pool> pools;
+
+  // The file descriptors of the journals of the pools, opened for
+  // appending.
+  //
+  // NOTE: The journals are not synced on every write: the containers
+  // don't survive a crash of the host, and the journals are only
+  // needed to survive a restart of the Agent.
+  hashmap<string, int_fd> journals;
+};
+
+
+Try<Owned<Ipam>> Ipam::create(const string& directory, const string& socket)
+{
+  Try<Nothing> mkdir = os::mkdir(directory);
+  if (mkdir.isError()) {
+    return Error(
+        "Unable to create the IPAM directory '" + directory + "': " +
+        mkdir.error());
+  }
+
+  Try<network::unix::Address> address =
+    network::unix::Address::create(socket);
+
+  if (address.isError()) {
+    return Error(
+        "Invalid IPAM socket '" + socket + "': " + address.error());
+  }
+
+  // Remove the socket left by a previous run of the Agent.
+  if (os::exists(socket)) {
+    Try<Nothing> rm = os::rm(socket);
+    if (rm.isError()) {
+      return Error(
+          "Unable to remove the IPAM socket '" + socket + "': " +
+          rm.error());
+    }
+  }
+
+  Try<network::Socket> _socket =
+    network::Socket::create(network::Address::Family::UNIX);
+
+  if (_socket.isError()) {
+    return Error("Unable to create the IPAM socket: " + _socket.error());
+  }
+
+  Try<network::Address> bind = _socket->bind(address.get());
+  if (bind.isError()) {
+    return Error(
+        "Unable to bind the IPAM socket '" + socket + "': " + bind.error());
+  }
+
+  // Only the CNI plugins, which run as root, reach the IPAM.
+  Try<Nothing> chmod = os::chmod(socket, S_IRUSR | S_IWUSR);
+  if (chmod.isError()) {
+    return Error(
+        "Unable to restrict the IPAM socket '" + socket + "': " +
+        chmod.error());
+  }
+
+  Try<Nothing> listen = _socket->listen(SOMAXCONN);
+  if (listen.isError()) {
+    return Error(
+        "Unable to listen on the IPAM socket '" + socket + "': " +
+        listen.error());
+  }
+
+  return Owned<Ipam>(new Ipam(
+      Owned<IpamProcess>(new IpamProcess(directory, _socket.get()))));
+}
+
+
+Ipam::Ipam(Owned<IpamProcess> _process)
+  : process(_process)
+{
+  spawn(process.get());
+}
+
+
+Ipam::~Ipam()
+{
+  terminate(process.get());
+  wait(process.get());
+}
+
+
+Future<Network> Ipam::allocate(
+    const string& network,
+    const Network& subnet,
+    const string& containerId,
+    const string& ifname)
+{
+  return dispatch(
+      process.get(),
+      &IpamProcess::allocate,
+      network,
+      subnet,
+      containerId,
+      ifname);
+}
+
+
+Future<Nothing> Ipam::release(
+    const string& network,
+    const string& containerId,
+    const string& ifname)
+{
+  return dispatch(
+      process.get(),
+      &IpamProcess::release,
+      network,
+      containerId,
+      ifname);
+}
+
+
+Future<Nothing> Ipam::remove(const string& network)
+{
+  return dispatch(process.get(), &IpamProcess::remove, network);
+}
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
@@ -0,0 +1,84 @@
+#ifndef __OVERLAY_IPAM_HPP__
+#define __OVERLAY_IPAM_HPP__
+
+#include <string>
+
+#include <process/future.hpp>
+#include <process/owned.hpp>
+
+#include <stout/nothing.hpp>
+#include <stout/try.hpp>
+
+#include "network.hpp"
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// The type of the CNI IPAM plugin that forwards the requests of the
+// CNI `bridge` plugin to the `Ipam` of the Agent.
+constexpr char IPAM_PLUGIN[] = "mesos-overlay-ipam";
+
+class IpamProcess;
+
+
+// Allocates the IPs of the containers of the Mesos networks of the
+// overlays, instead of the CNI `host-local` plugin, which takes a lock
+// file and writes a file per IP for every container.
+//
+// The IPs of every Mesos network are kept in memory: a bitmap of the
+// allocated IPs, and a queue of the free IPs in the order they are
+// reused, so that an allocation or a release is O(1) and the released
+// IPs are reused last. Every allocation and release is appended to a
+// journal of the network in `directory`, which is replayed when the
+// Agent restarts and compacted as it grows.
+//
+// The `mesos-overlay-ipam` plugin reaches the `Ipam` over HTTP on the
+// Unix `socket`:
+//   POST /allocate {"network", "subnet", "container_id", "ifname"}
+//     returns {"ip", "gateway"}.
+//   POST /release {"network", "container_id", "ifname"}
+class Ipam
+{
+public:
+  static Try<process::Owned<Ipam>> create(
+      const std::string& directory,
+      const std::string& socket);
+
+  ~Ipam();
+
+  // Allocates an IP of `subnet` to the interface `ifname` of the
+  // container. The network, address and broadcast address of `subnet`
+  // are never allocated, and the first IP is the gateway. The same IP
+  // is returned if the interface already has one. The allocations of
+  // the network are dropped if its subnet has changed.
+  process::Future<Network> allocate(
+      const std::string& network,
+      const Network& subnet,
+      const std::string& containerId,
+      const std::string& ifname);
+
+  // Releases the IP of the interface `ifname` of the container, if
+  // any.
+  process::Future<Nothing> release(
+      const std::string& network,
+      const std::string& containerId,
+      const std::string& ifname);
+
+  // Drops the allocations of `network`, e.g., once its overlay has
+  // been removed.
+  process::Future<Nothing> remove(const std::string& network);
+
+private:
+  explicit Ipam(process::Owned<IpamProcess> process);
+
+  process::Owned<IpamProcess> process;
+};
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_IPAM_HPP__
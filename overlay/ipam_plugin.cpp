@@ -0,0 +1,329 @@
+// A CNI IPAM plugin that forwards the requests of the CNI `bridge`
+// plugin to the IPAM of the Agent overlay module, over the Unix socket
+// set in the `ipam` section of the network config:
+//
+//   "ipam": {
+//     "type": "mesos-overlay-ipam",
+//     "socket": "/run/mesos/overlay-ipam.sock",
+//     "network": "dcos",
+//     "subnet": "9.0.0.0/25",
+//     "routes": [{"dst": "0.0.0.0/0"}]
+//   }
+//
+// Unlike the `host-local` plugin, the plugin takes no lock and writes
+// no file, so the containers launched together get their IPs in
+// parallel.
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <stout/duration.hpp>
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/json.hpp>
+#include <stout/option.hpp>
+#include <stout/os.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/write.hpp>
+
+using std::cin;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// The error codes of the CNI specification.
+constexpr int CNI_ERROR_INVALID_ENVIRONMENT = 4;
+constexpr int CNI_ERROR_DECODING = 6;
+constexpr int CNI_ERROR_INVALID_NETWORK_CONFIG = 7;
+
+// The plugin specific error code of the failures of the IPAM.
+constexpr int CNI_ERROR_IPAM = 100;
+
+constexpr char DEFAULT_CNI_VERSION[] = "0.2.0";
+
+// Time after which the plugin gives up sending a request to the IPAM,
+// or waiting for its response, e.g., when the Agent is stuck, rather
+// than blocking the launch of the container forever.
+const Duration IPAM_TIMEOUT = Seconds(30);
+
+static const vector<string> SUPPORTED_CNI_VERSIONS = {
+  "0.1.0", "0.2.0", "0.3.0", "0.3.1"
+};
+
+
+static int fail(const string& version, int code, const string& message)
+{
+  JSON::Object error;
+  error.values["cniVersion"] = version;
+  error.values["code"] = code;
+  error.values["msg"] = message;
+
+  cout << stringify(error) << endl;
+
+  return EXIT_FAILURE;
+}
+
+
+// Sends `body` to `path` on the IPAM listening on `socket`, and
+// returns the body of the response.
+static Try<string> post(
+    const string& socket,
+    const string& path,
+    const string& body)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  if (socket.size() >= sizeof(address.sun_path)) {
+    return Error("Socket path '" + socket + "' is too long");
+  }
+
+  memcpy(address.sun_path, socket.c_str(), socket.size() + 1);
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoError("Failed to create socket");
+  }
+
+  struct timeval timeout;
+  timeout.tv_sec = (time_t) IPAM_TIMEOUT.secs();
+  timeout.tv_usec = 0;
+
+  if (::setsockopt(
+          fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+      ::setsockopt(
+          fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+    ErrnoError error("Failed to set the timeout of the socket");
+    ::close(fd);
+    return error;
+  }
+
+  if (::connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    ErrnoError error("Failed to connect to '" + socket + "'");
+    ::close(fd);
+    return error;
+  }
+
+  const string request =
+    "POST " + path + " HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: " + stringify(body.size()) + "\r\n"
+    "Connection: close\r\n"
+    "\r\n" + body;
+
+  Try<Nothing> write = os::write(fd, request);
+  if (write.isError()) {
+    ::close(fd);
+    return Error("Failed to send request: " + write.error());
+  }
+
+  // The IPAM closes the connection once it has sent the response.
+  string response;
+  char buffer[4096];
+
+  while (true) {
+    ssize_t length = ::read(fd, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      ::close(fd);
+      return Error(
+          "Timed out after " + stringify(IPAM_TIMEOUT) +
+          " waiting for the response");
+    }
+
+    if (length < 0) {
+      ErrnoError error("Failed to receive response");
+      ::close(fd);
+      return error;
+    }
+
+    if (length == 0) {
+      break;
+    }
+
+    response.append(buffer, length);
+  }
+
+  ::close(fd);
+
+  const size_t headers = response.find("\r\n\r\n");
+  const vector<string> status =
+    strings::tokenize(response.substr(0, response.find("\r\n")), " ");
+
+  if (headers == string::npos || status.size() < 2) {
+    return Error("Invalid response");
+  }
+
+  const string content = response.substr(headers + 4);
+
+  if (status[1] != "200") {
+    return Error(
+        "Request failed with status " + status[1] + ": " + content);
+  }
+
+  return content;
+}
+
+
+int main(int argc, char** argv)
+{
+  const Option<string> command = os::getenv("CNI_COMMAND");
+  if (command.isNone()) {
+    return fail(
+        DEFAULT_CNI_VERSION,
+        CNI_ERROR_INVALID_ENVIRONMENT,
+        "Missing CNI_COMMAND");
+  }
+
+  if (command.get() == "VERSION") {
+    JSON::Array versions;
+    foreach (const string& version, SUPPORTED_CNI_VERSIONS) {
+      versions.values.push_back(version);
+    }
+
+    JSON::Object version;
+    version.values["cniVersion"] = DEFAULT_CNI_VERSION;
+    version.values["supportedVersions"] = versions;
+
+    cout << stringify(version) << endl;
+    return EXIT_SUCCESS;
+  }
+
+  const string input(
+      (std::istreambuf_iterator<char>(cin)),
+      std::istreambuf_iterator<char>());
+
+  Try<JSON::Object> config = JSON::parse<JSON::Object>(input);
+  if (config.isError()) {
+    return fail(
+        DEFAULT_CNI_VERSION,
+        CNI_ERROR_DECODING,
+        "Invalid network config: " + config.error());
+  }
+
+  string version = DEFAULT_CNI_VERSION;
+
+  Result<JSON::String> cniVersion = config->find<JSON::String>("cniVersion");
+  if (cniVersion.isSome()) {
+    version = cniVersion->value;
+  }
+
+  Result<JSON::String> socket = config->find<JSON::String>("ipam.socket");
+  Result<JSON::String> network = config->find<JSON::String>("ipam.network");
+  Result<JSON::String> subnet = config->find<JSON::String>("ipam.subnet");
+
+  if (!socket.isSome() || !network.isSome() || !subnet.isSome()) {
+    return fail(
+        version,
+        CNI_ERROR_INVALID_NETWORK_CONFIG,
+        "Expecting 'socket', 'network' and 'subnet' in the 'ipam' section");
+  }
+
+  const Option<string> containerId = os::getenv("CNI_CONTAINERID");
+  const Option<string> ifname = os::getenv("CNI_IFNAME");
+
+  if (containerId.isNone() || ifname.isNone()) {
+    return fail(
+        version,
+        CNI_ERROR_INVALID_ENVIRONMENT,
+        "Missing CNI_CONTAINERID or CNI_IFNAME");
+  }
+
+  JSON::Object request;
+  request.values["network"] = network->value;
+  request.values["container_id"] = containerId.get();
+  request.values["ifname"] = ifname.get();
+
+  if (command.get() == "DEL") {
+    Try<string> response = post(socket->value, "/release", stringify(request));
+    if (response.isError()) {
+      return fail(version, CNI_ERROR_IPAM, response.error());
+    }
+
+    return EXIT_SUCCESS;
+  }
+
+  if (command.get() != "ADD") {
+    return fail(
+        version,
+        CNI_ERROR_INVALID_ENVIRONMENT,
+        "Unsupported CNI_COMMAND '" + command.get() + "'");
+  }
+
+  request.values["subnet"] = subnet->value;
+
+  Try<string> response = post(socket->value, "/allocate", stringify(request));
+  if (response.isError()) {
+    return fail(version, CNI_ERROR_IPAM, response.error());
+  }
+
+  Try<JSON::Object> allocation = JSON::parse<JSON::Object>(response.get());
+  if (allocation.isError()) {
+    return fail(
+        version,
+        CNI_ERROR_IPAM,
+        "Invalid allocation: " + allocation.error());
+  }
+
+  Result<JSON::String> ip = allocation->find<JSON::String>("ip");
+  Result<JSON::String> gateway = allocation->find<JSON::String>("gateway");
+
+  if (!ip.isSome() || !gateway.isSome()) {
+    return fail(version, CNI_ERROR_IPAM, "Invalid allocation");
+  }
+
+  JSON::Array routes;
+
+  Result<JSON::Array> _routes = config->find<JSON::Array>("ipam.routes");
+  if (_routes.isSome()) {
+    routes = _routes.get();
+  }
+
+  JSON::Object result;
+  result.values["cniVersion"] = version;
+
+  // The results of the versions before 0.3.0 have a single IPv4.
+  if (strings::startsWith(version, "0.1.") ||
+      strings::startsWith(version, "0.2.")) {
+    JSON::Object ip4;
+    ip4.values["ip"] = ip->value;
+    ip4.values["gateway"] = gateway->value;
+    ip4.values["routes"] = routes;
+
+    result.values["ip4"] = ip4;
+  } else {
+    JSON::Object address;
+    address.values["version"] = "4";
+    address.values["address"] = ip->value;
+    address.values["gateway"] = gateway->value;
+
+    JSON::Array ips;
+    ips.values.push_back(address);
+
+    result.values["ips"] = ips;
+    result.values["routes"] = routes;
+  }
+
+  cout << stringify(result) << endl;
+
+  return EXIT_SUCCESS;
+}
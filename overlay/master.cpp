@@ -1,38 +1,51 @@
 #include <stdio.h>
 
+#include <algorithm>
 #include <list>
 
 #include <stout/check.hpp>
+#include <stout/hashset.hpp>
 #include <stout/interval.hpp>
 #include <stout/json.hpp>
+#include <stout/linkedhashmap.hpp>
 #include <stout/mac.hpp>
 #include <stout/os.hpp>
 #include <stout/protobuf.hpp>
 #include <stout/stringify.hpp>
 #include <stout/try.hpp>
 
+#include <process/clock.hpp>
 #include <process/collect.hpp>
 #include <process/defer.hpp>
 #include <process/delay.hpp>
+#include <process/dispatch.hpp>
+#include <process/authenticator.hpp>
 #include <process/future.hpp>
 #include <process/help.hpp>
 #include <process/http.hpp>
+#include <process/id.hpp>
 #include <process/io.hpp>
 #include <process/process.hpp>
 #include <process/protobuf.hpp>
 #include <process/subprocess.hpp>
+#include <process/time.hpp>
+#include <process/timer.hpp>
+
+#include <process/metrics/counter.hpp>
+#include <process/metrics/metrics.hpp>
 
 #include <mesos/mesos.hpp>
 #include <mesos/module.hpp>
 #include <mesos/module/anonymous.hpp>
-#include <mesos/state/log.hpp>
-#include <mesos/state/protobuf.hpp>
-#include <mesos/state/storage.hpp>
+#include <mesos/log/log.hpp>
 #include <mesos/zookeeper/detector.hpp>
 
 #include "messages.hpp"
 #include "network.hpp"
 #include "overlay.hpp"
+#include "store.hpp"
+
+#include "common/metrics.hpp"
 
 namespace http = process::http;
 
@@ -46,18 +59,25 @@ using std::vector;
 
 using net::MAC;
 
+using process::Clock;
 using process::DESCRIPTION;
 using process::HELP;
 using process::Owned;
 using process::Failure;
 using process::Future;
+using process::Time;
+using process::Timer;
 using process::TLDR;
 using process::UPID;
 using process::USAGE;
 
+using process::metrics::Counter;
+
 using mesos::log::Log;
 using mesos::modules::Anonymous;
 using mesos::modules::Module;
+using mesos::modules::common::Distribution;
+using mesos::modules::common::Gauge;
 using mesos::modules::overlay::AgentOverlayInfo;
 using mesos::modules::overlay::BackendInfo;
 using mesos::modules::overlay::NetworkConfig;
@@ -68,13 +88,16 @@ using mesos::modules::overlay::MESOS_QUORUM;
 using mesos::modules::overlay::internal::AgentNetworkConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
+using mesos::modules::overlay::internal::GroupCommitConfig;
 using mesos::modules::overlay::internal::MasterConfig;
+using mesos::modules::overlay::internal::MasterReadyMessage;
+using mesos::modules::overlay::internal::PeerInfo;
+using mesos::modules::overlay::internal::PeerSnapshotRequestMessage;
+using mesos::modules::overlay::internal::PeerUpdateMessage;
 using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RegisterAgentNackMessage;
 using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
 using mesos::Parameters;
-using mesos::state::LogStorage;
-using mesos::state::protobuf::Variable;
-using mesos::state::Storage;
 
 namespace mesos {
 namespace modules {
@@ -82,17 +105,64 @@ namespace overlay {
 namespace master {
 
 constexpr char REPLICATED_LOG_STORE[] = "overlay_replicated_log";
-constexpr char REPLICATED_LOG_STORE_KEY[] = "network-state";
 constexpr char REPLICATED_LOG_STORE_REPLICAS[] = "overlay_log_replicas";
 
 constexpr Duration PENDING_MESSAGE_PERIOD = Seconds(10);
 
+// How often a master that is not leading reads the replicated log to
+// keep up with the `State` written by the leading master.
+constexpr Duration REPLICATED_LOG_FOLLOW_INTERVAL = Seconds(1);
+
+// An admitted agent that hasn't sent a registration for this long is
+// assumed to have given up, and its admission is handed to another
+// agent.
+constexpr Duration REGISTRATION_ADMISSION_TIMEOUT = Seconds(60);
+
+// Bounds of the retry time suggested to the agents whose registration
+// is deferred. Most deferred agents register earlier, when they get a
+// `MasterReadyMessage`.
+constexpr Duration REGISTRATION_RETRY_AFTER_MIN = Seconds(1);
+constexpr Duration REGISTRATION_RETRY_AFTER_MAX = Minutes(5);
+
+// VNIs are 24 bits.
+constexpr uint32_t MAX_VNI = (1 << 24) - 1;
+
+constexpr char VTEP_NAME_PREFIX[] = "vtep";
+
+// The HTTP authentication realm of the endpoints of the Mesos master
+// that change its state, which the `overlays` endpoint shares.
+constexpr char READWRITE_HTTP_AUTHENTICATION_REALM[] =
+  "mesos-master-readwrite";
+
 const string OVERLAY_HELP = HELP(
     TLDR("Allocate overlay network resources for Master."),
     USAGE("/overlay-master/overlays"),
     DESCRIPTION("Allocate subnets, VTEP IP and the MAC addresses.", "")
 );
 
+const string OVERLAYS_HELP = HELP(
+    TLDR("Add, resize or remove overlays at runtime."),
+    USAGE("/overlay-master/overlays"),
+    DESCRIPTION(
+        "GET lists the overlays, with the VNIs assigned to them.",
+        "",
+        "POST adds the overlay in the body, a JSON `OverlayInfo`.",
+        "",
+        "PUT resizes the overlay in the body, whose subnets need to",
+        "contain the current subnets of the overlay. The prefixes",
+        "allocated to the agents and the VNI cannot be changed.",
+        "",
+        "DELETE removes the overlay in the `name` query parameter.",
+        "",
+        "The changes are stored in the replicated log before the",
+        "response is sent, and are sent to the registered agents.",
+        "",
+        "The requests are authenticated like the requests to the",
+        "endpoints of the master that change its state. Only the",
+        "`overlay_principals` of the master configuration, if any,",
+        "can change the overlays.")
+);
+
 // Helper function to convert std::string to `net::MAC`.
 static Try<net::MAC> createMAC(const string& _mac, const bool& oui)
 {
@@ -121,25 +191,184 @@ static Try<net::MAC> createMAC(const string& _mac, const bool& oui)
 }
 
 
+// Returns the network stored in `encoded` (see `Network::encode`),
+// falling back to parsing `value` when there is no binary encoded
+// copy, e.g., in a `State` written by an older master.
+static Try<Network> decodeNetwork(
+    const string& encoded,
+    const string& value,
+    int family)
+{
+  if (!encoded.empty()) {
+    Try<Network> network = Network::decode(encoded);
+    if (network.isError()) {
+      return Error(network.error());
+    }
+
+    if (network->address().family() != family) {
+      return Error("Unexpected address family for " + stringify(network.get()));
+    }
+
+    return network.get();
+  }
+
+  return Network::parse(value, family);
+}
+
+
+// Replaces the overlay of `overlays` with the name of `overlay`, or
+// appends `overlay` if there is none.
+static void setOverlay(
+    google::protobuf::RepeatedPtrField<OverlayInfo>* overlays,
+    const OverlayInfo& overlay)
+{
+  for (int i = 0; i < overlays->size(); i++) {
+    if (overlays->Get(i).name() == overlay.name()) {
+      overlays->Mutable(i)->CopyFrom(overlay);
+      return;
+    }
+  }
+
+  overlays->Add()->CopyFrom(overlay);
+}
+
+
+// Removes the overlay `name` from `overlays`, if any.
+static void eraseOverlay(
+    google::protobuf::RepeatedPtrField<OverlayInfo>* overlays,
+    const string& name)
+{
+  for (int i = 0; i < overlays->size(); i++) {
+    if (overlays->Get(i).name() == name) {
+      overlays->DeleteSubrange(i, 1);
+      return;
+    }
+  }
+}
+
+
+// Returns `overlays` with `overlay` replacing the overlay of the
+// same name, or appended if there is none.
+static vector<OverlayInfo> withOverlay(
+    vector<OverlayInfo> overlays,
+    const OverlayInfo& overlay)
+{
+  foreach (OverlayInfo& _overlay, overlays) {
+    if (_overlay.name() == overlay.name()) {
+      _overlay.CopyFrom(overlay);
+      return overlays;
+    }
+  }
+
+  overlays.push_back(overlay);
+  return overlays;
+}
+
+
+// Returns whether the overlays `left` and `right` have the same
+// subnets, and allocate subnets of the same prefixes to the agents.
+static bool sameAddressSpace(const OverlayInfo& left, const OverlayInfo& right)
+{
+  return left.subnet() == right.subnet() &&
+    left.prefix() == right.prefix() &&
+    left.subnet6() == right.subnet6() &&
+    left.prefix6() == right.prefix6();
+}
+
+
+// Sets the VNI of the VXLAN backend of `overlay` to the VNI of the
+// overlay, and names its VTEP after the VNI.
+static void setBackendVNI(AgentOverlayInfo* overlay)
+{
+  if (!overlay->backend().has_vxlan()) {
+    return;
+  }
+
+  const uint32_t vni =
+    overlay->info().has_vni() ? overlay->info().vni() : DEFAULT_VNI;
+
+  VxLANInfo* vxlan = overlay->mutable_backend()->mutable_vxlan();
+  vxlan->set_vni(vni);
+  vxlan->set_vtep_name(VTEP_NAME_PREFIX + stringify(vni));
+}
+
+
+// Reserves all of `values` in `available` in a single pass. The
+// values are sorted and coalesced into contiguous intervals, so that
+// `available` is updated once per interval instead of once per value.
+// Returns the values that could not be reserved, either because they
+// are duplicates or because they are not available.
+template <typename T>
+vector<T> reserveAll(IntervalSet<T>* available, vector<T> values)
+{
+  vector<T> rejected;
+
+  std::sort(values.begin(), values.end());
+
+  IntervalSet<T> reserved;
+
+  size_t i = 0;
+  while (i < values.size()) {
+    T lower = values[i];
+    T upper = values[i];
+
+    size_t j = i + 1;
+    for (; j < values.size(); j++) {
+      if (values[j] == upper) {
+        rejected.push_back(values[j]);
+        continue;
+      }
+
+      T next = upper;
+      ++next;
+
+      if (values[j] != next) {
+        break;
+      }
+
+      upper = next;
+    }
+
+    Interval<T> interval =
+      (Bound<T>::closed(lower), Bound<T>::closed(upper));
+
+    if (available->contains(interval)) {
+      reserved += interval;
+    } else {
+      // Find the offending values of this interval.
+      for (size_t k = i; k < j; k++) {
+        if (k > i && values[k] == values[k - 1]) {
+          // Already rejected as a duplicate above.
+          continue;
+        }
+
+        if (available->contains(values[k])) {
+          reserved += values[k];
+        } else {
+          rejected.push_back(values[k]);
+        }
+      }
+    }
+
+    i = j;
+  }
+
+  *available -= reserved;
+
+  return rejected;
+}
+
+
 struct Vtep
 {
-  Vtep(const Network& _network,
+  Vtep(const Option<Network>& _network,
        const Option<Network>& _network6,
        const MAC _oui)
-    : network(_network), 
+    : network(_network),
       network6(_network6),
       oui(_oui)
   {
-    freeIP += (
-      Bound<IP>::open(network.begin()), 
-      Bound<IP>::open(network.end()));
-
-    // IPv6
-    if (network6.isSome()) {
-      freeIP6 +=
-        (Bound<IP>::open(network6.get().begin()),
-         Bound<IP>::open(network6.get().end()));
-    }
+    reset();
   }
 
   Try<Network> allocateIP()
@@ -151,7 +380,7 @@ struct Vtep
     IP ip = freeIP.begin()->lower();
     freeIP -= ip;
 
-    return Network(ip, network.prefix()) ;
+    return Network(ip, network.get().prefix()) ;
   }
 
   Try<Network> allocateIP6()
@@ -166,56 +395,35 @@ struct Vtep
     return Network(ip6, network6.get().prefix()) ;
   } 
 
-  Try<Nothing> reserve(const Network& ip)
-  {
-    uint32_t addr = ntohl(ip.address().in().get().s_addr);
-    IP _ip = IP(addr);
-
-    if (!freeIP.contains(_ip)) {
-      VLOG(1) << "Current free IPs: " << freeIP;
-      return Error(
-          "Cannot reserve an unavailable IP: "  + stringify(ip) +
-          "(" + stringify(_ip) + ")");
-    }
-
-    freeIP -= _ip;
-
-    return Nothing();
-  }
-
-  Try<Nothing> reserve6(const Network& ip6)
-  {
-    in6_addr addr6 = ip6.address().in6().get();
-    IP _ip6 = IP(addr6);
-
-    if (!freeIP6.contains(_ip6)) {
-      VLOG(1) << "Current free IPv6s: " << freeIP6;
-      return Error(
-          "Cannot reserve an unavailable IPv6: "  + stringify(ip6) +
-          "(" + stringify(_ip6) + ")");
-    }
-
-    freeIP6 -= _ip6;
-
-    return Nothing();
-  }
-    
   // We generate the VTEP MAC from the IP by taking the least 24 bits
   // of the IP and using the 24 bits as the NIC of the MAC.
   //
   // NOTE: There is a caveat to using this technique to generating the
   // MAC, namely if the CIDR prefix of the IP is less than 8 then we
-  // the MAC being generated is not guaranteed to be unique.
+  // the MAC being generated is not guaranteed to be unique. IPv6 VTEP
+  // IPs are only allocated out of the first 2^24 addresses of the
+  // IPv6 VTEP subnet (see `reset`), so their least 24 bits are unique
+  // regardless of the prefix.
   Try<net::MAC> generateMAC(const IP& ip)
   {
-    Try<struct in_addr> in = ip.in();
-
-    if (in.isError()) {
-      return Error(in.error());
+    const uint8_t* nic = nullptr;
+
+    in_addr in;
+    in6_addr in6;
+
+    switch (ip.family()) {
+      case AF_INET:
+        in = ip.in().get();
+        nic = (const uint8_t*) &in.s_addr + 1;
+        break;
+      case AF_INET6:
+        in6 = ip.in6().get();
+        nic = in6.s6_addr + 13;
+        break;
+      default:
+        return Error("Unsupported family " + stringify(ip.family()));
     }
 
-    uint8_t *nic = (uint8_t*)&(in.get().s_addr);
-
     uint8_t mac[6];
 
     // Set the OUI.
@@ -224,9 +432,9 @@ struct Vtep
     mac[2] = oui[2];
 
     // Set the NIC.
-    mac[3] = nic[1];
-    mac[4] = nic[2];
-    mac[5] = nic[3];
+    mac[3] = nic[0];
+    mac[4] = nic[1];
+    mac[5] = nic[2];
 
     return MAC(mac);
   }
@@ -235,22 +443,35 @@ struct Vtep
   {
     freeIP = IntervalSet<IP>();
 
-    freeIP +=
-      (Bound<IP>::open(network.begin()),
-       Bound<IP>::open(network.end()));
+    if (network.isSome()) {
+      freeIP +=
+        (Bound<IP>::open(network.get().begin()),
+         Bound<IP>::open(network.get().end()));
+    }
 
     // IPv6
+    freeIP6 = IntervalSet<IP>();
+
     if (network6.isSome()) {
-      freeIP6 = IntervalSet<IP>();
+      // Cap the IPv6 VTEP IPs to the first 2^24 addresses of the
+      // subnet, whose least 24 bits are unique, so that the VTEP MACs
+      // derived from them are unique too.
+      const IP begin = network6.get().begin();
+
+      in6_addr last = begin.in6().get();
+      last.s6_addr[13] = 0xff;
+      last.s6_addr[14] = 0xff;
+      last.s6_addr[15] = 0xff;
 
       freeIP6 +=
-        (Bound<IP>::open(network6.get().begin()), 
-         Bound<IP>::open(network6.get().end()));
-	}
+        (Bound<IP>::open(begin),
+         Bound<IP>::open(std::min(network6.get().end(), IP(last))));
+    }
   }
 
-  // Network allocated to the VTEP.
-  Network network;
+  // Network allocated to the VTEP. An IPv6-only cluster has no IPv4
+  // VTEP network.
+  Option<Network> network;
 
   Option<Network> network6;
 
@@ -261,6 +482,155 @@ struct Vtep
   IntervalSet<IP> freeIP6;
 };
 
+// The free subnets of an overlay network, out of which the subnets of
+// the agents are allocated as prefix-aligned blocks of any prefix
+// length.
+//
+// The free subnets are kept as free lists of aligned blocks by prefix
+// length, as in a buddy allocator: a subnet is carved out of the
+// smallest free block that holds it (best fit), whose other halves
+// stay free, and a freed subnet is merged with its free buddy into
+// the block they were split from. The agents allocated subnets of
+// different sizes therefore fragment the overlay as little as
+// possible.
+class FreeSubnets
+{
+public:
+  FreeSubnets() = default;
+
+  explicit FreeSubnets(const Network& _network)
+    : network(aligned(_network.address(), _network.prefix()))
+  {
+    blocks[network->prefix()].insert(network.get());
+  }
+
+  // Allocates the lowest subnet of `prefix` out of the smallest free
+  // block that holds it.
+  Try<Network> allocate(uint32_t prefix)
+  {
+    if (network.isNone() ||
+        prefix < network->prefix() ||
+        prefix > (network->address().family() == AF_INET ? 32 : 128)) {
+      return Error("Invalid prefix " + stringify(prefix));
+    }
+
+    for (int length = prefix; length >= network->prefix(); length--) {
+      if (!blocks.contains(length) || blocks.at(length).empty()) {
+        continue;
+      }
+
+      Network subnet = *blocks.at(length).begin();
+      blocks.at(length).erase(blocks.at(length).begin());
+
+      // Split the block down to `prefix`, keeping the upper halves
+      // free.
+      while (subnet.prefix() < prefix) {
+        subnet = Network(subnet.begin(), subnet.prefix() + 1);
+
+        Network upper = subnet;
+        ++upper;
+
+        blocks[upper.prefix()].insert(upper);
+      }
+
+      return subnet;
+    }
+
+    return Error("No free subnet of prefix " + stringify(prefix));
+  }
+
+  // Frees `subnet`, which has been allocated before, merging it with
+  // its free buddies.
+  void free(const Network& subnet)
+  {
+    CHECK_SOME(network);
+
+    Network block = aligned(subnet.address(), subnet.prefix());
+
+    while (block.prefix() > network->prefix() &&
+           blocks.contains(block.prefix()) &&
+           blocks.at(block.prefix()).erase(buddy(block)) > 0) {
+      block = aligned(block.address(), block.prefix() - 1);
+    }
+
+    blocks[block.prefix()].insert(block);
+  }
+
+  // Removes `subnet` from the free subnets. Returns false if `subnet`
+  // is not entirely free.
+  bool reserve(const Network& subnet)
+  {
+    if (network.isNone() || subnet.prefix() < network->prefix()) {
+      return false;
+    }
+
+    for (int length = subnet.prefix();
+         length >= network->prefix();
+         length--) {
+      Network block = aligned(subnet.address(), length);
+
+      if (!blocks.contains(length) || blocks.at(length).erase(block) == 0) {
+        continue;
+      }
+
+      // Split the block down to `subnet`, keeping the halves that
+      // don't hold `subnet` free.
+      while (block.prefix() < subnet.prefix()) {
+        Network half = aligned(subnet.address(), block.prefix() + 1);
+        blocks[half.prefix()].insert(buddy(half));
+        block = half;
+      }
+
+      return true;
+    }
+
+    return false;
+  }
+
+  // Grows the free subnets to `_network`, which contains the current
+  // network. The subnets that are not free stay allocated.
+  void grow(const Network& _network)
+  {
+    CHECK_SOME(network);
+
+    FreeSubnets grown(_network);
+    CHECK(grown.reserve(network.get()));
+
+    foreachvalue (const set<Network>& _blocks, blocks) {
+      foreach (const Network& block, _blocks) {
+        grown.free(block);
+      }
+    }
+
+    *this = grown;
+  }
+
+private:
+  static Network aligned(const IP& address, uint8_t prefix)
+  {
+    return Network(Network(address, prefix).begin(), prefix);
+  }
+
+  // Returns the other half of the block `block` was split from.
+  static Network buddy(const Network& block)
+  {
+    Network lower = aligned(block.address(), block.prefix() - 1);
+    lower = Network(lower.begin(), block.prefix());
+
+    if (lower != block) {
+      return lower;
+    }
+
+    return ++lower;
+  }
+
+  Option<Network> network;
+
+  // The free blocks, by prefix length.
+  hashmap<uint8_t, set<Network>> blocks;
+};
+
+
 struct Overlay
 {
   Overlay(
@@ -275,45 +645,7 @@ struct Overlay
     prefix(_prefix),
     prefix6(_prefix6)
   {
-    // IPv4
-    if (network.isSome()) {
-      uint32_t addr = ntohl(network.get().address().in().get().s_addr);
-      uint32_t startMask = ntohl(network.get().netmask().in().get().s_addr);
-      uint32_t endMask = 0xffffffff << (32 - prefix.get());
-      uint32_t startAddr = addr & startMask;
-      uint32_t endAddr = (addr | ~startMask) & endMask;
-
-      Network startSubnet = Network(IP(startAddr), prefix.get());
-      Network endSubnet = Network(IP(endAddr), prefix.get());
-
-      LOG(INFO) << name << " IPv4: " << startSubnet << " - " << endSubnet;
-
-      freeNetworks +=
-        (Bound<Network>::closed(startSubnet),
-         Bound<Network>::closed(endSubnet));
-    }
-
-    // IPv6
-    if (network6.isSome()) {
-      in6_addr startAddr6, endAddr6;
-      in6_addr addr6 = network6.get().address().in6().get();
-      in6_addr startMask6 = network6.get().netmask().in6().get();
-      in6_addr endMask6_ = Network::toMask(prefix6.get(), AF_INET6).in6().get();
-      for (int i = 0; i < 16; i++) {
-        startAddr6.s6_addr[i] = addr6.s6_addr[i] & startMask6.s6_addr[i];
-        endAddr6.s6_addr[i] = addr6.s6_addr[i] | ~startMask6.s6_addr[i];
-        endAddr6.s6_addr[i] &= endMask6_.s6_addr[i];
-      }
-    
-      Network startSubnet6 = Network(IP(startAddr6), prefix6.get());
-      Network endSubnet6 = Network(IP(endAddr6), prefix6.get());
-
-      LOG(INFO) << "IPv6: " << startSubnet6 << " - " << endSubnet6;
-
-      freeNetworks6 +=
-        (Bound<Network>::closed(startSubnet6),
-         Bound<Network>::closed(endSubnet6));
-    }
+    reset();
   }
 
   OverlayInfo getOverlayInfo() const
@@ -333,157 +665,83 @@ struct Overlay
     return overlay;
   }
 
-  Try<Network> allocate()
+  // Allocates a subnet of `_prefix`, or of the prefix of the overlay.
+  Try<Network> allocate(const Option<uint32_t>& _prefix = None())
   {
-    if (freeNetworks.empty()) {
-      return Error("No free subnets available in the " + name + "overlay");
-    }
+    Try<Network> agentSubnet =
+      freeNetworks.allocate(_prefix.getOrElse(prefix.get()));
 
-    Network agentSubnet = freeNetworks.begin()->lower();
-    freeNetworks -= agentSubnet;
+    if (agentSubnet.isError()) {
+      return Error(
+          "No free subnets available in the " + name + " overlay: " +
+          agentSubnet.error());
+    }
 
-    return agentSubnet;
+    return agentSubnet.get();
   }
 
-  Try<Network> allocate6()
+  Try<Network> allocate6(const Option<uint32_t>& _prefix6 = None())
   {
-    if (freeNetworks6.empty()) {
-      return Error("No free IPv6 subnets available in the " + name + "overlay");
-    }
+    Try<Network> agentSubnet6 =
+      freeNetworks6.allocate(_prefix6.getOrElse(prefix6.get()));
 
-    Network agentSubnet6 = freeNetworks6.begin()->lower();
-    freeNetworks6 -= agentSubnet6;
+    if (agentSubnet6.isError()) {
+      return Error(
+          "No free IPv6 subnets available in the " + name + " overlay: " +
+          agentSubnet6.error());
+    }
 
-    return agentSubnet6;
+    return agentSubnet6.get();
   }
 
   Try<Nothing> free(const Network& subnet)
   {
-    if (subnet.prefix() != prefix.get()) {
-      return Error(
-          "Cannot free this network because prefix " + 
-          stringify(subnet.prefix()) + " does not match Agent prefix " + 
-          stringify(prefix.get()) + " of the overlay");
-    }
-
     if (subnet.prefix() < network.get().prefix()) {
       return Error(
           "Cannot free this network since it does not belong "
           " to the overlay subnet");
     }
 
-    freeNetworks += Network(subnet.address(), prefix.get());
+    freeNetworks.free(subnet);
 
     return Nothing();
   }
 
   Try<Nothing> free6(const Network& subnet6)
   {
-    if (subnet6.prefix() != prefix6.get()) {
-      return Error(
-          "Cannot free this IPv6 network because prefix " + 
-          stringify(subnet6.prefix()) + " does not match Agent prefix " + 
-          stringify(prefix6.get()) + " of the overlay");
-    }
-
     if (subnet6.prefix() < network6.get().prefix()) {
       return Error(
           "Cannot free this IPv6 network since it does not belong "
           " to the overlay subnet");
     }
 
-    freeNetworks6 += Network(subnet6.address(), prefix6.get());
-
-    return Nothing();
-  }
-
-  Try<Nothing> reserve(const Network& subnet)
-  {
-    uint32_t _mask = ntohl(subnet.netmask().in().get().s_addr);
-    uint32_t _address = ntohl(subnet.address().in().get().s_addr);
-    Network _subnet = Network(IP(_address & _mask), subnet.prefix());
-   
-
-    if (!freeNetworks.contains(_subnet)) {
-      return Error(
-          "Unable to reserve unavailable subnet " +
-          stringify(subnet) + "(" + stringify(_subnet) + ")");
-    }
-
-    freeNetworks -= _subnet;
-
-    return Nothing();
-  }
- 
-  Try<Nothing> reserve6(const Network& subnet6)
-  {
-    in6_addr _maskedAddr6;
-    in6_addr _addr6 = subnet6.address().in6().get();
-    in6_addr _mask6 = subnet6.netmask().in6().get();
-    for (int i = 0; i < 16; i++) {
-      _maskedAddr6.s6_addr[i] = _addr6.s6_addr[i] & _mask6.s6_addr[i];
-    }
-    Network _subnet6 = Network(IP(_maskedAddr6), subnet6.prefix());
-
-
-    if (!freeNetworks6.contains(_subnet6)) {
-      return Error(
-          "Unable to reserve unavailable IPv6 subnet " +
-          stringify(subnet6) + "(" + stringify(_subnet6) + ")");
-    }
-
-    freeNetworks6 -= _subnet6;
+    freeNetworks6.free(subnet6);
 
     return Nothing();
   }
 
+  // Frees all the subnets of the overlay.
+  //
+  // NOTE: This includes the first and the last subnets of the
+  // overlay, which are free when the overlay is created, so that the
+  // same subnets can be allocated before and after a failover.
   void reset()
   {
-    // Re-initialize `freeNetworks`.
     if (network.isSome()) {
-      freeNetworks = IntervalSet<Network>();
- 
-      uint32_t addr = ntohl(network.get().address().in().get().s_addr);
-      uint32_t startMask = ntohl(network.get().netmask().in().get().s_addr);
-      uint32_t endMask = 0xffffffff << (32 - prefix.get());
-      uint32_t startAddr = addr & startMask;
-      uint32_t endAddr = (addr | ~startMask) & endMask;
-
-      Network startSubnet = Network(IP(startAddr), prefix.get());
-      Network endSubnet = Network(IP(endAddr), prefix.get());
+      LOG(INFO) << name << " IPv4: " << network.get()
+                << ", agent prefix " << (int) prefix.get();
 
-      LOG(INFO) << name << " Reset IPv4: " << startSubnet << " - " << endSubnet;
-
-      freeNetworks +=
-        (Bound<Network>::open(startSubnet),
-         Bound<Network>::open(endSubnet));
+      freeNetworks = FreeSubnets(network.get());
     }
 
     // IPv6
     if (network6.isSome()) {
-      freeNetworks6 = IntervalSet<Network>();
-
-      in6_addr startAddr6, endAddr6;
-      in6_addr addr6 = network6.get().address().in6().get();
-      in6_addr startMask6 = network6.get().netmask().in6().get();
-      in6_addr endMask6_ = Network::toMask(prefix6.get(), AF_INET6).in6().get();
-      for (int i = 0; i < 16; i++) {
-        startAddr6.s6_addr[i] = addr6.s6_addr[i] & startMask6.s6_addr[i];
-        endAddr6.s6_addr[i] = addr6.s6_addr[i] | ~startMask6.s6_addr[i];
-        endAddr6.s6_addr[i] &= endMask6_.s6_addr[i];
-      }
-
-      Network startSubnet6 = Network(IP(startAddr6), prefix6.get());
-      Network endSubnet6 = Network(IP(endAddr6), prefix6.get());
+      LOG(INFO) << name << " IPv6: " << network6.get()
+                << ", agent prefix " << (int) prefix6.get();
 
-      LOG(INFO) << name 
-                << " Reset IPv6: " << startSubnet6 << " - " << endSubnet6; 
-
-      freeNetworks6 +=
-        (Bound<Network>::open(startSubnet6),
-         Bound<Network>::open(endSubnet6));
+      freeNetworks6 = FreeSubnets(network6.get());
     }
-  } 
+  }
 
   // Canonical name of the network.
   std::string name;
@@ -494,1204 +752,3429 @@ struct Overlay
   // IPv6 Network allocated to this overlay
   Option<Network> network6;
 
-  // Prefix length allocated to each agent.
+  // Prefix length allocated to each agent, unless the agent asks for
+  // another prefix length.
   Option<uint8_t> prefix;
 
   // IPv6 prefix length allocated to each agent
   Option<uint8_t> prefix6;
 
-  // Free subnets available in this network. The subnets are
-  // calcualted using the prefix length set for the agents in
-  // `prefix`.
-  IntervalSet<Network> freeNetworks;
+  // Free subnets available in this network.
+  FreeSubnets freeNetworks;
 
   // Free IPv6 subnets
-  IntervalSet<Network> freeNetworks6;
+  FreeSubnets freeNetworks6;
 };
 
 
-class Agent
+// Validates the overlays `infos` and creates their `Overlay`s, keyed
+// by name. The overlays need to have unique names and VNIs, and
+// cannot have overlapping address spaces.
+static Try<hashmap<string, Owned<Overlay>>> createOverlays(
+    const vector<OverlayInfo>& infos)
 {
-public:
-  static Try<Agent> create(const AgentInfo& agentInfo)
-  {
-    Try<IP> _ip = IP::parse(agentInfo.ip(), AF_INET);
+  hashset<uint32_t> vnis;
 
-    if (_ip.isError()) {
-      return Error("Unable to create `Agent`: " + _ip.error());
-    }
+  hashmap<string, Owned<Overlay>> overlays;
+  IntervalSet<IP> addressSpace;
 
-    Option<BackendInfo> backend = None();
+  // Overlay networks cannot have overlapping IP addresses. This
+  // lambda keeps track of the current address space and returns an
+  // `Error` if it detects an overlay that is going to use an
+  // already configured address space.
+  auto updateAddressSpace =
+    [&addressSpace](const Network &network) -> Try<Nothing> {
 
-    if (agentInfo.overlays_size() > 0) {
-      backend = agentInfo.overlays(0).backend();
-    }
+      Interval<IP> overlaySpace =
+        (Bound<IP>::closed(network.begin()), 
+         Bound<IP>::closed(network.end()));
 
-    Agent agent(_ip.get(), backend);
+      if (addressSpace.intersects(overlaySpace)) {
+        return Error("Found overlapping address spaces");
+      }
 
-    for (int i = 0; i < agentInfo.overlays_size(); i++) {
-      agent.addOverlay(agentInfo.overlays(i));
-    }
+      addressSpace += overlaySpace;
 
-    // We should clear any overlay `State` that might have been set.
-    // The `State` will be set once this information is downloaded to
-    // the corresponding agent.
-    agent.clearOverlaysState();
+      return Nothing();
+  };
 
-    return agent;
-  }
-
-  Agent(const IP& _ip, const Option<BackendInfo>& _backend = None())
-    : backend(_backend),
-      ip(_ip) {};
-  const IP getIP() const { return ip; };
+  foreach (const OverlayInfo& overlay, infos) {
+    if (overlays.contains(overlay.name())) {
+      return Error(
+          "Duplicate overlay configuration detected for overlay: " +
+          overlay.name());
+    }
 
-  void addOverlay(const AgentOverlayInfo& overlay)
-  {
-    if (overlays.contains(overlay.info().name())) {
-      return;
+    if (RESERVED_NETWORKS.contains(overlay.name())) {
+      return Error(
+        "Overlay network name: " + overlay.name() +
+        " is a reserved network name");
     }
 
-    // Create a new overlay on this agent.
-    overlays.emplace(
-        overlay.info().name(),
-        Owned<AgentOverlayInfo>(new AgentOverlayInfo()));
+    // The overlay name is used to derive the Mesos bridge and
+    // Docker bridge names. Since, in Linux, network device names
+    // cannot excced 15 characters, we need to impose the limit on
+    // the overlay network name.
+    if (overlay.name().size() > MAX_OVERLAY_NAME) {
+      return Error(
+          "Overlay name: " + overlay.name() +
+          " too long cannot, exceed " + stringify(MAX_OVERLAY_NAME) +
+          "  characters    IntervalSet<uint8_t> ");
+    }
 
-    overlays[overlay.info().name()]->CopyFrom(overlay);
-  }
+    LOG(INFO) << "Configuring overlay network:" << overlay.name();
 
-  bool addOverlays(
-      const hashmap<string, Owned<Overlay>>& _overlays,
-      const AgentNetworkConfig& networkConfig)
-  {
-    bool mutated = false;
+    if (overlay.has_vni()) {
+      if (overlay.vni() == 0 || overlay.vni() > MAX_VNI) {
+        return Error(
+            "Invalid VNI " + stringify(overlay.vni()) + " for overlay " +
+            overlay.name());
+      }
 
-    if (backend.isNone()) {
-      // There is no backend associated with this agent so we can't
-      // add overlays to this agent.
-      LOG(ERROR) << "No backend available for this agent "
-                 << "(" <<  ip
-                 << ") hence cannot add any overlays to this agent.";
+      if (vnis.contains(overlay.vni())) {
+        return Error(
+            "Duplicate VNI " + stringify(overlay.vni()) +
+            " for overlay " + overlay.name());
+      }
 
-      return mutated;
+      vnis.insert(overlay.vni());
     }
 
-    // Walk through all the overlay networks. Allocate a subnet from
-    // each overlay to the Agent. Allocate a VTEP IP and MAC for each
-    // agent. Queue the message on the Agent. Finally, ask Master to
-    // reliably send these messages to the Agent.
-    foreachpair (const string& name, const Owned<Overlay>& overlay, _overlays) {
-      // Skip if the overlay is present
-      if (overlays.contains(name)) {
-        continue;
+    // IPv4
+    Option<uint8_t> prefix = None();
+    Option<Network> address = None();
+    if (overlay.has_subnet()) {
+      Try<Network> _address =
+        Network::parse(overlay.subnet(), AF_INET);
+
+      if (_address.isError()) {
+        return Error(
+            "Unable to determine subnet for network: " +
+            _address.error());
       }
 
-      AgentOverlayInfo _overlay;
-      Option<Network> agentSubnet = None();
-      Option<Network> agentSubnet6 = None();
+      Try<Nothing> valid = updateAddressSpace(_address.get());
 
-      _overlay.mutable_info()->set_name(name);
-      if (overlay->network.isSome()) {
-        _overlay.mutable_info()->set_subnet(stringify(overlay->network.get()));
-        _overlay.mutable_info()->set_prefix(overlay->prefix.get());
+      if (valid.isError()) {
+        return Error(
+            "Incorrect address space for the overlay network '" +
+            overlay.name() + "': " + valid.error());
       }
-      if (overlay->network6.isSome()) {
-        _overlay.mutable_info()->set_subnet6(stringify(overlay->network6.get()));
-        _overlay.mutable_info()->set_prefix6(overlay->prefix6.get());
+      
+      if (overlay.prefix() < _address->prefix() || overlay.prefix() > 32) {
+        return Error(
+            "Invalid prefix " + stringify(overlay.prefix()) +
+            " for the overlay network '" + overlay.name() + "'");
       }
 
-      if (networkConfig.allocate_subnet()) {
-        // IPv4
-        if (overlay->network.isSome()) {
-          Try<Network> _agentSubnet = overlay->allocate();
-          if (_agentSubnet.isError()) {
-            LOG(ERROR) << "Cannot allocate subnet from overlay "
-                       << name << " to Agent " << ip << ":"
-                       << _agentSubnet.error();
-            continue;
-          }
+      address = _address.get();
+      prefix = overlay.prefix();
+    }
 
-          agentSubnet = _agentSubnet.get();
-          _overlay.set_subnet(stringify(agentSubnet.get()));
-        }
+    // IPv6
+    Option<uint8_t> prefix6 = None();
+    Option<Network> address6 = None();
+    if (overlay.has_subnet6()) {
+      Try<Network> _address6 = 
+        Network::parse(overlay.subnet6(), AF_INET6);
 
-        // IPv6
-        if (overlay->network6.isSome()) {
-          Try<Network> _agentSubnet6 = overlay->allocate6();
-          if (_agentSubnet6.isError()) {
-            LOG(ERROR) << "Cannot allocate IPv6 subnet from overlay "
-                       << name << " to Agent " << ip << ":"
-                       << _agentSubnet6.error();
-            continue;
-          }
+      if (_address6.isError()) {
+        return Error(
+           "Unable to determine IPv6 subnet for network: " +
+            _address6.error());
+      }
 
-          agentSubnet6 = _agentSubnet6.get();
-          _overlay.set_subnet6(stringify(agentSubnet6.get()));
-        }
+      Try<Nothing> valid6 = updateAddressSpace(_address6.get());
+    
+      if (valid6.isError()) {
+        return Error(
+            "Incorrect IPv6 address space for the overlay network '" +
+            overlay.name() + "': " + valid6.error());
+      }
 
-        // Allocate bridges for Mesos and Docker.
-        Try<Nothing> bridges = allocateBridges(
-            &_overlay,
-            networkConfig);
+      if (overlay.prefix6() < _address6->prefix() ||
+          overlay.prefix6() > 128) {
+        return Error(
+            "Invalid IPv6 prefix " + stringify(overlay.prefix6()) +
+            " for the overlay network '" + overlay.name() + "'");
+      }
 
-        if (bridges.isError()) {
-          LOG(ERROR) << "Unable to allocate bridge for network "
-                     << name << ": " << bridges.error();
+      address6 = _address6.get();
+      prefix6 = overlay.prefix6();
+    }
 
-          if ( agentSubnet.isSome()) {
-            overlay->free(agentSubnet.get());
-          }
+    overlays.emplace(
+        overlay.name(),
+        Owned<Overlay>(new Overlay(
+          overlay.name(),
+          address,
+          address6,
+          prefix,
+          prefix6)));
+  }
 
-          // IPv6
-          if (agentSubnet6.isSome()) {
-            overlay->free6(agentSubnet6.get());
-          }
-          continue;
-        }
-      }
+  return overlays;
+}
 
-      // By the time we reach here it is guaranteed that the
-      // `BackendInfo` has already been set for this agent.
-      _overlay.mutable_backend()->CopyFrom(backend.get());
 
-      addOverlay(_overlay);
+// Allocates the Mesos and Docker bridges of `_overlay` by splitting
+// the subnets allocated to the agent in two.
+static Try<Nothing> allocateBridges(
+    AgentOverlayInfo* _overlay,
+    const AgentNetworkConfig& networkConfig)
+{
+  if (!networkConfig.mesos_bridge() &&
+      !networkConfig.docker_bridge()) {
+    return Nothing();
+  }
+  const string name = _overlay->info().name();
 
-      // `addOverlay` is guaranteed to add this overlay since we have
-      // already checked at the beginning of this loop for the absence
-      // of this overlay on this agent.
-      mutated = true;
+  // IPv4
+  Option<Network> _network = None();
+  if (_overlay->has_subnet()) {
+    Try<Network> network = Network::parse(
+        _overlay->subnet(),
+        AF_INET);
+
+    if (network.isError()) {
+      return Error(
+          "Unable to parse the subnet of the network '" +
+          name + "' : " + network.error());
     }
 
-    return mutated;
+    _network = Network(network->address(), network->prefix() + 1);
   }
 
-  list<AgentOverlayInfo> getOverlays() const
-  {
-    list<AgentOverlayInfo> _overlays;
+  // IPv6
+  Option<Network> _network6 = None();
+  if (_overlay->has_subnet6()) {
+    Try<Network> network6 = Network::parse(
+        _overlay->subnet6(),
+        AF_INET6);
 
-    foreachvalue (const Owned<AgentOverlayInfo>& overlay, overlays) {
-      _overlays.push_back(*overlay);
+    if (network6.isError()) {
+      return Error("Unable to parse the IPv6 subnet of the network '" +
+          name + "' : " + network6.error());
     }
 
-    return _overlays;
+    _network6 = Network(network6->address(), network6->prefix() + 1);
   }
 
-  void clearOverlaysState()
-  {
-    foreachvalue (Owned<AgentOverlayInfo>& overlay, overlays) {
-      overlay->clear_state();
+  // Create the Mesos bridge.
+  if (networkConfig.mesos_bridge()) {
+    BridgeInfo mesosBridgeInfo;
+    if (_network.isSome()) {
+      mesosBridgeInfo.set_ip(stringify(_network.get()));
     }
+    if (_network6.isSome()) {
+      mesosBridgeInfo.set_ip6(stringify(_network6.get()));
+    }
+    mesosBridgeInfo.set_name(MESOS_BRIDGE_PREFIX + name);
+    _overlay->mutable_mesos_bridge()->CopyFrom(mesosBridgeInfo);
   }
 
-  AgentInfo getAgentInfo() const
+  // Create the docker bridge.
+  if (networkConfig.docker_bridge()) {
+    BridgeInfo dockerBridgeInfo;
+    if (_network.isSome()) {
+      dockerBridgeInfo.set_ip(stringify(++(_network.get())));
+    }
+    if (_network6.isSome()) {
+      dockerBridgeInfo.set_ip6(stringify(++(_network6.get())));
+    }
+    dockerBridgeInfo.set_name(DOCKER_BRIDGE_PREFIX + name);
+    _overlay->mutable_docker_bridge()->CopyFrom(dockerBridgeInfo);
+  }
+
+  return Nothing();
+}
+
+
+// A request for the allocation of an overlay to an agent.
+struct OverlayRequest
+{
+  IP agentIP;
+  AgentNetworkConfig networkConfig;
+};
+
+
+// Owns the free subnets of an `Overlay`. Every overlay is allocated
+// by its own actor, so that the overlays of the agents registering
+// together are allocated in parallel on the libprocess workers,
+// rather than on the actor of the `ManagerProcess`.
+class OverlayAllocatorProcess : public process::Process<OverlayAllocatorProcess>
+{
+public:
+  explicit OverlayAllocatorProcess(const Overlay& _overlay)
+    : ProcessBase(process::ID::generate("overlay-allocator")),
+      overlay(_overlay) {}
+
+  // Allocates the overlay to every agent of `requests`, in order.
+  // `None` is returned for the agents the overlay could not be
+  // allocated to.
+  //
+  // NOTE: The returned overlays don't have a backend, which is set
+  // by the `Agent`.
+  vector<Option<AgentOverlayInfo>> allocate(
+      const vector<OverlayRequest>& requests)
   {
-    AgentInfo info;
+    vector<Option<AgentOverlayInfo>> allocated;
+    allocated.reserve(requests.size());
 
-    info.set_ip(stringify(ip));
+    foreach (const OverlayRequest& request, requests) {
+      allocated.push_back(_allocate(request));
+    }
 
-    foreachvalue(const Owned<AgentOverlayInfo>& overlay, overlays) {
-      info.add_overlays()->CopyFrom(*overlay);
+    return allocated;
+  }
+
+  // Frees all the subnets, and reserves the subnets allocated to the
+  // agents found in a snapshot of the `State`.
+  void restore(
+      const vector<Network>& subnets,
+      const vector<Network>& subnets6)
+  {
+    overlay.reset();
+
+    foreach (const Network& subnet, subnets) {
+      if (!overlay.freeNetworks.reserve(subnet)) {
+        LOG(ERROR) << "Unable to reserve the subnet " << subnet
+                   << " in overlay " << overlay.name;
+      }
     }
 
-    return info;
+    foreach (const Network& subnet6, subnets6) {
+      if (!overlay.freeNetworks6.reserve(subnet6)) {
+        LOG(ERROR) << "Unable to reserve the IPv6 subnet " << subnet6
+                   << " in overlay " << overlay.name;
+      }
+    }
   }
 
-  void updateOverlayState(const AgentOverlayInfo& overlay)
+  // Grows the subnets of the overlay to the subnets of `_overlay`,
+  // which contain them. The subnets allocated to the agents stay
+  // allocated.
+  void resize(const Overlay& _overlay)
   {
-    const string name = overlay.info().name();
-    if (!overlays.contains(name)) {
-      LOG(ERROR) << "Got update for unknown network "
-                 << overlay.info().name();
+    if (_overlay.network.isSome()) {
+      overlay.freeNetworks.grow(_overlay.network.get());
     }
 
-    overlays.at(name)->mutable_state()->set_status(overlay.state().status());
+    if (_overlay.network6.isSome()) {
+      overlay.freeNetworks6.grow(_overlay.network6.get());
+    }
+
+    overlay.network = _overlay.network;
+    overlay.network6 = _overlay.network6;
   }
 
 private:
-  Try<Nothing> allocateBridges(
-      AgentOverlayInfo* _overlay,
-      const AgentNetworkConfig& networkConfig)
+  Option<AgentOverlayInfo> _allocate(const OverlayRequest& request)
   {
-    if (!networkConfig.mesos_bridge() &&
-        !networkConfig.docker_bridge()) {
-      return Nothing();
+    const string& name = overlay.name;
+
+    AgentOverlayInfo _overlay;
+    Option<Network> agentSubnet = None();
+    Option<Network> agentSubnet6 = None();
+
+    _overlay.mutable_info()->set_name(name);
+    if (overlay.network.isSome()) {
+      _overlay.mutable_info()->set_subnet(stringify(overlay.network.get()));
+      _overlay.mutable_info()->set_prefix(overlay.prefix.get());
+    }
+    if (overlay.network6.isSome()) {
+      _overlay.mutable_info()->set_subnet6(stringify(overlay.network6.get()));
+      _overlay.mutable_info()->set_prefix6(overlay.prefix6.get());
+    }
+
+    if (!request.networkConfig.allocate_subnet()) {
+      return _overlay;
     }
-    const string name = _overlay->info().name();
 
     // IPv4
-    Option<Network> _network = None();
-    if (_overlay->has_subnet()) {
-      Try<Network> network = Network::parse(
-          _overlay->subnet(),
-          AF_INET);
+    if (overlay.network.isSome()) {
+      Option<uint32_t> prefix = None();
+      if (request.networkConfig.has_subnet_prefix()) {
+        prefix = validPrefix(
+            request.agentIP,
+            request.networkConfig.subnet_prefix(),
+            overlay.network.get(),
+            32);
+      }
 
-      if (network.isError()) {
-        return Error(
-            "Unable to parse the subnet of the network '" +
-            name + "' : " + network.error());
+      Try<Network> _agentSubnet = overlay.allocate(prefix);
+      if (_agentSubnet.isError()) {
+        LOG(ERROR) << "Cannot allocate subnet from overlay "
+                   << name << " to Agent " << request.agentIP << ":"
+                   << _agentSubnet.error();
+        return None();
       }
 
-      _network = Network(network->address(), network->prefix() + 1);
+      agentSubnet = _agentSubnet.get();
+      _overlay.set_subnet(stringify(agentSubnet.get()));
+      _overlay.set_subnet_bin(agentSubnet->encode());
     }
 
     // IPv6
-    Option<Network> _network6 = None();
-    if (_overlay->has_subnet6()) {
-      Try<Network> network6 = Network::parse(
-          _overlay->subnet6(),
-          AF_INET6);
-
-      if (network6.isError()) {
-        return Error("Unable to parse the IPv6 subnet of the network '" +
-            name + "' : " + network6.error());
+    if (overlay.network6.isSome()) {
+      Option<uint32_t> prefix6 = None();
+      if (request.networkConfig.has_subnet_prefix6()) {
+        prefix6 = validPrefix(
+            request.agentIP,
+            request.networkConfig.subnet_prefix6(),
+            overlay.network6.get(),
+            128);
       }
 
-      _network6 = Network(network6->address(), network6->prefix() + 1);
-    }
+      Try<Network> _agentSubnet6 = overlay.allocate6(prefix6);
+      if (_agentSubnet6.isError()) {
+        LOG(ERROR) << "Cannot allocate IPv6 subnet from overlay "
+                   << name << " to Agent " << request.agentIP << ":"
+                   << _agentSubnet6.error();
 
-    // Create the Mesos bridge.
-    if (networkConfig.mesos_bridge()) {
-      BridgeInfo mesosBridgeInfo;
-      if (_network.isSome()) {
-        mesosBridgeInfo.set_ip(stringify(_network.get()));
-      }
-      if (_network6.isSome()) {
-        mesosBridgeInfo.set_ip6(stringify(_network6.get()));
+        if (agentSubnet.isSome()) {
+          overlay.free(agentSubnet.get());
+        }
+        return None();
       }
-      mesosBridgeInfo.set_name(MESOS_BRIDGE_PREFIX + name);
-      _overlay->mutable_mesos_bridge()->CopyFrom(mesosBridgeInfo);
+
+      agentSubnet6 = _agentSubnet6.get();
+      _overlay.set_subnet6(stringify(agentSubnet6.get()));
+      _overlay.set_subnet6_bin(agentSubnet6->encode());
     }
 
-    // Create the docker bridge.
-    if (networkConfig.docker_bridge()) {
-      BridgeInfo dockerBridgeInfo;
-      if (_network.isSome()) {
-        dockerBridgeInfo.set_ip(stringify(++(_network.get())));
+    // Allocate bridges for Mesos and Docker.
+    Try<Nothing> bridges = allocateBridges(
+        &_overlay,
+        request.networkConfig);
+
+    if (bridges.isError()) {
+      LOG(ERROR) << "Unable to allocate bridge for network "
+                 << name << ": " << bridges.error();
+
+      if (agentSubnet.isSome()) {
+        overlay.free(agentSubnet.get());
       }
-      if (_network6.isSome()) {
-        dockerBridgeInfo.set_ip6(stringify(++(_network6.get())));
+
+      // IPv6
+      if (agentSubnet6.isSome()) {
+        overlay.free6(agentSubnet6.get());
       }
-      dockerBridgeInfo.set_name(DOCKER_BRIDGE_PREFIX + name);
-      _overlay->mutable_docker_bridge()->CopyFrom(dockerBridgeInfo);
+      return None();
     }
 
-    return Nothing();
+    return _overlay;
   }
 
-  // Currently all overlays on an agent share a single backend.
-  //
-  // TODO(asridharan): When we introduce support for a per-overlay
-  // backend, we should deprecate this field.
-  Option<BackendInfo> backend;
+  // Returns the prefix length `prefix` asked for by an agent, if the
+  // subnet is smaller than the overlay `network` and leaves room for
+  // the two bridges of the agent, out of `length` bits. Otherwise the
+  // agent is allocated a subnet of the prefix length of the overlay.
+  Option<uint32_t> validPrefix(
+      const IP& agentIP,
+      uint32_t prefix,
+      const Network& network,
+      uint32_t length) const
+  {
+    if (prefix <= (uint32_t) network.prefix() || prefix >= length) {
+      LOG(WARNING) << "Ignoring the prefix length " << prefix
+                   << " asked for by Agent " << agentIP << " in overlay "
+                   << overlay.name << ", which is not within ["
+                   << network.prefix() + 1 << ", " << length - 1 << "]";
+      return None();
+    }
 
-  // A list of all overlay networks that reside on this agent.
-  hashmap<string, Owned<AgentOverlayInfo>> overlays;
+    return prefix;
+  }
 
-  IP ip;
+  Overlay overlay;
 };
 
-// Defines an operation that can be performed on a `State` object for
-// a given `AgentInfo`. Every operation returns a `Future<bool>` that
-// will be set once the operation is actually performed on the `State`
-// object. The operation is usually considered "performed" when the
-// mutated `State` is checkpointed to some storage (usually a
-// replicated log).
-class Operation : public process::Promise<bool> {
-public:
-  Operation() : success(false) {}
 
-  virtual ~Operation() {}
+// Owns the free VTEP IPs, from which the VTEP IPs and MACs of the
+// agents are allocated on a separate actor.
+class VtepAllocatorProcess : public process::Process<VtepAllocatorProcess>
+{
+public:
+  explicit VtepAllocatorProcess(const Vtep& _vtep)
+    : ProcessBase(process::ID::generate("overlay-vtep-allocator")),
+      vtep(_vtep) {}
 
-  Try<bool> operator()(
-      State* networkState,
-      hashmap<IP, Agent>* agents)
+  // Allocates a VTEP to every agent of `agentIPs`, in order. `None` is
+  // returned for the agents a VTEP could not be allocated to.
+  vector<Option<BackendInfo>> allocate(const vector<IP>& agentIPs)
   {
-    const Try<bool> result = perform(networkState, agents);
+    vector<Option<BackendInfo>> allocated;
+    allocated.reserve(agentIPs.size());
 
-    success = !result.isError();
+    foreach (const IP& agentIP, agentIPs) {
+      allocated.push_back(_allocate(agentIP));
+    }
 
-    return result;
+    return allocated;
   }
 
-  virtual const string description() const = 0;
+  // Frees all the VTEP IPs, and reserves the VTEP IPs allocated to the
+  // agents found in a snapshot of the `State`.
+  //
+  // NOTE: We only need to reserve the VTEP IP and not the VTEP MAC
+  // since the VTEP MAC is derived from the VTEP IP. Look at the
+  // `generateMAC` method in `VTEP` to see how this is done.
+  void restore(const vector<IP>& vtepIPs, const vector<IP>& vtepIPs6)
+  {
+    vtep.reset();
 
-  // Sets the promise based on whether the operation was successful.
-  bool set() { return process::Promise<bool>::set(success); }
+    foreach (const IP& ip, reserveAll(&vtep.freeIP, vtepIPs)) {
+      LOG(ERROR) << "Unable to reserve VTEP IP " << ip;
+    }
 
-protected:
-  virtual Try<bool> perform(
-      State* networkState,
-      hashmap<IP, Agent>* agents) = 0;
+    foreach (const IP& ip6, reserveAll(&vtep.freeIP6, vtepIPs6)) {
+      LOG(ERROR) << "Unable to reserve VTEP IPv6 " << ip6;
+    }
+  }
 
 private:
-  bool success;
-};
+  Option<BackendInfo> _allocate(const IP& agentIP)
+  {
+    Option<Network> vtepIP = None();
+    if (vtep.network.isSome()) {
+      Try<Network> _vtepIP = vtep.allocateIP();
+      if (_vtepIP.isError()) {
+        LOG(ERROR)
+          << "Unable to get VTEP IP for Agent: " << _vtepIP.error()
+          << "Cannot fulfill registration for Agent: " << agentIP;
+        return None();
+      }
+
+      vtepIP = _vtepIP.get();
+      LOG(INFO) << "Allocated VTEP IP : " << vtepIP.get();
+    }
 
+    // IPv6
+    Option<Network> vtepIP6 = None();
+    if (vtep.network6.isSome()) {
+      Try<Network> _vtepIP6 = vtep.allocateIP6();
+      if (_vtepIP6.isError()) {
+        LOG(ERROR)
+         << "Unable to get VTEP IPv6 for Agent: " << _vtepIP6.error()
+         << "Cannot fulfill registration for Agent: " << agentIP;
 
-// Add an `AgentInfo` to a `State` object.
-class AddAgent : public Operation {
-public:
-  explicit AddAgent(const AgentInfo& _agentInfo)
-  {
-    agentInfo.CopyFrom(_agentInfo);
-  }
+        // Don't leak the VTEP IP allocated above.
+        if (vtepIP.isSome()) {
+          vtep.freeIP += vtepIP->address();
+        }
 
-  const std::string description() const
-  {
-    return "Add operation for agent: " + agentInfo.ip();
-  }
+        return None();
+      }
 
-protected:
-  Try<bool> perform(State* networkState, hashmap<IP, Agent>* agents)
-  {
-    // Make sure the Agent we are going to add is already present in `agents`.
-    Try<IP> agentIP = IP::parse(agentInfo.ip(), AF_INET);
-    if (agentIP.isError()) {
-      return Error("Unable to parse the Agent IP: " + agentIP.error());
+      vtepIP6 = _vtepIP6.get();
+      LOG(INFO) << "Allocated VTEP IPv6 : " << vtepIP6.get();
     }
 
-    if (!agents->contains(agentIP.get())) {
-      return Error(
-          "Could not find the Agent (" + stringify(agentIP.get()) +
-          ") that needed to be added to `State`.");
+    // The VTEP MAC is derived from the IPv4 VTEP IP, if any, so that
+    // the MACs of dual-stack agents don't change; IPv6-only agents
+    // derive it from the IPv6 VTEP IP.
+    const IP macIP =
+      vtepIP.isSome() ? vtepIP->address() : vtepIP6->address();
+
+    Try<net::MAC> vtepMAC = vtep.generateMAC(macIP);
+    if (vtepMAC.isError()) {
+      LOG(ERROR)
+        << "Unable to get VTEP MAC for Agent: " << vtepMAC.error()
+        << "Cannot fulfill registration for Agent: " << agentIP;
+      return None();
     }
+    VLOG(1) << "Allocated VTEP MAC : " << vtepMAC.get();
 
-    networkState->add_agents()->CopyFrom(agentInfo);
-    return true;
+    VxLANInfo vxlan;
+    vxlan.set_vni(DEFAULT_VNI);
+    vxlan.set_vtep_name(VTEP_NAME_PREFIX + stringify(DEFAULT_VNI));
+    if (vtepIP.isSome()) {
+      vxlan.set_vtep_ip(stringify(vtepIP.get()));
+      vxlan.set_vtep_ip_bin(vtepIP->encode());
+    }
+    vxlan.set_vtep_mac(stringify(vtepMAC.get()));
+    if (vtepIP6.isSome()) {
+      vxlan.set_vtep_ip6(stringify(vtepIP6.get()));
+      vxlan.set_vtep_ip6_bin(vtepIP6->encode());
+    }
+
+    BackendInfo backend;
+    backend.mutable_vxlan()->CopyFrom(vxlan);
+
+    return backend;
   }
 
-private:
-  AgentInfo agentInfo;
+  Vtep vtep;
 };
 
 
-// Modify an `AgentInfo` in a `State` object.
-class ModifyAgent : public Operation {
+class Agent
+{
 public:
-  explicit ModifyAgent(const AgentInfo& _agentInfo)
-  {
-    agentInfo.CopyFrom(_agentInfo);
-  }
-
-  const std::string description() const
+  static Try<Agent> create(const AgentInfo& agentInfo)
   {
-    return "Modify operation for agent: " + agentInfo.ip();
-  }
+    Try<IP> _ip = IP::parse(agentInfo.ip(), AF_UNSPEC);
 
-protected:
-  Try<bool> perform(State* networkState, hashmap<IP, Agent>* agents)
-  {
-    // Make sure the Agent we are going to add is already present in `agents`.
-    Try<IP> agentIP = IP::parse(agentInfo.ip(), AF_INET);
-    if (agentIP.isError()) {
-      return Error("Unable to parse the Agent IP: " + agentIP.error());
+    if (_ip.isError()) {
+      return Error("Unable to create `Agent`: " + _ip.error());
     }
 
-    if (!agents->contains(agentIP.get())) {
-      return Error(
-          "Could not find the Agent (" + stringify(agentIP.get()) +
-          ") in the `agents` cache, that needed to be added to `State`.");
-    }
+    Option<BackendInfo> backend = None();
 
-    for(int i = 0; i < networkState->agents_size(); i++) {
-      AgentInfo* agentInfo_ = networkState->mutable_agents(i);
-      if (agentInfo_->ip() == agentInfo.ip()) {
-        agentInfo_->CopyFrom(agentInfo);
-        return true;
+    if (agentInfo.overlays_size() > 0) {
+      backend = agentInfo.overlays(0).backend();
+    }
+
+    Agent agent(_ip.get(), backend);
+
+    for (int i = 0; i < agentInfo.overlays_size(); i++) {
+      agent.addOverlay(agentInfo.overlays(i));
+    }
+
+    // We should clear any overlay `State` that might have been set.
+    // The `State` will be set once this information is downloaded to
+    // the corresponding agent.
+    agent.clearOverlaysState();
+
+    return agent;
+  }
+
+  Agent(const IP& _ip, const Option<BackendInfo>& _backend = None())
+    : backend(_backend),
+      ip(_ip) {};
+  const IP getIP() const { return ip; };
+
+  // Returns the VTEP of this agent, if it has been assigned one.
+  Option<PeerInfo> getPeer() const
+  {
+    if (backend.isNone() || !backend->has_vxlan()) {
+      return None();
+    }
+
+    PeerInfo peer;
+    peer.set_agent_ip(stringify(ip));
+    peer.mutable_vxlan()->CopyFrom(backend->vxlan());
+
+    return peer;
+  }
+
+  void addOverlay(const AgentOverlayInfo& overlay)
+  {
+    if (overlays.contains(overlay.info().name())) {
+      return;
+    }
+
+    // Create a new overlay on this agent.
+    overlays.emplace(
+        overlay.info().name(),
+        Owned<AgentOverlayInfo>(new AgentOverlayInfo()));
+
+    overlays[overlay.info().name()]->CopyFrom(overlay);
+  }
+
+  bool hasBackend() const { return backend.isSome(); }
+
+  bool hasOverlay(const string& name) const
+  {
+    return overlays.contains(name);
+  }
+
+  // Removes the overlay `name` from this agent. Returns whether the
+  // agent had the overlay.
+  bool removeOverlay(const string& name)
+  {
+    return overlays.erase(name) > 0;
+  }
+
+  // Replaces the definition of the overlay, e.g., once it has been
+  // resized, keeping the subnets allocated to this agent. Returns
+  // whether the agent has the overlay.
+  bool updateOverlayInfo(const OverlayInfo& info, uint64_t generation)
+  {
+    if (!overlays.contains(info.name())) {
+      return false;
+    }
+
+    overlays.at(info.name())->mutable_info()->CopyFrom(info);
+    overlays.at(info.name())->set_generation(generation);
+
+    return true;
+  }
+
+  // The configuration generation of this agent once it has applied
+  // all its overlays.
+  uint64_t getGeneration() const
+  {
+    uint64_t generation = 0;
+    foreachvalue (const Owned<AgentOverlayInfo>& overlay, overlays) {
+      generation = std::max(generation, overlay->generation());
+    }
+
+    return generation;
+  }
+
+  // The network configuration the agent last registered with, which
+  // is used to allocate the overlays added while it is registered.
+  // It is not stored in the replicated log, so it is unknown until
+  // the agent registers with this master.
+  const Option<AgentNetworkConfig>& getNetworkConfig() const
+  {
+    return networkConfig;
+  }
+
+  void setNetworkConfig(const AgentNetworkConfig& _networkConfig)
+  {
+    networkConfig = _networkConfig;
+  }
+
+  // Adds the overlays allocated to this agent, which all share the
+  // VTEP IP and MAC of the backend of the agent, and get the VTEP of
+  // their VNI. Returns whether any overlay was added.
+  bool addOverlays(const vector<AgentOverlayInfo>& allocated)
+  {
+    bool mutated = false;
+
+    if (backend.isNone()) {
+      // There is no backend associated with this agent so we can't
+      // add overlays to this agent.
+      LOG(ERROR) << "No backend available for this agent "
+                 << "(" <<  ip
+                 << ") hence cannot add any overlays to this agent.";
+
+      return mutated;
+    }
+
+    foreach (const AgentOverlayInfo& overlay, allocated) {
+      // Skip if the overlay is present
+      if (overlays.contains(overlay.info().name())) {
+        continue;
       }
+
+      AgentOverlayInfo _overlay = overlay;
+      _overlay.mutable_backend()->CopyFrom(backend.get());
+      setBackendVNI(&_overlay);
+
+      addOverlay(_overlay);
+
+      mutated = true;
     }
 
-    return Error(
-        "Could not find the Agent (" + stringify(agentIP.get()) +
-        ") in `State`.");
+    return mutated;
+  }
+
+  list<AgentOverlayInfo> getOverlays() const
+  {
+    list<AgentOverlayInfo> _overlays;
+
+    foreachvalue (const Owned<AgentOverlayInfo>& overlay, overlays) {
+      _overlays.push_back(*overlay);
+    }
+
+    return _overlays;
+  }
+
+  void clearOverlaysState()
+  {
+    foreachvalue (Owned<AgentOverlayInfo>& overlay, overlays) {
+      overlay->clear_state();
+    }
+  }
+
+  AgentInfo getAgentInfo() const
+  {
+    AgentInfo info;
+
+    info.set_ip(stringify(ip));
+
+    foreachvalue(const Owned<AgentOverlayInfo>& overlay, overlays) {
+      info.add_overlays()->CopyFrom(*overlay);
+    }
+
+    return info;
+  }
+
+  void updateOverlayState(const AgentOverlayInfo& overlay)
+  {
+    const string name = overlay.info().name();
+    if (!overlays.contains(name)) {
+      LOG(ERROR) << "Got update for unknown network "
+                 << overlay.info().name();
+      return;
+    }
+
+    overlays.at(name)->mutable_state()->set_status(overlay.state().status());
   }
 
 private:
-  AgentInfo agentInfo;
+  // The VTEP IP and MAC shared by the VTEPs of all the overlays on
+  // the agent. The VNI and the name of the VTEP of every overlay are
+  // set from the VNI of the overlay.
+  Option<BackendInfo> backend;
+
+  // A list of all overlay networks that reside on this agent.
+  hashmap<string, Owned<AgentOverlayInfo>> overlays;
+
+  Option<AgentNetworkConfig> networkConfig;
+
+  IP ip;
 };
 
+// Defines an operation that can be performed on a `State` object for
+// a given `AgentInfo`. Every operation returns a `Future<bool>` that
+// will be set once the operation is actually performed on the `State`
+// object. The operation is usually considered "performed" when the
+// mutated `State` is checkpointed to some storage (usually a
+// replicated log).
+class Operation : public process::Promise<bool> {
+public:
+  Operation() : success(false) {}
 
-inline ostream& operator<<(ostream& stream, const Operation& operation)
-{
-  return stream << operation.description();
-}
+  virtual ~Operation() {}
 
+  Try<bool> operator()(
+      State* networkState,
+      hashmap<IP, Agent>* agents)
+  {
+    const Try<bool> result = perform(networkState, agents);
 
-// `ManagerProcess` is responsible for managing all the overlays that
-// exist in the Mesos cluster. For each overlay the manager stores the
-// network associated with overlay and the prefix length of subnets
-// that need to be assigned to Agents. When an Agent registers with
-// the manager, the manager picks a network from each overlay that the
-// manager is aware off and assigns it to the Agent. When the Agent
-// de-registers (or goes away) the manager frees subnets allocated to
-// the Agent for all the overlays that existed on that Agent.
-class ManagerProcess : public ProtobufProcess<ManagerProcess>
-{
+    success = !result.isError();
+
+    return result;
+  }
+
+  virtual const string description() const = 0;
+
+  // Sets the promise based on whether the operation was successful.
+  bool set() { return process::Promise<bool>::set(success); }
+
+  // Sets the promise as not performed, once the operation has been
+  // dropped without being written to the replicated log.
+  bool drop() { return process::Promise<bool>::set(false); }
+
+  // The time at which the operation was queued for a write to the
+  // replicated log.
+  Time queued;
+
+protected:
+  virtual Try<bool> perform(
+      State* networkState,
+      hashmap<IP, Agent>* agents) = 0;
+
+private:
+  bool success;
+};
+
+
+// Add an `AgentInfo` to a `State` object.
+class AddAgent : public Operation {
 public:
-  static Try<Owned<ManagerProcess>> createManagerProcess(
-      const MasterConfig& masterConfig)
+  explicit AddAgent(const AgentInfo& _agentInfo)
   {
-    NetworkConfig networkConfig;
-    networkConfig.CopyFrom(masterConfig.network());
+    agentInfo.CopyFrom(_agentInfo);
+  }
 
-    Try<Network> vtepSubnet =
-      Network::parse(networkConfig.vtep_subnet(), AF_INET);
+  const std::string description() const
+  {
+    return "Add operation for agent: " + agentInfo.ip();
+  }
 
-    if (vtepSubnet.isError()) {
-      return Error(
-          "Unable to parse the VTEP Subnet: " + vtepSubnet.error());
+protected:
+  Try<bool> perform(State* networkState, hashmap<IP, Agent>* agents)
+  {
+    // Make sure the Agent we are going to add is already present in `agents`.
+    Try<IP> agentIP = IP::parse(agentInfo.ip(), AF_UNSPEC);
+    if (agentIP.isError()) {
+      return Error("Unable to parse the Agent IP: " + agentIP.error());
     }
 
-    // Make sure the VTEP subnet CIDR is not less than /8
-    if (vtepSubnet.get().prefix() < 8) {
+    if (!agents->contains(agentIP.get())) {
       return Error(
-          "VTEP MAC are derived from last 24 bits of VTEP IP.  Hence, "
-          "in order to guarantee unique VTEP MAC we need the VTEP IP "
-          "subnet to greater than /8");
+          "Could not find the Agent (" + stringify(agentIP.get()) +
+          ") that needed to be added to `State`.");
     }
 
-    Try<net::MAC> vtepMACOUI = createMAC(networkConfig.vtep_mac_oui(), true);
-    if(vtepMACOUI.isError()) {
-      return Error(
-          "Unable to parse VTEP MAC OUI: " + vtepMACOUI.error());
-    }
+    networkState->add_agents()->CopyFrom(agentInfo);
+    return true;
+  }
 
-    // IPv6
-    Option<Network> vtepSubnet6 = None();
-    if (networkConfig.has_vtep_subnet6()) {
-      Try<Network> _vtepSubnet6 =
-        Network::parse(networkConfig.vtep_subnet6(), AF_INET6);
+private:
+  AgentInfo agentInfo;
+};
 
-      if (_vtepSubnet6.isError()) {
-        return Error(
-            "Unable to parse the VTEP IPv6 Subnet: " + _vtepSubnet6.error());
-      }
-      vtepSubnet6 = _vtepSubnet6.get();
-    }
 
-    hashmap<string, Owned<Overlay>> overlays;
-    IntervalSet<IP> addressSpace;
+// Modify an `AgentInfo` in a `State` object.
+class ModifyAgent : public Operation {
+public:
+  explicit ModifyAgent(const AgentInfo& _agentInfo)
+  {
+    agentInfo.CopyFrom(_agentInfo);
+  }
 
-    // Overlay networks cannot have overlapping IP addresses. This
-    // lambda keeps track of the current address space and returns an
-    // `Error` if it detects an overlay that is going to use an
-    // already configured address space.
-    auto updateAddressSpace =
-      [&addressSpace](const Network &network) -> Try<Nothing> {
+  const std::string description() const
+  {
+    return "Modify operation for agent: " + agentInfo.ip();
+  }
+
+protected:
+  Try<bool> perform(State* networkState, hashmap<IP, Agent>* agents)
+  {
+    // Make sure the Agent we are going to add is already present in `agents`.
+    Try<IP> agentIP = IP::parse(agentInfo.ip(), AF_UNSPEC);
+    if (agentIP.isError()) {
+      return Error("Unable to parse the Agent IP: " + agentIP.error());
+    }
+
+    if (!agents->contains(agentIP.get())) {
+      return Error(
+          "Could not find the Agent (" + stringify(agentIP.get()) +
+          ") in the `agents` cache, that needed to be added to `State`.");
+    }
+
+    for(int i = 0; i < networkState->agents_size(); i++) {
+      AgentInfo* agentInfo_ = networkState->mutable_agents(i);
+      if (agentInfo_->ip() == agentInfo.ip()) {
+        agentInfo_->CopyFrom(agentInfo);
+        return true;
+      }
+    }
+
+    return Error(
+        "Could not find the Agent (" + stringify(agentIP.get()) +
+        ") in `State`.");
+  }
+
+private:
+  AgentInfo agentInfo;
+};
+
+
+// Adds an overlay to the `network` of a `State` object, or replaces
+// the overlay of the same name once it has been resized, and records
+// the change so that it is applied again when a master recovers. The
+// agents that have the overlay get its new definition.
+class UpdateOverlay : public Operation {
+public:
+  // `overlay` is the overlay with the VNI assigned to it, while
+  // `definition` is the overlay as requested by the operator.
+  UpdateOverlay(
+      const OverlayInfo& _overlay,
+      const OverlayInfo& _definition,
+      uint64_t _generation)
+    : generation(_generation)
+  {
+    overlay.CopyFrom(_overlay);
+    definition.CopyFrom(_definition);
+  }
+
+  const std::string description() const
+  {
+    return "Update operation for overlay: " + overlay.name();
+  }
+
+protected:
+  Try<bool> perform(State* networkState, hashmap<IP, Agent>* agents)
+  {
+    setOverlay(networkState->mutable_network()->mutable_overlays(), overlay);
+    setOverlay(networkState->mutable_runtime_overlays(), definition);
+
+    google::protobuf::RepeatedPtrField<string>* removed =
+      networkState->mutable_removed_overlays();
+
+    for (int i = 0; i < removed->size(); i++) {
+      if (removed->Get(i) == overlay.name()) {
+        removed->DeleteSubrange(i, 1);
+        break;
+      }
+    }
+
+    for (int i = 0; i < networkState->agents_size(); i++) {
+      AgentInfo* agentInfo = networkState->mutable_agents(i);
+
+      for (int j = 0; j < agentInfo->overlays_size(); j++) {
+        AgentOverlayInfo* _overlay = agentInfo->mutable_overlays(j);
+        if (_overlay->info().name() == overlay.name()) {
+          _overlay->mutable_info()->CopyFrom(overlay);
+          _overlay->set_generation(generation);
+        }
+      }
+    }
+
+    return true;
+  }
+
+private:
+  OverlayInfo overlay;
+  OverlayInfo definition;
+  uint64_t generation;
+};
+
+
+// Removes an overlay from the `network` and the agents of a `State`
+// object, and records the removal so that the overlay is not added
+// back from the master configuration when a master recovers.
+class RemoveOverlay : public Operation {
+public:
+  explicit RemoveOverlay(const string& _name) : name(_name) {}
+
+  const std::string description() const
+  {
+    return "Remove operation for overlay: " + name;
+  }
+
+protected:
+  Try<bool> perform(State* networkState, hashmap<IP, Agent>* agents)
+  {
+    eraseOverlay(networkState->mutable_network()->mutable_overlays(), name);
+    eraseOverlay(networkState->mutable_runtime_overlays(), name);
+
+    if (std::count(
+            networkState->removed_overlays().begin(),
+            networkState->removed_overlays().end(),
+            name) == 0) {
+      networkState->add_removed_overlays(name);
+    }
+
+    for (int i = 0; i < networkState->agents_size(); i++) {
+      AgentInfo* agentInfo = networkState->mutable_agents(i);
+
+      for (int j = 0; j < agentInfo->overlays_size(); j++) {
+        if (agentInfo->overlays(j).info().name() == name) {
+          agentInfo->mutable_overlays()->DeleteSubrange(j, 1);
+          break;
+        }
+      }
+    }
+
+    return true;
+  }
+
+private:
+  string name;
+};
+
+
+inline ostream& operator<<(ostream& stream, const Operation& operation)
+{
+  return stream << operation.description();
+}
+
+
+// Metrics exposed by the overlay master on `/metrics/snapshot`.
+struct Metrics
+{
+  Metrics()
+    : operations("overlay/master/replicated_log/operations"),
+      batches("overlay/master/replicated_log/batches"),
+      store_failures("overlay/master/replicated_log/store_failures"),
+      batch_size("overlay/master/replicated_log/batch_size"),
+      store_latency_ms("overlay/master/replicated_log/store_latency_ms"),
+      queue_wait_ms("overlay/master/replicated_log/queue_wait_ms"),
+      registration_queue_depth("overlay/master/registrations/queue_depth"),
+      registrations_deduplicated(
+          "overlay/master/registrations/deduplicated"),
+      registrations_dropped("overlay/master/registrations/dropped"),
+      registrations_admitted("overlay/master/registrations/admitted"),
+      registrations_deferred("overlay/master/registrations/deferred"),
+      registration_latency_ms("overlay/master/registrations/latency_ms")
+  {
+    process::metrics::add(operations);
+    process::metrics::add(batches);
+    process::metrics::add(store_failures);
+    process::metrics::add(batch_size);
+    process::metrics::add(store_latency_ms);
+    process::metrics::add(queue_wait_ms);
+    process::metrics::add(registration_queue_depth);
+    process::metrics::add(registrations_deduplicated);
+    process::metrics::add(registrations_dropped);
+    process::metrics::add(registrations_admitted);
+    process::metrics::add(registrations_deferred);
+    process::metrics::add(registration_latency_ms);
+  }
+
+  ~Metrics()
+  {
+    process::metrics::remove(operations);
+    process::metrics::remove(batches);
+    process::metrics::remove(store_failures);
+    process::metrics::remove(batch_size);
+    process::metrics::remove(store_latency_ms);
+    process::metrics::remove(queue_wait_ms);
+    process::metrics::remove(registration_queue_depth);
+    process::metrics::remove(registrations_deduplicated);
+    process::metrics::remove(registrations_dropped);
+    process::metrics::remove(registrations_admitted);
+    process::metrics::remove(registrations_deferred);
+    process::metrics::remove(registration_latency_ms);
+  }
+
+  // Number of operations queued for the replicated log.
+  Counter operations;
+
+  // Number of batches written to the replicated log.
+  Counter batches;
+
+  // Number of batches that could not be written to the replicated log.
+  Counter store_failures;
+
+  // Number of operations in each batch.
+  Distribution batch_size;
+
+  // Time taken by the replicated log to write a batch.
+  Distribution store_latency_ms;
+
+  // Time an operation spent queued before its batch was written.
+  Distribution queue_wait_ms;
+
+  // Number of registrations queued.
+  Gauge registration_queue_depth;
+
+  // Number of registrations that replaced a queued registration of
+  // the same agent.
+  Counter registrations_deduplicated;
+
+  // Number of registrations dropped because the queue was full.
+  Counter registrations_dropped;
+
+  // Number of agent registrations admitted for processing.
+  Counter registrations_admitted;
+
+  // Number of agent registrations deferred with a
+  // `RegisterAgentNackMessage`.
+  Counter registrations_deferred;
+
+  // Time from the admission of an agent registration to its
+  // acknowledgement.
+  Distribution registration_latency_ms;
+};
+
+
+// `ManagerProcess` is responsible for managing all the overlays that
+// exist in the Mesos cluster. For each overlay the manager stores the
+// network associated with overlay and the prefix length of subnets
+// that need to be assigned to Agents. When an Agent registers with
+// the manager, the manager picks a network from each overlay that the
+// manager is aware off and assigns it to the Agent. When the Agent
+// de-registers (or goes away) the manager frees subnets allocated to
+// the Agent for all the overlays that existed on that Agent.
+class ManagerProcess : public ProtobufProcess<ManagerProcess>
+{
+public:
+  static Try<Owned<ManagerProcess>> createManagerProcess(
+      const MasterConfig& masterConfig)
+  {
+    NetworkConfig networkConfig;
+    networkConfig.CopyFrom(masterConfig.network());
+
+    Option<Network> vtepSubnet = None();
+    if (networkConfig.has_vtep_subnet()) {
+      Try<Network> _vtepSubnet =
+        Network::parse(networkConfig.vtep_subnet(), AF_INET);
+
+      if (_vtepSubnet.isError()) {
+        return Error(
+            "Unable to parse the VTEP Subnet: " + _vtepSubnet.error());
+      }
+
+      // Make sure the VTEP subnet CIDR is not less than /8
+      if (_vtepSubnet.get().prefix() < 8) {
+        return Error(
+            "VTEP MAC are derived from last 24 bits of VTEP IP.  Hence, "
+            "in order to guarantee unique VTEP MAC we need the VTEP IP "
+            "subnet to greater than /8");
+      }
+
+      vtepSubnet = _vtepSubnet.get();
+    }
+
+    Try<net::MAC> vtepMACOUI = createMAC(networkConfig.vtep_mac_oui(), true);
+    if(vtepMACOUI.isError()) {
+      return Error(
+          "Unable to parse VTEP MAC OUI: " + vtepMACOUI.error());
+    }
+
+    // IPv6
+    Option<Network> vtepSubnet6 = None();
+    if (networkConfig.has_vtep_subnet6()) {
+      Try<Network> _vtepSubnet6 =
+        Network::parse(networkConfig.vtep_subnet6(), AF_INET6);
+
+      if (_vtepSubnet6.isError()) {
+        return Error(
+            "Unable to parse the VTEP IPv6 Subnet: " + _vtepSubnet6.error());
+      }
+      vtepSubnet6 = _vtepSubnet6.get();
+    }
+
+    // NOTE: An IPv6-only cluster only has an IPv6 VTEP subnet.
+    if (vtepSubnet.isNone() && vtepSubnet6.isNone()) {
+      return Error("Specify at least one of the VTEP Subnet or IPv6 Subnet");
+    }
+
+    if (networkConfig.has_vni_range()) {
+      const NetworkConfig::VNIRange& range = networkConfig.vni_range();
+      if (range.begin() == 0 ||
+          range.begin() > range.end() ||
+          range.end() > MAX_VNI) {
+        return Error(
+            "Invalid VNI range [" + stringify(range.begin()) + ", " +
+            stringify(range.end()) + "]: needs to be within [1, " +
+            stringify(MAX_VNI) + "]");
+      }
+    }
+
+    Try<hashmap<string, Owned<Overlay>>> _overlays =
+      createOverlays(vector<OverlayInfo>(
+          networkConfig.overlays().begin(),
+          networkConfig.overlays().end()));
+
+    if (_overlays.isError()) {
+      return Error(_overlays.error());
+    }
+
+    const hashmap<string, Owned<Overlay>>& overlays = _overlays.get();
+
+    if (overlays.empty()) {
+      return Error(
+          "Could not find any overlay configuration. Specify at"
+          " least one overlay");
+    }
+
+    Log* log = nullptr;
+
+    // Check if we need to create the replicated log.
+    if (masterConfig.has_replicated_log_dir()) {
+      Try<Nothing> mkdir = os::mkdir(masterConfig.replicated_log_dir());
+      if (mkdir.isError()) {
+        return Error(
+            "Unable to create replicated log directory: " +
+            mkdir.error());
+      }
+
+      LOG(INFO) << "Initializing the replicated log.";
+
+      // The ZK URL and Quorum can be specified through the JSON
+      // config or through environment variables.
+      Option<string> zkURL = None();
+      if (masterConfig.has_zk() && masterConfig.zk().has_url()) {
+           zkURL = masterConfig.zk().url();
+      } else {
+        zkURL = os::getenv(MESOS_ZK);
+      }
+
+      Option<uint32_t> quorum = None();
+      if (masterConfig.has_zk() && masterConfig.zk().has_quorum()) {
+          quorum = masterConfig.zk().quorum();
+      } else {
+        Option<string> _quorum = os::getenv(MESOS_QUORUM);
+        if (_quorum.isSome()) {
+          Try<uint32_t> result = numify<uint32_t>(_quorum.get());
+          if (result.isError()) {
+            return Error(
+                "Error parsing environment variable 'MESOS_QUORUM'(" +
+                _quorum.get() + "): " + result.error());
+          }
+
+          quorum = result.get();
+        }
+      }
+
+      if (zkURL.isSome() && quorum.isNone()) {
+        return Error(
+            "Cannot use replicated log with ZK URL '" + zkURL.get() +
+            "' without a quorum. Please specify quorum to be "
+            "used with zookeeper");
+      }
+
+      if (zkURL.isSome() && quorum.isSome()) {
+        LOG(INFO)
+          << "Using replicated log with zookeeper URL "
+          << zkURL.get() << " with a quorum of " << quorum.get()
+          << " for leader election.";
+
+        Try<zookeeper::URL> url = zookeeper::URL::parse(zkURL.get());
+        if (url.isError()) {
+          return Error("Error parsing ZooKeeper URL: " + url.error());
+        }
+
+        log = new Log(
+            (int)quorum.get(),
+            path::join(
+              masterConfig.replicated_log_dir(),
+              REPLICATED_LOG_STORE),
+            url.get().servers,
+            Seconds(masterConfig.zk().session_timeout()),
+            path::join(url.get().path, REPLICATED_LOG_STORE_REPLICAS),
+            url.get().authentication,
+            true,
+            "overlay/");
+      } else {
+        // Use replicated log without ZooKeeper.
+        LOG(INFO)
+          << "Using replicated log with local storage with a quorum of one.";
+
+        log = new Log(
+            1,
+            path::join(
+              masterConfig.replicated_log_dir(),
+              REPLICATED_LOG_STORE),
+            set<UPID>(),
+            true,
+            "overlay/");
+      }
+    }
+
+    if (masterConfig.replicated_log_retention() == 0) {
+      return Error(
+          "Invalid `replicated_log_retention`: needs to be greater "
+          "than zero");
+    }
+
+    Owned<Store> replicatedLog;
+
+    if (log != nullptr) {
+      replicatedLog = Owned<Store>(
+          new Store(log, masterConfig.replicated_log_retention()));
+    }
+
+    GroupCommitConfig groupCommit;
+    if (masterConfig.has_group_commit()) {
+      groupCommit.CopyFrom(masterConfig.group_commit());
+    }
+
+    if (groupCommit.max_operations() == 0) {
+      return Error(
+          "Invalid group commit configuration: `max_operations` "
+          "needs to be greater than zero");
+    }
+
+    if (masterConfig.max_queued_registrations() == 0) {
+      return Error(
+          "Invalid `max_queued_registrations`: needs to be greater "
+          "than zero");
+    }
+
+    hashset<string> principals;
+    foreach (const string& principal, masterConfig.overlay_principals()) {
+      principals.insert(principal);
+    }
+
+    return Owned<ManagerProcess>(new ManagerProcess(
+          overlays,
+          vtepSubnet,
+          vtepSubnet6,
+          vtepMACOUI.get(),
+          networkConfig,
+          groupCommit,
+          masterConfig.max_queued_registrations(),
+          masterConfig.max_concurrent_registrations(),
+          principals,
+          replicatedLog,
+          log));
+  }
+
+  ~ManagerProcess()
+  {
+    LOG(INFO) << "Shutting down the master manager process...";
+
+    replicatedLog.reset();
+
+    if (log != nullptr)  {
+      delete log;
+    }
+
+    foreachvalue (const Owned<OverlayAllocatorProcess>& overlay, overlays) {
+      process::terminate(overlay.get());
+      process::wait(overlay.get());
+    }
+
+    foreach (const Owned<OverlayAllocatorProcess>& allocator, retired) {
+      process::wait(allocator.get());
+    }
+
+    process::terminate(vtep.get());
+    process::wait(vtep.get());
+  }
+
+
+protected:
+  virtual void initialize()
+  {
+    foreachvalue (const Owned<OverlayAllocatorProcess>& overlay, overlays) {
+      process::spawn(overlay.get());
+    }
+
+    process::spawn(vtep.get());
+
+    LOG(INFO) << "Adding route for '" << self().id << "/state'";
+
+    route("/state",
+          OVERLAY_HELP,
+          &ManagerProcess::state);
+
+    LOG(INFO) << "Adding route for '" << self().id << "/overlays'";
+
+    route("/overlays",
+          READWRITE_HTTP_AUTHENTICATION_REALM,
+          OVERLAYS_HELP,
+          &ManagerProcess::overlaysEndpoint);
+
+    // When a new agent comes up or an existing agent reconnects with
+    // the master, it'll first send a `RegisterAgentMessage` to the
+    // master. The master will reply with `UpdateAgentNetworkMessage`.
+    install<RegisterAgentMessage>(&ManagerProcess::registerAgent);
+
+    // When the agent finishes its configuration based on the content
+    // in `UpdateAgentNetworkMessage`, it'll reply the master with an
+    // `AgentRegisteredMessage`.
+    // TODO(jieyu): Master should retry `UpdateAgentNetworkMessage` in
+    // case the message gets dropped.
+    install<AgentRegisteredMessage>(&ManagerProcess::agentRegistered);
+
+    // Once registered, agents receive the VTEPs of all the agents in
+    // `PeerUpdateMessage`s, and ask for a snapshot of them if they
+    // miss an update.
+    install<PeerSnapshotRequestMessage>(&ManagerProcess::requestPeers);
+
+    // Keep the agents and allocations warm while we are not leading,
+    // so that we don't need to rebuild them once we are elected.
+    if (replicatedLog.get() != nullptr) {
+      follow();
+    }
+  }
+
+  // Queues the registration of the agent at `pid`. The queue holds a
+  // single registration per agent IP, so the retries of an agent that
+  // is still queued only replace its registration, and it is bounded
+  // by `maxQueuedRegistrations`: once full, the registrations of other
+  // agents are dropped and the agents are told when to retry.
+  void registerAgent(
+      const UPID& pid,
+      const RegisterAgentMessage& registerMessage)
+  {
+    LOG(INFO) << "Got registration from pid: " << pid;
+
+    Try<IP> agentIP = IP::convert(pid.address.ip);
+    if (agentIP.isError()) {
+      LOG(ERROR) << "Couldn't parse agent ip "
+                 << agentIP.error();
+      return;
+    }
+
+    if (registrations.contains(agentIP.get())) {
+      ++metrics.registrations_deduplicated;
+    } else if (registrations.size() >= maxQueuedRegistrations) {
+      ++metrics.registrations_dropped;
+
+      LOG(WARNING) << "Dropping the registration of agent " << pid
+                   << " since " << registrations.size()
+                   << " registrations are queued";
+
+      nack(
+          pid,
+          retryAfter(registrations.size(), groupCommit.max_operations()),
+          "The registration queue is full");
+      return;
+    }
+
+    registrations[agentIP.get()] = Registration{pid, registerMessage};
+    metrics.registration_queue_depth.set(registrations.size());
+
+    if (replicatedLog.get() != nullptr && !recovered) {
+      // Hold on to the registration until we have recovered.
+      if (!recovering) {
+        // We haven't started recovering.
+        LOG(INFO) << MASTER_MANAGER_PROCESS_ID << " moving to `RECOVERING`"
+          << " state . Hence, queuing the registration of agent "
+          << pid;
+        recover();
+      } else {
+        LOG(INFO) << MASTER_MANAGER_PROCESS_ID << " in `RECOVERING`"
+          << " state . Hence, queuing the registration of agent "
+          << pid;
+      }
+
+      return;
+    }
+
+    processRegistrations();
+  }
+
+  // A registration whose VTEP, for a new agent, and overlays are being
+  // allocated by the allocators.
+  struct Allocation
+  {
+    UPID pid;
+    IP agentIP;
+    AgentNetworkConfig networkConfig;
+    Option<uint64_t> applied;
+
+    // The overlays to allocate to the agent.
+    vector<string> overlays;
+
+    // Whether this is a new agent, which needs a VTEP.
+    bool added;
+    Option<BackendInfo> backend;
+  };
+
+  // Processes the queued registrations in order. With the replicated
+  // log, registrations are only processed while fewer than a batch of
+  // operations is waiting to be written, so that a registration storm
+  // waits in the queue, where the retries are collapsed, and is
+  // written in full batches as the previous batches are stored.
+  void processRegistrations()
+  {
+    if (replicatedLog.get() != nullptr && !recovered) {
+      return;
+    }
+
+    // The registrations whose overlays need to be allocated, which
+    // are allocated together.
+    vector<Allocation> batch;
+
+    while (!registrations.empty() &&
+           (replicatedLog.get() == nullptr ||
+            operations.size() + allocating.size() <
+              groupCommit.max_operations())) {
+      const IP agentIP = registrations.keys().front();
+      const Registration registration = registrations.at(agentIP);
+      registrations.erase(agentIP);
+
+      _registerAgent(
+          registration.pid,
+          agentIP,
+          registration.message,
+          &batch);
+    }
+
+    metrics.registration_queue_depth.set(registrations.size());
+
+    if (!batch.empty()) {
+      allocate(batch);
+    }
+  }
+
+  void _registerAgent(
+      const UPID& pid,
+      const IP& agentIP,
+      const RegisterAgentMessage& registerMessage,
+      vector<Allocation>* batch)
+  {
+    if (!admit(pid, agentIP)) {
+      return;
+    }
+
+    if (allocating.contains(agentIP)) {
+      VLOG(1) << "Dropping the registration of agent " << pid
+              << " since its overlays are being allocated";
+      return;
+    }
+
+    if (agents.contains(agentIP)) {
+      LOG(INFO) << "Agent " << pid << " re-registering.";
+
+      // The generation of the configuration that the agent has
+      // already applied, which allows us to only send the overlays
+      // that have been assigned to the agent since.
+      Option<uint64_t> applied = None();
+      if (registerMessage.has_generation()) {
+        applied = registerMessage.generation();
+      }
+
+      // Check if any new overlay need to be installed on the
+      // agent.
+      Agent& agent = agents.at(agentIP);
+      agent.setNetworkConfig(registerMessage.network_config());
+
+      vector<string> missing;
+      if (agent.hasBackend()) {
+        foreachkey (const string& name, overlays) {
+          if (!agent.hasOverlay(name)) {
+            missing.push_back(name);
+          }
+        }
+      }
+
+      if (!missing.empty()) {
+        allocating.insert(agentIP);
+        batch->push_back(Allocation{
+            pid,
+            agentIP,
+            registerMessage.network_config(),
+            applied,
+            missing,
+            false,
+            None()});
+
+        return;
+      }
+
+      reregisterAgent(pid, agentIP, applied);
+    } else {
+      // New Agent.
+      LOG(INFO) << "New registration from pid: " << pid;
+
+      vector<string> names;
+      foreachkey (const string& name, overlays) {
+        names.push_back(name);
+      }
+
+      allocating.insert(agentIP);
+      batch->push_back(Allocation{
+          pid,
+          agentIP,
+          registerMessage.network_config(),
+          None(),
+          names,
+          true,
+          None()});
+    }
+  }
+
+  // Sends its overlays to a re-registering agent that has all the
+  // overlays.
+  void reregisterAgent(
+      const UPID& pid,
+      const IP& agentIP,
+      const Option<uint64_t>& applied)
+  {
+    // Ensure that the agent is added to the replicated log.
+    const string _agentIP = stringify(agentIP);
+    for (int i = 0; i < networkState.agents_size(); i++) {
+      if (_agentIP == networkState.agents(i).ip()) {
+        // Given that `networkState` already has this Agent, the
+        // information is already stored in replicated log and hence
+        // we can just send an "ACK" to the agent with the
+        // configuration info
+        __registerAgent(pid, agentIP, applied, true);
+        return;
+      }
+    }
+
+    // The fact that we have reached here implies that the Agent
+    // exists in the `agents` database, but its information has not
+    // been updated in the replicated log. Simply drop this message
+    // since the Agent will re-register.
+    LOG(INFO) << "Agent " << pid
+              << " info has not been updated in the replicated log."
+              << " Hence dropping this registration request.";
+  }
+
+  // Allocates the VTEPs of the new agents of `batch` on the VTEP
+  // allocator, and then the overlays of all the agents of `batch` on
+  // the allocators of the overlays.
+  void allocate(const vector<Allocation>& batch)
+  {
+    vector<IP> agentIPs;
+    foreach (const Allocation& allocation, batch) {
+      if (allocation.added) {
+        agentIPs.push_back(allocation.agentIP);
+      }
+    }
+
+    if (agentIPs.empty()) {
+      _allocate(batch, epoch, vector<Option<BackendInfo>>());
+      return;
+    }
+
+    process::dispatch(
+        vtep->self(),
+        &VtepAllocatorProcess::allocate,
+        agentIPs)
+      .onAny(defer(self(),
+                   &ManagerProcess::_allocate,
+                   batch,
+                   epoch,
+                   lambda::_1));
+  }
+
+  void _allocate(
+      vector<Allocation> batch,
+      uint64_t _epoch,
+      const Future<vector<Option<BackendInfo>>>& backends)
+  {
+    // The allocations have been reset since, see `restore`.
+    if (_epoch != epoch) {
+      return;
+    }
+
+    if (!backends.isReady()) {
+      LOG(ERROR) << "Unable to allocate the VTEPs of " << batch.size()
+                 << " agents: "
+                 << (backends.isFailed() ? backends.failure() : "discarded");
+
+      foreach (const Allocation& allocation, batch) {
+        allocating.erase(allocation.agentIP);
+      }
+
+      processRegistrations();
+      return;
+    }
+
+    vector<Allocation> allocations;
+
+    size_t i = 0;
+    foreach (Allocation& allocation, batch) {
+      if (allocation.added) {
+        allocation.backend = backends->at(i++);
+
+        // The agent will retry its registration.
+        if (allocation.backend.isNone()) {
+          allocating.erase(allocation.agentIP);
+          continue;
+        }
+      }
+
+      allocations.push_back(allocation);
+    }
+
+    // Every overlay allocator gets the requests of all the agents the
+    // overlay needs to be allocated to in a single dispatch.
+    vector<string> names;
+    list<Future<vector<Option<AgentOverlayInfo>>>> futures;
+
+    foreachpair (const string& name,
+                 const Owned<OverlayAllocatorProcess>& allocator,
+                 overlays) {
+      vector<OverlayRequest> requests;
+
+      foreach (const Allocation& allocation, allocations) {
+        if (std::count(
+                allocation.overlays.begin(),
+                allocation.overlays.end(),
+                name) > 0) {
+          requests.push_back(OverlayRequest{
+              allocation.agentIP,
+              allocation.networkConfig});
+        }
+      }
+
+      if (requests.empty()) {
+        continue;
+      }
+
+      names.push_back(name);
+      futures.push_back(process::dispatch(
+          allocator->self(),
+          &OverlayAllocatorProcess::allocate,
+          requests));
+    }
+
+    collect(futures)
+      .onAny(defer(self(),
+                   &ManagerProcess::__allocate,
+                   allocations,
+                   names,
+                   _epoch,
+                   lambda::_1));
+  }
+
+  void __allocate(
+      const vector<Allocation>& allocations,
+      const vector<string>& names,
+      uint64_t _epoch,
+      const Future<list<vector<Option<AgentOverlayInfo>>>>& results)
+  {
+    if (_epoch != epoch) {
+      return;
+    }
+
+    foreach (const Allocation& allocation, allocations) {
+      allocating.erase(allocation.agentIP);
+    }
+
+    if (!results.isReady()) {
+      LOG(ERROR) << "Unable to allocate the overlays of "
+                 << allocations.size() << " agents: "
+                 << (results.isFailed() ? results.failure() : "discarded");
+
+      processRegistrations();
+      return;
+    }
+
+    // The overlays allocated to every agent, in the order of
+    // `allocations`. The results of every allocator are in the order
+    // of the agents it got requests for.
+    vector<vector<AgentOverlayInfo>> allocated(allocations.size());
+
+    auto result = results->begin();
+    foreach (const string& name, names) {
+      const vector<Option<AgentOverlayInfo>>& subnets = *result++;
+
+      // The overlay has been removed while it was being allocated.
+      if (!overlays.contains(name)) {
+        continue;
+      }
+
+      size_t j = 0;
+      for (size_t k = 0; k < allocations.size(); k++) {
+        if (std::count(
+                allocations[k].overlays.begin(),
+                allocations[k].overlays.end(),
+                name) > 0) {
+          const Option<AgentOverlayInfo>& overlay = subnets.at(j++);
+          if (overlay.isSome()) {
+            allocated[k].push_back(overlay.get());
+            assignVNI(&allocated[k].back());
+          }
+        }
+      }
+    }
+
+    for (size_t k = 0; k < allocations.size(); k++) {
+      const Allocation& allocation = allocations[k];
+      const IP& agentIP = allocation.agentIP;
+
+      // The overlays that the agent got since, e.g., from an earlier
+      // registration, are not allocated again.
+      if (agents.contains(agentIP)) {
+        const Agent& agent = agents.at(agentIP);
+
+        vector<AgentOverlayInfo> _allocated;
+        foreach (const AgentOverlayInfo& overlay, allocated[k]) {
+          if (!agent.hasOverlay(overlay.info().name())) {
+            _allocated.push_back(overlay);
+          }
+        }
+
+        allocated[k] = _allocated;
+      }
+
+      // NOTE: Only an allocation that changes the overlays of the
+      // agent consumes a generation, so that the registrations that
+      // change nothing don't make the agents re-apply their
+      // configuration.
+      if (!allocated[k].empty()) {
+        const uint64_t _generation = ++generation;
+
+        foreach (AgentOverlayInfo& overlay, allocated[k]) {
+          overlay.set_generation(_generation);
+        }
+      }
+
+      if (allocation.added) {
+        agents.emplace(agentIP, Agent(agentIP, allocation.backend.get()));
+
+        Agent* agent = &(agents.at(agentIP));
+        agent->setNetworkConfig(allocation.networkConfig);
+
+        agent->addOverlays(allocated[k]);
+
+        // Update the `networkState in the replicated log before
+        // sending the overlay configuration to the Agent, and telling
+        // the other agents about its VTEP.
+        update(Owned<Operation>(
+              new AddAgent(agent->getAgentInfo())))
+          .onAny(defer(self(),
+                &ManagerProcess::__registerAgent,
+                allocation.pid,
+                agentIP,
+                None(),
+                lambda::_1))
+          .onReady(defer(self(),
+                &ManagerProcess::addPeer,
+                agentIP,
+                lambda::_1));
+
+        continue;
+      }
+
+      if (!agents.contains(agentIP)) {
+        continue;
+      }
+
+      if (agents.at(agentIP).addOverlays(allocated[k])) {
+        // We installed a new overlay on this agent.
+        update(Owned<Operation>(
+               new ModifyAgent(agents.at(agentIP).getAgentInfo())))
+          .onAny(defer(self(),
+                 &ManagerProcess::__registerAgent,
+                 allocation.pid,
+                 agentIP,
+                 allocation.applied,
+                 lambda::_1));
+
+        continue;
+      }
+
+      reregisterAgent(allocation.pid, agentIP, allocation.applied);
+    }
+
+    // Registrations might have waited for these allocations.
+    processRegistrations();
+  }
+
+  // Will be called once the operation is successfully applied to the
+  // `networkState`.
+  void __registerAgent(const UPID& pid,
+                      const IP& agentIP,
+                      const Option<uint64_t>& applied,
+                      const Future<bool>& result)
+  {
+    if (!result.isReady()) {
+      LOG(WARNING) << "Unable to process registration request from "
+                   << pid << " due to: "
+                   << (result.isDiscarded() ? "discarded" : result.failure());
+      return;
+    }
+
+    CHECK(agents.contains(agentIP));
+
+    list<AgentOverlayInfo> _overlays = agents.at(agentIP).getOverlays();
+
+    // Create the network update message and send it to the Agent.
+    UpdateAgentOverlaysMessage update;
+
+    const uint64_t _generation = agents.at(agentIP).getGeneration();
+
+    update.set_generation(_generation);
+
+    // If the agent has applied a generation, only send the overlays
+    // assigned to it since. When nothing has changed this is an empty
+    // update, which the agent treats as an acknowledgement.
+    //
+    // NOTE: An agent that has applied a generation newer than ours
+    // got it from a master whose allocations we don't know about, so
+    // it needs the complete configuration.
+    if (applied.isSome() && applied.get() <= _generation) {
+      update.set_delta(true);
+    }
+
+    foreach (const AgentOverlayInfo& overlay, _overlays) {
+      if (!update.delta() || overlay.generation() > applied.get()) {
+        update.add_overlays()->CopyFrom(overlay);
+      }
+    }
+
+    VLOG(1) << "Sending " << update.overlays_size() << " out of "
+            << _overlays.size() << " overlays to agent " << pid
+            << " at generation " << _generation;
+
+    // Clear the state for all overlays in this update.
+    for (int i = 0; i < update.overlays_size(); i++) {
+      update.mutable_overlays(i)->clear_state();
+    }
+
+    // The agent might not have been told about the overlays removed
+    // at runtime, e.g., if it was not registered when they were.
+    update.mutable_removed_overlays()->CopyFrom(
+        networkState.removed_overlays());
+
+    send(pid, update);
+  }
+
+  void agentRegistered(const UPID& from, const AgentRegisteredMessage& message)
+  {
+    Try<IP> _agentIP = IP::convert(from.address.ip);
+    if (_agentIP.isError()) {
+      LOG(ERROR) << "Couldn't parse agent IP " << _agentIP.error()
+                 << " Got ACK from " << from;
+      return;
+    }
+
+    if(agents.contains(_agentIP.get())) {
+      LOG(INFO) << "Got ACK for addition of networks from " << from;
+      for(int i = 0; i < message.overlays_size(); i++) {
+        const string& name = message.overlays(i).info().name();
+
+        // The agent reports the overlays it was configuring when they
+        // were removed through the `overlays` endpoint.
+        if (std::find(
+                networkState.removed_overlays().begin(),
+                networkState.removed_overlays().end(),
+                name) != networkState.removed_overlays().end()) {
+          VLOG(1) << "Ignoring the state of removed overlay " << name
+                  << " reported by " << from;
+          continue;
+        }
+
+        agents.at(_agentIP.get()).updateOverlayState(message.overlays(i));
+      }
+
+      // We don't need to store the "state" of an overlay network on
+      // an agent in the replicated log so go ahead and update the
+      // `networkState` without updating the overlay replicated log.
+      for (int i = 0; i < networkState.agents_size(); i++) {
+        if (stringify(_agentIP.get()) == networkState.agents(i).ip()) {
+          networkState.mutable_agents(i)->CopyFrom(
+              agents.at(_agentIP.get()).getAgentInfo());
+
+          LOG(INFO) << "Sending register ACK to: " << from;
+          send(from, AgentRegisteredAcknowledgement());
+
+          release(_agentIP.get());
+
+          // Start sending the updates of the peer table to the agent,
+          // unless it already gets them, e.g., when it acknowledges
+          // the overlays sent to it at runtime.
+          if (!peerSubscribers.contains(_agentIP.get()) ||
+              peerSubscribers.at(_agentIP.get()) != from) {
+            peerSubscribers.put(_agentIP.get(), from);
+            sendPeers(from);
+          }
+
+          if (outdated.contains(_agentIP.get())) {
+            outdated.erase(_agentIP.get());
+            addMissingOverlays({_agentIP.get()});
+          }
+          return;
+        }
+      }
+      LOG(ERROR) << "Unable to find the registered agent in the `networkState`";
+    } else {
+      LOG(ERROR) << "Got ACK for network message for non-existent PID "
+                 << from;
+    }
+  }
+
+  // Returns whether the registration of the agent at `pid` can be
+  // processed now. If `maxConcurrentRegistrations` registrations are
+  // in progress, the registration is deferred: the agent is told when
+  // to retry with a `RegisterAgentNackMessage`, and is sent a
+  // `MasterReadyMessage` once a registration in progress completes.
+  //
+  // NOTE: An agent stays admitted until it acknowledges the overlays
+  // we send it, so that the retries of its registration are processed
+  // while it configures its overlays.
+  bool admit(const UPID& pid, const IP& agentIP)
+  {
+    if (maxConcurrentRegistrations == 0) {
+      return true;
+    }
+
+    const Time now = Clock::now();
+
+    if (admissions.contains(agentIP)) {
+      admissions.at(agentIP).seen = now;
+      return true;
+    }
+
+    // Hand the admissions of the agents that have stopped registering,
+    // e.g., because they have gone away, to the deferred agents.
+    foreach (const IP& ip, admissions.keys()) {
+      if (now - admissions.at(ip).seen > REGISTRATION_ADMISSION_TIMEOUT) {
+        LOG(WARNING) << "Agent " << ip << " has not registered for "
+                     << REGISTRATION_ADMISSION_TIMEOUT
+                     << ", releasing its admission";
+
+        admissions.erase(ip);
+      }
+    }
+
+    readyDeferred();
+
+    // NOTE: `readyDeferred` hands out the free admissions, so this
+    // agent is only admitted if no agent is waiting before it.
+    if (admissions.size() < maxConcurrentRegistrations) {
+      admissions.put(agentIP, Admission{now, now});
+      ++metrics.registrations_admitted;
+      return true;
+    }
+
+    deferred[agentIP] = pid;
+    ++metrics.registrations_deferred;
+
+    LOG(INFO) << "Deferring the registration of agent " << pid << " behind "
+              << deferred.size() - 1 << " other agents";
+
+    nack(
+        pid,
+        retryAfter(deferred.size(), maxConcurrentRegistrations),
+        stringify(admissions.size()) + " registrations in progress");
+
+    return false;
+  }
+
+  // Returns the retry time suggested to an agent that waits behind
+  // `waiting` registrations, of which `rate` are processed at a time.
+  // The jitter keeps the agents that were turned away together from
+  // retrying together.
+  Duration retryAfter(size_t waiting, size_t rate) const
+  {
+    Duration retry = registrationTime *
+      (1.0 + (double) waiting / rate) *
+      (1.0 + 0.5 * ((double) ::random() / RAND_MAX));
+
+    retry = std::max(retry, REGISTRATION_RETRY_AFTER_MIN);
+    retry = std::min(retry, REGISTRATION_RETRY_AFTER_MAX);
+
+    return retry;
+  }
+
+  void nack(const UPID& pid, const Duration& retry, const string& reason)
+  {
+    VLOG(1) << "Telling agent " << pid << " to retry its registration in "
+            << retry << ": " << reason;
+
+    RegisterAgentNackMessage message;
+    message.set_retry_after_ms(retry.ms());
+    message.set_reason(reason);
+
+    send(pid, message);
+  }
+
+  // Releases the admission of an agent whose registration completed,
+  // and hands it to the next deferred agent.
+  void release(const IP& agentIP)
+  {
+    if (!admissions.contains(agentIP)) {
+      return;
+    }
+
+    const Duration elapsed = Clock::now() - admissions.at(agentIP).admitted;
+    admissions.erase(agentIP);
+
+    metrics.registration_latency_ms.set(elapsed.ms());
+
+    // Keep a moving average of the registration time, which paces the
+    // retries suggested to the deferred agents.
+    registrationTime = registrationTime * 0.8 + elapsed * 0.2;
+
+    readyDeferred();
+  }
+
+  // Admits the deferred agents, in the order they were deferred, as
+  // long as admissions are free.
+  void readyDeferred()
+  {
+    const Time now = Clock::now();
+
+    while (admissions.size() < maxConcurrentRegistrations &&
+           !deferred.empty()) {
+      const IP agentIP = deferred.keys().front();
+      const UPID pid = deferred.at(agentIP);
+      deferred.erase(agentIP);
+
+      admissions.put(agentIP, Admission{now, now});
+      ++metrics.registrations_admitted;
+
+      VLOG(1) << "Telling agent " << pid << " to register";
+
+      send(pid, MasterReadyMessage());
+    }
+  }
+
+  // Sends the VTEP of a newly stored agent to the registered agents.
+  void addPeer(const IP& agentIP, bool stored)
+  {
+    if (!stored || !agents.contains(agentIP)) {
+      return;
+    }
+
+    Option<PeerInfo> peer = agents.at(agentIP).getPeer();
+    if (peer.isNone()) {
+      return;
+    }
+
+    PeerUpdateMessage update;
+    update.set_base(peerVersion);
+    update.set_version(++peerVersion);
+    update.add_peers()->CopyFrom(peer.get());
+
+    VLOG(1) << "Sending the VTEP of agent " << agentIP << " to "
+            << peerSubscribers.size() << " agents at peer table version "
+            << peerVersion;
+
+    foreachvalue (const UPID& pid, peerSubscribers) {
+      send(pid, update);
+    }
+  }
+
+  // Sends a snapshot of the peer table to `pid`.
+  void sendPeers(const UPID& pid)
+  {
+    PeerUpdateMessage update;
+    update.set_version(peerVersion);
+    update.set_snapshot(true);
+
+    foreachvalue (const Agent& agent, agents) {
+      Option<PeerInfo> peer = agent.getPeer();
+      if (peer.isSome()) {
+        update.add_peers()->CopyFrom(peer.get());
+      }
+    }
+
+    VLOG(1) << "Sending " << update.peers_size() << " peers to " << pid
+            << " at peer table version " << peerVersion;
+
+    send(pid, update);
+  }
+
+  void requestPeers(const UPID& from, const PeerSnapshotRequestMessage&)
+  {
+    Try<IP> agentIP = IP::convert(from.address.ip);
+    if (agentIP.isError() ||
+        !peerSubscribers.contains(agentIP.get()) ||
+        peerSubscribers.at(agentIP.get()) != from) {
+      LOG(WARNING) << "Ignored 'PeerSnapshotRequestMessage' from " << from
+                   << " since it is not a registered agent";
+      return;
+    }
+
+    sendPeers(from);
+  }
+
+  // Allocates the overlays that the agents `agentIPs` are missing,
+  // e.g., since the overlays have been added at runtime, and sends
+  // them to the agents. Only the agents that have acknowledged their
+  // registration are sent the overlays here; the agents that have
+  // not yet are sent them once they do.
+  void addMissingOverlays(const vector<IP>& agentIPs)
+  {
+    vector<Allocation> batch;
+
+    foreach (const IP& agentIP, agentIPs) {
+      if (!agents.contains(agentIP)) {
+        continue;
+      }
+
+      const Agent& agent = agents.at(agentIP);
+
+      vector<string> missing;
+      if (agent.hasBackend()) {
+        foreachkey (const string& name, overlays) {
+          if (!agent.hasOverlay(name)) {
+            missing.push_back(name);
+          }
+        }
+      }
+
+      if (missing.empty()) {
+        continue;
+      }
+
+      if (!peerSubscribers.contains(agentIP) ||
+          allocating.contains(agentIP) ||
+          agent.getNetworkConfig().isNone()) {
+        outdated.insert(agentIP);
+        continue;
+      }
+
+      allocating.insert(agentIP);
+      batch.push_back(Allocation{
+          peerSubscribers.at(agentIP),
+          agentIP,
+          agent.getNetworkConfig().get(),
+          agent.getGeneration(),
+          missing,
+          false,
+          None()});
+    }
+
+    VLOG(1) << "Allocating the missing overlays of " << batch.size()
+            << " agents";
+
+    if (!batch.empty()) {
+      allocate(batch);
+    }
+  }
+
+  // Sends the overlays that have changed since the generations in
+  // `applied` to the agents, keyed by agent IP, once the change has
+  // been stored.
+  void sendOverlays(
+      const hashmap<IP, uint64_t>& applied,
+      const Future<bool>& stored)
+  {
+    if (!stored.isReady() || !stored.get()) {
+      return;
+    }
+
+    foreachpair (const IP& agentIP, uint64_t _applied, applied) {
+      if (agents.contains(agentIP) && peerSubscribers.contains(agentIP)) {
+        __registerAgent(
+            peerSubscribers.at(agentIP),
+            agentIP,
+            _applied,
+            true);
+      }
+    }
+  }
+
+  // Lists, adds, resizes or removes overlays, see `OVERLAYS_HELP`.
+  //
+  // NOTE: The principal is `None` unless the master authenticates the
+  // requests of its read-write realm, e.g., with
+  // `--authenticate_http_readwrite`.
+  Future<http::Response> overlaysEndpoint(
+      const http::Request& request,
+      const Option<http::authentication::Principal>& principal)
+  {
+    if (request.method == "GET") {
+      JSON::Array array;
+      foreachkey (const string& name, definitions) {
+        array.values.push_back(JSON::protobuf(getOverlayInfo(name)));
+      }
+
+      JSON::Object object;
+      object.values["overlays"] = array;
+
+      return http::OK(object, request.url.query.get("jsonp"));
+    }
+
+    if (!principals.empty() &&
+        (principal.isNone() ||
+         principal->value.isNone() ||
+         !principals.contains(principal->value.get()))) {
+      return http::Forbidden(
+          "The principal is not allowed to change the overlays");
+    }
+
+    if (replicatedLog.get() != nullptr && !recovered) {
+      return http::ServiceUnavailable(
+          "The overlay master has not recovered its state yet");
+    }
+
+    if (request.method == "DELETE") {
+      Option<string> name = request.url.query.get("name");
+      if (name.isNone()) {
+        return http::BadRequest("Missing the `name` query parameter");
+      }
+
+      return removeOverlay(name.get());
+    }
+
+    if (request.method != "POST" && request.method != "PUT") {
+      return http::MethodNotAllowed(
+          {"GET", "POST", "PUT", "DELETE"},
+          request.method);
+    }
+
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(request.body);
+    if (json.isError()) {
+      return http::BadRequest("Unable to parse the overlay: " + json.error());
+    }
+
+    Try<OverlayInfo> overlay = ::protobuf::parse<OverlayInfo>(json.get());
+    if (overlay.isError()) {
+      return http::BadRequest(
+          "Unable to parse the overlay: " + overlay.error());
+    }
+
+    if (request.method == "POST") {
+      return addOverlay(overlay.get());
+    }
+
+    return resizeOverlay(overlay.get());
+  }
+
+  Future<http::Response> addOverlay(const OverlayInfo& definition)
+  {
+    if (definitions.contains(definition.name())) {
+      return http::Conflict(
+          "Overlay " + definition.name() + " already exists");
+    }
+
+    Try<hashmap<string, Owned<Overlay>>> created =
+      createOverlays(withOverlay(getDefinitions(), definition));
+
+    if (created.isError()) {
+      return http::BadRequest(created.error());
+    }
+
+    Option<uint32_t> vni = None();
+    if (definition.has_vni()) {
+      foreachvalue (uint32_t _vni, vnis) {
+        if (_vni == definition.vni()) {
+          return http::Conflict(
+              "VNI " + stringify(_vni) + " is assigned to another overlay");
+        }
+      }
+
+      vni = definition.vni();
+    } else if (networkConfig.has_vni_range()) {
+      vni = allocateVNI();
+      if (vni.isNone()) {
+        LOG(ERROR) << "Unable to allocate a VNI to overlay "
+                   << definition.name() << ": the VNI range is exhausted,"
+                   << " hence it shares the VNI " << DEFAULT_VNI;
+      }
+    }
+
+    const string& name = definition.name();
+
+    LOG(INFO) << "Adding overlay " << name;
+
+    definitions.put(name, definition);
+    if (vni.isSome()) {
+      vnis[name] = vni.get();
+    }
+
+    Owned<OverlayAllocatorProcess> allocator(
+        new OverlayAllocatorProcess(*created->at(name)));
+
+    process::spawn(allocator.get());
+    overlays.emplace(name, allocator);
+
+    const OverlayInfo overlay = getOverlayInfo(name);
+    const uint64_t _epoch = epoch;
+
+    // The agents are only allocated the overlay once it has been
+    // stored, while the agents that register meanwhile are allocated
+    // the overlay with their registration.
+    return update(Owned<Operation>(
+          new UpdateOverlay(overlay, definition, generation)))
+      .then(defer(self(), [=](bool stored) -> http::Response {
+        if (!stored) {
+          rollback(_epoch);
+
+          return http::ServiceUnavailable(
+              "Unable to store overlay " + name);
+        }
+
+        vector<IP> agentIPs;
+        foreachkey (const IP& agentIP, agents) {
+          agentIPs.push_back(agentIP);
+        }
+
+        addMissingOverlays(agentIPs);
+
+        return http::OK(JSON::protobuf(overlay));
+      }));
+  }
+
+  Future<http::Response> resizeOverlay(const OverlayInfo& definition)
+  {
+    const string& name = definition.name();
+
+    if (!definitions.contains(name)) {
+      return http::NotFound("Unknown overlay " + name);
+    }
+
+    const OverlayInfo& current = definitions.at(name);
+
+    if (definition.has_vni() != current.has_vni() ||
+        definition.vni() != current.vni()) {
+      return http::BadRequest(
+          "The VNI of overlay " + name + " cannot be changed");
+    }
+
+    if (definition.has_subnet() != current.has_subnet() ||
+        definition.prefix() != current.prefix() ||
+        definition.has_subnet6() != current.has_subnet6() ||
+        definition.prefix6() != current.prefix6()) {
+      return http::BadRequest(
+          "Only the subnets of overlay " + name + " can be changed");
+    }
+
+    Try<hashmap<string, Owned<Overlay>>> created =
+      createOverlays(withOverlay(getDefinitions(), definition));
+
+    if (created.isError()) {
+      return http::BadRequest(created.error());
+    }
+
+    // The subnets allocated to the agents need to stay in the
+    // overlay, hence its subnets can only grow.
+    Try<hashmap<string, Owned<Overlay>>> _current =
+      createOverlays({current});
+
+    CHECK_SOME(_current);
+
+    const Overlay& from = *_current->at(name);
+    const Overlay& to = *created->at(name);
+
+    if ((from.network.isSome() &&
+         (from.network->begin() < to.network->begin() ||
+          to.network->end() < from.network->end())) ||
+        (from.network6.isSome() &&
+         (from.network6->begin() < to.network6->begin() ||
+          to.network6->end() < from.network6->end()))) {
+      return http::BadRequest(
+          "The subnets of overlay " + name + " need to contain its"
+          " current subnets");
+    }
+
+    LOG(INFO) << "Resizing overlay " << name;
+
+    process::dispatch(
+        overlays.at(name)->self(),
+        &OverlayAllocatorProcess::resize,
+        to);
+
+    definitions.put(name, definition);
+
+    const OverlayInfo overlay = getOverlayInfo(name);
+    const uint64_t _generation = ++generation;
+    const uint64_t _epoch = epoch;
+
+    // The agents that have the overlay get its new subnets.
+    hashmap<IP, uint64_t> applied;
+    foreachpair (const IP& agentIP, Agent& agent, agents) {
+      const uint64_t _applied = agent.getGeneration();
+      if (agent.updateOverlayInfo(overlay, _generation)) {
+        applied[agentIP] = _applied;
+      }
+    }
+
+    return update(Owned<Operation>(
+          new UpdateOverlay(overlay, definition, _generation)))
+      .onAny(defer(self(), &Self::sendOverlays, applied, lambda::_1))
+      .then(defer(self(), [=](bool stored) -> http::Response {
+        if (!stored) {
+          rollback(_epoch);
+
+          return http::ServiceUnavailable(
+              "Unable to store overlay " + name);
+        }
+
+        return http::OK(JSON::protobuf(overlay));
+      }));
+  }
+
+  Future<http::Response> removeOverlay(const string& name)
+  {
+    if (!definitions.contains(name)) {
+      return http::NotFound("Unknown overlay " + name);
+    }
+
+    if (definitions.size() == 1) {
+      return http::Conflict("Cannot remove the last overlay " + name);
+    }
+
+    LOG(INFO) << "Removing overlay " << name;
+
+    const uint64_t _epoch = epoch;
+
+    definitions.erase(name);
+    vnis.erase(name);
+
+    Owned<OverlayAllocatorProcess> allocator = overlays.at(name);
+    overlays.erase(name);
+
+    // NOTE: The allocator is terminated once it has processed the
+    // allocations in progress, whose results are dropped since the
+    // overlay is gone, so that the agents they are for don't wait for
+    // them forever.
+    process::terminate(allocator.get(), false);
+    retired.push_back(allocator);
+
+    hashmap<IP, uint64_t> applied;
+    foreachpair (const IP& agentIP, Agent& agent, agents) {
+      const uint64_t _applied = agent.getGeneration();
+      if (agent.removeOverlay(name)) {
+        applied[agentIP] = _applied;
+      }
+    }
+
+    return update(Owned<Operation>(new RemoveOverlay(name)))
+      .onAny(defer(self(), &Self::sendOverlays, applied, lambda::_1))
+      .then(defer(self(), [=](bool stored) -> http::Response {
+        if (!stored) {
+          rollback(_epoch);
+
+          return http::ServiceUnavailable(
+              "Unable to store the removal of overlay " + name);
+        }
+
+        return http::OK();
+      }));
+  }
+
+  // Reverts the changes made to the overlays, their allocators and the
+  // agents by a request of the `overlays` endpoint that could not be
+  // stored, by restoring the `State` last stored. The changes have
+  // already been reverted if the allocations have been restored since
+  // `_epoch`, e.g., when the master is demoted after failing to store.
+  //
+  // NOTE: Restoring the allocator of a removed overlay also restores
+  // the subnets allocated to the agents before the removal.
+  void rollback(uint64_t _epoch)
+  {
+    if (epoch != _epoch) {
+      return;
+    }
+
+    LOG(WARNING) << "Reverting the changes to the overlays that have not"
+                 << " been stored";
+
+    const overlay::State snapshot = networkState;
+    restore(snapshot);
+  }
+
+  Future<http::Response> state(const http::Request& request)
+  {
+    VLOG(1) << "Responding to `state` endpoint";
+
+    return http::OK(
+        JSON::protobuf(networkState),
+        request.url.query.get("jsonp"));
+  }
+
+  void recover()
+  {
+    // Nothing to recover.
+    CHECK_NOTNULL(replicatedLog.get());
+
+    recovering = true;
+
+    replicatedLog->recover()
+      .onAny(defer(self(),
+                   &ManagerProcess::_recover,
+                   lambda::_1));
+  }
 
-        Interval<IP> overlaySpace =
-          (Bound<IP>::closed(network.begin()), 
-           Bound<IP>::closed(network.end()));
+  void _recover(const Future<Option<overlay::State>>& state)
+  {
+    CHECK_NOTNULL(replicatedLog.get());
 
-        if (addressSpace.intersects(overlaySpace)) {
-          return Error("Found overlapping address spaces");
-        }
+    recovering = false;
 
-        addressSpace += overlaySpace;
+    if (!state.isReady()) {
+      LOG(WARNING) << "This " << self().id <<"might have been demoted."
+                   << "Aborting recovery of replicated log"
+                   <<(state.isDiscarded() ? "discarded"
+                       : state.failure());
 
-        return Nothing();
-    };
+      // The agents will re-register, and the next registration will
+      // retry the recovery.
+      registrations.clear();
+      metrics.registration_queue_depth.set(0);
+      return;
+    }
 
-    for (int i = 0; i < networkConfig.overlays_size(); i++) {
-      OverlayInfo overlay = networkConfig.overlays(i);
+    // A `None` implies that there is no `State` in the replicated log
+    // newer than the one we restored while following the log.
+    if (state.get().isSome()) {
+      restore(state.get().get());
+    }
 
-      if (overlays.contains(overlay.name())) {
-        return Error(
-            "Duplicate overlay configuration detected for overlay: " +
-            overlay.name());
-      }
+    recovered = true;
 
-      if (RESERVED_NETWORKS.contains(overlay.name())) {
-        return Error(
-          "Overlay network name: " + overlay.name() +
-          " is a reserved network name");
-      }
+    LOG(INFO) << "Moving " << self() << " to `RECOVERED` state with "
+              << agents.size() << " agents, processing "
+              << registrations.size() << " queued registrations";
 
-      // The overlay name is used to derive the Mesos bridge and
-      // Docker bridge names. Since, in Linux, network device names
-      // cannot excced 15 characters, we need to impose the limit on
-      // the overlay network name.
-      if (overlay.name().size() > MAX_OVERLAY_NAME) {
-        return Error(
-            "Overlay name: " + overlay.name() +
-            " too long cannot, exceed " + stringify(MAX_OVERLAY_NAME) +
-            "  characters    IntervalSet<uint8_t> ");
-      }
+    processRegistrations();
+  }
 
-      LOG(INFO) << "Configuring overlay network:" << overlay.name();
+  // Reads the `State` written to the replicated log by the leading
+  // master, while this master is not leading.
+  void follow()
+  {
+    CHECK_NOTNULL(replicatedLog.get());
 
-      // IPv4
-      Option<uint8_t> prefix = None();
-      Option<Network> address = None();
-      if (overlay.has_subnet()) {
-        Try<Network> _address =
-          Network::parse(overlay.subnet(), AF_INET);
+    if (recovering || recovered) {
+      process::delay(
+          REPLICATED_LOG_FOLLOW_INTERVAL,
+          self(),
+          &ManagerProcess::follow);
+      return;
+    }
 
-        if (_address.isError()) {
-          return Error(
-              "Unable to determine subnet for network: " +
-              _address.error());
-        }
+    replicatedLog->follow()
+      .onAny(defer(self(),
+                   &ManagerProcess::_follow,
+                   lambda::_1));
+  }
 
-        Try<Nothing> valid = updateAddressSpace(_address.get());
+  void _follow(const Future<Option<overlay::State>>& state)
+  {
+    if (!state.isReady()) {
+      // The local replica might not have learned all the positions
+      // written by the leading master yet, so we retry later.
+      VLOG(1) << "Unable to follow the replicated log: "
+              << (state.isDiscarded() ? "discarded" : state.failure());
+    } else if (state.get().isSome() && !recovered) {
+      restore(state.get().get());
+
+      VLOG(1) << "Followed the replicated log up to " << agents.size()
+              << " agents";
+    }
 
-        if (valid.isError()) {
-          return Error(
-              "Incorrect address space for the overlay network '" +
-              overlay.name() + "': " + valid.error());
-        }
-        
-        address = _address.get();
-        prefix = overlay.prefix();
-      }
+    process::delay(
+        REPLICATED_LOG_FOLLOW_INTERVAL,
+        self(),
+        &ManagerProcess::follow);
+  }
 
-      // IPv6
-      Option<uint8_t> prefix6 = None();
-      Option<Network> address6 = None();
-      if (overlay.has_subnet6()) {
-        Try<Network> _address6 = 
-          Network::parse(overlay.subnet6(), AF_INET6);
+  // Rebuilds the agents and the allocations of the overlays and the
+  // VTEP from a snapshot of the `State`.
+  void restore(const overlay::State& snapshot)
+  {
+    agents.clear();
+    networkState.clear_agents();
 
-        if (_address6.isError()) {
-          return Error(
-             "Unable to determine IPv6 subnet for network: " +
-              _address6.error());
-        }
+    // The allocations in progress were made from the allocations we
+    // are about to reset.
+    allocating.clear();
+    outdated.clear();
+    ++epoch;
 
-        Try<Nothing> valid6 = updateAddressSpace(_address6.get());
-      
-        if (valid6.isError()) {
-          return Error(
-              "Incorrect IPv6 address space for the overlay network '" +
-              overlay.name() + "': " + valid6.error());
-        }
+    restoreOverlays(snapshot);
+    assignVNIs(snapshot.network());
 
-        address6 = _address6.get();
-        prefix6 = overlay.prefix6();
-      }
+    Allocations allocations;
 
-      overlays.emplace(
-          overlay.name(),
-          Owned<Overlay>(new Overlay(
-            overlay.name(),
-            address,
-            address6,
-            prefix,
-            prefix6)));
+    // Only if the `network_config` is present does it imply that the
+    // overlay-master stored state in the replicated log, else  this
+    // is the first time an overlay-master is accessing the
+    // replicated log and hence the state will be empty.
+    if (!snapshot.has_network()) {
+      VLOG(1) << "No network state present, hence nothing to"
+              << " recover from replicated log";
+      restoreAllocations(allocations);
+      return;
     }
 
-    if (overlays.empty()) {
-      return Error(
-          "Could not find any overlay configuration. Specify at"
-          " least one overlay");
-    }
+    overlay::State _networkState = snapshot;
 
-    Storage* storage = nullptr;
-    Log* log = nullptr;
+    // Re-populate the agents, the overlay subnets that have been
+    // allocated, and the VTEP IP and VTEP MAC that have been
+    // allocated. We first walk all the agents and decode their
+    // addresses, and then reserve the addresses of all agents in bulk
+    // with a single sorted pass over each allocator.
+    //
+    // NOTE: The information stored in the replicated log should not
+    // have any errors. If it does, we drop the offending agent from
+    // the recovered state instead of aborting the failover; the
+    // agent will be allocated new addresses when it re-registers.
+    // This includes an agent whose subnet or VTEP IP conflicts with
+    // the addresses of an agent recovered before it, so that no two
+    // agents end up sharing an address.
 
-    // Check if we need to create the replicated log.
-    if (masterConfig.has_replicated_log_dir()) {
-      Try<Nothing> mkdir = os::mkdir(masterConfig.replicated_log_dir());
-      if (mkdir.isError()) {
-        return Error(
-            "Unable to create replicated log directory: " +
-            mkdir.error());
-      }
+    google::protobuf::RepeatedPtrField<AgentInfo> restored;
+    restored.Reserve(_networkState.agents_size());
 
-      LOG(INFO) << "Initializing the replicated log.";
+    for (int i = 0; i < _networkState.agents_size(); i++) {
+      AgentInfo* agentInfo = _networkState.mutable_agents(i);
 
-      // The ZK URL and Quorum can be specified through the JSON
-      // config or through environment variables.
-      Option<string> zkURL = None();
-      if (masterConfig.has_zk() && masterConfig.zk().has_url()) {
-           zkURL = masterConfig.zk().url();
-      } else {
-        zkURL = os::getenv(MESOS_ZK);
+      foreach (const AgentOverlayInfo& overlay, agentInfo->overlays()) {
+        generation = std::max(generation, overlay.generation());
       }
 
-      Option<uint32_t> quorum = None();
-      if (masterConfig.has_zk() && masterConfig.zk().has_quorum()) {
-          quorum = masterConfig.zk().quorum();
-      } else {
-        Option<string> _quorum = os::getenv(MESOS_QUORUM);
-        if (_quorum.isSome()) {
-          Try<uint32_t> result = numify<uint32_t>(_quorum.get());
-          if (result.isError()) {
-            return Error(
-                "Error parsing environment variable 'MESOS_QUORUM'(" +
-                _quorum.get() + "): " + result.error());
-          }
-
-          quorum = result.get();
-        }
+      // Clear the `State` of the overlays, and make sure the binary
+      // encoded addresses are present so that they get persisted
+      // with the next write to the replicated log.
+      Try<Nothing> decoded = decodeAgent(agentInfo, &allocations);
+      if (decoded.isError()) {
+        LOG(ERROR) << "Could not recover Agent " << agentInfo->ip()
+                   << ": " << decoded.error();
+        continue;
       }
 
-      if (zkURL.isSome() && quorum.isNone()) {
-        return Error(
-            "Cannot use replicated log with ZK URL '" + zkURL.get() +
-            "' without a quorum. Please specify quorum to be "
-            "used with zookeeper");
+      // NOTE: An agent without overlays has no VTEP either, so it is
+      // allocated a VTEP and the overlays as a new agent once it
+      // registers again.
+      if (agentInfo->overlays_size() == 0) {
+        LOG(INFO) << "Not recovering Agent " << agentInfo->ip()
+                  << " since none of its overlays exist anymore";
+        continue;
       }
 
-      if (zkURL.isSome() && quorum.isSome()) {
-        LOG(INFO)
-          << "Using replicated log with zookeeper URL "
-          << zkURL.get() << " with a quorum of " << quorum.get()
-          << " for leader election.";
+      Try<Agent> agent = Agent::create(*agentInfo);
+      if (agent.isError()) {
+        LOG(ERROR) << "Could not recover Agent: "<< agent.error();
+        continue;
+      }
 
-        Try<zookeeper::URL> url = zookeeper::URL::parse(zkURL.get());
-        if (url.isError()) {
-          return Error("Error parsing ZooKeeper URL: " + url.error());
-        }
+      agents.emplace(agent->getIP(), agent.get());
+      VLOG(1) << "Recovered agent: " << agent->getIP();
 
-        log = new Log(
-            (int)quorum.get(),
-            path::join(
-              masterConfig.replicated_log_dir(),
-              REPLICATED_LOG_STORE),
-            url.get().servers,
-            Seconds(masterConfig.zk().session_timeout()),
-            path::join(url.get().path, REPLICATED_LOG_STORE_REPLICAS),
-            url.get().authentication,
-            true,
-            "overlay/");
-      } else {
-        // Use replicated log without ZooKeeper.
-        LOG(INFO)
-          << "Using replicated log with local storage with a quorum of one.";
+      restored.Add()->Swap(agentInfo);
+    }
 
-        log = new Log(
-            1,
-            path::join(
-              masterConfig.replicated_log_dir(),
-              REPLICATED_LOG_STORE),
-            set<UPID>(),
-            true,
-            "overlay/");
-      }
+    _networkState.mutable_agents()->Swap(&restored);
 
-      storage = new LogStorage(log);
-    }
+    restoreAllocations(allocations);
 
-    Owned<mesos::state::protobuf::State> replicatedLog;
+    VLOG(1) << "Restored " << agents.size() << " agents out of "
+            << snapshot.agents_size()
+              << " agents stored in the replicated log";
 
-    if (storage != nullptr) {
-      replicatedLog = Owned<mesos::state::protobuf::State>(
-          new mesos::state::protobuf::State(storage));
-    }
+    // Recovery done. Copy the recovered state into the `State`
+    // object.
+    //
+    // NOTE: We are retaining the current configuration, which has
+    // the overlays restored by `restoreOverlays`, so that we can
+    // remember any new overlay networks that might have been added by
+    // the operator during the restart.
+    _networkState.mutable_network()->CopyFrom(networkState.network());
 
-    return Owned<ManagerProcess>(new ManagerProcess(
-          overlays,
-          vtepSubnet.get(),
-          vtepSubnet6,
-          vtepMACOUI.get(),
-          networkConfig,
-          replicatedLog,
-          storage,
-          log));
+    networkState.CopyFrom(_networkState);
   }
 
-  ~ManagerProcess()
+  // Rebuilds the definitions of the overlays from the overlays of the
+  // `MasterConfig` and the changes made to them at runtime that are
+  // stored in `snapshot`, and replaces the allocators of the overlays
+  // that have been added, resized or removed since.
+  //
+  // NOTE: The allocators are reset by `restoreAllocations`, and the
+  // VNIs are assigned by `assignVNIs`.
+  void restoreOverlays(const overlay::State& snapshot)
   {
-    LOG(INFO) << "Shutting down the master manager process...";
+    vector<OverlayInfo> infos;
+    foreach (const OverlayInfo& overlay, networkConfig.overlays()) {
+      if (std::count(
+              snapshot.removed_overlays().begin(),
+              snapshot.removed_overlays().end(),
+              overlay.name()) == 0) {
+        infos.push_back(overlay);
+      }
+    }
 
-    replicatedLog.reset();
+    // NOTE: The overlays of the `MasterConfig` have been validated
+    // when the master started.
+    Try<hashmap<string, Owned<Overlay>>> created = createOverlays(infos);
+    CHECK_SOME(created);
+
+    // The overlays of the `MasterConfig` might have been changed while
+    // the master was down, in which case a change made at runtime
+    // might conflict with them.
+    foreach (const OverlayInfo& overlay, snapshot.runtime_overlays()) {
+      const vector<OverlayInfo> _infos = withOverlay(infos, overlay);
+
+      Try<hashmap<string, Owned<Overlay>>> _created = createOverlays(_infos);
+      if (_created.isError()) {
+        LOG(ERROR) << "Unable to restore the overlay " << overlay.name()
+                   << " changed at runtime: " << _created.error();
+        continue;
+      }
 
-    if (storage != nullptr)  {
-      delete storage;
+      infos = _infos;
+      created = _created;
     }
 
-    if (log != nullptr)  {
-      delete log;
+    LinkedHashMap<string, OverlayInfo> _definitions;
+    foreach (const OverlayInfo& overlay, infos) {
+      _definitions.put(overlay.name(), overlay);
     }
-  }
 
+    foreach (const string& name, overlays.keys()) {
+      if (_definitions.contains(name) &&
+          sameAddressSpace(definitions.at(name), _definitions.at(name))) {
+        continue;
+      }
 
-protected:
-  virtual void initialize()
-  {
-    LOG(INFO) << "Adding route for '" << self().id << "/state'";
+      LOG(INFO) << "Removing the allocator of overlay " << name;
 
-    route("/state",
-          OVERLAY_HELP,
-          &ManagerProcess::state);
+      Owned<OverlayAllocatorProcess> allocator = overlays.at(name);
+      overlays.erase(name);
 
-    // When a new agent comes up or an existing agent reconnects with
-    // the master, it'll first send a `RegisterAgentMessage` to the
-    // master. The master will reply with `UpdateAgentNetworkMessage`.
-    install<RegisterAgentMessage>(&ManagerProcess::registerAgent);
+      // NOTE: The allocations in progress are stale, so the allocator
+      // is terminated before it processes them. Their results, if any,
+      // are dropped by the epoch checks.
+      process::terminate(allocator.get());
+      retired.push_back(allocator);
+    }
 
-    // When the agent finishes its configuration based on the content
-    // in `UpdateAgentNetworkMessage`, it'll reply the master with an
-    // `AgentRegisteredMessage`.
-    // TODO(jieyu): Master should retry `UpdateAgentNetworkMessage` in
-    // case the message gets dropped.
-    install<AgentRegisteredMessage>(&ManagerProcess::agentRegistered);
-  }
+    foreachpair (const string& name,
+                 const Owned<Overlay>& overlay,
+                 created.get()) {
+      if (overlays.contains(name)) {
+        continue;
+      }
 
-  void registerAgent(
-      const UPID& pid,
-      const RegisterAgentMessage& registerMessage)
-  {
-    LOG(INFO) << "Got registration from pid: " << pid;
+      LOG(INFO) << "Adding the allocator of overlay " << name;
 
-    if (replicatedLog.get() != nullptr) {
-      if (storedState.isNone() && !recovering) {
-        // We haven't started recovering.
-        LOG(INFO) << MASTER_MANAGER_PROCESS_ID << " moving to `RECOVERING`"
-          << " state . Hence, not sending an update to agent"
-          << pid;
-        recover();
-        return;
-      } else if (storedState.isNone() && recovering) {
-        // We are recovering. Drop the message, the agent will try to
-        // re-register.
-        LOG(INFO) << MASTER_MANAGER_PROCESS_ID << " in `RECOVERING`"
-          << " state . Hence, not sending an update to agent"
-          << pid;
-        return;
-      } // else -> `storedState.isSome` , we have recovered.
-    }
+      Owned<OverlayAllocatorProcess> allocator(
+          new OverlayAllocatorProcess(*overlay));
 
-    // Recovery complete.
-    Try<IP> agentIP = IP::convert(pid.address.ip);
-    if (agentIP.isError()) {
-      LOG(ERROR) << "Couldn't parse agent ip "
-                 << agentIP.error();
-      return;
+      process::spawn(allocator.get());
+      overlays.emplace(name, allocator);
     }
 
-    if (agents.contains(agentIP.get())) {
-      LOG(INFO) << "Agent " << pid << " re-registering.";
+    definitions = _definitions;
 
-      // Check if any new overlay need to be installed on the
-      // agent.
-      if (agents.at(agentIP.get()).addOverlays(
-            overlays,
-            registerMessage.network_config())) {
-        // We installed a new overlay on this agent.
-        update(Owned<Operation>(
-               new ModifyAgent(agents.at(agentIP.get()).getAgentInfo())))
-          .onAny(defer(self(),
-                 &ManagerProcess::_registerAgent,
-                 pid,
-                 agentIP.get(),
-                 lambda::_1));
+    networkState.mutable_runtime_overlays()->CopyFrom(
+        snapshot.runtime_overlays());
+    networkState.mutable_removed_overlays()->CopyFrom(
+        snapshot.removed_overlays());
+  }
 
-        return;
-      }
+private:
+  // The addresses allocated to the agents found in the replicated
+  // log, which are reserved in bulk once all the agents have been
+  // decoded.
+  struct Allocations
+  {
+    // Subnets allocated in each overlay, keyed by overlay name.
+    hashmap<string, vector<Network>> subnets;
+    hashmap<string, vector<Network>> subnets6;
 
-      // Ensure that the agent is added to the replicated log.
-      const string _agentIP = stringify(agentIP.get());
-      for (int i = 0; i < networkState.agents_size(); i++) {
-        if (_agentIP == networkState.agents(i).ip()) {
-          // Given that `networkState` already has this Agent, the
-          // information is already stored in replicated log and hence
-          // we can just send an "ACK" to the agent with the
-          // configuration info
-          _registerAgent(pid, agentIP.get(), true);
-          return;
-        }
-      }
+    vector<IP> vtepIPs;
+    vector<IP> vtepIPs6;
 
-      // The fact that we have reached here implies that the Agent
-      // exists in the `agents` database, but its information has not
-      // been updated in the replicated log. Simply drop this message
-      // since the Agent will re-register.
-      LOG(INFO) << "Agent " << pid
-                << " info has not been updated in the replicated log."
-                << " Hence dropping this registration request.";
-      return;
-    } else {
-      // New Agent.
-      LOG(INFO) << "New registration from pid: " << pid;
+    // The addresses above, to find the agents whose addresses
+    // conflict with the addresses of the agents decoded before them.
+    hashmap<string, IntervalSet<IP>> claimed;
+    hashmap<string, IntervalSet<IP>> claimed6;
 
-      Try<Network> vtepIP = vtep.allocateIP();
-      if (vtepIP.isError()) {
-        LOG(ERROR)
-          << "Unable to get VTEP IP for Agent: " << vtepIP.error()
-          << "Cannot fulfill registration for Agent: " << pid;
-        return;
-      }
-      LOG(INFO) << "Allocated VTEP IP : " << vtepIP.get();
+    IntervalSet<IP> claimedVtepIPs;
+    IntervalSet<IP> claimedVtepIPs6;
+  };
 
-      // IPv6
-      Option<Network> vtepIP6 = None();
-      if (vtep.network6.isSome()) {
-        Try<Network> _vtepIP6 = vtep.allocateIP6();
-        if (_vtepIP6.isError()) {
-          LOG(ERROR) 
-           << "Unable to get VTEP IPv6 for Agent: " << _vtepIP6.error()
-           << "Cannot fulfill registration for Agent: " << pid;
-          return;
-        }
-        
-        vtepIP6 = _vtepIP6.get();
-        LOG(INFO) << "Allocated VTEP IPv6 : " << vtepIP6.get();
-      }
+  // Resets the allocators to `allocations`, each on its own actor.
+  //
+  // NOTE: The allocators process the allocations we dispatch once
+  // they have been reset, since the dispatches of an actor are
+  // processed in order.
+  void restoreAllocations(const Allocations& allocations)
+  {
+    foreachpair (const string& name,
+                 const Owned<OverlayAllocatorProcess>& overlay,
+                 overlays) {
+      process::dispatch(
+          overlay->self(),
+          &OverlayAllocatorProcess::restore,
+          allocations.subnets.get(name).getOrElse(vector<Network>()),
+          allocations.subnets6.get(name).getOrElse(vector<Network>()));
+    }
 
-      Try<IP> _vtepIP = IP::convert(vtepIP.get().address());
-      if (_vtepIP.isError()) {
-        LOG(ERROR) << "Couldn't parse vtep IP " << _vtepIP.error()
-                   << "Cannot fulfill registration for Agent: " << pid;
-        return;
-      }
+    process::dispatch(
+        vtep->self(),
+        &VtepAllocatorProcess::restore,
+        allocations.vtepIPs,
+        allocations.vtepIPs6);
+  }
 
-      Try<net::MAC> vtepMAC = vtep.generateMAC(_vtepIP.get());
-      if (vtepMAC.isError()) {
-        LOG(ERROR)
-          << "Unable to get VTEP MAC for Agent: " << vtepMAC.error()
-          << "Cannot fulfill registration for Agent: " << pid;
-          return;
+  // Assigns a VNI to every overlay: the VNI the operator configured
+  // the overlay with, if any, else the VNI the overlay was assigned
+  // in the `stored` configuration, e.g., before a failover, else the
+  // first free VNI of the `vni_range`, if any. The overlays that are
+  // not assigned a VNI share the `DEFAULT_VNI`, which is never
+  // allocated out of the range.
+  //
+  // NOTE: This happens before any overlay is allocated to an agent,
+  // either when the master starts or when it restores the `State`.
+  void assignVNIs(const NetworkConfig& stored)
+  {
+    vnis.clear();
+
+    foreachvalue (const OverlayInfo& definition, definitions) {
+      if (definition.has_vni()) {
+        vnis[definition.name()] = definition.vni();
       }
-      VLOG(1) << "Allocated VTEP MAC : " << vtepMAC.get();
+    }
 
-      VxLANInfo vxlan;
-      vxlan.set_vni(1024);
-      vxlan.set_vtep_name("vtep1024");
-      vxlan.set_vtep_ip(stringify(vtepIP.get()));
-      vxlan.set_vtep_mac(stringify(vtepMAC.get()));
-      if (vtepIP6.isSome()) {
-        vxlan.set_vtep_ip6(stringify(vtepIP6.get()));
+    hashset<uint32_t> used;
+    used.insert(DEFAULT_VNI);
+
+    foreachvalue (uint32_t vni, vnis) {
+      used.insert(vni);
+    }
+
+    foreach (const OverlayInfo& overlay, stored.overlays()) {
+      if (!overlay.has_vni() ||
+          !definitions.contains(overlay.name()) ||
+          vnis.contains(overlay.name()) ||
+          used.contains(overlay.vni())) {
+        continue;
       }
 
-      BackendInfo backend;
-      backend.mutable_vxlan()->CopyFrom(vxlan);
+      vnis[overlay.name()] = overlay.vni();
+      used.insert(overlay.vni());
+    }
+
+    if (networkConfig.has_vni_range()) {
+      uint32_t next = networkConfig.vni_range().begin();
 
-      agents.emplace(agentIP.get(), Agent(agentIP.get(), backend));
+      foreachvalue (const OverlayInfo& definition, definitions) {
+        if (vnis.contains(definition.name())) {
+          continue;
+        }
 
-      Agent* agent = &(agents.at(agentIP.get()));
+        while (next <= networkConfig.vni_range().end() &&
+               used.contains(next)) {
+          next++;
+        }
 
-      agent->addOverlays(overlays, registerMessage.network_config());
+        if (next > networkConfig.vni_range().end()) {
+          LOG(ERROR) << "Unable to allocate a VNI to overlay "
+                     << definition.name() << ": the VNI range is exhausted,"
+                     << " hence it shares the VNI " << DEFAULT_VNI;
+          continue;
+        }
 
-      // Update the `networkState in the replicated log before
-      // sending the overlay configuration to the Agent.
-      update(Owned<Operation>(
-            new AddAgent(agent->getAgentInfo())))
-        .onAny(defer(self(),
-              &ManagerProcess::_registerAgent,
-              pid,
-              agentIP.get(),
-              lambda::_1));
-      return;
+        vnis[definition.name()] = next;
+        used.insert(next);
+      }
     }
 
-    UNREACHABLE();
+    NetworkConfig* network = networkState.mutable_network();
+    network->clear_overlays();
+
+    foreachkey (const string& name, definitions) {
+      network->add_overlays()->CopyFrom(getOverlayInfo(name));
+    }
   }
 
-  // Will be called once the operation is successfully applied to the
-  // `networkState`.
-  void _registerAgent(const UPID& pid,
-                      const IP& agentIP, 
-                      const Future<bool>& result)
+  // Returns the first VNI of the `vni_range` that is not assigned to
+  // any overlay, if any.
+  Option<uint32_t> allocateVNI() const
   {
-    if (!result.isReady()) {
-      LOG(WARNING) << "Unable to process registration request from "
-                   << pid << " due to: "
-                   << (result.isDiscarded() ? "discarded" : result.failure());
-      return;
+    if (!networkConfig.has_vni_range()) {
+      return None();
     }
 
-    CHECK(agents.contains(agentIP));
-
-    list<AgentOverlayInfo> _overlays = agents.at(agentIP).getOverlays();
-
-    // Create the network update message and send it to the Agent.
-    UpdateAgentOverlaysMessage update;
+    hashset<uint32_t> used;
+    used.insert(DEFAULT_VNI);
 
-    foreach(const AgentOverlayInfo& overlay, _overlays) {
-      update.add_overlays()->CopyFrom(overlay);
+    foreachvalue (uint32_t vni, vnis) {
+      used.insert(vni);
     }
 
-    // Clear the state for all overlays in this update.
-    for (int i = 0; i < update.overlays_size(); i++) {
-      update.mutable_overlays(i)->clear_state();
+    for (uint32_t vni = networkConfig.vni_range().begin();
+         vni <= networkConfig.vni_range().end();
+         vni++) {
+      if (!used.contains(vni)) {
+        return vni;
+      }
     }
 
-    send(pid, update);
+    return None();
   }
 
-  void agentRegistered(const UPID& from, const AgentRegisteredMessage& message)
+  vector<OverlayInfo> getDefinitions() const
   {
-    Try<IP> _agentIP = IP::convert(from.address.ip);
-    if (_agentIP.isError()) {
-      LOG(ERROR) << "Couldn't parse agent IP " << _agentIP.error()
-                 << " Got ACK from " << from;
-      return;
+    vector<OverlayInfo> _definitions;
+    foreachvalue (const OverlayInfo& definition, definitions) {
+      _definitions.push_back(definition);
     }
 
-    if(agents.contains(_agentIP.get())) {
-      LOG(INFO) << "Got ACK for addition of networks from " << from;
-      for(int i = 0; i < message.overlays_size(); i++) {
-        agents.at(_agentIP.get()).updateOverlayState(message.overlays(i));
-      }
+    return _definitions;
+  }
 
-      // We don't need to store the "state" of an overlay network on
-      // an agent in the replicated log so go ahead and update the
-      // `networkState` without updating the overlay replicated log.
-      for (int i = 0; i < networkState.agents_size(); i++) {
-        if (stringify(_agentIP.get()) == networkState.agents(i).ip()) {
-          networkState.mutable_agents(i)->CopyFrom(
-              agents.at(_agentIP.get()).getAgentInfo());
+  // Returns the definition of the overlay `name` with the VNI
+  // assigned to it, if any.
+  OverlayInfo getOverlayInfo(const string& name) const
+  {
+    OverlayInfo overlay = definitions.at(name);
 
-          LOG(INFO) << "Sending register ACK to: " << from;
-          send(from, AgentRegisteredAcknowledgement());
-          return;
-        }
-      }
-      LOG(ERROR) << "Unable to find the registered agent in the `networkState`";
+    if (vnis.contains(name)) {
+      overlay.set_vni(vnis.at(name));
     } else {
-      LOG(ERROR) << "Got ACK for network message for non-existent PID "
-                 << from;
+      overlay.clear_vni();
     }
+
+    return overlay;
   }
 
-  Future<http::Response> state(const http::Request& request)
+  // Sets the VNI assigned to the overlay of `overlay`, and the VNI of
+  // its backend. Returns whether the VNI of the backend changed.
+  bool assignVNI(AgentOverlayInfo* overlay) const
   {
-    VLOG(1) << "Responding to `state` endpoint";
+    const string& name = overlay->info().name();
 
-    return http::OK(
-        JSON::protobuf(networkState),
-        request.url.query.get("jsonp"));
-  }
+    if (vnis.contains(name)) {
+      overlay->mutable_info()->set_vni(vnis.at(name));
+    } else {
+      overlay->mutable_info()->clear_vni();
+    }
 
-  void recover()
-  {
-    // Nothing to recover.
-    CHECK_NOTNULL(replicatedLog.get());
+    if (!overlay->backend().has_vxlan()) {
+      return false;
+    }
 
-    recovering = true;
+    const uint32_t vni = overlay->backend().vxlan().vni();
 
-    replicatedLog->fetch<overlay::State>(REPLICATED_LOG_STORE_KEY)
-      .onAny(defer(self(),
-                   &ManagerProcess::_recover,
-                   lambda::_1));
+    setBackendVNI(overlay);
+
+    return overlay->backend().vxlan().vni() != vni;
   }
 
-  void _recover(Future<Variable<overlay::State>> variable)
+  // Decodes the addresses allocated to `agentInfo` into
+  // `allocations`, clearing the state of its overlays, removing the
+  // overlays that no longer exist and filling in any missing binary
+  // encoded address. Nothing is added to
+  // `allocations` if any of the addresses of the agent is invalid, or
+  // has already been allocated to another agent.
+  Try<Nothing> decodeAgent(AgentInfo* agentInfo, Allocations* allocations)
   {
-    CHECK_NOTNULL(replicatedLog.get());
+    Allocations agent;
 
-    if (!variable.isReady()) {
-      LOG(WARNING) << "This " << self().id <<"might have been demoted."
-                   << "Aborting recovery of replicated log"
-                   <<(variable.isDiscarded() ? "discarded"
-                       : variable.failure());
+    for (int j = 0; j < agentInfo->overlays_size(); j++) {
+      AgentOverlayInfo* overlay = agentInfo->mutable_overlays(j);
+      const string& name = overlay->info().name();
 
-      return;
-    }
+      overlay->clear_state();
 
-    overlay::State _networkState = variable.get().get();
+      // The overlay might have been removed from the configuration
+      // while the master was down, in which case its allocation is
+      // dropped from the agent.
+      if (!overlays.contains(name)) {
+        LOG(WARNING) << "Agent " << agentInfo->ip() << " has an"
+                     << " allocation in unknown overlay " << name
+                     << ", removing it";
 
-    // Only if the `network_config` is present does it imply that the
-    // overlay-master stored state in the replicated log, else  this
-    // is the first time an overlay-master is accessing the
-    // replicated log and hence the state will be empty.
-    if (!_networkState.has_network()) {
-      LOG(INFO) << "No network state present, hence nothing to"
-                << " recover from replicated log";
+        agentInfo->mutable_overlays()->DeleteSubrange(j--, 1);
+        continue;
+      }
 
-      // Update the `storeState` variable so that we know where to
-      // update the `State` in the replicated log.
-      storedState = variable.get();
+      // The VNI of the overlay might have been changed by the operator
+      // while the master was down, in which case the agent needs to
+      // be sent the overlay again.
+      if (assignVNI(overlay)) {
+        overlay->set_generation(++generation);
+      }
 
-      LOG(INFO) << "Moving " << self() << " to `RECOVERED` state.";
-      return;
-    }
+      // IPv4
+      if (overlay->has_subnet()) {
+        Try<Network> network =
+          decodeNetwork(overlay->subnet_bin(), overlay->subnet(), AF_INET);
 
-    // Re-populate the agents, the overlay subnets that have been
-    // allocated, and the VTEP IP and VTEP MAC that have been
-    // allocated. The information stored in the replicated log should
-    // not have any errors.
-    for (int i = 0; i < _networkState.agents_size(); i++) {
-      const AgentInfo& agentInfo = _networkState.agents(i);
+        if (network.isError()) {
+          return Error(
+              "Unable to decode the subnet " + overlay->subnet() + ": " +
+              network.error());
+        }
 
-      // Clear the `State` of the `AgentInfo`
-      Try<Agent> agent = Agent::create(agentInfo);
-      if (agent.isError()) {
-        LOG(ERROR) << "Could not recover Agent: "<< agent.error();
-        abort();
+        overlay->set_subnet_bin(network->encode());
+
+        // Reserve the subnet the agent's network belongs to.
+        agent.subnets[name].push_back(
+            Network(network->begin(), network->prefix()));
       }
 
-      agents.emplace(agent->getIP(), agent.get());
-      VLOG(1) << "Recovered agent: " << agent->getIP();
+      // IPv6
+      if (overlay->has_subnet6()) {
+        Try<Network> network6 =
+          decodeNetwork(overlay->subnet6_bin(), overlay->subnet6(), AF_INET6);
 
-      for (int j = 0; j < agentInfo.overlays_size(); j++) {
-        const AgentOverlayInfo& overlay = agentInfo.overlays(j);
+        if (network6.isError()) {
+          return Error(
+              "Unable to decode the IPv6 subnet " + overlay->subnet6() +
+              ": " + network6.error());
+        }
 
-        // clear the overlay state.
-        _networkState.mutable_agents(i)->mutable_overlays(j)->clear_state();
+        overlay->set_subnet6_bin(network6->encode());
 
-        // IPv4
-        if (overlay.has_subnet()) {
-          Try<Network> network = Network::parse(
-              overlay.subnet(),
-              AF_INET);
+        agent.subnets6[name].push_back(
+            Network(network6->begin(), network6->prefix()));
+      }
 
-          if (network.isError()) {
-            LOG(ERROR) << "Unable to parse the retrieved network: "
-                       << overlay.subnet() << ": "
-                       << network.error();
+      VxLANInfo* vxlan = overlay->mutable_backend()->mutable_vxlan();
 
-            abort();
-          }
+      Option<Network> vtepIP = None();
+      if (vxlan->has_vtep_ip()) {
+        Try<Network> _vtepIP =
+          decodeNetwork(vxlan->vtep_ip_bin(), vxlan->vtep_ip(), AF_INET);
 
-          // We should already have this particular overlay at bootup.
-          CHECK(overlays.contains(overlay.info().name()));
+        if (_vtepIP.isError()) {
+          return Error(
+              "Unable to decode the VTEP IP " + vxlan->vtep_ip() + ": " +
+              _vtepIP.error());
+        }
 
-          LOG(INFO) << "reserving IPv4 " << stringify(network.get());
-          Try<Nothing> result = overlays.at(overlay.info().name())->reserve(network.get());
-          if (result.isError()) {
-            LOG(ERROR) << "Unable to reserve the subnet " << network.get()
-                       << ": " << result.error();
+        vxlan->set_vtep_ip_bin(_vtepIP->encode());
+        vtepIP = _vtepIP.get();
+      }
 
-            abort();
-          }
+      Option<Network> vtepIP6 = None();
+      if (vxlan->has_vtep_ip6()) {
+        Try<Network> _vtepIP6 =
+          decodeNetwork(vxlan->vtep_ip6_bin(), vxlan->vtep_ip6(), AF_INET6);
+
+        if (_vtepIP6.isError()) {
+          return Error(
+              "Unable to decode the VTEP IPv6 " + vxlan->vtep_ip6() + ": " +
+              _vtepIP6.error());
         }
 
-        // IPv6
-        if (overlay.has_subnet6()) {
-          Try<Network> network6 = Network::parse(
-              overlay.subnet6(),
-              AF_INET6);
-
-          if (network6.isError()) {
-            LOG(ERROR) << "Unable to parse the retrieved network: "
-              << overlay.subnet6() << ": "
-              << network6.error();
-            abort();
+        vxlan->set_vtep_ip6_bin(_vtepIP6->encode());
+        vtepIP6 = _vtepIP6.get();
+      }
+
+      // All overlay instances on an Agent share the same VTEP IP and
+      // MAC, so we need to reserve them only once.
+      if (agent.vtepIPs.empty() && agent.vtepIPs6.empty()) {
+        if (vtepIP.isSome()) {
+          Try<IP> ip = IP::convert(vtepIP->address());
+          if (ip.isError()) {
+            return Error(ip.error());
           }
 
-          LOG(INFO) << "reserving IPv6 " << stringify(network6.get());
-          Try<Nothing> result = overlays.at(overlay.info().name())->reserve6(network6.get());
-          if (result.isError()) {
-            LOG(ERROR) << "Unable to reserve the IPv6 subnet " << network6.get()
-                       << ": " << result.error();
-            abort();
+          agent.vtepIPs.push_back(ip.get());
+        }
+
+        if (vtepIP6.isSome()) {
+          Try<IP> ip6 = IP::convert(vtepIP6->address());
+          if (ip6.isError()) {
+            return Error(ip6.error());
           }
+
+          agent.vtepIPs6.push_back(ip6.get());
         }
+      }
+    }
 
-        // All overlay instances on an Agent share the same VTEP IP
-        // and MAC. Hence, the backend information on all the overlay
-        // information would be the same. We therefore need to reserve
-        // the VTEP IP and MAC only once.
-        if (j == 0) {
-          Try<Network> vtepIP =
-            Network::parse(overlay.backend().vxlan().vtep_ip(), AF_INET);
+    Try<Nothing> claimed = claim(agent, allocations);
+    if (claimed.isError()) {
+      return claimed;
+    }
 
-          if (vtepIP.isError()) {
-            LOG(ERROR) << "Unable to parse the retrieved `vtepIP`: "
-                       << overlay.backend().vxlan().vtep_ip() << ": "
-                       << vtepIP.error();
+    foreachpair (const string& name,
+                 const vector<Network>& subnets,
+                 agent.subnets) {
+      vector<Network>& all = allocations->subnets[name];
+      all.insert(all.end(), subnets.begin(), subnets.end());
+    }
 
-            abort();
-          }
+    foreachpair (const string& name,
+                 const vector<Network>& subnets6,
+                 agent.subnets6) {
+      vector<Network>& all = allocations->subnets6[name];
+      all.insert(all.end(), subnets6.begin(), subnets6.end());
+    }
 
-          // NOTE: We only need to reserve the VTEP IP and not the
-          // VTEP MAC since the VTEP MAC is derived from the VTEP IP.
-          // Look at the `generateMAC` method in `VTEP` to see how
-          // this is done.
-          LOG(INFO) << "Reserving VTEP IP: " << vtepIP.get();
-          Try<Nothing> result = vtep.reserve(vtepIP.get());
-          if (result.isError()) {
-            LOG(ERROR) << "Unable to reserve VTEP IP: "
-                       << vtepIP.get() << ": " << result.error();
+    allocations->vtepIPs.insert(
+        allocations->vtepIPs.end(),
+        agent.vtepIPs.begin(),
+        agent.vtepIPs.end());
 
-            abort();
-          }
+    allocations->vtepIPs6.insert(
+        allocations->vtepIPs6.end(),
+        agent.vtepIPs6.begin(),
+        agent.vtepIPs6.end());
 
-          // IPv6
-          if (overlay.backend().vxlan().has_vtep_ip6()) {
-            Try<Network> vtepIP6 =
-              Network::parse(overlay.backend().vxlan().vtep_ip6(), AF_INET6);
-
-            if (vtepIP6.isError()) {
-              LOG(ERROR) << "Unable to parse the retrieved `vtep IPv6`: "
-                << overlay.backend().vxlan().vtep_ip6() << ": "
-                << vtepIP6.error();
-              abort();
-            }
-
-            LOG(INFO) << "Reserving VTEP IPv6: " << vtepIP6.get();
-            result = vtep.reserve6(vtepIP6.get());
-            if (result.isError()) {
-              LOG(ERROR) << "Unable to reserve VTEP IPv6: "
-                         << vtepIP6.get() << ": " << result.error();
-              abort();
-            }
-          }
+    return Nothing();
+  }
+
+  // Claims the addresses of `agent` in `allocations`. Returns an
+  // `Error` without claiming any address if a subnet of `agent`
+  // overlaps with a subnet, or a VTEP IP of `agent` is the VTEP IP, of
+  // an agent claimed before.
+  static Try<Nothing> claim(const Allocations& agent, Allocations* allocations)
+  {
+    auto space = [](const Network& network) -> Interval<IP> {
+      return (Bound<IP>::closed(network.begin()),
+              Bound<IP>::closed(network.end()));
+    };
+
+    foreachpair (const string& name,
+                 const vector<Network>& subnets,
+                 agent.subnets) {
+      foreach (const Network& subnet, subnets) {
+        if (allocations->claimed[name].intersects(space(subnet))) {
+          return Error(
+              "The subnet " + stringify(subnet) + " overlaps with the"
+              " subnet of another agent in overlay " + name);
         }
       }
     }
 
-    // Recovery done. Copy the recovered state into the `State`
-    // object.
-    //
-    // NOTE: We are retaining the current configuration so that we can
-    // remember any new overlay networks that might have been added by
-    // the operator during the restart.
-    _networkState.mutable_network()->CopyFrom(networkState.network());
+    foreachpair (const string& name,
+                 const vector<Network>& subnets6,
+                 agent.subnets6) {
+      foreach (const Network& subnet6, subnets6) {
+        if (allocations->claimed6[name].intersects(space(subnet6))) {
+          return Error(
+              "The IPv6 subnet " + stringify(subnet6) + " overlaps with"
+              " the IPv6 subnet of another agent in overlay " + name);
+        }
+      }
+    }
 
-    networkState.CopyFrom(_networkState);
+    foreach (const IP& ip, agent.vtepIPs) {
+      if (allocations->claimedVtepIPs.contains(ip)) {
+        return Error(
+            "The VTEP IP " + stringify(ip) + " is allocated to another"
+            " agent");
+      }
+    }
 
-    // Update the `storeState` variable so that we know where to
-    // update the `State` in the replicated log.
-    storedState = variable.get();
+    foreach (const IP& ip6, agent.vtepIPs6) {
+      if (allocations->claimedVtepIPs6.contains(ip6)) {
+        return Error(
+            "The VTEP IPv6 " + stringify(ip6) + " is allocated to another"
+            " agent");
+      }
+    }
 
-    LOG(INFO) << "Moving " << self() << " to `RECOVERED` state.";
-    return;
+    foreachpair (const string& name,
+                 const vector<Network>& subnets,
+                 agent.subnets) {
+      foreach (const Network& subnet, subnets) {
+        allocations->claimed[name] += space(subnet);
+      }
+    }
+
+    foreachpair (const string& name,
+                 const vector<Network>& subnets6,
+                 agent.subnets6) {
+      foreach (const Network& subnet6, subnets6) {
+        allocations->claimed6[name] += space(subnet6);
+      }
+    }
+
+    foreach (const IP& ip, agent.vtepIPs) {
+      allocations->claimedVtepIPs += ip;
+    }
+
+    foreach (const IP& ip6, agent.vtepIPs6) {
+      allocations->claimedVtepIPs6 += ip6;
+    }
+
+    return Nothing();
   }
 
-private:
   bool recovering;
+  bool recovered;
   bool storing;
 
-  hashmap<string, Owned<Overlay>> overlays;
+  // The allocators of the overlays, keyed by overlay name, and of the
+  // VTEPs.
+  hashmap<string, Owned<OverlayAllocatorProcess>> overlays;
+  Owned<VtepAllocatorProcess> vtep;
+
+  // The allocators of the overlays that have been removed. They are
+  // terminated without waiting for them, since that would block this
+  // process, and are only waited for when this process is destroyed.
+  vector<Owned<OverlayAllocatorProcess>> retired;
+
   hashmap<IP, Agent> agents;
 
-  Owned<mesos::state::protobuf::State> replicatedLog;
+  // The registrations waiting to be processed, in the order they were
+  // received, keyed by agent IP. Registrations received while
+  // recovering wait here until the recovery completes.
+  struct Registration
+  {
+    UPID pid;
+    RegisterAgentMessage message;
+  };
+
+  const uint32_t maxQueuedRegistrations;
+  LinkedHashMap<IP, Registration> registrations;
 
-  Option<Variable<overlay::State>> storedState;
+  // The agents whose overlays are being allocated, whose registrations
+  // are dropped until the allocation completes.
+  hashset<IP> allocating;
 
-  overlay::State networkState;
+  // Incremented whenever the allocations are restored, which makes
+  // the results of the allocations in progress stale.
+  uint64_t epoch;
+
+  // Admission control of the registrations, see `admit`.
+  struct Admission
+  {
+    // When the agent was admitted.
+    Time admitted;
+
+    // When the agent last sent a registration.
+    Time seen;
+  };
+
+  const uint32_t maxConcurrentRegistrations;
+  hashmap<IP, Admission> admissions;
+
+  // The agents whose registration has been deferred, in the order
+  // they were deferred.
+  LinkedHashMap<IP, UPID> deferred;
 
-  // We need to keep track of `storage` and `log`, since we will need
-  // to free them up when the master manager process is deleted.
-  Storage* storage;
+  // Moving average of the time between the admission of a
+  // registration and its acknowledgement.
+  Duration registrationTime;
 
+  // The last configuration generation assigned to an agent's overlays.
+  //
+  // NOTE: This is initialized with the current time (in microseconds)
+  // so that a master that doesn't use the replicated log never
+  // re-issues a generation issued before it restarted.
+  uint64_t generation;
+
+  // The version of the peer table sent to the agents, and the agents
+  // that receive its updates, i.e., the agents that have acknowledged
+  // their registration with this master.
+  //
+  // NOTE: The version is initialized like `generation`, so that the
+  // versions of different masters are unlikely to collide.
+  uint64_t peerVersion;
+  hashmap<IP, UPID> peerSubscribers;
+
+  Owned<Store> replicatedLog;
+
+  overlay::State networkState;
+
+  // We need to keep track of `log`, since we will need to free it up
+  // when the master manager process is deleted.
   Log* log;
 
   // The set of operations that need to be performed on the
   // `networkState` before writing to the replicated log.
   std::deque<Owned<Operation>> operations;
 
-  Vtep vtep;
+  // Controls how many of the queued `operations` are written to the
+  // replicated log in a single batch, and for how long a batch waits
+  // for more operations.
+  const GroupCommitConfig groupCommit;
+
+  // Set while a partially filled batch is waiting for `max_delay_ms`
+  // to expire.
+  Option<Timer> commitTimer;
+
+  // The network configuration of the `MasterConfig`. The overlays
+  // added, resized and removed at runtime are applied on top of its
+  // overlays, see `restoreOverlays`.
+  const NetworkConfig networkConfig;
+
+  // The principals allowed to change the overlays, if any.
+  const hashset<string> principals;
+
+  // The overlays as the operator defined them, either in the
+  // `MasterConfig` or through the `overlays` endpoint, in the order
+  // they were defined, and the VNIs assigned to the overlays, keyed
+  // by overlay name. See `assignVNIs`.
+  LinkedHashMap<string, OverlayInfo> definitions;
+  hashmap<string, uint32_t> vnis;
+
+  // The agents that could not be sent the overlays added at runtime,
+  // since their registration was in progress. They are sent the
+  // overlays once they acknowledge their registration.
+  hashset<IP> outdated;
+
+  Metrics metrics;
 
   ManagerProcess(
       const hashmap<string, Owned<Overlay>>& _overlays,
-      const Network& vtepSubnet,
+      const Option<Network>& vtepSubnet,
       const Option<Network>& vtepSubnet6,
       const net::MAC& vtepMACOUI,
       const NetworkConfig& _networkConfig,
-      const Owned<mesos::state::protobuf::State> _replicatedLog,
-      Storage* _storage,
+      const GroupCommitConfig& _groupCommit,
+      const uint32_t _maxQueuedRegistrations,
+      const uint32_t _maxConcurrentRegistrations,
+      const hashset<string>& _principals,
+      const Owned<Store> _replicatedLog,
       Log* _log)
     : ProcessBase("overlay-master"),
       recovering(false),
+      recovered(false),
       storing(false),
-      overlays(_overlays),
+      vtep(new VtepAllocatorProcess(
+          Vtep(vtepSubnet, vtepSubnet6, vtepMACOUI))),
+      maxQueuedRegistrations(_maxQueuedRegistrations),
+      epoch(0),
+      maxConcurrentRegistrations(_maxConcurrentRegistrations),
+      registrationTime(Seconds(1)),
+      generation(Clock::now().duration().us()),
+      peerVersion(Clock::now().duration().us()),
       replicatedLog(_replicatedLog),
-      storedState(None()),
-      storage(_storage),
       log(_log),
-      vtep(vtepSubnet, vtepSubnet6, vtepMACOUI)
+      groupCommit(_groupCommit),
+      networkConfig(_networkConfig),
+      principals(_principals)
   {
+    foreachpair (const string& name,
+                 const Owned<Overlay>& overlay,
+                 _overlays) {
+      overlays.emplace(
+          name,
+          Owned<OverlayAllocatorProcess>(
+              new OverlayAllocatorProcess(*overlay)));
+    }
+
     networkState.mutable_network()->CopyFrom(_networkConfig);
+
+    foreach (const OverlayInfo& overlay, _networkConfig.overlays()) {
+      definitions.put(overlay.name(), overlay);
+    }
+
+    assignVNIs(NetworkConfig());
   };
 
   // Updates the `networkState` with the operation provided. If we are
   // using the replicated log we will `queue` the operation and invoke
-  // `store, else we will apply the operation immediately.
+  // `commit`, else we will apply the operation immediately.
   // In case the replicated log is being used, the stored operation is
   // applied on a copy of `networkState` and the mutated `State` is
   // written into the overlay replicated log. On a successful write
@@ -1709,71 +4192,144 @@ private:
       return result.get();
     }
 
+    operation->queued = Clock::now();
     operations.push_back(operation);
+    ++metrics.operations;
+
     Future<bool> future = operation->future();
 
-    if (!storing) {
+    commit();
+
+    return future;
+  }
+
+  // Writes the next batch of queued `operations` to the replicated
+  // log. A batch is written once it holds `max_operations`, or once
+  // its oldest operation has waited for `max_delay_ms`, whichever
+  // comes first. Only one batch is written at a time; operations
+  // queued while a write is in flight are picked up when it
+  // completes.
+  void commit()
+  {
+    if (storing || operations.empty()) {
+      return;
+    }
+
+    const Duration maxDelay = Milliseconds(groupCommit.max_delay_ms());
+    const Duration waited = Clock::now() - operations.front()->queued;
+
+    if (operations.size() >= groupCommit.max_operations() ||
+        waited >= maxDelay) {
       store();
+      return;
     }
 
-    return future;
+    if (commitTimer.isNone()) {
+      commitTimer = process::delay(
+          maxDelay - waited,
+          self(),
+          &ManagerProcess::_commit);
+    }
+  }
+
+  void _commit()
+  {
+    commitTimer = None();
+    commit();
   }
 
   void store()
   {
       // We should not be trying to store to the replicated log till
       // recovery is complete.
-      CHECK(storedState.isSome());
+      CHECK(recovered);
 
       storing = true;
 
+      if (commitTimer.isSome()) {
+        Clock::cancel(commitTimer.get());
+        commitTimer = None();
+      }
+
       CHECK_NOTNULL(replicatedLog.get());
 
       overlay::State _networkState;
       _networkState.CopyFrom(networkState);
 
-      foreach (Owned<Operation> operation, operations) {
+      const Time started = Clock::now();
+
+      std::deque<Owned<Operation>> batch;
+      while (!operations.empty() &&
+             batch.size() < groupCommit.max_operations()) {
+        Owned<Operation> operation = operations.front();
+        operations.pop_front();
+
+        metrics.queue_wait_ms.set((started - operation->queued).ms());
+
         (*operation)(&_networkState, &agents);
+        batch.push_back(operation);
       }
 
+      ++metrics.batches;
+      metrics.batch_size.set(batch.size());
 
-      Variable<overlay::State> stateVariable = storedState.get();
-      stateVariable = stateVariable.mutate(_networkState);
+      VLOG(1) << "Writing a batch of " << batch.size() << " operations"
+              << " to the replicated log, " << operations.size()
+              << " operations still queued";
 
-      replicatedLog->store(stateVariable)
-        .onAny(defer(self(), &ManagerProcess::_store, lambda::_1, operations));
-
-      operations.clear();
+      replicatedLog->store(_networkState)
+        .onAny(defer(self(),
+                     &ManagerProcess::_store,
+                     lambda::_1,
+                     _networkState,
+                     batch,
+                     started));
+
+      // Fill the next batch with the queued registrations while this
+      // one is written.
+      //
+      // NOTE: We dispatch since `store` is called while registrations
+      // are being processed.
+      process::dispatch(self(), &ManagerProcess::processRegistrations);
   }
 
   void _store(
-      const Future<Option<Variable<overlay::State>>>& variable,
-      std::deque<Owned<Operation>> applied)
+      const Future<bool>& stored,
+      const overlay::State& storedNetworkState,
+      std::deque<Owned<Operation>> applied,
+      const Time& started)
   {
     storing = false;
 
-    if (!variable.isReady()) {
-      LOG(WARNING) << "Not updating `State` due to failure to write to log."
-                   << (variable.isDiscarded() ? "discarded"
-                       : variable.failure());
-      demote();
-      return;
-    }
+    metrics.store_latency_ms.set((Clock::now() - started).ms());
+
+    if (!stored.isReady() || !stored.get()) {
+      if (!stored.isReady()) {
+        LOG(WARNING) << "Not updating `State` due to failure to write to log."
+                     << (stored.isDiscarded() ? "discarded"
+                         : stored.failure());
+      } else {
+        LOG(WARNING) << "Not updating `State` since this Master might"
+                     << "have been demoted.";
+      }
+
+      ++metrics.store_failures;
+
+      foreach (const Owned<Operation>& operation, applied) {
+        operation->drop();
+      }
 
-    if (variable.get().isNone()) {
-      LOG(WARNING) << "Not updating `State` since this Master might"
-                   << "have been demoted.";
       demote();
       return;
     }
 
     LOG(INFO) << "Stored the network state successfully";
 
-    overlay::State storedNetworkState = variable.get().get().get();
-
     VLOG(1) << "Stored the following network state:";
     if (storedNetworkState.has_network()) {
-      VLOG(1) << "VTEP: " << storedNetworkState.network().vtep_subnet();
+      if (storedNetworkState.network().has_vtep_subnet()) {
+        VLOG(1) << "VTEP: " << storedNetworkState.network().vtep_subnet();
+      }
       if (storedNetworkState.network().has_vtep_subnet6()) {
         VLOG(1) << "VTEP IPv6: " << storedNetworkState.network().vtep_subnet6();
       }
@@ -1788,8 +4344,6 @@ private:
 
     networkState.CopyFrom(storedNetworkState);
 
-    storedState = variable.get();
-
     // Signal all operations are complete.
     while (!applied.empty()) {
       Owned<Operation> operation = applied.front();
@@ -1801,9 +4355,7 @@ private:
                 << " successfully.";
     }
 
-    if (!operations.empty()) {
-      store();
-    }
+    commit();
   }
 
   void demote()
@@ -1811,27 +4363,35 @@ private:
     // Reset state of the replicated log.
     recovering = false;
     storing = false;
-    operations.clear();
-    storedState = None();
+    recovered = false;
 
-    // We should forget all agents since when this master becomes
-    // the leader they will re-register and get added to the
-    // in-memory databse.
-    agents.clear();
-    networkState.clear_agents();
+    // The queued operations will never be written, so their callers
+    // are told that they have not been performed.
+    foreach (const Owned<Operation>& operation, operations) {
+      operation->drop();
+    }
 
+    operations.clear();
 
-    // While we should not clear all the overlays (since they are static) we
-    // need to de-allocate the address space of the overlays so that
-    // when this master becomes the leader it can reserve any
-    // addresses that were pending.
-    foreachvalue(Owned<Overlay>& overlay, overlays) {
-      overlay->reset();
+    if (commitTimer.isSome()) {
+      Clock::cancel(commitTimer.get());
+      commitTimer = None();
     }
 
-    // We need to de-allocate the VTEP MAC and VTEP addresses
-    // allocated to the Agent as well.
-    vtep.reset();
+    registrations.clear();
+    metrics.registration_queue_depth.set(0);
+    admissions.clear();
+    deferred.clear();
+
+    // The agents will register with the new leading master.
+    peerSubscribers.clear();
+
+    // Forget the agents and allocations that have not been stored in
+    // the replicated log, and keep the ones that have been stored so
+    // that this master stays warm. We will follow the log to learn
+    // about any `State` written by the new leading master.
+    const overlay::State snapshot = networkState;
+    restore(snapshot);
   }
 };
 
@@ -0,0 +1,504 @@
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stout/foreach.hpp>
+#include <stout/hashset.hpp>
+#include <stout/lambda.hpp>
+#include <stout/os.hpp>
+#include <stout/strings.hpp>
+
+#include <stout/os/mktemp.hpp>
+#include <stout/os/rm.hpp>
+#include <stout/os/strerror.hpp>
+#include <stout/os/write.hpp>
+
+#include <process/collect.hpp>
+#include <process/defer.hpp>
+#include <process/dispatch.hpp>
+#include <process/id.hpp>
+#include <process/process.hpp>
+
+#include "constants.hpp"
+#include "netfilter.hpp"
+#include "netlink.hpp"
+#include "network.hpp"
+
+#include "common/shell.hpp"
+
+using std::list;
+using std::pair;
+using std::string;
+using std::vector;
+
+using process::Failure;
+using process::Future;
+using process::Owned;
+using process::Process;
+using process::Promise;
+
+using mesos::modules::common::runCommand;
+using mesos::modules::common::runScriptCommand;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// NOTE: The kernel accepts any protocol version between
+// `IPSET_PROTOCOL_MIN` and `IPSET_PROTOCOL`, so we use the oldest
+// version to support kernels older than our headers.
+#ifdef IPSET_PROTOCOL_MIN
+constexpr uint8_t IPSET_PROTOCOL_VERSION = IPSET_PROTOCOL_MIN;
+#else
+constexpr uint8_t IPSET_PROTOCOL_VERSION = IPSET_PROTOCOL;
+#endif
+
+
+// Returns the iptables rule that masquerades the traffic from
+// `subnet`, in the form printed by `iptables-save`.
+static string masquerade(const string& subnet)
+{
+  return "-A POSTROUTING -s " + subnet + " -m set --match-set " +
+    IPSET_OVERLAY + " dst -j MASQUERADE";
+}
+
+
+// Adds `subnets` to the ipset `set` with the `nomatch` option, with a
+// single netlink request holding an `IPSET_CMD_ADD` message for every
+// subnet. The entries are added as with `ipset add -exist`.
+static Try<Nothing> ipsetAdd(const string& set, const vector<Network>& subnets)
+{
+  netlink::Request request;
+
+  foreach (const Network& subnet, subnets) {
+    struct nfgenmsg genmsg;
+    memset(&genmsg, 0, sizeof(genmsg));
+    genmsg.nfgen_family = AF_INET;
+    genmsg.version = NFNETLINK_V0;
+    genmsg.res_id = htons(0);
+
+    request.message((NFNL_SUBSYS_IPSET << 8) | IPSET_CMD_ADD, 0, genmsg);
+
+    request.scalar(IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL_VERSION);
+    request.attribute(IPSET_ATTR_SETNAME, set);
+
+    const size_t data = request.nest(IPSET_ATTR_DATA);
+
+    const size_t ip = request.nest(IPSET_ATTR_IP);
+    const in_addr address = subnet.address().in().get();
+    request.scalar(
+        IPSET_ATTR_IPADDR_IPV4 | NLA_F_NET_BYTEORDER,
+        address.s_addr);
+    request.unnest(ip);
+
+    request.scalar(IPSET_ATTR_CIDR, (uint8_t) subnet.prefix());
+    request.scalar(
+        IPSET_ATTR_CADT_FLAGS | NLA_F_NET_BYTEORDER,
+        htonl(IPSET_FLAG_NOMATCH));
+
+    request.unnest(data);
+  }
+
+  Try<vector<int>> results = request.send(NETLINK_NETFILTER);
+  if (results.isError()) {
+    return Error("Failed to send ipset request: " + results.error());
+  }
+
+  vector<string> errors;
+  for (size_t i = 0; i < subnets.size(); i++) {
+    const int error = -results.get()[i];
+    if (error != 0) {
+      errors.push_back(
+          "Failed to add " + stringify(subnets[i]) + " to ipset '" + set +
+          "': " +
+          (error < IPSET_ERR_PRIVATE
+             ? string(os::strerror(error))
+             : "ipset error " + stringify(error)));
+    }
+  }
+
+  if (!errors.empty()) {
+    return Error(strings::join("; ", errors));
+  }
+
+  return Nothing();
+}
+
+
+// Returns the CIDR notation of `subnet` as reported by `ipsetList`.
+static string cidr(const Network& subnet)
+{
+  return stringify(subnet.address()) + "/" + stringify(subnet.prefix());
+}
+
+
+// Returns the IPv4 entries of the ipset `set`, in CIDR notation, with
+// a netlink dump of `IPSET_CMD_LIST`.
+static Try<hashset<string>> ipsetList(const string& set)
+{
+  struct nfgenmsg genmsg;
+  memset(&genmsg, 0, sizeof(genmsg));
+  genmsg.nfgen_family = AF_INET;
+  genmsg.version = NFNETLINK_V0;
+  genmsg.res_id = htons(0);
+
+  netlink::Request request;
+  request.message(
+      (NFNL_SUBSYS_IPSET << 8) | IPSET_CMD_LIST,
+      NLM_F_DUMP,
+      genmsg);
+  request.scalar(IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL_VERSION);
+  request.attribute(IPSET_ATTR_SETNAME, set);
+
+  Try<vector<string>> messages = request.dump(NETLINK_NETFILTER);
+  if (messages.isError()) {
+    return Error("Failed to list ipset '" + set + "': " + messages.error());
+  }
+
+  hashset<string> entries;
+
+  foreach (const string& message, messages.get()) {
+    Option<string> adt = netlink::find(
+        netlink::parse(message, NLMSG_ALIGN(sizeof(struct nfgenmsg))),
+        IPSET_ATTR_ADT);
+
+    if (adt.isNone()) {
+      continue;
+    }
+
+    foreach (const netlink::Attribute& data, netlink::parse(adt.get())) {
+      if (data.type != IPSET_ATTR_DATA) {
+        continue;
+      }
+
+      const vector<netlink::Attribute> attributes = netlink::parse(data.value);
+
+      Option<string> ip = netlink::find(attributes, IPSET_ATTR_IP);
+      Option<string> prefix = netlink::find(attributes, IPSET_ATTR_CIDR);
+
+      if (ip.isNone() || prefix.isNone() || prefix->empty()) {
+        continue;
+      }
+
+      Option<string> address =
+        netlink::find(netlink::parse(ip.get()), IPSET_ATTR_IPADDR_IPV4);
+
+      if (address.isNone() || address->size() != sizeof(struct in_addr)) {
+        continue;
+      }
+
+      struct in_addr in;
+      memcpy(&in, address->data(), sizeof(in));
+
+      entries.insert(
+          stringify(net::IP(in)) + "/" + stringify((int) prefix->at(0)));
+    }
+  }
+
+  return entries;
+}
+
+
+class NetfilterProcess : public Process<NetfilterProcess>
+{
+public:
+  explicit NetfilterProcess(bool _batch)
+    : ProcessBase(process::ID::generate("overlay-netfilter")),
+      batch(_batch),
+      programming(false) {}
+
+  Future<Nothing> add(const string& subnet)
+  {
+    Owned<Promise<Nothing>> promise(new Promise<Nothing>());
+    pending.push_back(std::make_pair(subnet, promise));
+
+    // Let the overlays that are configured in the same round of
+    // events join this batch before programming it.
+    if (!programming) {
+      programming = true;
+      dispatch(self(), &NetfilterProcess::program);
+    }
+
+    return promise->future();
+  }
+
+  Future<vector<string>> repair(const vector<string>& subnets)
+  {
+    Try<hashset<string>> entries = ipsetList(IPSET_OVERLAY);
+    if (entries.isError()) {
+      return Failure(entries.error());
+    }
+
+    // NOTE: iptables has no netlink interface, so the rules are
+    // listed with a single `iptables-save`.
+    return runCommand("iptables-save", {"iptables-save", "-t", "nat"})
+      .then(defer(self(),
+                  &NetfilterProcess::_repair,
+                  subnets,
+                  entries.get(),
+                  lambda::_1));
+  }
+
+private:
+  Future<vector<string>> _repair(
+      const vector<string>& subnets,
+      const hashset<string>& entries,
+      const string& rules)
+  {
+    hashset<string> existing;
+    foreach (const string& rule, strings::tokenize(rules, "\n")) {
+      existing.insert(strings::trim(rule));
+    }
+
+    vector<string> drifted;
+    foreach (const string& subnet, subnets) {
+      Try<Network> network = Network::parse(subnet, AF_INET);
+      if (network.isError()) {
+        return Failure(
+            "Unable to parse subnet " + subnet + ": " + network.error());
+      }
+
+      if (!entries.contains(cidr(network.get())) ||
+          !existing.contains(masquerade(subnet))) {
+        drifted.push_back(subnet);
+      }
+    }
+
+    if (drifted.empty()) {
+      return drifted;
+    }
+
+    LOG(WARNING) << "Programming again the netfilter rules of "
+                 << stringify(drifted) << " since they have been removed";
+
+    list<Future<Nothing>> futures;
+    foreach (const string& subnet, drifted) {
+      futures.push_back(add(subnet));
+    }
+
+    return collect(futures)
+      .then([drifted]() { return drifted; });
+  }
+
+  void program()
+  {
+    list<pair<string, Owned<Promise<Nothing>>>> requests;
+    requests.swap(pending);
+
+    vector<string> subnets;
+    foreach (const auto& request, requests) {
+      subnets.push_back(request.first);
+    }
+
+    VLOG(1) << "Programming the netfilter rules of " << subnets.size()
+            << " overlay subnets";
+
+    Future<Nothing> programmed = batch
+      ? programBatch(subnets)
+      : programShell(subnets);
+
+    programmed
+      .onAny(defer(self(), &NetfilterProcess::_program, requests, lambda::_1));
+  }
+
+  void _program(
+      const list<pair<string, Owned<Promise<Nothing>>>>& requests,
+      const Future<Nothing>& programmed)
+  {
+    foreach (const auto& request, requests) {
+      if (programmed.isReady()) {
+        request.second->set(Nothing());
+      } else {
+        request.second->fail(
+            "Unable to program the netfilter rules of " + request.first +
+            ": " +
+            (programmed.isFailed() ? programmed.failure() : "discarded"));
+      }
+    }
+
+    programming = false;
+
+    if (!pending.empty()) {
+      programming = true;
+      dispatch(self(), &NetfilterProcess::program);
+    }
+  }
+
+  Future<Nothing> programShell(const vector<string>& subnets)
+  {
+    list<Future<string>> futures;
+
+    foreach (const string& subnet, subnets) {
+      // The below command is a script consisting of three commands:
+      // <set ipset> && <check iptables rule exists> ||
+      // <insert iptables rule>
+      Try<string> command = strings::format(
+          "ipset add -exist %s %s" " nomatch &&"
+          " iptables -t nat -C POSTROUTING -s %s -m set"
+          " --match-set %s dst -j MASQUERADE ||"
+          " iptables -t nat -A POSTROUTING -s %s -m"
+          " set --match-set %s dst -j MASQUERADE",
+          IPSET_OVERLAY,
+          subnet,
+          subnet,
+          IPSET_OVERLAY,
+          subnet,
+          IPSET_OVERLAY);
+
+      if (command.isError()) {
+        return Failure(
+            "Unable to create iptables rule for " + subnet + ": " +
+            command.error());
+      }
+
+      LOG(INFO) << "Insert following iptables rule for subnet " << subnet
+                << ": " << command.get();
+
+      futures.push_back(runScriptCommand(command.get()));
+    }
+
+    return collect(futures)
+      .then([]() { return Nothing(); });
+  }
+
+  Future<Nothing> programBatch(const vector<string>& subnets)
+  {
+    vector<Network> networks;
+    foreach (const string& subnet, subnets) {
+      Try<Network> network = Network::parse(subnet, AF_INET);
+      if (network.isError()) {
+        return Failure(
+            "Unable to parse subnet " + subnet + ": " + network.error());
+      }
+
+      networks.push_back(network.get());
+    }
+
+    Try<Nothing> ipset = ipsetAdd(IPSET_OVERLAY, networks);
+    if (ipset.isError()) {
+      LOG(WARNING) << "Falling back to the shell to program the netfilter "
+                   << "rules: " << ipset.error();
+
+      return programShell(subnets);
+    }
+
+    return runCommand("iptables-save", {"iptables-save", "-t", "nat"})
+      .then(defer(self(), &NetfilterProcess::restore, subnets, lambda::_1))
+      .repair(defer(self(), [=](const Future<Nothing>& future) {
+        LOG(WARNING) << "Falling back to the shell to program the netfilter "
+                     << "rules: "
+                     << (future.isFailed() ? future.failure() : "discarded");
+
+        return programShell(subnets);
+      }));
+  }
+
+  // Appends the rules of the `subnets` that are not in `rules` (the
+  // output of `iptables-save`) with a single `iptables-restore`.
+  Future<Nothing> restore(const vector<string>& subnets, const string& rules)
+  {
+    hashset<string> existing;
+    foreach (const string& rule, strings::tokenize(rules, "\n")) {
+      existing.insert(strings::trim(rule));
+    }
+
+    string input = "*nat\n";
+    size_t added = 0;
+
+    foreach (const string& subnet, subnets) {
+      const string rule = masquerade(subnet);
+      if (!existing.contains(rule)) {
+        input += rule + "\n";
+        existing.insert(rule);
+        added++;
+      }
+    }
+
+    if (added == 0) {
+      return Nothing();
+    }
+
+    input += "COMMIT\n";
+
+    LOG(INFO) << "Inserting " << added << " iptables rules: " << input;
+
+    Try<string> path = os::mktemp();
+    if (path.isError()) {
+      return Failure("Failed to create temporary file: " + path.error());
+    }
+
+    Try<Nothing> write = os::write(path.get(), input);
+    if (write.isError()) {
+      os::rm(path.get());
+      return Failure("Failed to write iptables rules: " + write.error());
+    }
+
+    const string file = path.get();
+
+    return runScriptCommand("iptables-restore --noflush < " + file)
+      .onAny([file]() { os::rm(file); })
+      .then([]() { return Nothing(); });
+  }
+
+  const bool batch;
+
+  // Set while a batch is scheduled or being programmed.
+  bool programming;
+
+  // Subnets waiting for the next batch.
+  list<pair<string, Owned<Promise<Nothing>>>> pending;
+};
+
+
+Try<Owned<Netfilter>> Netfilter::create(const string& backend)
+{
+  if (backend == NETFILTER_BACKEND_BATCH) {
+    return Owned<Netfilter>(new Netfilter(true));
+  } else if (backend == NETFILTER_BACKEND_SHELL) {
+    return Owned<Netfilter>(new Netfilter(false));
+  }
+
+  return Error("Unknown netfilter backend '" + backend + "'");
+}
+
+
+Netfilter::Netfilter(bool batch)
+  : process(new NetfilterProcess(batch))
+{
+  spawn(process.get());
+}
+
+
+Netfilter::~Netfilter()
+{
+  terminate(process.get());
+  wait(process.get());
+}
+
+
+Future<Nothing> Netfilter::add(const string& subnet)
+{
+  return dispatch(process.get(), &NetfilterProcess::add, subnet);
+}
+
+
+Future<vector<string>> Netfilter::repair(const vector<string>& subnets)
+{
+  return dispatch(process.get(), &NetfilterProcess::repair, subnets);
+}
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
@@ -0,0 +1,64 @@
+#ifndef __OVERLAY_NETFILTER_HPP__
+#define __OVERLAY_NETFILTER_HPP__
+
+#include <string>
+#include <vector>
+
+#include <process/future.hpp>
+#include <process/owned.hpp>
+
+#include <stout/nothing.hpp>
+#include <stout/try.hpp>
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+constexpr char NETFILTER_BACKEND_BATCH[] = "batch";
+constexpr char NETFILTER_BACKEND_SHELL[] = "shell";
+
+class NetfilterProcess;
+
+
+// Programs the netfilter rules of the overlay subnets on the Agent.
+// Every overlay subnet is added to the `IPSET_OVERLAY` ipset with the
+// `nomatch` option, and gets a rule in the POSTROUTING chain of the
+// NAT table that masquerades the traffic leaving the overlays.
+//
+// Subnets added while the rules of other subnets are being programmed
+// are programmed together in the next batch. The "batch" backend
+// adds all the ipset entries of a batch with a single netlink request
+// and all the iptables rules with a single `iptables-restore`, so a
+// batch takes the xtables lock once regardless of the number of
+// overlays. The "shell" backend runs `ipset` and `iptables` for every
+// subnet, and is used as a fallback if the "batch" backend fails.
+class Netfilter
+{
+public:
+  static Try<process::Owned<Netfilter>> create(const std::string& backend);
+
+  ~Netfilter();
+
+  // Adds the IPv4 `subnet` of an overlay to the netfilter rules.
+  process::Future<Nothing> add(const std::string& subnet);
+
+  // Checks that the ipset entries and the iptables rules of the
+  // `subnets`, which have been added before, still exist, and
+  // programs again the ones that have been removed since. Returns the
+  // subnets whose rules had drifted.
+  process::Future<std::vector<std::string>> repair(
+      const std::vector<std::string>& subnets);
+
+private:
+  explicit Netfilter(bool batch);
+
+  process::Owned<NetfilterProcess> process;
+};
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_NETFILTER_HPP__
@@ -0,0 +1,283 @@
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/stringify.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/strerror.hpp>
+
+#include "netlink.hpp"
+
+using std::string;
+using std::vector;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace netlink {
+
+void Request::attribute(uint16_t type, const void* value, size_t length)
+{
+  struct nlattr attribute;
+  attribute.nla_type = type;
+  attribute.nla_len = NLA_HDRLEN + length;
+
+  data.append((const char*) &attribute, sizeof(attribute));
+
+  if (length > 0) {
+    data.append((const char*) value, length);
+    data.append(NLA_ALIGN(length) - length, '\0');
+  }
+}
+
+
+size_t Request::nest(uint16_t type)
+{
+  const size_t offset = data.size();
+  attribute(type | NLA_F_NESTED, nullptr, 0);
+  return offset;
+}
+
+
+void Request::unnest(size_t offset)
+{
+  struct nlattr* attribute = (struct nlattr*) &data[offset];
+  attribute->nla_len = data.size() - offset;
+}
+
+
+void Request::finish()
+{
+  if (!offsets.empty()) {
+    struct nlmsghdr* header = (struct nlmsghdr*) &data[offsets.back()];
+    header->nlmsg_len = data.size() - offsets.back();
+  }
+}
+
+
+// Returns a netlink socket of `protocol` bound to the kernel, whose
+// receives fail with `EAGAIN` after `NETLINK_TIMEOUT`.
+static Try<int> openSocket(int protocol)
+{
+  int fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+  if (fd < 0) {
+    return ErrnoError("Failed to create netlink socket");
+  }
+
+  struct sockaddr_nl address;
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+
+  if (::bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    ErrnoError error("Failed to bind netlink socket");
+    os::close(fd);
+    return error;
+  }
+
+  struct timeval timeout;
+  timeout.tv_sec = (time_t) NETLINK_TIMEOUT.secs();
+  timeout.tv_usec = 0;
+
+  if (::setsockopt(
+          fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+    ErrnoError error("Failed to set the timeout of the netlink socket");
+    os::close(fd);
+    return error;
+  }
+
+  return fd;
+}
+
+
+Try<vector<int>> Request::send(int protocol, size_t window)
+{
+  finish();
+
+  Try<int> socket = openSocket(protocol);
+  if (socket.isError()) {
+    return Error(socket.error());
+  }
+
+  const int fd = socket.get();
+
+  vector<int> results(offsets.size(), 0);
+  char buffer[32768];
+
+  for (size_t first = 0; first < offsets.size(); first += window) {
+    const size_t last = std::min(first + window, offsets.size());
+    const size_t end = last < offsets.size() ? offsets[last] : data.size();
+
+    if (::send(fd, &data[offsets[first]], end - offsets[first], 0) < 0) {
+      ErrnoError error("Failed to send netlink request");
+      os::close(fd);
+      return error;
+    }
+
+    // Wait for the acknowledgement of every message in the window.
+    size_t acknowledged = 0;
+
+    while (acknowledged < last - first) {
+      ssize_t length = ::recv(fd, buffer, sizeof(buffer), 0);
+      if (length < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          os::close(fd);
+          return Error(
+              "Timed out after " + stringify(NETLINK_TIMEOUT) +
+              " waiting for the acknowledgements of " +
+              stringify(last - first - acknowledged) + " netlink messages");
+        }
+
+        ErrnoError error("Failed to receive netlink response");
+        os::close(fd);
+        return error;
+      }
+
+      int remaining = length;
+      for (struct nlmsghdr* header = (struct nlmsghdr*) buffer;
+           NLMSG_OK(header, remaining);
+           header = NLMSG_NEXT(header, remaining)) {
+        if (header->nlmsg_type != NLMSG_ERROR) {
+          continue;
+        }
+
+        // Sequence numbers start at one, see `message`.
+        const size_t index = header->nlmsg_seq - 1;
+        if (index < first || index >= last) {
+          continue;
+        }
+
+        const struct nlmsgerr* error = (struct nlmsgerr*) NLMSG_DATA(header);
+        results[index] = error->error;
+        acknowledged++;
+      }
+    }
+  }
+
+  os::close(fd);
+
+  return results;
+}
+
+
+Try<vector<string>> Request::dump(int protocol)
+{
+  CHECK_EQ(1u, offsets.size());
+
+  finish();
+
+  Try<int> socket = openSocket(protocol);
+  if (socket.isError()) {
+    return Error(socket.error());
+  }
+
+  const int fd = socket.get();
+
+  if (::send(fd, data.data(), data.size(), 0) < 0) {
+    ErrnoError error("Failed to send netlink dump request");
+    os::close(fd);
+    return error;
+  }
+
+  // NOTE: The kernel fills every datagram of a dump with as many
+  // messages as fit in its buffer, which can be larger than a page.
+  vector<char> buffer(65536);
+  vector<string> messages;
+
+  while (true) {
+    ssize_t length = ::recv(fd, buffer.data(), buffer.size(), 0);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        os::close(fd);
+        return Error(
+            "Timed out after " + stringify(NETLINK_TIMEOUT) +
+            " waiting for the netlink dump");
+      }
+
+      ErrnoError error("Failed to receive netlink dump");
+      os::close(fd);
+      return error;
+    }
+
+    int remaining = length;
+    for (struct nlmsghdr* header = (struct nlmsghdr*) buffer.data();
+         NLMSG_OK(header, remaining);
+         header = NLMSG_NEXT(header, remaining)) {
+      if (header->nlmsg_type == NLMSG_DONE) {
+        os::close(fd);
+        return messages;
+      }
+
+      if (header->nlmsg_type == NLMSG_ERROR) {
+        const struct nlmsgerr* error = (struct nlmsgerr*) NLMSG_DATA(header);
+        if (error->error != 0) {
+          os::close(fd);
+          return Error(
+              "Failed to dump: " + string(os::strerror(-error->error)));
+        }
+
+        continue;
+      }
+
+      messages.push_back(string(
+          (const char*) NLMSG_DATA(header),
+          header->nlmsg_len - NLMSG_HDRLEN));
+    }
+  }
+}
+
+
+vector<Attribute> parse(const string& data, size_t offset)
+{
+  vector<Attribute> attributes;
+
+  while (offset + NLA_HDRLEN <= data.size()) {
+    const struct nlattr* attribute = (struct nlattr*) &data[offset];
+    if (attribute->nla_len < NLA_HDRLEN ||
+        offset + attribute->nla_len > data.size()) {
+      break;
+    }
+
+    attributes.push_back(Attribute{
+        (uint16_t) (attribute->nla_type & NLA_TYPE_MASK),
+        data.substr(offset + NLA_HDRLEN, attribute->nla_len - NLA_HDRLEN)});
+
+    offset += NLA_ALIGN(attribute->nla_len);
+  }
+
+  return attributes;
+}
+
+
+Option<string> find(const vector<Attribute>& attributes, uint16_t type)
+{
+  foreach (const Attribute& attribute, attributes) {
+    if (attribute.type == type) {
+      return attribute.value;
+    }
+  }
+
+  return None();
+}
+
+} // namespace netlink {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
@@ -0,0 +1,135 @@
+#ifndef __OVERLAY_NETLINK_HPP__
+#define __OVERLAY_NETLINK_HPP__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/netlink.h>
+
+#include <string>
+#include <vector>
+
+#include <stout/duration.hpp>
+#include <stout/option.hpp>
+#include <stout/try.hpp>
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace netlink {
+
+// How long to wait for every response of the kernel. The kernel
+// answers right away, so a request that hasn't been answered by then
+// is not going to be, e.g., because the acknowledgements were dropped.
+const Duration NETLINK_TIMEOUT = Seconds(10);
+
+
+// A batch of netlink messages that are sent to the kernel together,
+// and whose acknowledgements are collected together. Every message
+// is sent with `NLM_F_ACK`, so the kernel reports the result of every
+// message, including the ones that succeed.
+//
+// Attributes are appended to the last message started with
+// `message`. Nested attributes are opened with `nest`, which returns
+// the offset to pass to `unnest` once the nested attributes have been
+// appended.
+class Request
+{
+public:
+  // Starts a new message of `type`, whose payload starts with the
+  // family specific `header` (e.g., `struct ifinfomsg`).
+  template <typename T>
+  void message(uint16_t type, uint16_t flags, const T& header)
+  {
+    finish();
+
+    offsets.push_back(data.size());
+
+    struct nlmsghdr _header;
+    memset(&_header, 0, sizeof(_header));
+    _header.nlmsg_type = type;
+    _header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    _header.nlmsg_seq = offsets.size();
+
+    data.append((const char*) &_header, sizeof(_header));
+    data.append((const char*) &header, sizeof(header));
+    data.append(NLMSG_ALIGN(sizeof(header)) - sizeof(header), '\0');
+  }
+
+  void attribute(uint16_t type, const void* value, size_t length);
+
+  // Appends a NUL terminated string attribute.
+  void attribute(uint16_t type, const std::string& value)
+  {
+    attribute(type, value.c_str(), value.size() + 1);
+  }
+
+  template <typename T>
+  void scalar(uint16_t type, const T& value)
+  {
+    attribute(type, &value, sizeof(value));
+  }
+
+  size_t nest(uint16_t type);
+
+  void unnest(size_t offset);
+
+  // Number of messages in the request.
+  size_t size() const { return offsets.size(); }
+
+  // Sends the messages over a new netlink socket of `protocol`, and
+  // returns the result of every message, in order: zero on success,
+  // or a negative errno.
+  //
+  // NOTE: The kernel drops acknowledgements that don't fit in the
+  // receive buffer of the socket, hence at most `window` messages
+  // are sent before waiting for their acknowledgements. The request
+  // fails if the kernel doesn't respond within `NETLINK_TIMEOUT`.
+  Try<std::vector<int>> send(int protocol, size_t window = 256);
+
+  // Sends the single message of the request, which needs to have been
+  // started with `NLM_F_DUMP`, over a new netlink socket of
+  // `protocol`, and returns the payload of every message of the dump,
+  // starting with its family specific header. The dump fails if the
+  // kernel stops responding for `NETLINK_TIMEOUT`.
+  Try<std::vector<std::string>> dump(int protocol);
+
+private:
+  // Sets the length of the last message.
+  void finish();
+
+  std::string data;
+
+  // Offset of every message in `data`.
+  std::vector<size_t> offsets;
+};
+
+
+// An attribute of a message received from the kernel.
+struct Attribute
+{
+  // The type of the attribute, without the `NLA_F_NESTED` and
+  // `NLA_F_NET_BYTEORDER` flags.
+  uint16_t type;
+
+  std::string value;
+};
+
+
+// Parses the attributes of `data` starting at `offset`, e.g., after
+// the family specific header of a message, or the attributes nested
+// in the value of an attribute.
+std::vector<Attribute> parse(const std::string& data, size_t offset = 0);
+
+
+// Returns the value of the first attribute of `type`, if any.
+Option<std::string> find(
+    const std::vector<Attribute>& attributes,
+    uint16_t type);
+
+} // namespace netlink {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_NETLINK_HPP__
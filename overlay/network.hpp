@@ -1,7 +1,9 @@
 #ifndef __OVERLAY_NETWORK_HPP__
 #define __OVERLAY_NETWORK_HPP__
 
+#include <endian.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <boost/functional/hash.hpp>
 
@@ -24,6 +26,57 @@ namespace mesos {
 namespace modules {
 namespace overlay {
 
+// Returns the netmask of the 32 bits of an IPv4 address for `prefix`.
+constexpr uint32_t mask32(int prefix)
+{
+  return prefix <= 0 ? 0 : ~uint32_t(0) << (32 - prefix);
+}
+
+
+// Returns the netmask of a 64-bit half of an IPv6 address for the
+// `prefix` bits that fall in the half, i.e., `prefix` for the upper
+// half and `prefix - 64` for the lower half.
+constexpr uint64_t mask64(int prefix)
+{
+  return prefix <= 0 ? 0 :
+    prefix >= 64 ? ~uint64_t(0) : ~uint64_t(0) << (64 - prefix);
+}
+
+
+// Returns the upper or the lower 64 bits of an IPv6 address, in host
+// byte order.
+inline uint64_t upper64(const in6_addr& in6)
+{
+  uint64_t value;
+  memcpy(&value, in6.s6_addr, sizeof(value));
+  return be64toh(value);
+}
+
+
+inline uint64_t lower64(const in6_addr& in6)
+{
+  uint64_t value;
+  memcpy(&value, in6.s6_addr + sizeof(value), sizeof(value));
+  return be64toh(value);
+}
+
+
+// Builds an IPv6 address from its upper and lower 64 bits, in host
+// byte order.
+inline in6_addr toIn6(uint64_t upper, uint64_t lower)
+{
+  in6_addr result;
+
+  upper = htobe64(upper);
+  lower = htobe64(lower);
+
+  memcpy(result.s6_addr, &upper, sizeof(upper));
+  memcpy(result.s6_addr + sizeof(upper), &lower, sizeof(lower));
+
+  return result;
+}
+
+
 class IP : public net::IP
 {
 public:
@@ -66,7 +119,10 @@ public:
     return net::IP::operator>(that);
   } 
 
-  IP& operator++() {
+  // NOTE: IPv6 addresses are stepped as two 64-bit halves, carrying
+  // into (or borrowing from) the upper half when the lower half wraps.
+  IP& operator++()
+  {
     switch (family_) {
       case AF_INET: {
         uint32_t address = ntohl(storage_.in_.s_addr);
@@ -74,25 +130,20 @@ public:
         break;
       }
       case AF_INET6: {
-        in6_addr addr6 = storage_.in6_;
-        for (int i = 15; i >= 0; i--) {
-          if (addr6.s6_addr[i] != 0xff) {
-            addr6.s6_addr[i]++;
-            index_ = i;
-            break;
-          }
-        } 
-        storage_.in6_  = addr6;
+        const uint64_t lower = lower64(storage_.in6_) + 1;
+        const uint64_t carry = lower == 0;
+        storage_.in6_ = toIn6(upper64(storage_.in6_) + carry, lower);
         break;
-      } 
+      }
       default: {
-       UNREACHABLE();
+        UNREACHABLE();
       }
     }
     return *this;
   }
 
-  IP& operator--() {
+  IP& operator--()
+  {
     switch (family_) {
       case AF_INET: {
         uint32_t address = ntohl(storage_.in_.s_addr);
@@ -100,12 +151,9 @@ public:
         break;
       }
       case AF_INET6: {
-        in6_addr addr6 = storage_.in6_;
-        addr6.s6_addr[index_]--;
-        if (!addr6.s6_addr[index_]) {
-          index_--;
-        }
-        storage_.in6_ = addr6;
+        const uint64_t lower = lower64(storage_.in6_);
+        const uint64_t borrow = lower == 0;
+        storage_.in6_ = toIn6(upper64(storage_.in6_) - borrow, lower - 1);
         break;
       }
       default: {
@@ -113,10 +161,7 @@ public:
       }
     }
     return *this;
-  } 
-
-private:
-  uint8_t index_;
+  }
 };
 
 
@@ -154,47 +199,57 @@ inline std::ostream& operator<<(std::ostream& stream, const IP& ip)
 }
   
 
-class Network : public net::IP::Network
+// An IP network, i.e., an address and a prefix length.
+//
+// Unlike `net::IP::Network`, which keeps its address and netmask on
+// the heap, a `Network` is a plain value: the netmask is derived from
+// the prefix length when needed, so copying, comparing and stepping
+// the networks held in the interval sets of the master don't
+// allocate. IPv6 addresses are operated on as two 64-bit halves.
+class Network
 {
 public:
-  // default constructor
-  Network() 
-    :net::IP::Network(net::IP(0), net::IP(0)),
-     prefix_(0)
-  {}  
+  Network()
+    : address_(0),
+      prefix_(0) {}
 
-  // paramatized constructor
   Network(const net::IP& address, uint8_t prefix)
-    :net::IP::Network(address, toMask(prefix, address.family())),
-     prefix_(prefix) {}
+    : address_(IP::convert(address).get()),
+      prefix_(prefix) {}
 
-  Network(const Network& network)
-    :net::IP::Network(network),
-     prefix_(network.prefix()) {}
-  
   // Creates an IP network from the given IP address and netmask.
   // Returns error if the netmask is not valid (e.g., not contiguous).
   static Try<Network> parse(const std::string& value, int family = AF_UNSPEC);
 
   // Helper function to convert prefix to netmask
-  static net::IP toMask(uint8_t prefix, int family); 
+  static IP toMask(uint8_t prefix, int family);
+
+  // Encodes the network as its address, in network byte order,
+  // followed by a single byte holding the prefix length.
+  std::string encode() const;
+
+  // Decodes a network encoded by `encode`.
+  static Try<Network> decode(const std::string& value);
+
+  IP address() const { return address_; }
+
+  IP netmask() const { return toMask(prefix_, address_.family()); }
 
-  // Helper function to return the first address of a network 
-  IP begin() const {
-    switch (address_->family()) {
+  uint8_t prefix() const { return prefix_; }
+
+  // Helper function to return the first address of a network
+  IP begin() const
+  {
+    switch (address_.family()) {
       case AF_INET: {
-        uint32_t addr = ntohl(address_->in().get().s_addr);
-        uint32_t mask = ntohl(netmask_->in().get().s_addr);
-        return IP(addr & mask);    
+        const uint32_t addr = ntohl(address_.in().get().s_addr);
+        return IP(addr & mask32(prefix_));
       }
       case AF_INET6: {
-        in6_addr saddr6;
-        in6_addr addr6 = address_->in6().get();
-        in6_addr mask6 = netmask_->in6().get();
-        for (int i = 0; i < 16; i++) {
-          saddr6.s6_addr[i] = addr6.s6_addr[i] & mask6.s6_addr[i];
-        }
-        return IP(saddr6);
+        const in6_addr addr6 = address_.in6().get();
+        return IP(toIn6(
+            upper64(addr6) & mask64(prefix_),
+            lower64(addr6) & mask64(prefix_ - 64)));
       }
       default:
         UNREACHABLE();
@@ -202,21 +257,18 @@ public:
   }
 
   // Helper function to return the last address of a network
-  IP end() const {
-    switch (address_->family()) {
+  IP end() const
+  {
+    switch (address_.family()) {
       case AF_INET: {
-        uint32_t addr = ntohl(address_->in().get().s_addr);
-        uint32_t mask = ntohl(netmask_->in().get().s_addr);
-        return IP(addr | ~mask);
+        const uint32_t addr = ntohl(address_.in().get().s_addr);
+        return IP(addr | ~mask32(prefix_));
       }
       case AF_INET6: {
-        in6_addr eaddr6;
-        in6_addr addr6 = address_->in6().get();
-        in6_addr mask6 = netmask_->in6().get();
-        for (int i = 0; i < 16; i++) {
-          eaddr6.s6_addr[i] = addr6.s6_addr[i] | ~mask6.s6_addr[i];
-        }
-        return IP(eaddr6);
+        const in6_addr addr6 = address_.in6().get();
+        return IP(toIn6(
+            upper64(addr6) | ~mask64(prefix_),
+            lower64(addr6) | ~mask64(prefix_ - 64)));
       }
       default:
         UNREACHABLE();
@@ -225,12 +277,12 @@ public:
 
   bool operator==(const Network& that) const
   {
-    return net::IP::Network::operator==(that);
+    return prefix_ == that.prefix_ && address_ == that.address_;
   }
 
   bool operator!=(const Network& that) const
   {
-    return net::IP::Network::operator!=(that);
+    return !(*this == that);
   }
 
   bool operator<(const Network& that) const
@@ -238,7 +290,7 @@ public:
     if (prefix_ != that.prefix()) {
       return prefix_ > that.prefix();
     } else {
-      return address() < that.address();
+      return address_ < that.address_;
     }
   }
 
@@ -247,78 +299,64 @@ public:
     if (prefix_ != that.prefix()) {
       return prefix_ < that.prefix();
     } else {
-      return address() > that.address();
+      return address_ > that.address_;
     }
   }
 
-  Network& operator++() {
-    switch (address_->family()) {
+  // Steps to the next network of the same prefix length, i.e., adds
+  // one to the bits of the address covered by the prefix, and clears
+  // the other bits.
+  Network& operator++()
+  {
+    switch (address_.family()) {
       case AF_INET: {
-        uint32_t addr = ntohl(address_->in().get().s_addr);
-        addr = addr >> (32 - prefix_);
-        addr = (addr + 1) << (32 - prefix_);
-        address_.reset(new net::IP(addr));
+        const uint32_t addr = ntohl(address_.in().get().s_addr);
+
+        // NOTE: The step of a /0 network is 2^32, which wraps around
+        // to the same network.
+        const uint64_t step = uint64_t(1) << (32 - prefix_);
+        address_ = IP(uint32_t((addr & mask32(prefix_)) + step));
         break;
       }
       case AF_INET6: {
-        bool incremented = false;
-        uint8_t startInx = prefix_ >> 3;
-        in6_addr addr6 = address_->in6().get();
-
-        if (prefix_ & 7) {
-          uint8_t bitshift = 8 - (prefix_ & 7);
-          uint8_t lowerbits = addr6.s6_addr[startInx] >> bitshift;
-          if ((lowerbits & 7) != 7) {
-            addr6.s6_addr[startInx] = (lowerbits + 1) << bitshift;
-            index_ = startInx;
-            incremented = true;
-          }          
-        }
-
-        if (!incremented) {
-          for (int i = startInx - 1; i >= 0; i--) {
-            if (addr6.s6_addr[i] != 0xff) {
-              addr6.s6_addr[i]++;
-              index_ = i;
-              break;
-            }   
-          }
-        }
-
-        address_.reset(new net::IP(addr6));  
+        const in6_addr addr6 = address_.in6().get();
+
+        const uint64_t upper = upper64(addr6) & mask64(prefix_);
+        const uint64_t lower = lower64(addr6) & mask64(prefix_ - 64);
+
+        const uint64_t _lower = lower + lowerStep();
+        const uint64_t carry = _lower < lower;
+
+        address_ = IP(toIn6(upper + upperStep() + carry, _lower));
         break;
       }
       default: {
         UNREACHABLE();
       }
-   }
-   return *this;
+    }
+    return *this;
   }
 
-  Network& operator--() {
-    switch (address_->family()) {
+  // Steps to the previous network of the same prefix length.
+  Network& operator--()
+  {
+    switch (address_.family()) {
       case AF_INET: {
-        uint32_t addr = ntohl(address_->in().get().s_addr);
-        addr = addr >> (32 - prefix_);
-        addr = (addr - 1) << (32 - prefix_);
-        address_.reset(new net::IP(addr));
+        const uint32_t addr = ntohl(address_.in().get().s_addr);
+        const uint64_t step = uint64_t(1) << (32 - prefix_);
+        address_ = IP(uint32_t((addr & mask32(prefix_)) - step));
         break;
       }
       case AF_INET6: {
-        in6_addr addr6 = address_->in6().get();
-        if ((prefix_ & 7) && (index_ == prefix_ >> 3)) {
-          uint8_t bitshift = 8 - (prefix_ & 7);
-          uint8_t lowerbits = addr6.s6_addr[index_] >> bitshift;
-          addr6.s6_addr[index_] = (lowerbits - 1) << bitshift;
-        } else {
-          addr6.s6_addr[index_]--;
-        }
-
-        if (!addr6.s6_addr[index_]) {
-          index_--;
-        }
-
-        address_.reset(new net::IP(addr6));
+        const in6_addr addr6 = address_.in6().get();
+
+        const uint64_t upper = upper64(addr6) & mask64(prefix_);
+        const uint64_t lower = lower64(addr6) & mask64(prefix_ - 64);
+
+        const uint64_t _lower = lower - lowerStep();
+        const uint64_t borrow = _lower > lower;
+
+        address_ = IP(toIn6(upper - upperStep() - borrow, _lower));
         break;
       }
       default: {
@@ -328,11 +366,23 @@ public:
     return *this;
   }
 
-  uint8_t prefix() const { return prefix_; }
-
 private:
+  // The steps added to the upper and the lower halves of an IPv6
+  // address to move to the next network of the prefix length. The
+  // step of a /0 network is 2^128, which wraps around to the same
+  // network.
+  uint64_t upperStep() const
+  {
+    return prefix_ > 0 && prefix_ <= 64 ? uint64_t(1) << (64 - prefix_) : 0;
+  }
+
+  uint64_t lowerStep() const
+  {
+    return prefix_ > 64 ? uint64_t(1) << (128 - prefix_) : 0;
+  }
+
+  IP address_;
   uint8_t prefix_;
-  uint8_t index_;
 };
 
 
@@ -347,30 +397,71 @@ inline Try<Network> Network::parse(const std::string& value, int family)
 }
 
 
-inline net::IP Network::toMask(uint8_t prefix, int family)
+inline std::string Network::encode() const
 {
-  switch (family) {
+  std::string result;
+
+  switch (address_.family()) {
     case AF_INET: {
-      uint32_t mask = 0xffffffff << (32 - prefix);
-      return net::IP(mask); 
+      const in_addr in = address_.in().get();
+      result.append((const char*) &in.s_addr, sizeof(in.s_addr));
+      break;
     }
     case AF_INET6: {
-      in6_addr mask;
-      memset(&mask, 0, sizeof(mask));
+      const in6_addr in6 = address_.in6().get();
+      result.append((const char*) in6.s6_addr, sizeof(in6.s6_addr));
+      break;
+    }
+    default:
+      UNREACHABLE();
+  }
+
+  result.push_back((char) prefix_);
+
+  return result;
+}
 
-      int i = 0;
-      while (prefix >= 8) {
-        mask.s6_addr[i++] = 0xff;
-        prefix -= 8;
+
+inline Try<Network> Network::decode(const std::string& value)
+{
+  switch (value.size()) {
+    case sizeof(in_addr) + 1: {
+      in_addr in;
+      memcpy(&in.s_addr, value.data(), sizeof(in.s_addr));
+
+      const uint8_t prefix = value[sizeof(in.s_addr)];
+      if (prefix > 32) {
+        return Error("Invalid IPv4 prefix length " + stringify((int) prefix));
       }
 
-      if (prefix > 0) {
-        uint8_t _mask = 0xff << (8 - prefix);
-        mask.s6_addr[i] = _mask;
+      return Network(net::IP(in), prefix);
+    }
+    case sizeof(in6_addr) + 1: {
+      in6_addr in6;
+      memcpy(in6.s6_addr, value.data(), sizeof(in6.s6_addr));
+
+      const uint8_t prefix = value[sizeof(in6.s6_addr)];
+      if (prefix > 128) {
+        return Error("Invalid IPv6 prefix length " + stringify((int) prefix));
       }
-      return net::IP(mask); 
+
+      return Network(net::IP(in6), prefix);
     }
-    default: 
+    default:
+      return Error(
+          "Invalid encoded network of " + stringify(value.size()) + " bytes");
+  }
+}
+
+
+inline IP Network::toMask(uint8_t prefix, int family)
+{
+  switch (family) {
+    case AF_INET:
+      return IP(mask32(prefix));
+    case AF_INET6:
+      return IP(toIn6(mask64(prefix), mask64(prefix - 64)));
+    default:
       UNREACHABLE();
   }
 }
@@ -380,8 +471,7 @@ inline net::IP Network::toMask(uint8_t prefix, int family)
 //canonical form with prefix. For example: "10.0.0.1/8".
 inline std::ostream& operator<<(std::ostream& stream, const Network& network)
 {
-   const net::IP::Network& _network = network;
-   return stream << _network;
+  return stream << network.address() << "/" << (int) network.prefix();
 }
 
 
@@ -21,6 +21,9 @@ constexpr char DOCKER_BRIDGE_PREFIX[] = "d-";
 constexpr char MASTER_MANAGER_PROCESS_ID[] = "overlay-master";
 constexpr char AGENT_MANAGER_PROCESS_ID[] = "overlay-agent";
 
+// The VNI of the overlays that are not assigned a VNI of their own.
+constexpr uint32_t DEFAULT_VNI = 1024;
+
 const hashset<std::string> RESERVED_NETWORKS = {
   "host",
   "bridge",
@@ -0,0 +1,370 @@
+#include <string.h>
+
+#include <list>
+#include <string>
+
+#include <stout/foreach.hpp>
+#include <stout/lambda.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+#include <process/defer.hpp>
+#include <process/dispatch.hpp>
+#include <process/id.hpp>
+#include <process/process.hpp>
+
+#include <mesos/state/log.hpp>
+#include <mesos/state/protobuf.hpp>
+
+#include "store.hpp"
+
+using std::list;
+using std::string;
+
+using process::Failure;
+using process::Future;
+using process::Owned;
+using process::Process;
+using process::Promise;
+
+using mesos::log::Log;
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace master {
+
+// The key under which older masters stored the `State` using the
+// `LogStorage`. See `StoreProcess::migrate`.
+constexpr char LEGACY_STORE_KEY[] = "network-state";
+
+// Every snapshot starts with this header, which tells snapshots apart
+// from the entries written by the `LogStorage` of older masters.
+constexpr char SNAPSHOT_HEADER[] = "overlay-state-snapshot\n";
+
+// Number of log positions read at a time while looking for the latest
+// snapshot.
+constexpr uint64_t SEARCH_WINDOW = 8;
+
+
+class StoreProcess : public Process<StoreProcess>
+{
+public:
+  StoreProcess(Log* _log, size_t _retention)
+    : ProcessBase(process::ID::generate("overlay-store")),
+      log(_log),
+      reader(_log),
+      writer(_log),
+      retention(_retention),
+      truncated(0),
+      truncating(Nothing()),
+      legacy(false) {}
+
+  Future<Option<State>> recover()
+  {
+    legacy = false;
+
+    return writer.start()
+      .then(defer(self(), &StoreProcess::_recover, lambda::_1));
+  }
+
+  Future<Option<State>> follow()
+  {
+    return reader.beginning()
+      .then(defer(self(), &StoreProcess::_follow, lambda::_1));
+  }
+
+  Future<bool> store(const State& state)
+  {
+    // The writer can only perform one write at a time, so we need to
+    // wait for any pending truncation of the log.
+    return truncating
+      .then(defer(self(),
+                  &StoreProcess::append,
+                  SNAPSHOT_HEADER + state.SerializeAsString()));
+  }
+
+private:
+  Future<Option<State>> _recover(const Option<Log::Position>& ending)
+  {
+    if (ending.isNone()) {
+      return Failure("Lost the election to become the writer of the log");
+    }
+
+    return reader.beginning()
+      .then(defer(self(),
+                  &StoreProcess::__recover,
+                  lambda::_1,
+                  ending.get()));
+  }
+
+  Future<Option<State>> __recover(
+      const Log::Position& beginning,
+      const Log::Position& ending)
+  {
+    truncated = toIndex(beginning);
+
+    return read(beginning, ending)
+      .then(defer(self(), &StoreProcess::___recover, lambda::_1));
+  }
+
+  Future<Option<State>> ___recover(const Option<State>& state)
+  {
+    if (state.isNone() && latest.isNone() && legacy) {
+      return migrate();
+    }
+
+    return state;
+  }
+
+  Future<Option<State>> _follow(const Log::Position& beginning)
+  {
+    return reader.ending()
+      .then(defer(self(), &StoreProcess::read, beginning, lambda::_1));
+  }
+
+  // Returns the latest snapshot in the log if it is newer than the
+  // `latest` snapshot we have seen.
+  Future<Option<State>> read(
+      const Log::Position& beginning,
+      const Log::Position& ending)
+  {
+    uint64_t lowest = toIndex(beginning);
+    if (latest.isSome() && latest.get() >= lowest) {
+      lowest = latest.get() + 1;
+    }
+
+    if (toIndex(ending) < lowest) {
+      return None();
+    }
+
+    return search(lowest, toIndex(ending));
+  }
+
+  // Returns the latest snapshot in the positions [lowest, highest] of
+  // the log. The log is read backwards, `SEARCH_WINDOW` positions at
+  // a time, so that we don't read older snapshots.
+  Future<Option<State>> search(uint64_t lowest, uint64_t highest)
+  {
+    const uint64_t start = highest - lowest >= SEARCH_WINDOW
+      ? highest - SEARCH_WINDOW + 1
+      : lowest;
+
+    return reader.read(toPosition(start), toPosition(highest))
+      .then(defer(self(),
+                  &StoreProcess::_search,
+                  lowest,
+                  start,
+                  lambda::_1));
+  }
+
+  Future<Option<State>> _search(
+      uint64_t lowest,
+      uint64_t start,
+      const list<Log::Entry>& entries)
+  {
+    for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry) {
+      if (!strings::startsWith(entry->data, SNAPSHOT_HEADER)) {
+        // This entry has been written by the `LogStorage` of an older
+        // master.
+        legacy = true;
+        continue;
+      }
+
+      State state;
+      if (!state.ParseFromString(
+              entry->data.substr(strlen(SNAPSHOT_HEADER)))) {
+        return Failure(
+            "Failed to parse the snapshot at position " +
+            stringify(toIndex(entry->position)));
+      }
+
+      latest = toIndex(entry->position);
+
+      return state;
+    }
+
+    if (start == lowest) {
+      return None();
+    }
+
+    return search(lowest, start - 1);
+  }
+
+  Future<bool> append(const string& snapshot)
+  {
+    return writer.append(snapshot)
+      .then(defer(self(), &StoreProcess::_append, lambda::_1));
+  }
+
+  Future<bool> _append(const Option<Log::Position>& position)
+  {
+    if (position.isNone()) {
+      // We are no longer the writer of the log.
+      return false;
+    }
+
+    // Truncate the log once it holds twice as many positions as we
+    // need to retain, so that we truncate once every `retention`
+    // snapshots rather than after every snapshot.
+    const uint64_t index = toIndex(position.get());
+
+    latest = index;
+    if (index - truncated >= 2 * retention) {
+      truncated = index - retention;
+
+      VLOG(1) << "Truncating the overlay replicated log to position "
+              << truncated;
+
+      Owned<Promise<Nothing>> promise(new Promise<Nothing>());
+      truncating = promise->future();
+
+      writer.truncate(toPosition(truncated))
+        .onAny([promise](const Future<Option<Log::Position>>& result) {
+          // A failure to truncate is not fatal, the next truncation
+          // will include the positions that we failed to truncate.
+          if (!result.isReady()) {
+            LOG(WARNING) << "Failed to truncate the overlay replicated log: "
+                         << (result.isFailed() ? result.failure()
+                                               : "discarded");
+          }
+
+          promise->set(Nothing());
+        });
+    }
+
+    return true;
+  }
+
+  // Reads the `State` stored by an older master using the
+  // `LogStorage`, and stores it as a snapshot so that subsequent
+  // recoveries don't need the `LogStorage`.
+  Future<Option<State>> migrate()
+  {
+    LOG(INFO) << "Migrating the overlay `State` stored by an older master";
+
+    legacyStorage.reset(new mesos::state::LogStorage(log));
+    legacyState.reset(
+        new mesos::state::protobuf::State(legacyStorage.get()));
+
+    return legacyState->fetch<State>(LEGACY_STORE_KEY)
+      .then(defer(self(), &StoreProcess::_migrate, lambda::_1));
+  }
+
+  Future<Option<State>> _migrate(
+      const mesos::state::protobuf::Variable<State>& variable)
+  {
+    const State state = variable.get();
+
+    legacyState.reset();
+    legacyStorage.reset();
+
+    // The `LogStorage` has used a writer of its own, hence we need to
+    // get elected again before we can append to the log.
+    return writer.start()
+      .then(defer(self(),
+                  &StoreProcess::__migrate,
+                  state,
+                  lambda::_1));
+  }
+
+  Future<Option<State>> __migrate(
+      const State& state,
+      const Option<Log::Position>& ending)
+  {
+    if (ending.isNone()) {
+      return Failure("Lost the election to become the writer of the log");
+    }
+
+    return append(SNAPSHOT_HEADER + state.SerializeAsString())
+      .then([state](bool stored) -> Future<Option<State>> {
+        if (!stored) {
+          return Failure("Lost the log while migrating the `State`");
+        }
+
+        return state;
+      });
+  }
+
+  // Helpers to convert a `Log::Position` to an index in the log, and
+  // back, using the encoding of `Log::Position::identity`.
+  uint64_t toIndex(const Log::Position& position) const
+  {
+    uint64_t index = 0;
+    foreach (char byte, position.identity()) {
+      index = (index << 8) | (uint8_t) byte;
+    }
+
+    return index;
+  }
+
+  Log::Position toPosition(uint64_t index) const
+  {
+    string identity(sizeof(index), '\0');
+    for (size_t i = 0; i < sizeof(index); i++) {
+      identity[i] = (char) (0xff & (index >> ((sizeof(index) - i - 1) * 8)));
+    }
+
+    return log->position(identity);
+  }
+
+  Log* log;
+  Log::Reader reader;
+  Log::Writer writer;
+
+  // Number of log positions retained behind the latest snapshot.
+  const size_t retention;
+
+  // The position up to which the log has been truncated.
+  uint64_t truncated;
+
+  // Pending truncation of the log.
+  Future<Nothing> truncating;
+
+  // The position of the latest snapshot that has been read from, or
+  // appended to, the log.
+  Option<uint64_t> latest;
+
+  // Set if the log contains entries written by the `LogStorage`.
+  bool legacy;
+
+  Owned<mesos::state::Storage> legacyStorage;
+  Owned<mesos::state::protobuf::State> legacyState;
+};
+
+
+Store::Store(Log* log, size_t retention)
+  : process(new StoreProcess(log, retention))
+{
+  spawn(process.get());
+}
+
+
+Store::~Store()
+{
+  terminate(process.get());
+  wait(process.get());
+}
+
+
+Future<Option<State>> Store::recover()
+{
+  return dispatch(process.get(), &StoreProcess::recover);
+}
+
+
+Future<Option<State>> Store::follow()
+{
+  return dispatch(process.get(), &StoreProcess::follow);
+}
+
+
+Future<bool> Store::store(const State& state)
+{
+  return dispatch(process.get(), &StoreProcess::store, state);
+}
+
+} // namespace master {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
@@ -0,0 +1,62 @@
+#ifndef __OVERLAY_STORE_HPP__
+#define __OVERLAY_STORE_HPP__
+
+#include <process/future.hpp>
+#include <process/owned.hpp>
+
+#include <stout/option.hpp>
+
+#include <mesos/log/log.hpp>
+
+#include <overlay/overlay.hpp>
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace master {
+
+class StoreProcess;
+
+
+// Checkpoints the overlay `State` in a replicated log.
+//
+// Every write appends a complete snapshot of the `State` to the log,
+// hence recovering only requires reading the latest snapshot. Older
+// snapshots are never read again, so the log is periodically
+// truncated to keep only the last `retention` positions. This bounds
+// the disk used by the log, and the time it takes a replica to catch
+// up with the log.
+class Store
+{
+public:
+  Store(mesos::log::Log* log, size_t retention);
+
+  ~Store();
+
+  // Elects this master as the writer of the log, and returns the
+  // latest snapshot of the `State` in the log. Returns `None` if the
+  // log holds no snapshot newer than the last one returned by `follow`
+  // or `recover`, or stored with `store`.
+  process::Future<Option<State>> recover();
+
+  // Returns the latest snapshot in the local replica of the log if it
+  // is newer than the last one seen by this store, without becoming
+  // the writer of the log. Used by masters that are not leading to
+  // keep up with the leading master.
+  process::Future<Option<State>> follow();
+
+  // Appends a snapshot of `state` to the log. Returns false if this
+  // master is no longer the writer of the log, in which case it needs
+  // to `recover` before it can store again.
+  process::Future<bool> store(const State& state);
+
+private:
+  process::Owned<StoreProcess> process;
+};
+
+} // namespace master {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_STORE_HPP__
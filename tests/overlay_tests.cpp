@@ -1,4 +1,13 @@
+#include <errno.h>
+#include <signal.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
 #include <string>
+#include <vector>
 #include <ostream>
 
 #include <gmock/gmock.h>
@@ -7,6 +16,8 @@
 #include <mesos/mesos.hpp>
 #include <mesos/resources.hpp>
 
+#include <mesos/log/log.hpp>
+
 #include <mesos/module/module.hpp>
 #include <mesos/module/anonymous.hpp>
 
@@ -14,22 +25,37 @@
 
 #include <mesos/slave/isolator.hpp>
 
+#include <mesos/state/log.hpp>
+#include <mesos/state/protobuf.hpp>
+
+#include <process/clock.hpp>
+#include <process/collect.hpp>
 #include <process/future.hpp>
 #include <process/gmock.hpp>
 #include <process/gtest.hpp>
 #include <process/http.hpp>
 #include <process/process.hpp>
 #include <process/owned.hpp>
+#include <process/socket.hpp>
 
+#include <stout/bytes.hpp>
+#include <stout/foreach.hpp>
 #include <stout/gtest.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/hashset.hpp>
 #include <stout/json.hpp>
+#include <stout/numify.hpp>
 #include <stout/option.hpp>
 #include <stout/os.hpp>
 #include <stout/path.hpp>
 #include <stout/protobuf.hpp>
+#include <stout/stopwatch.hpp>
 #include <stout/try.hpp>
 
 #include <stout/os/read.hpp>
+#include <stout/os/stat.hpp>
+
+#include <stout/tests/utils.hpp>
 
 #include "common/shell.hpp"
 
@@ -41,9 +67,15 @@
 
 #include "overlay/agent.hpp"
 #include "overlay/constants.hpp"
+#include "overlay/datapath.hpp"
+#include "overlay/docker.hpp"
+#include "overlay/ipam.hpp"
 #include "overlay/messages.pb.h"
+#include "overlay/netfilter.hpp"
+#include "overlay/network.hpp"
 #include "overlay/overlay.hpp"
 #include "overlay/overlay.pb.h"
+#include "overlay/store.hpp"
 
 
 #include "slave/flags.hpp"
@@ -58,7 +90,9 @@ using namespace mesos::internal::tests;
 using std::cout;
 using std::endl;
 using std::string;
+using std::vector;
 
+using process::Clock;
 using process::Future;
 using process::Owned;
 using process::PID;
@@ -73,8 +107,12 @@ using mesos::internal::slave::Containerizer;
 using mesos::internal::slave::MesosContainerizerProcess;
 using mesos::internal::slave::Slave;
 
+using mesos::log::Log;
+
 using mesos::master::detector::MasterDetector;
 
+using mesos::modules::common::MAX_COMMAND_OUTPUT;
+using mesos::modules::common::MAX_CONCURRENT_COMMANDS;
 using mesos::modules::common::runCommand;
 using mesos::modules::common::runScriptCommand;
 
@@ -84,15 +122,34 @@ using mesos::modules::overlay::AgentInfo;
 using mesos::modules::overlay::AgentOverlayInfo;
 using mesos::modules::overlay::AGENT_MANAGER_PROCESS_ID;
 using mesos::modules::overlay::MASTER_MANAGER_PROCESS_ID;
+using mesos::modules::overlay::Network;
+using mesos::modules::overlay::ReconciliationInfo;
 using mesos::modules::overlay::RESERVED_NETWORKS;
+using mesos::modules::overlay::internal::AgentCheckpoint;
 using mesos::modules::overlay::internal::AgentConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
 using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RegisterAgentNackMessage;
+using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
 using mesos::modules::overlay::internal::MasterConfig;
+using mesos::modules::overlay::internal::MasterReadyMessage;
+using mesos::modules::overlay::internal::PeerSnapshotRequestMessage;
+using mesos::modules::overlay::internal::PeerUpdateMessage;
+using mesos::modules::overlay::master::Store;
 using mesos::modules::overlay::OverlayInfo;
+using mesos::modules::overlay::OverlayState;
 using mesos::modules::overlay::State;
+using mesos::modules::overlay::VxLANInfo;
+using mesos::modules::overlay::agent::Datapath;
+using mesos::modules::overlay::agent::DockerClient;
+using mesos::modules::overlay::agent::DockerNetwork;
 using mesos::modules::overlay::agent::IPSET_OVERLAY;
+using mesos::modules::overlay::agent::Ipam;
+using mesos::modules::overlay::agent::NETFILTER_BACKEND_BATCH;
+using mesos::modules::overlay::agent::NETFILTER_BACKEND_SHELL;
+using mesos::modules::overlay::agent::Netfilter;
+using mesos::modules::overlay::agent::Peer;
 
 namespace mesos {
 namespace overlay {
@@ -104,6 +161,7 @@ constexpr char OVERLAY_SUBNET[] = "192.168.0.0/16";
 constexpr char OVERLAY_SUBNET6[] = "fd02::/64";
 constexpr char OVERLAY_NAME[] = "mz-overlay";
 constexpr char MASTER_JSON_CONFIG[] = "master.json";
+constexpr char MASTER_REPLICATED_LOG_DIR[] = "overlay_replicated_log";
 constexpr char MASTER_OVERLAY_MODULE_NAME[] =
   "com_mesosphere_mesos_OverlayMasterManager";
 
@@ -304,6 +362,12 @@ protected:
     masterOverlayConfig.mutable_network()->clear_overlays();
   }
 
+  // Removes the IPv4 VTEP subnet, as in an IPv6-only cluster.
+  void clearVtepSubnet()
+  {
+    masterOverlayConfig.mutable_network()->clear_vtep_subnet();
+  }
+
   // Initializes the overlay Agent module using the
   // `agentOverlayConfig` initialized during `Setup`. By default the
   // `agentOverlayConfig` has the Mesos and the Docker networks
@@ -526,31 +590,25 @@ TEST_F(OverlayTest, checkMasterAgentComm)
 }
 
 
-// Tests the ability of the `Agent overlay module` to create Mesos CNI
-// networks when `mesos bridge` has been enabled.
-TEST_F(OverlayTest, ROOT_checkMesosNetwork)
+// Tests that the `overlay` endpoint of the `Agent overlay module`
+// honors the ETag of its response, that the `overlay/stream` endpoint
+// starts with the current status of the overlays, and that the
+// `overlay/reconciliation` endpoint reports the last reconciliation.
+TEST_F(OverlayTest, checkAgentOverlayEndpoint)
 {
   Try<Owned<cluster::Master>> master = StartMaster();
   ASSERT_SOME(master);
 
-  LOG(INFO) << "Master PID: " << master.get()->pid;
-
   Try<Owned<Anonymous>> masterModule = startOverlayMaster();
   ASSERT_SOME(masterModule);
 
-  // Master `Anonymous` module created successfully. Lets see if we
-  // can hit the `state` endpoint of the Master.
   UPID overlayMaster = UPID(
       MASTER_MANAGER_PROCESS_ID,
       master.get()->pid.address);
 
   AgentConfig agentOverlayConfig;
   agentOverlayConfig.set_master(stringify(overlayMaster.address));
-  // Enable Mesos network.
-  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
 
-  // Setup a future to notify the test that Agent overlay module has
-  // registered.
   Future<AgentRegisteredMessage> agentRegisteredMessage =
     FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
 
@@ -560,90 +618,123 @@ TEST_F(OverlayTest, ROOT_checkMesosNetwork)
   ASSERT_SOME(agentModule);
 
   AWAIT_READY(agentRegisteredMessage);
-
-  // Check the agent is allowed to progress.
   AWAIT_READY(agentModule.get()->ready());
 
-  // Verify that `ipset` has been created and the `iptables` entries
-  // exist.
-  Future<string> ipset = runCommand("ipset",
-      {"ipset",
-      "list",
-      IPSET_OVERLAY});
-  AWAIT_READY(ipset);
+  UPID overlayAgent = UPID(
+      AGENT_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
 
-  // Verify that the `IPMASQ` rules have been installed.
-  Future<string> iptables = runCommand("iptables",
-      {"iptables",
-      "-t", "nat",
-      "-C", "POSTROUTING",
-      "-s", OVERLAY_SUBNET,
-      "-m", "set",
-      "--match-set", stringify(IPSET_OVERLAY), "dst",
-      "-j", "MASQUERADE",
-      });
-  AWAIT_READY(iptables);
+  Future<Response> response = process::http::get(overlayAgent, "overlay");
 
-  // Verify the CNI configuration has been installed correctly.
-  Try<string> cniConfig = os::read(
-      path::join("cni", stringify(OVERLAY_NAME) + ".conf"));
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+  ASSERT_TRUE(response->headers.contains("ETag"));
 
-  ASSERT_SOME(cniConfig);
+  const string etag = response->headers.at("ETag");
+  const string body = response->body;
 
-  Try<JSON::Object> json = JSON::parse<JSON::Object>(cniConfig.get());
-  ASSERT_SOME(json);
+  // The information has not changed, so it is not sent again.
+  http::Headers headers;
+  headers["If-None-Match"] = etag;
 
-  Result<JSON::String> network = json->find<JSON::String>("name");
-  ASSERT_SOME(network);
-  EXPECT_EQ(network.get(), OVERLAY_NAME);
+  response = process::http::get(overlayAgent, "overlay", None(), headers);
 
-  // Since we introduced port-mapping support for DC/OS overlay with
-  // the `MesoContainerizer`, the bridge configuration is now part of
-  // the `delegate` field in the CNI configuration. Therefore need to
-  // we need find the `ipMasq`, `mtu` and `ipam` fields under
-  // `delegate`.
-  Result<JSON::Boolean> ipMasq = json->find<JSON::Boolean>("delegate.ipMasq");
-  ASSERT_SOME(ipMasq) << "CNI config: " << cniConfig.get();
-  EXPECT_EQ(ipMasq.get(), false);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(
+      http::Status::string(http::Status::NOT_MODIFIED),
+      response);
+  EXPECT_EQ(etag, response->headers.get("ETag"));
 
-  Result<JSON::Number> mtu = json->find<JSON::Number>("delegate.mtu");
-  ASSERT_SOME(mtu) << "CNI config: " << cniConfig.get();
-  EXPECT_EQ(mtu.get(), 1420);
+  // A stale ETag gets the information.
+  headers["If-None-Match"] = "\"stale\"";
 
-  Result<JSON::Object> ipam = json->find<JSON::Object>("delegate.ipam");
-  ASSERT_SOME(ipam) << "CNI config: " << cniConfig.get();
+  response = process::http::get(overlayAgent, "overlay", None(), headers);
 
-  Result<JSON::String> subnet = ipam->find<JSON::String>("subnet");
-  ASSERT_SOME(subnet) << "CNI config: " << cniConfig.get();
-  EXPECT_EQ(subnet.get(), "192.168.0.0/25");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+  EXPECT_EQ(body, response->body);
+
+  response = http::streaming::get(overlayAgent, "overlay/stream");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+  ASSERT_EQ(http::Response::PIPE, response->type);
+  ASSERT_SOME(response->reader);
+
+  http::Pipe::Reader reader = response->reader.get();
+
+  string events;
+  while (!strings::contains(events, "\n")) {
+    Future<string> read = reader.read();
+    AWAIT_READY(read);
+    ASSERT_FALSE(read->empty());
+
+    events += read.get();
+  }
+
+  Try<JSON::Object> event = JSON::parse<JSON::Object>(
+      events.substr(0, events.find('\n')));
+
+  ASSERT_SOME(event);
+  EXPECT_SOME_EQ(JSON::String(OVERLAY_NAME), event->find<JSON::String>("name"));
+  EXPECT_SOME_EQ(
+      JSON::String("STATUS_OK"),
+      event->find<JSON::String>("status"));
+
+  reader.close();
+
+  // The agent reports the phases of the reconciliation that
+  // configured its overlay.
+  response = process::http::get(overlayAgent, "overlay/reconciliation");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+  Try<JSON::Object> json = JSON::parse<JSON::Object>(response->body);
+  ASSERT_SOME(json);
+
+  Try<ReconciliationInfo> reconciliation =
+    ::protobuf::parse<ReconciliationInfo>(json.get());
+  ASSERT_SOME(reconciliation);
+  EXPECT_EQ(1u, reconciliation->overlays());
+
+  // The phases after the one that failed the overlay, if any, are
+  // skipped.
+  const vector<string> phases = {
+    "datapath", "mesos", "docker", "docker_isolation", "netfilter"};
+
+  ASSERT_LE(1, reconciliation->phases_size());
+  ASSERT_GE(5, reconciliation->phases_size());
+
+  for (int i = 0; i < reconciliation->phases_size(); i++) {
+    EXPECT_EQ(phases[i], reconciliation->phases(i).name());
+  }
 }
 
 
-// Tests the ability of the `Agent overlay module` to create Docker
-// network.
-TEST_F(OverlayTest, ROOT_checkDockerNetwork)
+// Tests that the `Master overlay module` allocates IPv6-only VTEPs
+// and subnets when neither the VTEPs nor the overlays have an IPv4
+// subnet, and derives the VTEP MAC from the VTEP IPv6.
+TEST_F(OverlayTest, checkIPv6OnlyMaster)
 {
   Try<Owned<cluster::Master>> master = StartMaster();
   ASSERT_SOME(master);
 
-  LOG(INFO) << "Master PID: " << master.get()->pid;
+  clearVtepSubnet();
+  clearOverlays();
 
-  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet6(OVERLAY_SUBNET6);
+  overlay.set_prefix6(OVERLAY_PREFIX6);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
   ASSERT_SOME(masterModule);
 
-  // Master `Anonymous` module created successfully. Lets see if we
-  // can hit the `state` endpoint of the Master.
   UPID overlayMaster = UPID(
       MASTER_MANAGER_PROCESS_ID,
       master.get()->pid.address);
 
   AgentConfig agentOverlayConfig;
   agentOverlayConfig.set_master(stringify(overlayMaster.address));
-  // Enable Docker network.
-  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
 
-  // Setup a future to notify the test that Agent overlay module has
-  // registered.
   Future<AgentRegisteredMessage> agentRegisteredMessage =
     FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
 
@@ -653,697 +744,3419 @@ TEST_F(OverlayTest, ROOT_checkDockerNetwork)
   ASSERT_SOME(agentModule);
 
   AWAIT_READY(agentRegisteredMessage);
-
-  // Check the agent is allowed to progress.
   AWAIT_READY(agentModule.get()->ready());
 
-  // Verify that `ipset` has been created and the `iptables` entries
-  // exist.
-  Future<string> ipset = runCommand("ipset",
-      {"ipset",
-      "list",
-      IPSET_OVERLAY});
-
-  AWAIT_READY(ipset);
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
 
-  // Verify that the `IPMASQ` rules have been installed.
-  Future<string> iptables = runCommand("iptables",
-      {"iptables",
-      "-t", "nat",
-      "-C", "POSTROUTING",
-      "-s", OVERLAY_SUBNET,
-      "-m", "set",
-      "--match-set", stringify(IPSET_OVERLAY), "dst",
-      "-j", "MASQUERADE",
-      });
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
 
-  AWAIT_READY(iptables);
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  EXPECT_FALSE(state->network().has_vtep_subnet());
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(1, state->agents(0).overlays_size());
 
-  // Verify the docker network has been installed correctly.
-  Future<string> docker = runCommand("docker",
-      {"docker",
-      "network",
-      "inspect",
-      OVERLAY_NAME});
+  const AgentOverlayInfo& agentOverlay = state->agents(0).overlays(0);
+  EXPECT_FALSE(agentOverlay.has_subnet());
+  EXPECT_EQ("fd02::/80", agentOverlay.subnet6());
 
-  AWAIT_READY(docker);
+  const VxLANInfo& vxlan = agentOverlay.backend().vxlan();
+  EXPECT_FALSE(vxlan.has_vtep_ip());
+  EXPECT_EQ("fd03::1/64", vxlan.vtep_ip6());
 
-  Try<JSON::Array> json = JSON::parse<JSON::Array>(docker.get());
-  ASSERT_SOME(json);
+  // The NIC of the VTEP MAC is the least 24 bits of the VTEP IPv6.
+  EXPECT_EQ("70:b3:d5:00:00:01", vxlan.vtep_mac());
 }
 
 
-// Tests the ability of the `Master overlay module` to recover
-// checkpointed overlay `State`.
-TEST_F(OverlayTest, ROOT_checkMasterRecovery)
+// Tests that the `Master overlay module` allocates a VNI of its own
+// to every overlay that is not configured with one, and that the
+// backend of every overlay of an Agent has the VNI and the VTEP of
+// the overlay.
+TEST_F(OverlayTest, checkPerOverlayVNI)
 {
   Try<Owned<cluster::Master>> master = StartMaster();
   ASSERT_SOME(master);
 
-  LOG(INFO) << "Master PID: " << master.get()->pid;
+  OverlayInfo overlay;
+  overlay.set_name("vni-overlay");
+  overlay.set_subnet("10.0.0.0/8");
+  overlay.set_prefix(OVERLAY_PREFIX);
+  overlay.set_vni(2000);
 
-  // Ask overlay Master to use the replicated log by setting
-  // `replicated_log_dir`. We are not specifying `zk` configuration so
-  // the `quorum` will default to "1".
   MasterConfig masterOverlayConfig;
-  masterOverlayConfig
-    .set_replicated_log_dir("overlay_replicated_log");
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+  masterOverlayConfig.mutable_network()->mutable_vni_range()->set_begin(4096);
+  masterOverlayConfig.mutable_network()->mutable_vni_range()->set_end(4100);
 
   Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
   ASSERT_SOME(masterModule);
 
-  // Master `Anonymous` module created successfully. Lets see if we
-  // can hit the `state` endpoint of the Master.
   UPID overlayMaster = UPID(
       MASTER_MANAGER_PROCESS_ID,
       master.get()->pid.address);
 
   AgentConfig agentOverlayConfig;
   agentOverlayConfig.set_master(stringify(overlayMaster.address));
-  // Enable Mesos network.
-  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
-  // Enable Docker network.
-  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
 
-  // Setup a future to notify the test that Agent overlay module has
-  // registered.
-  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
-    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
 
   Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
       agentOverlayConfig);
 
-  ASSERT_SOME(agentModule );
-
-  AWAIT_READY(agentRegisteredAcknowledgement);
+  ASSERT_SOME(agentModule);
 
-  // Check the agent is allowed to progress.
+  AWAIT_READY(agentRegisteredMessage);
   AWAIT_READY(agentModule.get()->ready());
 
-  // Agent manager has been created. Hit the `overlay` endpoint to
-  // check that module is up and responding.
-  UPID overlayAgent = UPID(master.get()->pid);
-  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
 
-  Future<Response> agentResponse = process::http::get(
-      overlayAgent,
-      "overlay");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      agentResponse);
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
 
-  // The `overlay` end-point is backed by the
-  // mesos::modules::overlay::AgentInfo protobuf, so need to parse the
-  // JSON and verify that the correct configuration is being
-  // reflected.
-  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
-  ASSERT_SOME(info);
+  hashmap<string, uint32_t> expected;
+  expected[OVERLAY_NAME] = 4096;
+  expected["vni-overlay"] = 2000;
 
-  // There should be only 1 overlay.
-  ASSERT_EQ(1, info->overlays_size());
-  EXPECT_EQ(OVERLAY_NAME, info->overlays(0).info().name());
+  ASSERT_EQ(2, state->network().overlays_size());
+  foreach (const OverlayInfo& info, state->network().overlays()) {
+    ASSERT_TRUE(expected.contains(info.name()));
+    EXPECT_EQ(expected.at(info.name()), info.vni());
+  }
 
-  Try<net::IP::Network> agentNetwork = net::IP::Network::parse(
-      info->overlays(0).subnet(), AF_INET);
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(2, state->agents(0).overlays_size());
 
-  ASSERT_SOME(agentNetwork);
-  EXPECT_EQ(OVERLAY_PREFIX, agentNetwork->prefix());
+  foreach (const AgentOverlayInfo& agentOverlay, state->agents(0).overlays()) {
+    const uint32_t vni = expected.at(agentOverlay.info().name());
 
-  Try<net::IP::Network> allocatedSubnet = net::IP::Network::parse(
-      "192.168.0.0/24", AF_INET);
+    EXPECT_EQ(vni, agentOverlay.info().vni());
+    EXPECT_EQ(vni, agentOverlay.backend().vxlan().vni());
+    EXPECT_EQ(
+        "vtep" + stringify(vni),
+        agentOverlay.backend().vxlan().vtep_name());
+  }
 
-  ASSERT_SOME(allocatedSubnet);
-  EXPECT_EQ(allocatedSubnet.get(), agentNetwork.get());
+  // The VTEPs of the overlays share the VTEP MAC of the agent.
+  EXPECT_EQ(
+      state->agents(0).overlays(0).backend().vxlan().vtep_mac(),
+      state->agents(0).overlays(1).backend().vxlan().vtep_mac());
+}
 
-  // IPv6
-  Try<net::IP::Network> agentNetwork6 = net::IP::Network::parse(
-      info->overlays(0).subnet6(), AF_INET6);
 
-  ASSERT_SOME(agentNetwork6);
-  EXPECT_EQ(OVERLAY_PREFIX6, agentNetwork6->prefix());
+// Tests that the overlays added and removed through the `overlays`
+// endpoint of the `Master overlay module` are stored, and are sent to
+// a registered Agent without it re-registering.
+TEST_F(OverlayTest, checkRuntimeOverlays)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
 
-  Try<net::IP::Network> allocatedSubnet6 = net::IP::Network::parse(
-      "fd02::/80", AF_INET6);
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
 
-  ASSERT_SOME(allocatedSubnet6);
-  EXPECT_EQ(allocatedSubnet6.get(), agentNetwork6.get());
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
 
-  ASSERT_SOME(allocatedSubnet);
-  EXPECT_EQ(allocatedSubnet.get(), agentNetwork.get());
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
 
-  // Hit the `state` end-point. We should be seeing the
-  // Agents overlay subnet allocation in the `state` endpoint.
-  Future<http::Response> masterResponse = process::http::get(
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+  AWAIT_READY(agentModule.get()->ready());
+
+  // An overlay that overlaps an existing overlay is rejected.
+  OverlayInfo overlay;
+  overlay.set_name("mz-overlay2");
+  overlay.set_subnet("192.168.128.0/17");
+  overlay.set_prefix(OVERLAY_PREFIX);
+
+  Future<Response> response = process::http::post(
       overlayMaster,
-      "state");
+      "overlays",
+      None(),
+      stringify(JSON::protobuf(overlay)),
+      APPLICATION_JSON);
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      masterResponse);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(http::BadRequest().status, response);
 
-  Try<State> state = parseMasterState(masterResponse->body);
-  ASSERT_SOME(state);
-  ASSERT_EQ(1, state->agents_size());
+  // The added overlay is sent to the Agent as a delta.
+  Future<UpdateAgentOverlaysMessage> updateMessage =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), _, _);
 
-  AgentInfo masterAgentInfo;
-  masterAgentInfo.CopyFrom(state->agents(0));
-  EXPECT_EQ(
-      info.get().SerializeAsString(),
-      masterAgentInfo.SerializeAsString())
-      << "Agent response: " << agentResponse->body
-      << ", Master response: " << masterResponse->body;
+  agentRegisteredMessage = FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
 
-  // Kill the master.
-  masterModule->reset();
+  overlay.set_subnet("10.0.0.0/16");
 
-  masterModule = startOverlayMaster(masterOverlayConfig);
-  ASSERT_SOME(masterModule);
+  response = process::http::post(
+      overlayMaster,
+      "overlays",
+      None(),
+      stringify(JSON::protobuf(overlay)),
+      APPLICATION_JSON);
 
-  // Re-start the master and wait for the Agent to re-register.
-  agentRegisteredAcknowledgement = FUTURE_PROTOBUF(
-      AgentRegisteredAcknowledgement(), _, _);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
 
-  AWAIT_READY(agentRegisteredAcknowledgement);
+  AWAIT_READY(updateMessage);
+  EXPECT_TRUE(updateMessage->delta());
+  ASSERT_EQ(1, updateMessage->overlays_size());
+  EXPECT_EQ("mz-overlay2", updateMessage->overlays(0).info().name());
+  EXPECT_EQ("10.0.0.0/24", updateMessage->overlays(0).subnet());
 
-  // Hit the master end-point again.
-  masterResponse = process::http::get(
-      overlayMaster,
-      "state");
+  AWAIT_READY(agentRegisteredMessage);
+  EXPECT_EQ(2, agentRegisteredMessage->overlays_size());
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      masterResponse);
+  response = process::http::get(overlayMaster, "state");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
 
-  state = parseMasterState(masterResponse->body);
+  Try<State> state = parseMasterState(response->body);
   ASSERT_SOME(state);
+  EXPECT_EQ(2, state->network().overlays_size());
+  ASSERT_EQ(1, state->runtime_overlays_size());
+  EXPECT_EQ("mz-overlay2", state->runtime_overlays(0).name());
   ASSERT_EQ(1, state->agents_size());
+  EXPECT_EQ(2, state->agents(0).overlays_size());
 
-  AgentInfo recoveredMasterAgentInfo;
-  recoveredMasterAgentInfo.CopyFrom(state->agents(0));
-  EXPECT_EQ(
-      masterAgentInfo.SerializeAsString(),
-      recoveredMasterAgentInfo.SerializeAsString());
+  // The removed overlay is removed from the Agent.
+  updateMessage = FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), _, _);
+
+  http::Request request;
+  request.method = "DELETE";
+  request.url = http::URL(
+      "http",
+      overlayMaster.address.ip,
+      overlayMaster.address.port,
+      overlayMaster.id + "/overlays");
+  request.url.query["name"] = "mz-overlay2";
+  request.keepAlive = false;
+
+  response = http::request(request);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+  AWAIT_READY(updateMessage);
+  ASSERT_EQ(1, updateMessage->removed_overlays_size());
+  EXPECT_EQ("mz-overlay2", updateMessage->removed_overlays(0));
+
+  response = process::http::get(overlayMaster, "state");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+  state = parseMasterState(response->body);
+  ASSERT_SOME(state);
+  EXPECT_EQ(1, state->network().overlays_size());
+  EXPECT_EQ(0, state->runtime_overlays_size());
+  ASSERT_EQ(1, state->removed_overlays_size());
+  EXPECT_EQ("mz-overlay2", state->removed_overlays(0));
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(1, state->agents(0).overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, state->agents(0).overlays(0).info().name());
 }
 
 
-// Tests the ability of the `Agent overlay module` to recover
-// `AgentInfo` from the master.
-TEST_F(OverlayTest, ROOT_checkAgentRecovery)
+// Tests that the `Master overlay module` ignores the state of an
+// overlay removed while an Agent is configuring it, which the Agent
+// reports once its configuration completes.
+TEST_F(OverlayTest, checkRemoveConfiguringOverlay)
 {
   Try<Owned<cluster::Master>> master = StartMaster();
   ASSERT_SOME(master);
 
-  LOG(INFO) << "Master PID: " << master.get()->pid;
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
 
-  // Ask overlay Master to use the replicated log by setting
-  // `replicated_log_dir`. We are not specifying `zk` configuration so
-  // the `quorum` will default to "1".
-  MasterConfig masterOverlayConfig;
-  masterOverlayConfig
-    .set_replicated_log_dir("overlay_replicated_log");
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
 
-  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
-  ASSERT_SOME(masterModule);
+  OverlayInfo overlay;
+  overlay.set_name("mz-overlay2");
+  overlay.set_subnet("10.0.0.0/16");
+  overlay.set_prefix(OVERLAY_PREFIX);
 
-  // Master `Anonymous` module created successfully. Lets see if we
-  // can hit the `state` endpoint of the Master.
-  UPID overlayMaster = UPID(master.get()->pid);
-  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+  Future<Response> response = process::http::post(
+      overlayMaster,
+      "overlays",
+      None(),
+      stringify(JSON::protobuf(overlay)),
+      APPLICATION_JSON);
 
-  AgentConfig agentOverlayConfig;
-  agentOverlayConfig.set_master(stringify(overlayMaster.address));
-  // Enable Mesos network.
-  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
-  // Enable Docker network.
-  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
 
-  // Setup a future to notify the test that Agent overlay module has
-  // registered.
-  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
-    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+  // NOTE: Nothing listens on the address of the agent, so the agent
+  // never acknowledges the overlays, i.e., it is configuring them.
+  UPID agent(
+      AGENT_MANAGER_PROCESS_ID,
+      process::network::inet::Address(net::IP(0x7f010001), 1));
+
+  Future<UpdateAgentOverlaysMessage> update =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+
+  RegisterAgentMessage registerMessage;
+  registerMessage.mutable_network_config();
+
+  process::post(agent, overlayMaster, registerMessage);
+
+  AWAIT_READY(update);
+  ASSERT_EQ(2, update->overlays_size());
+
+  http::Request request;
+  request.method = "DELETE";
+  request.url = http::URL(
+      "http",
+      overlayMaster.address.ip,
+      overlayMaster.address.port,
+      overlayMaster.id + "/overlays");
+  request.url.query["name"] = "mz-overlay2";
+  request.keepAlive = false;
+
+  response = http::request(request);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+  // The agent reports the overlays it has configured, including the
+  // removed overlay.
+  AgentRegisteredMessage registered;
+  foreach (AgentOverlayInfo _overlay, update->overlays()) {
+    _overlay.mutable_state()->set_status(OverlayState::STATUS_OK);
+    registered.add_overlays()->CopyFrom(_overlay);
+  }
 
-  Try<Owned<overlayAgent::ManagerProcess>> agentModule  = startOverlayAgent(
-      agentOverlayConfig);
+  Future<AgentRegisteredAcknowledgement> acknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), overlayMaster, _);
 
-  ASSERT_SOME(agentModule);
+  process::post(agent, overlayMaster, registered);
 
-  AWAIT_READY(agentRegisteredAcknowledgement);
+  AWAIT_READY(acknowledgement);
 
-  // Check the agent is allowed to progress.
-  AWAIT_READY(agentModule.get()->ready());
+  response = process::http::get(overlayMaster, "state");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
 
-  // Agent manager has been created. Hit the `overlay` endpoint to
-  // check that module is up and responding.
-  UPID overlayAgent = UPID(master.get()->pid);
-  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+  Try<State> state = parseMasterState(response->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+  ASSERT_EQ(1, state->agents(0).overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, state->agents(0).overlays(0).info().name());
+  EXPECT_EQ(
+      OverlayState::STATUS_OK,
+      state->agents(0).overlays(0).state().status());
+}
 
-  Future<Response> agentResponse = process::http::get(
-      overlayAgent,
-      "overlay");
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      agentResponse);
+// Tests that the `Master overlay module` only sends the overlays that
+// changed since the generation applied by a re-registering Agent, and
+// that the re-registrations that change nothing keep the generation.
+TEST_F(OverlayTest, checkDeltaRegistration)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
 
-  // The `overlay` end-point is backed by the
-  // mesos::modules::overlay::AgentInfo protobuf, so need to parse the
-  // JSON and verify that the correct configuration is being
-  // reflected.
-  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
-  ASSERT_SOME(info);
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
 
-  // There should be only 1 overlay.
-  ASSERT_EQ(1, info->overlays_size());
-  EXPECT_EQ(OVERLAY_NAME, info->overlays(0).info().name());
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
 
-  Try<net::IP::Network> agentNetwork = net::IP::Network::parse(
-      info->overlays(0).subnet(), AF_INET);
+  UPID overlayAgent = UPID(
+      AGENT_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
 
-  ASSERT_SOME(agentNetwork);
-  EXPECT_EQ(24, agentNetwork->prefix());
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
 
-  Try<net::IP::Network> allocatedSubnet = net::IP::Network::parse(
-      "192.168.0.0/24", AF_INET);
+  Future<UpdateAgentOverlaysMessage> update =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
 
-  ASSERT_SOME(allocatedSubnet);
-  EXPECT_EQ(allocatedSubnet.get(), agentNetwork.get());
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+  ASSERT_SOME(agentModule);
 
-  // IPv6
-  Try<net::IP::Network> agentNetwork6 = net::IP::Network::parse(
-      info->overlays(0).subnet6(), AF_INET6);
+  // The first registration gets the complete configuration.
+  AWAIT_READY(update);
+  EXPECT_FALSE(update->delta());
+  ASSERT_EQ(1, update->overlays_size());
+  ASSERT_TRUE(update->has_generation());
+  EXPECT_EQ(update->generation(), update->overlays(0).generation());
 
-  ASSERT_SOME(agentNetwork6);
-  EXPECT_EQ(OVERLAY_PREFIX6, agentNetwork6->prefix());
+  const uint64_t generation = update->generation();
 
-  Try<net::IP::Network> allocatedSubnet6 = net::IP::Network::parse(
-      "fd02::/80", AF_INET6);
+  AWAIT_READY(agentModule.get()->ready());
 
-  ASSERT_SOME(allocatedSubnet6);
-  EXPECT_EQ(allocatedSubnet6.get(), agentNetwork6.get());
+  // An agent that has applied the latest generation gets an empty
+  // update.
+  RegisterAgentMessage registerMessage;
+  registerMessage.mutable_network_config();
+  registerMessage.set_generation(generation);
 
-  // Re-start the agent and wait for the agent to re-register.
-  Future<AgentRegisteredAcknowledgement> agentReRegisteredAcknowledgement =
-    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+  update = FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+  process::post(overlayAgent, overlayMaster, registerMessage);
 
-  // Kill the agent.
-  Try<Nothing> stop = stopOverlayAgent();
-  ASSERT_SOME(stop);
+  AWAIT_READY(update);
+  EXPECT_TRUE(update->delta());
+  EXPECT_EQ(0, update->overlays_size());
+  EXPECT_EQ(generation, update->generation());
 
-  // re-start the agent.
-  agentModule  = startOverlayAgent(agentOverlayConfig);
-  ASSERT_SOME(agentModule );
+  // An agent that has applied an older generation gets the overlays
+  // assigned since.
+  registerMessage.set_generation(generation - 1);
 
-  AWAIT_READY(agentReRegisteredAcknowledgement);
+  update = FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+  process::post(overlayAgent, overlayMaster, registerMessage);
 
-  // Check the agent is allowed to progress.
-  AWAIT_READY(agentModule.get()->ready());
+  AWAIT_READY(update);
+  EXPECT_TRUE(update->delta());
+  EXPECT_EQ(1, update->overlays_size());
+  EXPECT_EQ(generation, update->generation());
 
-  // Hit the master end-point again.
-  agentResponse = process::http::get(
-      overlayAgent,
-      "overlay");
+  // An agent that doesn't report a generation gets the complete
+  // configuration.
+  registerMessage.clear_generation();
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      agentResponse);
+  update = FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+  process::post(overlayAgent, overlayMaster, registerMessage);
 
-  Try<AgentInfo> reRegisterInfo = parseAgentOverlay(agentResponse->body);
-  ASSERT_SOME(reRegisterInfo);
+  AWAIT_READY(update);
+  EXPECT_FALSE(update->delta());
+  EXPECT_EQ(1, update->overlays_size());
 
-  EXPECT_EQ(
-      info.get().SerializeAsString(),
-      reRegisterInfo.get().SerializeAsString());
+  // The re-registrations changed nothing, so they didn't consume a
+  // generation.
+  EXPECT_EQ(generation, update->generation());
 }
 
 
-// Tests the ability of the `Agent overlay module` to honor the
-// `AgentNetworkConfig` over the overlay the network configuration
-// specified by the Master.
-TEST_F(OverlayTest, ROOT_checkAgentNetworkConfigChange)
+// Tests that the `Master overlay module` defers the registrations of
+// the Agents beyond `max_concurrent_registrations` with a
+// `RegisterAgentNackMessage`, and tells a deferred Agent to register
+// with a `MasterReadyMessage` once a registration in progress
+// completes.
+TEST_F(OverlayTest, checkRegistrationAdmission)
 {
   Try<Owned<cluster::Master>> master = StartMaster();
   ASSERT_SOME(master);
 
-  LOG(INFO) << "Master PID: " << master.get()->pid;
-
-  // Ask overlay Master to use the replicated log by setting
-  // `replicated_log_dir`. We are not specifying `zk` configuration so
-  // the `quorum` will default to "1".
   MasterConfig masterOverlayConfig;
-  masterOverlayConfig
-    .set_replicated_log_dir("overlay_replicated_log");
+  masterOverlayConfig.set_max_concurrent_registrations(1);
 
   Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
   ASSERT_SOME(masterModule);
 
-  // Master `Anonymous` module created successfully. Lets see if we
-  // can hit the `state` endpoint of the Master.
-  UPID overlayMaster = UPID(master.get()->pid);
-  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  // NOTE: Nothing listens on the address of this agent, so it holds
+  // the only admission until we acknowledge its overlays for it.
+  UPID agent(
+      AGENT_MANAGER_PROCESS_ID,
+      process::network::inet::Address(net::IP(0x7f010001), 1));
+
+  Future<UpdateAgentOverlaysMessage> update =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, agent);
+
+  RegisterAgentMessage registerMessage;
+  registerMessage.mutable_network_config();
+
+  process::post(agent, overlayMaster, registerMessage);
+
+  AWAIT_READY(update);
+
+  UPID overlayAgent = UPID(
+      AGENT_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
 
   AgentConfig agentOverlayConfig;
   agentOverlayConfig.set_master(stringify(overlayMaster.address));
-  // Enable Mesos network.
-  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
-  // Enable Docker network.
-  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
 
-  // Setup a future to notify the test that Agent overlay module has
-  // registered.
-  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
-    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+  Future<RegisterAgentNackMessage> nack =
+    FUTURE_PROTOBUF(RegisterAgentNackMessage(), overlayMaster, overlayAgent);
+
+  Future<MasterReadyMessage> ready =
+    FUTURE_PROTOBUF(MasterReadyMessage(), overlayMaster, overlayAgent);
+
+  // The clock is paused until the Agent has handled the
+  // `RegisterAgentNackMessage`, so that it doesn't retry its
+  // registration before.
+  Clock::pause();
 
   Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
       agentOverlayConfig);
-
   ASSERT_SOME(agentModule);
 
-  AWAIT_READY(agentRegisteredAcknowledgement);
+  AWAIT_READY(nack);
+  EXPECT_LE(Seconds(1).ms(), nack->retry_after_ms());
+  EXPECT_GE(Minutes(5).ms(), nack->retry_after_ms());
+  EXPECT_TRUE(nack->has_reason());
+  EXPECT_TRUE(ready.isPending());
+
+  Clock::settle();
+  Clock::resume();
+
+  JSON::Object metrics = Metrics();
+  EXPECT_EQ(1u, metrics.values["overlay/master/registrations/admitted"]);
+  EXPECT_EQ(1u, metrics.values["overlay/master/registrations/deferred"]);
+
+  // Completing the registration of the first agent hands its
+  // admission to the deferred Agent, which registers right away
+  // rather than waiting for the suggested retry time.
+  Future<RegisterAgentMessage> registration =
+    FUTURE_PROTOBUF(RegisterAgentMessage(), overlayAgent, overlayMaster);
+
+  AgentRegisteredMessage registered;
+  foreach (AgentOverlayInfo overlay, update->overlays()) {
+    overlay.mutable_state()->set_status(OverlayState::STATUS_OK);
+    registered.add_overlays()->CopyFrom(overlay);
+  }
 
-  // Agent manager has been created. Hit the `overlay` endpoint to
-  // check that module is up and responding.
-  UPID overlayAgent = UPID(master.get()->pid);
-  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+  process::post(agent, overlayMaster, registered);
 
-  Future<Response> agentResponse = process::http::get(
-      overlayAgent,
-      "overlay");
+  AWAIT_READY(ready);
+  AWAIT_READY(registration);
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      agentResponse);
+  AWAIT_READY(agentModule.get()->ready());
 
-  // The `overlay` end-point is backed by the
-  // mesos::modules::overlay::AgentInfo protobuf, so need to parse the
-  // JSON and verify that the correct configuration is being
-  // reflected.
-  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
-  ASSERT_SOME(info);
+  metrics = Metrics();
+  EXPECT_EQ(2u, metrics.values["overlay/master/registrations/admitted"]);
+  EXPECT_EQ(1u, metrics.values["overlay/master/registrations/deferred"]);
+  EXPECT_EQ(
+      1u,
+      metrics.values.count("overlay/master/registrations/latency_ms"));
+}
 
-  // There should be only 1 overlay.
-  ASSERT_EQ(1, info->overlays_size());
-  EXPECT_EQ(OVERLAY_NAME, info->overlays(0).info().name());
 
-  Try<net::IP::Network> agentNetwork = net::IP::Network::parse(
-      info->overlays(0).subnet(), AF_INET);
+// Tests that the `Master overlay module` writes the agents that
+// register concurrently to the replicated log in a single batch.
+TEST_F(OverlayTest, checkGroupCommit)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
 
-  ASSERT_SOME(agentNetwork);
-  EXPECT_EQ(OVERLAY_PREFIX, agentNetwork->prefix());
+  const size_t agentCount = 3;
 
-  Try<net::IP::Network> allocatedSubnet = net::IP::Network::parse(
-      "192.168.0.0/24", AF_INET);
+  // A batch is only written once it holds an operation for every
+  // agent, long before the `max_delay_ms` of its first operation.
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.set_replicated_log_dir(MASTER_REPLICATED_LOG_DIR);
+  masterOverlayConfig.mutable_group_commit()->set_max_operations(agentCount);
+  masterOverlayConfig.mutable_group_commit()->set_max_delay_ms(
+      Minutes(1).ms());
 
-  ASSERT_SOME(allocatedSubnet);
-  EXPECT_EQ(allocatedSubnet.get(), agentNetwork.get());
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
 
-  // IPv6
-  Try<net::IP::Network> agentNetwork6 = net::IP::Network::parse(
-      info->overlays(0).subnet6(), AF_INET6);
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
 
-  ASSERT_SOME(agentNetwork6);
-  EXPECT_EQ(OVERLAY_PREFIX6, agentNetwork6->prefix());
+  // NOTE: Nothing listens on the address of the agents, so the
+  // updates sent by the master are dropped.
+  vector<Future<UpdateAgentOverlaysMessage>> updates;
+  for (size_t i = 0; i < agentCount; i++) {
+    UPID agent(
+        AGENT_MANAGER_PROCESS_ID,
+        process::network::inet::Address(net::IP(0x7f010000 + i + 1), 1));
 
-  Try<net::IP::Network> allocatedSubnet6 = net::IP::Network::parse(
-      "fd02::/80", AF_INET6);
+    updates.push_back(
+        FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, agent));
 
-  ASSERT_SOME(allocatedSubnet6);
+    RegisterAgentMessage registerMessage;
+    registerMessage.mutable_network_config();
+
+    process::post(agent, overlayMaster, registerMessage);
+  }
+
+  // The agents are sent their overlays once they have been stored.
+  foreach (const Future<UpdateAgentOverlaysMessage>& update, updates) {
+    AWAIT_READY(update);
+  }
+
+  JSON::Object metrics = Metrics();
+  EXPECT_EQ(
+      agentCount,
+      metrics.values["overlay/master/replicated_log/operations"]);
+  EXPECT_EQ(1u, metrics.values["overlay/master/replicated_log/batches"]);
+  EXPECT_EQ(
+      agentCount,
+      metrics.values["overlay/master/replicated_log/batch_size"]);
+  EXPECT_EQ(
+      0u,
+      metrics.values["overlay/master/replicated_log/store_failures"]);
+}
+
+
+// Tests that the `Master overlay module` queues the registrations it
+// gets while it recovers, keeping a single registration per Agent and
+// dropping the registrations beyond `max_queued_registrations`, and
+// then processes `max_concurrent_registrations` of them at a time.
+TEST_F(OverlayTest, checkRegistrationQueue)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.set_replicated_log_dir(MASTER_REPLICATED_LOG_DIR);
+  masterOverlayConfig.set_max_queued_registrations(2);
+  masterOverlayConfig.set_max_concurrent_registrations(1);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  // NOTE: Nothing listens on the address of the agents, so the first
+  // agent holds the only admission.
+  vector<UPID> agents;
+  for (size_t i = 0; i < 3; i++) {
+    agents.push_back(UPID(
+        AGENT_MANAGER_PROCESS_ID,
+        process::network::inet::Address(net::IP(0x7f010000 + i + 1), 1)));
+  }
+
+  Future<UpdateAgentOverlaysMessage> update =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, agents[0]);
+
+  Future<RegisterAgentNackMessage> deferred =
+    FUTURE_PROTOBUF(RegisterAgentNackMessage(), overlayMaster, agents[1]);
+
+  Future<RegisterAgentNackMessage> dropped =
+    FUTURE_PROTOBUF(RegisterAgentNackMessage(), overlayMaster, agents[2]);
+
+  RegisterAgentMessage registerMessage;
+  registerMessage.mutable_network_config();
+
+  // The first registration starts the recovery of the master, which
+  // queues the registrations until it has recovered. The retry of the
+  // first agent replaces its queued registration, which leaves no
+  // room for the third agent.
+  process::post(agents[0], overlayMaster, registerMessage);
+  process::post(agents[0], overlayMaster, registerMessage);
+  process::post(agents[1], overlayMaster, registerMessage);
+  process::post(agents[2], overlayMaster, registerMessage);
+
+  AWAIT_READY(dropped);
+  EXPECT_EQ("The registration queue is full", dropped->reason());
+
+  AWAIT_READY(update);
+
+  AWAIT_READY(deferred);
+  EXPECT_NE("The registration queue is full", deferred->reason());
+
+  // The master serves its `state` endpoint once it has processed the
+  // registrations it got before.
+  Future<Response> response = process::http::get(overlayMaster, "state");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+  JSON::Object metrics = Metrics();
+  EXPECT_EQ(1u, metrics.values["overlay/master/registrations/deduplicated"]);
+  EXPECT_EQ(1u, metrics.values["overlay/master/registrations/dropped"]);
+  EXPECT_EQ(0u, metrics.values["overlay/master/registrations/queue_depth"]);
+  EXPECT_EQ(1u, metrics.values["overlay/master/registrations/admitted"]);
+  EXPECT_EQ(1u, metrics.values["overlay/master/registrations/deferred"]);
+}
+
+
+// Tests that the `Master overlay module` allocates the subnets of the
+// prefix lengths asked for by the Agents, filling the free space left
+// by the smaller subnets first, and ignores the prefix lengths that
+// are not valid.
+TEST_F(OverlayTest, checkVariableSubnets)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  // The prefix lengths asked for by every agent, if any, and the
+  // subnets they are expected to be allocated.
+  struct Expectation
+  {
+    Option<uint32_t> prefix;
+    string subnet;
+    string subnet6;
+  };
+
+  const vector<Expectation> agents = {
+    {26, "192.168.0.0/26", "fd02::/96"},
+    {None(), "192.168.1.0/24", "fd02::1:0:0:0/80"},
+    {25, "192.168.0.128/25", "fd02::1:0:0/96"},
+
+    // The prefix lengths that leave no room for the bridges, or that
+    // are not smaller than the overlay, fall back to the prefix length
+    // of the overlay.
+    {32, "192.168.2.0/24", "fd02::2:0:0/96"},
+    {16, "192.168.3.0/24", "fd02::3:0:0/96"}
+  };
+
+  for (size_t i = 0; i < agents.size(); i++) {
+    RegisterAgentMessage registerMessage;
+    registerMessage.mutable_network_config();
+
+    if (agents[i].prefix.isSome()) {
+      registerMessage.mutable_network_config()->set_subnet_prefix(
+          agents[i].prefix.get());
+      registerMessage.mutable_network_config()->set_subnet_prefix6(96);
+    }
+
+    // NOTE: Nothing listens on the address of the agent, so the
+    // updates sent by the master are dropped.
+    UPID agent(
+        AGENT_MANAGER_PROCESS_ID,
+        process::network::inet::Address(net::IP(0x7f010000 + i + 1), 1));
+
+    process::post(agent, overlayMaster, registerMessage);
+
+    Option<State> state = None();
+    while (true) {
+      Future<Response> response = process::http::get(overlayMaster, "state");
+      AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+      Try<State> _state = parseMasterState(response->body);
+      ASSERT_SOME(_state);
+
+      if (_state->agents_size() > (int) i) {
+        state = _state.get();
+        break;
+      }
+
+      os::sleep(Milliseconds(10));
+    }
+
+    const AgentInfo* info = nullptr;
+    foreach (const AgentInfo& _info, state->agents()) {
+      if (_info.ip() == stringify(agent.address.ip)) {
+        info = &_info;
+      }
+    }
+
+    ASSERT_NE(nullptr, info);
+    ASSERT_EQ(1, info->overlays_size());
+    EXPECT_EQ(agents[i].subnet, info->overlays(0).subnet());
+    EXPECT_EQ(agents[i].subnet6, info->overlays(0).subnet6());
+  }
+}
+
+
+// Tests that the `Master overlay module` allocates the first and the
+// last subnets of an overlay after recovering its allocations from
+// the replicated log, as it does before, without allocating the
+// subnets of the recovered agents again.
+TEST_F(OverlayTest, checkRecoveredBoundarySubnets)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // Use an overlay of four agent subnets.
+  clearOverlays();
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet("10.0.0.0/22");
+  overlay.set_prefix(OVERLAY_PREFIX);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.set_replicated_log_dir(MASTER_REPLICATED_LOG_DIR);
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  // The agent allocated the first subnet before the failover.
+  State state;
+  state.mutable_network()->set_vtep_subnet("44.128.0.0/16");
+  state.mutable_network()->set_vtep_mac_oui("70:B3:D5:00:00:00");
+  state.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  AgentInfo* recovered = state.add_agents();
+  recovered->set_ip("172.16.0.1");
+
+  AgentOverlayInfo* recoveredOverlay = recovered->add_overlays();
+  recoveredOverlay->mutable_info()->CopyFrom(overlay);
+  recoveredOverlay->set_subnet("10.0.0.0/24");
+
+  VxLANInfo* vxlan = recoveredOverlay->mutable_backend()->mutable_vxlan();
+  vxlan->set_vni(1024);
+  vxlan->set_vtep_name("vtep1024");
+  vxlan->set_vtep_ip("44.128.0.1/16");
+  vxlan->set_vtep_mac("70:b3:d5:00:00:01");
+
+  // Checkpoint the `State` in the replicated log used by the master.
+  {
+    ASSERT_SOME(os::mkdir(MASTER_REPLICATED_LOG_DIR));
+
+    Log log(
+        1,
+        path::join(MASTER_REPLICATED_LOG_DIR, "overlay_replicated_log"),
+        std::set<UPID>(),
+        true);
+
+    Store store(&log, 1);
+
+    Future<Option<State>> _recovered = store.recover();
+    AWAIT_READY(_recovered);
+    ASSERT_NONE(_recovered.get());
+
+    AWAIT_ASSERT_EQ(true, store.store(state));
+  }
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  const vector<string> subnets = {
+    "10.0.1.0/24",
+    "10.0.2.0/24",
+    "10.0.3.0/24"
+  };
+
+  for (size_t i = 0; i < subnets.size(); i++) {
+    RegisterAgentMessage registerMessage;
+    registerMessage.mutable_network_config();
+
+    // NOTE: Nothing listens on the address of the agent, so the
+    // updates sent by the master are dropped.
+    UPID agent(
+        AGENT_MANAGER_PROCESS_ID,
+        process::network::inet::Address(net::IP(0x7f010000 + i + 1), 1));
+
+    process::post(agent, overlayMaster, registerMessage);
+
+    // The master reports the agents in its `state` endpoint only once
+    // it has recovered.
+    Option<State> _state = None();
+    while (true) {
+      Future<Response> response = process::http::get(overlayMaster, "state");
+      AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+      Try<State> __state = parseMasterState(response->body);
+      ASSERT_SOME(__state);
+
+      if (__state->agents_size() > (int) i + 1) {
+        _state = __state.get();
+        break;
+      }
+
+      os::sleep(Milliseconds(10));
+    }
+
+    const AgentInfo* info = nullptr;
+    foreach (const AgentInfo& _info, _state->agents()) {
+      if (_info.ip() == stringify(agent.address.ip)) {
+        info = &_info;
+      }
+    }
+
+    ASSERT_NE(nullptr, info);
+    ASSERT_EQ(1, info->overlays_size());
+    EXPECT_EQ(subnets[i], info->overlays(0).subnet());
+  }
+}
+
+
+// Tests that the `Master overlay module` drops the allocations of the
+// overlays that were removed from its configuration while it was
+// down from the agents it recovers.
+TEST_F(OverlayTest, checkRecoveredUnknownOverlay)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.set_replicated_log_dir(MASTER_REPLICATED_LOG_DIR);
+
+  OverlayInfo removed;
+  removed.set_name("mz-overlay2");
+  removed.set_subnet("10.0.0.0/16");
+  removed.set_prefix(OVERLAY_PREFIX);
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet(OVERLAY_SUBNET);
+  overlay.set_prefix(OVERLAY_PREFIX);
+
+  // The agent was allocated both overlays before the failover.
+  State state;
+  state.mutable_network()->set_vtep_subnet("44.128.0.0/16");
+  state.mutable_network()->set_vtep_mac_oui("70:B3:D5:00:00:00");
+  state.mutable_network()->add_overlays()->CopyFrom(overlay);
+  state.mutable_network()->add_overlays()->CopyFrom(removed);
+
+  AgentInfo* recovered = state.add_agents();
+  recovered->set_ip("172.16.0.1");
+
+  const vector<std::pair<OverlayInfo, string>> allocations = {
+    {overlay, "192.168.0.0/24"},
+    {removed, "10.0.0.0/24"}
+  };
+
+  foreach (const auto& allocation, allocations) {
+    AgentOverlayInfo* recoveredOverlay = recovered->add_overlays();
+    recoveredOverlay->mutable_info()->CopyFrom(allocation.first);
+    recoveredOverlay->set_subnet(allocation.second);
+
+    VxLANInfo* vxlan = recoveredOverlay->mutable_backend()->mutable_vxlan();
+    vxlan->set_vni(1024);
+    vxlan->set_vtep_name("vtep1024");
+    vxlan->set_vtep_ip("44.128.0.1/16");
+    vxlan->set_vtep_mac("70:b3:d5:00:00:01");
+  }
+
+  // Checkpoint the `State` in the replicated log used by the master.
+  {
+    ASSERT_SOME(os::mkdir(MASTER_REPLICATED_LOG_DIR));
+
+    Log log(
+        1,
+        path::join(MASTER_REPLICATED_LOG_DIR, "overlay_replicated_log"),
+        std::set<UPID>(),
+        true);
+
+    Store store(&log, 1);
+
+    Future<Option<State>> _recovered = store.recover();
+    AWAIT_READY(_recovered);
+    ASSERT_NONE(_recovered.get());
+
+    AWAIT_ASSERT_EQ(true, store.store(state));
+  }
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  // NOTE: Nothing listens on the address of the agent, so the updates
+  // sent by the master are dropped.
+  UPID agent(
+      AGENT_MANAGER_PROCESS_ID,
+      process::network::inet::Address(net::IP(0x7f010001), 1));
+
+  Future<UpdateAgentOverlaysMessage> update =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, agent);
+
+  // The registration starts the recovery of the master.
+  RegisterAgentMessage registerMessage;
+  registerMessage.mutable_network_config();
+
+  process::post(agent, overlayMaster, registerMessage);
+
+  AWAIT_READY(update);
+
+  Future<Response> response = process::http::get(overlayMaster, "state");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+  Try<State> _state = parseMasterState(response->body);
+  ASSERT_SOME(_state);
+
+  const AgentInfo* info = nullptr;
+  foreach (const AgentInfo& _info, _state->agents()) {
+    if (_info.ip() == recovered->ip()) {
+      info = &_info;
+    }
+  }
+
+  ASSERT_NE(nullptr, info);
+  ASSERT_EQ(1, info->overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, info->overlays(0).info().name());
+  EXPECT_EQ("192.168.0.0/24", info->overlays(0).subnet());
+}
+
+
+// Tests that the overlay master sends a snapshot of the peer table to
+// a registered agent, and that the agent asks for a new snapshot when
+// it misses an update of the peer table.
+TEST_F(OverlayTest, checkPeerUpdates)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  UPID overlayAgent = UPID(
+      AGENT_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Future<PeerUpdateMessage> snapshot =
+    FUTURE_PROTOBUF(PeerUpdateMessage(), overlayMaster, overlayAgent);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  // The agent gets a snapshot holding its own VTEP once it has
+  // registered.
+  AWAIT_READY(snapshot);
+  EXPECT_TRUE(snapshot->snapshot());
+  ASSERT_EQ(1, snapshot->peers_size());
+  EXPECT_EQ(
+      stringify(master.get()->pid.address.ip),
+      snapshot->peers(0).agent_ip());
+  EXPECT_EQ("vtep1024", snapshot->peers(0).vxlan().vtep_name());
+
+  // An update that does not apply to the version of the peer table
+  // of the agent makes the agent ask for a snapshot.
+  const uint64_t version = snapshot->version();
+
+  Future<PeerSnapshotRequestMessage> request =
+    FUTURE_PROTOBUF(PeerSnapshotRequestMessage(), overlayAgent, overlayMaster);
+
+  // NOTE: The most recent expectation is matched first, so `posted`
+  // intercepts the update we post, and `snapshot` the reply of the
+  // master.
+  snapshot = FUTURE_PROTOBUF(PeerUpdateMessage(), overlayMaster, overlayAgent);
+
+  Future<PeerUpdateMessage> posted =
+    FUTURE_PROTOBUF(PeerUpdateMessage(), overlayMaster, overlayAgent);
+
+  PeerUpdateMessage delta;
+  delta.set_base(version + 1);
+  delta.set_version(version + 2);
+
+  process::post(overlayMaster, overlayAgent, delta);
+
+  AWAIT_READY(posted);
+  EXPECT_FALSE(posted->snapshot());
+
+  AWAIT_READY(request);
+
+  AWAIT_READY(snapshot);
+  EXPECT_TRUE(snapshot->snapshot());
+  EXPECT_EQ(version, snapshot->version());
+  EXPECT_EQ(1, snapshot->peers_size());
+}
+
+
+// Tests the ability of the `Agent overlay module` to create Mesos CNI
+// networks when `mesos bridge` has been enabled.
+TEST_F(OverlayTest, ROOT_checkMesosNetwork)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  // Master `Anonymous` module created successfully. Lets see if we
+  // can hit the `state` endpoint of the Master.
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  // Enable Mesos network.
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+
+  // Setup a future to notify the test that Agent overlay module has
+  // registered.
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+
+  // Check the agent is allowed to progress.
+  AWAIT_READY(agentModule.get()->ready());
+
+  // Verify that `ipset` has been created and the `iptables` entries
+  // exist.
+  Future<string> ipset = runCommand("ipset",
+      {"ipset",
+      "list",
+      IPSET_OVERLAY});
+  AWAIT_READY(ipset);
+
+  // Verify that the `IPMASQ` rules have been installed.
+  Future<string> iptables = runCommand("iptables",
+      {"iptables",
+      "-t", "nat",
+      "-C", "POSTROUTING",
+      "-s", OVERLAY_SUBNET,
+      "-m", "set",
+      "--match-set", stringify(IPSET_OVERLAY), "dst",
+      "-j", "MASQUERADE",
+      });
+  AWAIT_READY(iptables);
+
+  // Verify the CNI configuration has been installed correctly.
+  Try<string> cniConfig = os::read(
+      path::join("cni", stringify(OVERLAY_NAME) + ".conf"));
+
+  ASSERT_SOME(cniConfig);
+
+  Try<JSON::Object> json = JSON::parse<JSON::Object>(cniConfig.get());
+  ASSERT_SOME(json);
+
+  Result<JSON::String> network = json->find<JSON::String>("name");
+  ASSERT_SOME(network);
+  EXPECT_EQ(network.get(), OVERLAY_NAME);
+
+  // Since we introduced port-mapping support for DC/OS overlay with
+  // the `MesoContainerizer`, the bridge configuration is now part of
+  // the `delegate` field in the CNI configuration. Therefore need to
+  // we need find the `ipMasq`, `mtu` and `ipam` fields under
+  // `delegate`.
+  Result<JSON::Boolean> ipMasq = json->find<JSON::Boolean>("delegate.ipMasq");
+  ASSERT_SOME(ipMasq) << "CNI config: " << cniConfig.get();
+  EXPECT_EQ(ipMasq.get(), false);
+
+  Result<JSON::Number> mtu = json->find<JSON::Number>("delegate.mtu");
+  ASSERT_SOME(mtu) << "CNI config: " << cniConfig.get();
+  EXPECT_EQ(mtu.get(), 1420);
+
+  Result<JSON::Object> ipam = json->find<JSON::Object>("delegate.ipam");
+  ASSERT_SOME(ipam) << "CNI config: " << cniConfig.get();
+
+  Result<JSON::String> subnet = ipam->find<JSON::String>("subnet");
+  ASSERT_SOME(subnet) << "CNI config: " << cniConfig.get();
+  EXPECT_EQ(subnet.get(), "192.168.0.0/25");
+
+  // The config has been renamed over from its temporary file.
+  EXPECT_FALSE(os::exists(
+      path::join("cni", ".tmp", stringify(OVERLAY_NAME) + ".conf")));
+}
+
+
+// Tests the ability of the `Agent overlay module` to create Docker
+// network.
+TEST_F(OverlayTest, ROOT_checkDockerNetwork)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  // Master `Anonymous` module created successfully. Lets see if we
+  // can hit the `state` endpoint of the Master.
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  // Enable Docker network.
+  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+
+  // Setup a future to notify the test that Agent overlay module has
+  // registered.
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+
+  // Check the agent is allowed to progress.
+  AWAIT_READY(agentModule.get()->ready());
+
+  // Verify that `ipset` has been created and the `iptables` entries
+  // exist.
+  Future<string> ipset = runCommand("ipset",
+      {"ipset",
+      "list",
+      IPSET_OVERLAY});
+
+  AWAIT_READY(ipset);
+
+  // Verify that the `IPMASQ` rules have been installed.
+  Future<string> iptables = runCommand("iptables",
+      {"iptables",
+      "-t", "nat",
+      "-C", "POSTROUTING",
+      "-s", OVERLAY_SUBNET,
+      "-m", "set",
+      "--match-set", stringify(IPSET_OVERLAY), "dst",
+      "-j", "MASQUERADE",
+      });
+
+  AWAIT_READY(iptables);
+
+  // Verify the docker network has been installed correctly.
+  Future<string> docker = runCommand("docker",
+      {"docker",
+      "network",
+      "inspect",
+      OVERLAY_NAME});
+
+  AWAIT_READY(docker);
+
+  Try<JSON::Array> json = JSON::parse<JSON::Array>(docker.get());
+  ASSERT_SOME(json);
+}
+
+
+// Tests the ability of the `Master overlay module` to recover
+// checkpointed overlay `State`.
+TEST_F(OverlayTest, ROOT_checkMasterRecovery)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  // Ask overlay Master to use the replicated log by setting
+  // `replicated_log_dir`. We are not specifying `zk` configuration so
+  // the `quorum` will default to "1".
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig
+    .set_replicated_log_dir("overlay_replicated_log");
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  // Master `Anonymous` module created successfully. Lets see if we
+  // can hit the `state` endpoint of the Master.
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  // Enable Mesos network.
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+  // Enable Docker network.
+  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+
+  // Setup a future to notify the test that Agent overlay module has
+  // registered.
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule );
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // Check the agent is allowed to progress.
+  AWAIT_READY(agentModule.get()->ready());
+
+  // Agent manager has been created. Hit the `overlay` endpoint to
+  // check that module is up and responding.
+  UPID overlayAgent = UPID(master.get()->pid);
+  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+
+  Future<Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      agentResponse);
+
+  // The `overlay` end-point is backed by the
+  // mesos::modules::overlay::AgentInfo protobuf, so need to parse the
+  // JSON and verify that the correct configuration is being
+  // reflected.
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+
+  // There should be only 1 overlay.
+  ASSERT_EQ(1, info->overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, info->overlays(0).info().name());
+
+  Try<net::IP::Network> agentNetwork = net::IP::Network::parse(
+      info->overlays(0).subnet(), AF_INET);
+
+  ASSERT_SOME(agentNetwork);
+  EXPECT_EQ(OVERLAY_PREFIX, agentNetwork->prefix());
+
+  Try<net::IP::Network> allocatedSubnet = net::IP::Network::parse(
+      "192.168.0.0/24", AF_INET);
+
+  ASSERT_SOME(allocatedSubnet);
+  EXPECT_EQ(allocatedSubnet.get(), agentNetwork.get());
+
+  // IPv6
+  Try<net::IP::Network> agentNetwork6 = net::IP::Network::parse(
+      info->overlays(0).subnet6(), AF_INET6);
+
+  ASSERT_SOME(agentNetwork6);
+  EXPECT_EQ(OVERLAY_PREFIX6, agentNetwork6->prefix());
+
+  Try<net::IP::Network> allocatedSubnet6 = net::IP::Network::parse(
+      "fd02::/80", AF_INET6);
+
+  ASSERT_SOME(allocatedSubnet6);
+  EXPECT_EQ(allocatedSubnet6.get(), agentNetwork6.get());
+
+  ASSERT_SOME(allocatedSubnet);
+  EXPECT_EQ(allocatedSubnet.get(), agentNetwork.get());
+
+  // Hit the `state` end-point. We should be seeing the
+  // Agents overlay subnet allocation in the `state` endpoint.
+  Future<http::Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      masterResponse);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+
+  AgentInfo masterAgentInfo;
+  masterAgentInfo.CopyFrom(state->agents(0));
+  EXPECT_EQ(
+      info.get().SerializeAsString(),
+      masterAgentInfo.SerializeAsString())
+      << "Agent response: " << agentResponse->body
+      << ", Master response: " << masterResponse->body;
+
+  // Kill the master.
+  masterModule->reset();
+
+  masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  // Re-start the master and wait for the Agent to re-register.
+  agentRegisteredAcknowledgement = FUTURE_PROTOBUF(
+      AgentRegisteredAcknowledgement(), _, _);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // Hit the master end-point again.
+  masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      masterResponse);
+
+  state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+
+  AgentInfo recoveredMasterAgentInfo;
+  recoveredMasterAgentInfo.CopyFrom(state->agents(0));
+  EXPECT_EQ(
+      masterAgentInfo.SerializeAsString(),
+      recoveredMasterAgentInfo.SerializeAsString());
+}
+
+
+// Tests the ability of the `Agent overlay module` to recover
+// `AgentInfo` from the master.
+TEST_F(OverlayTest, ROOT_checkAgentRecovery)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  // Ask overlay Master to use the replicated log by setting
+  // `replicated_log_dir`. We are not specifying `zk` configuration so
+  // the `quorum` will default to "1".
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig
+    .set_replicated_log_dir("overlay_replicated_log");
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  // Master `Anonymous` module created successfully. Lets see if we
+  // can hit the `state` endpoint of the Master.
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  // Enable Mesos network.
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+  // Enable Docker network.
+  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+
+  // Setup a future to notify the test that Agent overlay module has
+  // registered.
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule  = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // Check the agent is allowed to progress.
+  AWAIT_READY(agentModule.get()->ready());
+
+  // Agent manager has been created. Hit the `overlay` endpoint to
+  // check that module is up and responding.
+  UPID overlayAgent = UPID(master.get()->pid);
+  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+
+  Future<Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      agentResponse);
+
+  // The `overlay` end-point is backed by the
+  // mesos::modules::overlay::AgentInfo protobuf, so need to parse the
+  // JSON and verify that the correct configuration is being
+  // reflected.
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+
+  // There should be only 1 overlay.
+  ASSERT_EQ(1, info->overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, info->overlays(0).info().name());
+
+  Try<net::IP::Network> agentNetwork = net::IP::Network::parse(
+      info->overlays(0).subnet(), AF_INET);
+
+  ASSERT_SOME(agentNetwork);
+  EXPECT_EQ(24, agentNetwork->prefix());
+
+  Try<net::IP::Network> allocatedSubnet = net::IP::Network::parse(
+      "192.168.0.0/24", AF_INET);
+
+  ASSERT_SOME(allocatedSubnet);
+  EXPECT_EQ(allocatedSubnet.get(), agentNetwork.get());
+
+  // IPv6
+  Try<net::IP::Network> agentNetwork6 = net::IP::Network::parse(
+      info->overlays(0).subnet6(), AF_INET6);
+
+  ASSERT_SOME(agentNetwork6);
+  EXPECT_EQ(OVERLAY_PREFIX6, agentNetwork6->prefix());
+
+  Try<net::IP::Network> allocatedSubnet6 = net::IP::Network::parse(
+      "fd02::/80", AF_INET6);
+
+  ASSERT_SOME(allocatedSubnet6);
+  EXPECT_EQ(allocatedSubnet6.get(), agentNetwork6.get());
+
+  // Re-start the agent and wait for the agent to re-register.
+  Future<AgentRegisteredAcknowledgement> agentReRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  // Kill the agent.
+  Try<Nothing> stop = stopOverlayAgent();
+  ASSERT_SOME(stop);
+
+  // re-start the agent.
+  agentModule  = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule );
+
+  AWAIT_READY(agentReRegisteredAcknowledgement);
+
+  // Check the agent is allowed to progress.
+  AWAIT_READY(agentModule.get()->ready());
+
+  // Hit the master end-point again.
+  agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      agentResponse);
+
+  Try<AgentInfo> reRegisterInfo = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(reRegisterInfo);
+
+  EXPECT_EQ(
+      info.get().SerializeAsString(),
+      reRegisterInfo.get().SerializeAsString());
+}
+
+
+// Tests that a restarted `Agent overlay module` recovers its overlays
+// from its checkpoint, and is ready before it has registered with the
+// master again.
+TEST_F(OverlayTest, ROOT_checkAgentCheckpoint)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  const string checkpoint =
+    path::join(os::getcwd(), "overlay-agent.checkpoint");
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.set_checkpoint_path(checkpoint);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+  AWAIT_READY(agentModule.get()->ready());
+
+  Result<AgentCheckpoint> checkpointed =
+    ::protobuf::read<AgentCheckpoint>(checkpoint);
+
+  ASSERT_SOME(checkpointed);
+  ASSERT_EQ(1, checkpointed->overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, checkpointed->overlays(0).info().name());
+  EXPECT_TRUE(checkpointed->has_generation());
+
+  Try<Nothing> stop = stopOverlayAgent();
+  ASSERT_SOME(stop);
+
+  // The master does not get the registrations of the restarted agent,
+  // which is ready nonetheless.
+  DROP_PROTOBUFS(RegisterAgentMessage(), _, _);
+
+  agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentModule.get()->ready());
+
+  UPID overlayAgent = UPID(
+      AGENT_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  Future<Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+
+  ASSERT_EQ(1, info->overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, info->overlays(0).info().name());
+  EXPECT_EQ(
+      AgentOverlayInfo::State::STATUS_OK,
+      info->overlays(0).state().status());
+}
+
+
+// Tests the ability of the `Agent overlay module` to honor the
+// `AgentNetworkConfig` over the overlay the network configuration
+// specified by the Master.
+TEST_F(OverlayTest, ROOT_checkAgentNetworkConfigChange)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  // Ask overlay Master to use the replicated log by setting
+  // `replicated_log_dir`. We are not specifying `zk` configuration so
+  // the `quorum` will default to "1".
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig
+    .set_replicated_log_dir("overlay_replicated_log");
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  // Master `Anonymous` module created successfully. Lets see if we
+  // can hit the `state` endpoint of the Master.
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  // Enable Mesos network.
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+  // Enable Docker network.
+  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+
+  // Setup a future to notify the test that Agent overlay module has
+  // registered.
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // Agent manager has been created. Hit the `overlay` endpoint to
+  // check that module is up and responding.
+  UPID overlayAgent = UPID(master.get()->pid);
+  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+
+  Future<Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      agentResponse);
+
+  // The `overlay` end-point is backed by the
+  // mesos::modules::overlay::AgentInfo protobuf, so need to parse the
+  // JSON and verify that the correct configuration is being
+  // reflected.
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+
+  // There should be only 1 overlay.
+  ASSERT_EQ(1, info->overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, info->overlays(0).info().name());
+
+  Try<net::IP::Network> agentNetwork = net::IP::Network::parse(
+      info->overlays(0).subnet(), AF_INET);
+
+  ASSERT_SOME(agentNetwork);
+  EXPECT_EQ(OVERLAY_PREFIX, agentNetwork->prefix());
+
+  Try<net::IP::Network> allocatedSubnet = net::IP::Network::parse(
+      "192.168.0.0/24", AF_INET);
+
+  ASSERT_SOME(allocatedSubnet);
+  EXPECT_EQ(allocatedSubnet.get(), agentNetwork.get());
+
+  // IPv6
+  Try<net::IP::Network> agentNetwork6 = net::IP::Network::parse(
+      info->overlays(0).subnet6(), AF_INET6);
+
+  ASSERT_SOME(agentNetwork6);
+  EXPECT_EQ(OVERLAY_PREFIX6, agentNetwork6->prefix());
+
+  Try<net::IP::Network> allocatedSubnet6 = net::IP::Network::parse(
+      "fd02::/80", AF_INET6);
+
+  ASSERT_SOME(allocatedSubnet6);
   EXPECT_EQ(allocatedSubnet6.get(), agentNetwork6.get());
 
-  // Check that the `mesos-bridge` and `docker-bridge` are present.
-  EXPECT_TRUE(info->overlays(0).has_mesos_bridge());
-  EXPECT_TRUE(info->overlays(0).has_docker_bridge());
+  // Check that the `mesos-bridge` and `docker-bridge` are present.
+  EXPECT_TRUE(info->overlays(0).has_mesos_bridge());
+  EXPECT_TRUE(info->overlays(0).has_docker_bridge());
+
+  // Verify that the `IPMASQ` rules have been installed.
+  Future<string> iptables = runCommand("iptables",
+      {"iptables",
+      "-t", "nat",
+      "-C", "POSTROUTING",
+      "-s", OVERLAY_SUBNET,
+      "-m", "set",
+      "--match-set", stringify(IPSET_OVERLAY), "dst",
+      "-j", "MASQUERADE",
+      });
+
+  AWAIT_READY(iptables);
+
+  // Delete the IPMASQ rules.
+  iptables = runCommand("iptables",
+      {"iptables",
+      "-t", "nat",
+      "-D", "POSTROUTING",
+      "-s", OVERLAY_SUBNET,
+      "-m", "set",
+      "--match-set", stringify(IPSET_OVERLAY), "dst",
+      "-j", "MASQUERADE",
+      });
+
+  AWAIT_READY(iptables);
+
+  // Re-start the agent and wait for the agent to re-register.
+  Future<AgentRegisteredAcknowledgement> agentReRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  // Kill the agent.
+  Try<Nothing> stop = stopOverlayAgent();
+  ASSERT_SOME(stop);
+
+  // Reset the `mesos_bridge` and `docker_bridge` before restarting.
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(false);
+  agentOverlayConfig.mutable_network_config()->set_docker_bridge(false);
+
+  // re-start the agent.
+  agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentReRegisteredAcknowledgement);
+
+  // With the `mesos_bridge` and the `docker_bridge` disabled there
+  // should be no IPMASQ rules installed. Check IPMASQ rules don't exist.
+  iptables = runCommand("iptables",
+      {"iptables",
+      "-t", "nat",
+      "-C", "POSTROUTING",
+      "-s", OVERLAY_SUBNET,
+      "-m", "set",
+      "--match-set", stringify(IPSET_OVERLAY), "dst",
+      "-j", "MASQUERADE",
+      });
+
+  AWAIT_FAILED(iptables);
+
+  // Hit the agent end-point again.
+  agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      agentResponse);
+
+  Try<AgentInfo> reRegisterInfo = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(reRegisterInfo);
+
+  // Though the `mesos_bridge` and `docker_bridge` have been disabled
+  // in the `AgentNetworkConfig`, the Master still has them enabled in
+  // this agents overlay configuration. So the overlay configuration
+  // reflected on the agent should also reflect the same configuration
+  // that the Master has tried to applied, i.e. the `mesos_bridge` and
+  // `docker_bridge` should have been enabled.
+  ASSERT_EQ(1, reRegisterInfo->overlays_size());
+  EXPECT_TRUE(reRegisterInfo->overlays(0).has_mesos_bridge());
+  EXPECT_TRUE(reRegisterInfo->overlays(0).has_docker_bridge());
+}
+
+
+// Tests if reserved network names are correctly rejected by the
+// master overlay module.
+TEST_F(OverlayTest, checkReservedNetworks)
+{
+  // Try creating a master module with an overlay network that has a
+  // reserved name. The creation should fail.
+  foreach(const string& networkName, RESERVED_NETWORKS) {
+    // Whatever `MasterConfig` is given to the fixture is "merged"
+    // with the existing `MasterConfig`. So need to clear the existing
+    // overlays to test the reserved overlay network. Otherwise any
+    // "reserved" network that was added in the previous iteration
+    // would persist and would make this test void.
+    clearOverlays();
+
+    OverlayInfo overlay;
+    overlay.set_name(networkName);
+    overlay.set_subnet("9.0.0.0/8");
+    overlay.set_prefix(24);
+
+    MasterConfig masterOverlayConfig;
+    masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+    Try<Owned<Anonymous>> masterModule = startOverlayMaster(
+        masterOverlayConfig);
+
+    ASSERT_ERROR(masterModule);
+  }
+}
+
+
+// Tests the ability of the overlay to add virtual networks.
+TEST_F(OverlayTest, ROOT_checkAddVirtualNetworks)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  // Ask overlay Master to use the replicated log by setting
+  // `replicated_log_dir`. We are not specifying `zk` configuration so
+  // the `quorum` will default to "1".
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig
+    .set_replicated_log_dir("overlay_replicated_log");
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  // Master `Anonymous` module created successfully. Lets see if we
+  // can hit the `state` endpoint of the Master.
+  UPID overlayMaster = UPID(master.get()->pid);
+  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  // Enable Mesos network.
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+  // Enable Docker network.
+  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+
+  // Setup a future to notify the test that Agent overlay module has
+  // registered.
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule );
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // Check the agent is allowed to progress.
+  AWAIT_READY(agentModule.get()->ready());
+
+  // Kill the master.
+  masterModule->reset();
+
+  // Add an overlay network to the master configuration.
+  //
+  // NOTE: Since the `masterOverlayConfig` is "merged" with the stored
+  // `masterOverlayConfig` ensure this is the only overlay network
+  // delcared in the `masterOverlayConfig` object being passed into
+  // `startOverlayMaster`.
+  OverlayInfo overlay;
+  overlay.set_name("mz-test-add");
+  overlay.set_subnet("11.0.0.0/8");
+  overlay.set_subnet6("fd04::/64");
+  overlay.set_prefix(OVERLAY_PREFIX);
+  overlay.set_prefix6(OVERLAY_PREFIX6);
+
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  // Re-start the master and wait for the Agent to re-register.
+  agentRegisteredAcknowledgement = FUTURE_PROTOBUF(
+      AgentRegisteredAcknowledgement(), _, _);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  // Hit the master end-point again.
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      masterResponse);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+
+  ASSERT_TRUE(state->has_network());
+  ASSERT_EQ(2, state->network().overlays_size());
+
+  Option<OverlayInfo> _overlay;
+  foreach(const OverlayInfo& __overlay, state->network().overlays()) {
+    if (__overlay.name() == "mz-test-add") {
+      _overlay = __overlay;
+      break;
+    }
+  }
+
+  ASSERT_SOME(_overlay);
+  ASSERT_EQ(_overlay->subnet(), "11.0.0.0/8");
+  ASSERT_EQ(_overlay->subnet6(), "fd04::/64");
+
+  // Hit the `overlay` endpoint of the agent to check that module is
+  // up and responding.
+  UPID overlayAgent = UPID(master.get()->pid);
+  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+
+  Future<Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      agentResponse);
+
+  // The `overlay` end-point is backed by the
+  // mesos::modules::overlay::AgentInfo protobuf, so need to parse the
+  // JSON and verify that the correct configuration is being
+  // reflected.
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+
+  // There should be 2 overlays.
+  ASSERT_EQ(2, info->overlays_size());
+
+  Option<AgentOverlayInfo> agentOverlay;
+
+  foreach(const AgentOverlayInfo& _agentOverlay, info->overlays()) {
+    if (_agentOverlay.info().name() == "mz-test-add") {
+      agentOverlay = _agentOverlay;
+      break;
+    }
+  }
+
+  ASSERT_SOME(agentOverlay);
+  ASSERT_EQ(agentOverlay->subnet(), "11.0.0.0/24");
+  ASSERT_EQ(agentOverlay->info().subnet(), "11.0.0.0/8");
+  ASSERT_EQ(agentOverlay->subnet6(), "fd04::/80");
+  ASSERT_EQ(agentOverlay->info().subnet6(), "fd04::/64");
+}
+
+
+// Tests that the master evicts the agents whose subnets or VTEP IPs,
+// recovered from the replicated log, conflict with the addresses of
+// the agents recovered before them.
+TEST_F(OverlayTest, checkConflictingRecovery)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  clearOverlays();
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet("10.0.0.0/8");
+  overlay.set_prefix(OVERLAY_PREFIX);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.set_replicated_log_dir(MASTER_REPLICATED_LOG_DIR);
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  State state;
+  state.mutable_network()->set_vtep_subnet("44.128.0.0/16");
+  state.mutable_network()->set_vtep_mac_oui("70:B3:D5:00:00:00");
+  state.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  auto addAgent = [&](
+      const string& ip,
+      const string& subnet,
+      const string& vtepIP,
+      const string& vtepMAC) {
+    AgentInfo* agent = state.add_agents();
+    agent->set_ip(ip);
+
+    AgentOverlayInfo* agentOverlay = agent->add_overlays();
+    agentOverlay->mutable_info()->CopyFrom(overlay);
+    agentOverlay->set_subnet(subnet);
+
+    VxLANInfo* vxlan = agentOverlay->mutable_backend()->mutable_vxlan();
+    vxlan->set_vni(1024);
+    vxlan->set_vtep_name("vtep1024");
+    vxlan->set_vtep_ip(vtepIP);
+    vxlan->set_vtep_mac(vtepMAC);
+  };
+
+  addAgent(
+      "172.16.0.1", "10.0.0.0/24", "44.128.0.1/16", "70:b3:d5:00:00:01");
+
+  // Its subnet overlaps with the subnet of the first agent.
+  addAgent(
+      "172.16.0.2", "10.0.0.128/25", "44.128.0.2/16", "70:b3:d5:00:00:02");
+
+  // Its VTEP IP is the VTEP IP of the first agent.
+  addAgent(
+      "172.16.0.3", "10.0.1.0/24", "44.128.0.1/16", "70:b3:d5:00:00:01");
+
+  addAgent(
+      "172.16.0.4", "10.0.2.0/24", "44.128.0.4/16", "70:b3:d5:00:00:04");
+
+  // Checkpoint the `State` in the replicated log used by the master.
+  {
+    ASSERT_SOME(os::mkdir(MASTER_REPLICATED_LOG_DIR));
+
+    Log log(
+        1,
+        path::join(MASTER_REPLICATED_LOG_DIR, "overlay_replicated_log"),
+        std::set<UPID>(),
+        true);
+
+    Store store(&log, 1);
+
+    Future<Option<State>> recovered = store.recover();
+    AWAIT_READY(recovered);
+    ASSERT_NONE(recovered.get());
+
+    AWAIT_ASSERT_EQ(true, store.store(state));
+  }
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  // The agent registers once the master has recovered.
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+
+  Future<Response> response = process::http::get(overlayMaster, "state");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+  Try<State> _state = parseMasterState(response->body);
+  ASSERT_SOME(_state);
+
+  hashset<string> ips;
+  hashset<string> subnets;
+  hashset<string> vtepIPs;
+
+  foreach (const AgentInfo& agent, _state->agents()) {
+    ips.insert(agent.ip());
+
+    foreach (const AgentOverlayInfo& agentOverlay, agent.overlays()) {
+      EXPECT_FALSE(subnets.contains(agentOverlay.subnet()));
+      subnets.insert(agentOverlay.subnet());
+
+      const string& vtepIP = agentOverlay.backend().vxlan().vtep_ip();
+      EXPECT_FALSE(vtepIPs.contains(vtepIP));
+      vtepIPs.insert(vtepIP);
+    }
+  }
+
+  // The first and the last agents, and the agent that just
+  // registered.
+  EXPECT_EQ(3u, ips.size());
+  EXPECT_TRUE(ips.contains("172.16.0.1"));
+  EXPECT_FALSE(ips.contains("172.16.0.2"));
+  EXPECT_FALSE(ips.contains("172.16.0.3"));
+  EXPECT_TRUE(ips.contains("172.16.0.4"));
+}
+
+
+// Measures the time taken by the `Master overlay module` to recover
+// the allocations of a large number of agents from the replicated
+// log.
+TEST_F(OverlayTest, BENCHMARK_MasterRecovery)
+{
+  const int AGENTS = 20000;
+
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // Use an overlay that is large enough to allocate a subnet to
+  // every agent.
+  clearOverlays();
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME);
+  overlay.set_subnet("10.0.0.0/8");
+  overlay.set_prefix(OVERLAY_PREFIX);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.set_replicated_log_dir(MASTER_REPLICATED_LOG_DIR);
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  // Build the `State` that a master would have checkpointed after
+  // `AGENTS` agents registered with it.
+  State state;
+  state.mutable_network()->set_vtep_subnet("44.128.0.0/16");
+  state.mutable_network()->set_vtep_mac_oui("70:B3:D5:00:00:00");
+  state.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  for (int i = 0; i < AGENTS; i++) {
+    const int j = i + 1;
+
+    AgentInfo* agent = state.add_agents();
+    agent->set_ip(
+        "172.16." + stringify(j >> 8) + "." + stringify(j & 0xff));
+
+    AgentOverlayInfo* agentOverlay = agent->add_overlays();
+    agentOverlay->mutable_info()->CopyFrom(overlay);
+
+    Try<Network> subnet = Network::parse(
+        "10." + stringify(i >> 8) + "." + stringify(i & 0xff) + ".0/24",
+        AF_INET);
+    ASSERT_SOME(subnet);
+
+    agentOverlay->set_subnet(stringify(subnet.get()));
+    agentOverlay->set_subnet_bin(subnet->encode());
+
+    Try<Network> vtepIP = Network::parse(
+        "44.128." + stringify(j >> 8) + "." + stringify(j & 0xff) + "/16",
+        AF_INET);
+    ASSERT_SOME(vtepIP);
+
+    VxLANInfo* vxlan = agentOverlay->mutable_backend()->mutable_vxlan();
+    vxlan->set_vni(1024);
+    vxlan->set_vtep_name("vtep1024");
+    vxlan->set_vtep_ip(stringify(vtepIP.get()));
+    vxlan->set_vtep_ip_bin(vtepIP->encode());
+    vxlan->set_vtep_mac(
+        strings::format(
+            "70:b3:d5:00:%02x:%02x", j >> 8, j & 0xff).get());
+  }
+
+  // Checkpoint the `State` in the replicated log used by the master.
+  {
+    ASSERT_SOME(os::mkdir(MASTER_REPLICATED_LOG_DIR));
+
+    Log log(
+        1,
+        path::join(MASTER_REPLICATED_LOG_DIR, "overlay_replicated_log"),
+        std::set<UPID>(),
+        true);
+
+    Store store(&log, 1);
+
+    Future<Option<State>> recovered = store.recover();
+    AWAIT_READY(recovered);
+    ASSERT_NONE(recovered.get());
+
+    AWAIT_ASSERT_EQ(true, store.store(state));
+  }
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  // The registration of the first agent triggers the recovery.
+  Future<RegisterAgentMessage> registerAgentMessage =
+    FUTURE_PROTOBUF(RegisterAgentMessage(), _, _);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(registerAgentMessage);
+
+  Stopwatch watch;
+  watch.start();
+
+  // The master reports the agents in its `state` endpoint only once
+  // it has recovered.
+  while (true) {
+    Future<Response> response = process::http::get(overlayMaster, "state");
+    AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+    Try<State> _state = parseMasterState(response->body);
+    ASSERT_SOME(_state);
+
+    if (_state->agents_size() >= AGENTS) {
+      break;
+    }
+
+    os::sleep(Milliseconds(1));
+  }
+
+  watch.stop();
+
+  cout << "Recovered " << AGENTS << " agents in "
+       << watch.elapsed() << endl;
+}
+
+
+// Measures the time taken by the `Master overlay module` to register
+// a large number of agents as the number of overlays grows. Every
+// overlay is allocated by its own actor, so the registration time
+// should grow slower than the number of overlays, up to the number of
+// libprocess workers.
+TEST_F(OverlayTest, BENCHMARK_MasterRegistrations)
+{
+  const int AGENTS = 4000;
+
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  foreach (int count, vector<int>({1, 2, 4, 8})) {
+    // Every overlay has room for a /24 subnet for every agent.
+    clearOverlays();
+
+    MasterConfig masterOverlayConfig;
+    masterOverlayConfig.set_max_concurrent_registrations(0);
+
+    for (int i = 0; i < count; i++) {
+      OverlayInfo overlay;
+      overlay.set_name(OVERLAY_NAME + stringify(i));
+      overlay.set_subnet("10." + stringify(i * 16) + ".0.0/12");
+      overlay.set_prefix(OVERLAY_PREFIX);
+
+      masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(
+          overlay);
+    }
+
+    Try<Owned<Anonymous>> masterModule =
+      startOverlayMaster(masterOverlayConfig);
+    ASSERT_SOME(masterModule);
+
+    Stopwatch watch;
+    watch.start();
+
+    RegisterAgentMessage registerMessage;
+    registerMessage.mutable_network_config();
+
+    // The agents are only known by their address, which is where the
+    // master sends their overlays.
+    //
+    // NOTE: Nothing listens on these addresses, so the updates sent
+    // by the master are dropped.
+    for (int i = 0; i < AGENTS; i++) {
+      UPID agent(
+          AGENT_MANAGER_PROCESS_ID,
+          process::network::inet::Address(net::IP(0x7f010000 + i + 1), 1));
+
+      process::post(agent, overlayMaster, registerMessage);
+    }
+
+    while (true) {
+      Future<Response> response = process::http::get(overlayMaster, "state");
+      AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+      Try<State> state = parseMasterState(response->body);
+      ASSERT_SOME(state);
+
+      if (state->agents_size() >= AGENTS) {
+        break;
+      }
+
+      os::sleep(Milliseconds(10));
+    }
+
+    watch.stop();
+
+    cout << "Registered " << AGENTS << " agents with " << count
+         << " overlays in " << watch.elapsed() << endl;
+  }
+}
+
+
+// Compares the time taken by the netfilter backends of the `Agent
+// overlay module` to program the rules of a large number of overlays.
+TEST_F(OverlayTest, ROOT_BENCHMARK_NetfilterBackends)
+{
+  const int OVERLAYS = 50;
+
+  vector<string> subnets;
+  for (int i = 0; i < OVERLAYS; i++) {
+    subnets.push_back("10." + stringify(i) + ".0.0/16");
+  }
+
+  // Removes the rules of the `subnets`, so that every backend starts
+  // from scratch.
+  auto cleanup = [&subnets]() {
+    foreach (const string& subnet, subnets) {
+      Try<string> command = strings::format(
+          "iptables -t nat -D POSTROUTING -s %s "
+          "-m set --match-set %s dst -j MASQUERADE; "
+          "ipset del %s %s; "
+          "true",
+          subnet,
+          stringify(IPSET_OVERLAY),
+          stringify(IPSET_OVERLAY),
+          subnet);
+      ASSERT_SOME(command);
+
+      Future<string> result = runScriptCommand(command.get());
+      result.await();
+    }
+  };
+
+  Future<string> ipset = runScriptCommand(
+      "ipset create -exist " + stringify(IPSET_OVERLAY) +
+      " hash:net counters");
+  AWAIT_READY(ipset);
+
+  const vector<string> backends = {
+    NETFILTER_BACKEND_SHELL,
+    NETFILTER_BACKEND_BATCH
+  };
+
+  foreach (const string& backend, backends) {
+    cleanup();
+
+    Try<Owned<Netfilter>> netfilter = Netfilter::create(backend);
+    ASSERT_SOME(netfilter);
+
+    Stopwatch watch;
+    watch.start();
+
+    std::list<Future<Nothing>> programmed;
+    foreach (const string& subnet, subnets) {
+      programmed.push_back(netfilter.get()->add(subnet));
+    }
+
+    AWAIT_READY(process::collect(programmed));
+
+    watch.stop();
+
+    cout << "Programmed the netfilter rules of " << OVERLAYS
+         << " overlays with the '" << backend << "' backend in "
+         << watch.elapsed() << endl;
+
+    foreach (const string& subnet, subnets) {
+      Future<string> iptables = runCommand("iptables",
+          {"iptables",
+          "-t", "nat",
+          "-C", "POSTROUTING",
+          "-s", subnet,
+          "-m", "set",
+          "--match-set", stringify(IPSET_OVERLAY), "dst",
+          "-j", "MASQUERADE",
+          });
+      AWAIT_READY(iptables);
+
+      Future<string> entry = runCommand("ipset",
+          {"ipset",
+          "test",
+          stringify(IPSET_OVERLAY),
+          subnet,
+          "nomatch",
+          });
+      AWAIT_READY(entry);
+    }
+  }
+
+  cleanup();
+}
+
+
+// Measures the time taken by the `Datapath` to program the FDB and
+// neighbor entries of a large number of peer VTEPs.
+TEST_F(OverlayTest, ROOT_BENCHMARK_DatapathPeers)
+{
+  const uint32_t PEERS = 5000;
+
+  const string cleanup =
+    "ip link del vtep-bench; ip link del br-bench; true";
+
+  Future<string> cleaned = runScriptCommand(cleanup);
+  AWAIT_READY(cleaned);
+
+  VxLANInfo vxlan;
+  vxlan.set_vni(1025);
+  vxlan.set_vtep_name("vtep-bench");
+  vxlan.set_vtep_ip("44.128.0.1/16");
+  vxlan.set_vtep_mac("70:b3:d5:80:00:01");
+
+  Datapath datapath(64001);
+  ASSERT_SOME(datapath.configure(vxlan, {"br-bench"}, 1420));
+
+  vector<Peer> peers;
+  for (uint32_t i = 0; i < PEERS; i++) {
+    const uint8_t mac[6] = {
+      0x70, 0xb3, 0xd5, 0x81, (uint8_t) (i >> 8), (uint8_t) i};
+
+    peers.push_back(Peer{
+        net::IP(0x0a000000 + i + 1),
+        net::IP(0x2c800000 + i + 2),
+        None(),
+        net::MAC(mac)});
+  }
+
+  Stopwatch watch;
+  watch.start();
+
+  ASSERT_SOME(datapath.update(peers));
+
+  watch.stop();
+
+  cout << "Programmed the entries of " << PEERS << " peers in "
+       << watch.elapsed() << endl;
+
+  Future<string> fdb = runScriptCommand(
+      "bridge fdb show dev vtep-bench | grep -c ' dst '");
+  AWAIT_READY(fdb);
+  EXPECT_EQ(stringify(PEERS), strings::trim(fdb.get()));
+
+  // Remove half of the peers.
+  peers.resize(PEERS / 2);
+
+  watch.start();
+
+  ASSERT_SOME(datapath.update(peers));
+
+  watch.stop();
+
+  cout << "Removed the entries of " << PEERS - PEERS / 2 << " peers in "
+       << watch.elapsed() << endl;
+
+  fdb = runScriptCommand("bridge fdb show dev vtep-bench | grep -c ' dst '");
+  AWAIT_READY(fdb);
+  EXPECT_EQ(stringify(PEERS / 2), strings::trim(fdb.get()));
+
+  cleaned = runScriptCommand(cleanup);
+  AWAIT_READY(cleaned);
+}
+
+
+
+// Deletes a bridge and flushes the FDB of the VTEP configured by a
+// `Datapath`, and verifies that `repair` only restores what has been
+// removed.
+TEST_F(OverlayTest, ROOT_DatapathRepair)
+{
+  const string cleanup =
+    "ip link del vtep-drift; ip link del br-drift; true";
+
+  Future<string> cleaned = runScriptCommand(cleanup);
+  AWAIT_READY(cleaned);
+
+  VxLANInfo vxlan;
+  vxlan.set_vni(1026);
+  vxlan.set_vtep_name("vtep-drift");
+  vxlan.set_vtep_ip("44.129.0.1/16");
+  vxlan.set_vtep_mac("70:b3:d5:90:00:01");
+
+  Datapath datapath(64002);
+  ASSERT_SOME(datapath.configure(vxlan, {"br-drift"}, 1420));
+
+  const uint8_t mac[6] = {0x70, 0xb3, 0xd5, 0x91, 0x00, 0x01};
+
+  vector<Peer> peers = {
+    Peer{net::IP(0x0a000001), net::IP(0x2c810002), None(), net::MAC(mac)}};
+
+  ASSERT_SOME(datapath.update(peers));
+
+  // Nothing has drifted yet.
+  Try<Datapath::Drift> drift = datapath.repair();
+  ASSERT_SOME(drift);
+  EXPECT_EQ(0u, drift->links);
+  EXPECT_EQ(0u, drift->entries);
+
+  Future<string> removed = runScriptCommand(
+      "ip link del br-drift && "
+      "bridge fdb del 70:b3:d5:91:00:01 dev vtep-drift dst 10.0.0.1");
+  AWAIT_READY(removed);
+
+  drift = datapath.repair();
+  ASSERT_SOME(drift);
+  EXPECT_EQ(1u, drift->links);
+  EXPECT_EQ(1u, drift->entries);
+
+  Future<string> fdb = runScriptCommand(
+      "ip link show br-drift up && "
+      "bridge fdb show dev vtep-drift | grep -c ' dst '");
+  AWAIT_READY(fdb);
+  EXPECT_TRUE(strings::endsWith(strings::trim(fdb.get()), "1"));
+
+  drift = datapath.repair();
+  ASSERT_SOME(drift);
+  EXPECT_EQ(0u, drift->links);
+  EXPECT_EQ(0u, drift->entries);
+
+  cleaned = runScriptCommand(cleanup);
+  AWAIT_READY(cleaned);
+}
+
+
+class OverlayStoreTest : public TemporaryDirectoryTest {};
+
+
+// Stores a few mutations of the `State`, enough for the store to
+// truncate the replicated log several times, and verifies that the
+// latest snapshot is recovered from the truncated log.
+TEST_F(OverlayStoreTest, RecoverTruncatedLog)
+{
+  const int MUTATIONS = 50;
+  const size_t RETENTION = 5;
+
+  Log log(1, path::join(sandbox.get(), "log"), std::set<UPID>(), true);
+  Store store(&log, RETENTION);
+
+  Future<Option<State>> recovered = store.recover();
+  AWAIT_READY(recovered);
+  ASSERT_NONE(recovered.get());
+
+  State state;
+  state.mutable_network()->set_vtep_subnet("44.128.0.0/16");
+  state.mutable_network()->set_vtep_mac_oui("70:B3:D5:00:00:00");
+
+  for (int i = 0; i < MUTATIONS; i++) {
+    state.add_agents()->set_ip("172.16.0." + stringify(i + 1));
+
+    AWAIT_ASSERT_EQ(true, store.store(state));
+  }
+
+  Store recovery(&log, RETENTION);
+
+  recovered = recovery.recover();
+  AWAIT_READY(recovered);
+  ASSERT_SOME(recovered.get());
+  EXPECT_EQ(state.SerializeAsString(),
+            recovered.get().get().SerializeAsString());
+}
+
+
+// Stores many mutations of the `State` and verifies that the disk used
+// by the replicated log stays bounded, since the store truncates the
+// log behind the latest snapshot.
+TEST_F(OverlayStoreTest, BENCHMARK_BoundedLogGrowth)
+{
+  const int MUTATIONS = 100000;
+  const size_t RETENTION = 100;
+
+  const string logPath = path::join(sandbox.get(), "log");
+
+  // Returns the size of the files of the replicated log.
+  auto diskUsage = [&logPath]() -> Try<Bytes> {
+    Try<std::list<string>> files = os::ls(logPath);
+    if (files.isError()) {
+      return Error(files.error());
+    }
+
+    Bytes total;
+    foreach (const string& file, files.get()) {
+      Try<Bytes> size = os::stat::size(path::join(logPath, file));
+      if (size.isError()) {
+        return Error(size.error());
+      }
+
+      total += size.get();
+    }
+
+    return total;
+  };
+
+  Log log(1, logPath, std::set<UPID>(), true);
+  Store store(&log, RETENTION);
+
+  Future<Option<State>> recovered = store.recover();
+  AWAIT_READY(recovered);
+  ASSERT_NONE(recovered.get());
+
+  State state;
+  state.mutable_network()->set_vtep_subnet("44.128.0.0/16");
+  state.mutable_network()->set_vtep_mac_oui("70:B3:D5:00:00:00");
+
+  for (int i = 0; i < 16; i++) {
+    state.add_agents()->set_ip("172.16.0." + stringify(i + 1));
+  }
+
+  uint64_t written = 0;
+  for (int i = 0; i < MUTATIONS; i++) {
+    state.mutable_agents(i % state.agents_size())->set_ip(
+        "172.16." + stringify((i >> 8) & 0xff) + "." + stringify(i & 0xff));
+
+    AWAIT_ASSERT_EQ(true, store.store(state));
+
+    written += state.ByteSize();
+  }
+
+  Try<Bytes> usage = diskUsage();
+  ASSERT_SOME(usage);
+
+  // Without truncation the log would hold every snapshot that has
+  // been written.
+  EXPECT_LT(usage->bytes(), written / 10)
+    << "Wrote " << Bytes(written) << " of snapshots";
+
+  // Recovering only reads the latest snapshot.
+  Store recovery(&log, RETENTION);
+
+  recovered = recovery.recover();
+  AWAIT_READY(recovered);
+  ASSERT_SOME(recovered.get());
+  EXPECT_EQ(state.SerializeAsString(),
+            recovered.get().get().SerializeAsString());
+}
+
+
+// Verifies that the `State` stored by older masters through the
+// `LogStorage` is recovered, and migrated to a snapshot.
+TEST_F(OverlayStoreTest, MigrateLegacyState)
+{
+  const string logPath = path::join(sandbox.get(), "log");
+
+  State state;
+  state.mutable_network()->set_vtep_subnet("44.128.0.0/16");
+  state.mutable_network()->set_vtep_mac_oui("70:B3:D5:00:00:00");
+  state.add_agents()->set_ip("172.16.0.1");
+
+  Log log(1, logPath, std::set<UPID>(), true);
+
+  {
+    mesos::state::LogStorage storage(&log);
+    mesos::state::protobuf::State replicatedLog(&storage);
+
+    Future<mesos::state::protobuf::Variable<State>> variable =
+      replicatedLog.fetch<State>("network-state");
+    AWAIT_READY(variable);
+
+    Future<Option<mesos::state::protobuf::Variable<State>>> stored =
+      replicatedLog.store(variable.get().mutate(state));
+    AWAIT_READY(stored);
+    ASSERT_SOME(stored.get());
+  }
+
+  {
+    Store store(&log, 1);
+
+    Future<Option<State>> recovered = store.recover();
+    AWAIT_READY(recovered);
+    ASSERT_SOME(recovered.get());
+    EXPECT_EQ(state.SerializeAsString(),
+              recovered.get().get().SerializeAsString());
+  }
+
+  // The second recovery finds the snapshot written by the migration.
+  Store store(&log, 1);
+
+  Future<Option<State>> recovered = store.recover();
+  AWAIT_READY(recovered);
+  ASSERT_SOME(recovered.get());
+  EXPECT_EQ(state.SerializeAsString(),
+            recovered.get().get().SerializeAsString());
+}
+
+
+// Verifies that a store that is not the writer of the log follows the
+// snapshots appended by the writer, and that it does not return them
+// again once it becomes the writer.
+TEST_F(OverlayStoreTest, Follow)
+{
+  Log log(1, path::join(sandbox.get(), "log"), std::set<UPID>(), true);
+
+  Store leader(&log, 10);
+  Store standby(&log, 10);
+
+  Future<Option<State>> state = leader.recover();
+  AWAIT_READY(state);
+  ASSERT_NONE(state.get());
+
+  state = standby.follow();
+  AWAIT_READY(state);
+  ASSERT_NONE(state.get());
+
+  State snapshot;
+  snapshot.mutable_network()->set_vtep_subnet("44.128.0.0/16");
+  snapshot.add_agents()->set_ip("172.16.0.1");
+
+  AWAIT_ASSERT_EQ(true, leader.store(snapshot));
+
+  state = standby.follow();
+  AWAIT_READY(state);
+  ASSERT_SOME(state.get());
+  EXPECT_EQ(snapshot.SerializeAsString(),
+            state.get().get().SerializeAsString());
+
+  // The snapshot is only returned once.
+  state = standby.follow();
+  AWAIT_READY(state);
+  EXPECT_NONE(state.get());
+
+  // Once the standby is elected there is nothing new to restore, and
+  // the previous writer can no longer append to the log.
+  state = standby.recover();
+  AWAIT_READY(state);
+  EXPECT_NONE(state.get());
+
+  AWAIT_EXPECT_EQ(false, leader.store(snapshot));
+
+  snapshot.add_agents()->set_ip("172.16.0.2");
+  AWAIT_ASSERT_EQ(true, standby.store(snapshot));
+
+  state = leader.follow();
+  AWAIT_READY(state);
+  ASSERT_SOME(state.get());
+  EXPECT_EQ(2, state.get()->agents_size());
+}
+
+
+
+// A fake Docker Engine API server, listening on a Unix socket, that
+// serves the network endpoints used by the `DockerClient`.
+class FakeDockerServer
+{
+public:
+  struct State
+  {
+    std::mutex mutex;
+
+    // The names of the Docker networks.
+    hashset<string> networks;
+
+    // The bodies of the requests that created networks.
+    vector<JSON::Object> created;
+
+    // The number of requests that listed the networks.
+    size_t lists = 0;
+  };
+
+  static Try<Owned<FakeDockerServer>> create(const string& path)
+  {
+    Try<network::unix::Address> address =
+      network::unix::Address::create(path);
+
+    if (address.isError()) {
+      return Error(address.error());
+    }
+
+    Try<network::Socket> socket =
+      network::Socket::create(network::Address::Family::UNIX);
+
+    if (socket.isError()) {
+      return Error(socket.error());
+    }
+
+    Try<network::Address> bind = socket->bind(address.get());
+    if (bind.isError()) {
+      return Error(bind.error());
+    }
+
+    Try<Nothing> listen = socket->listen(16);
+    if (listen.isError()) {
+      return Error(listen.error());
+    }
+
+    Owned<FakeDockerServer> server(new FakeDockerServer(socket.get()));
+    accept(server->socket, server->state);
+
+    return server;
+  }
+
+  std::shared_ptr<State> state;
+
+private:
+  explicit FakeDockerServer(const network::Socket& _socket)
+    : state(new State()),
+      socket(_socket) {}
+
+  static void accept(network::Socket socket, std::shared_ptr<State> state)
+  {
+    socket.accept()
+      .onReady([socket, state](const network::Socket& client) {
+        http::serve(client, [state](const http::Request& request) {
+          return handle(state, request);
+        });
+
+        accept(socket, state);
+      });
+  }
+
+  static Future<http::Response> handle(
+      const std::shared_ptr<State>& state,
+      const http::Request& request)
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    if (request.method == "GET" && request.url.path == "/networks") {
+      state->lists++;
+
+      JSON::Array networks;
+      foreach (const string& name, state->networks) {
+        JSON::Object network;
+        network.values["Name"] = name;
+        networks.values.push_back(network);
+      }
+
+      return http::OK(networks);
+    }
+
+    if (request.method == "POST" && request.url.path == "/networks/create") {
+      Try<JSON::Object> body = JSON::parse<JSON::Object>(request.body);
+      if (body.isError()) {
+        return http::BadRequest(body.error());
+      }
+
+      Result<JSON::String> name = body->find<JSON::String>("Name");
+      if (!name.isSome()) {
+        return http::BadRequest("Missing 'Name'");
+      }
+
+      if (state->networks.contains(name->value)) {
+        return http::Conflict();
+      }
+
+      state->networks.insert(name->value);
+      state->created.push_back(body.get());
+
+      return http::Response(
+          "{\"Id\": \"" + name->value + "\"}",
+          http::Status::CREATED,
+          "application/json");
+    }
+
+    return http::NotFound();
+  }
+
+  network::Socket socket;
+};
+
+
+class OverlayDockerTest : public TemporaryDirectoryTest {};
+
+
+// Tests that the `DockerClient` only creates the Docker networks that
+// don't exist, with the options of the `docker network create`
+// command used by the `Agent overlay module`.
+TEST_F(OverlayDockerTest, CreateNetworks)
+{
+  const string socket = path::join(sandbox.get(), "docker.sock");
+
+  Try<Owned<FakeDockerServer>> server = FakeDockerServer::create(socket);
+  ASSERT_SOME(server);
+
+  server.get()->state->networks.insert("existing");
+
+  Try<Owned<DockerClient>> client = DockerClient::create(socket);
+  ASSERT_SOME(client);
+
+  DockerNetwork dcos;
+  dcos.name = "dcos";
+  dcos.bridge = "d-dcos";
+  dcos.mtu = 1420;
+  dcos.subnet = "9.0.0.128/25";
+
+  DockerNetwork dcos6;
+  dcos6.name = "dcos6";
+  dcos6.bridge = "d-dcos6";
+  dcos6.mtu = 1420;
+  dcos6.subnet6 = "fd01:b::/80";
+
+  DockerNetwork existing;
+  existing.name = "existing";
+  existing.bridge = "d-existing";
+  existing.mtu = 1420;
+
+  Future<bool> createdDcos = client.get()->ensure(dcos);
+  Future<bool> createdDcos6 = client.get()->ensure(dcos6);
+  Future<bool> createdExisting = client.get()->ensure(existing);
+
+  AWAIT_EXPECT_EQ(true, createdDcos);
+  AWAIT_EXPECT_EQ(true, createdDcos6);
+  AWAIT_EXPECT_EQ(false, createdExisting);
+
+  {
+    std::lock_guard<std::mutex> lock(server.get()->state->mutex);
+
+    // The networks might have been reconciled in more than one batch,
+    // but every batch lists the networks once.
+    EXPECT_LE(1u, server.get()->state->lists);
+    EXPECT_GE(3u, server.get()->state->lists);
+
+    ASSERT_EQ(2u, server.get()->state->created.size());
+
+    foreach (const JSON::Object& body, server.get()->state->created) {
+      Result<JSON::String> name = body.find<JSON::String>("Name");
+      ASSERT_SOME(name);
+
+      // NOTE: `find` splits paths on dots, hence we look up the
+      // options, whose names contain dots, directly.
+      Result<JSON::Object> options = body.find<JSON::Object>("Options");
+      ASSERT_SOME(options);
+
+      EXPECT_EQ(
+          JSON::String("d-" + name->value),
+          options->values.at("com.docker.network.bridge.name"));
+      EXPECT_EQ(
+          JSON::String("false"),
+          options->values.at(
+              "com.docker.network.bridge.enable_ip_masquerade"));
+      EXPECT_EQ(
+          JSON::String("1420"),
+          options->values.at("com.docker.network.driver.mtu"));
+
+      Result<JSON::Boolean> ipv6 = body.find<JSON::Boolean>("EnableIPv6");
+      ASSERT_SOME(ipv6);
+      EXPECT_EQ(name->value == "dcos6", ipv6->value);
+    }
+  }
+
+  // Networks that exist are not created again.
+  createdDcos = client.get()->ensure(dcos);
+  AWAIT_EXPECT_EQ(false, createdDcos);
+
+  std::lock_guard<std::mutex> lock(server.get()->state->mutex);
+  EXPECT_EQ(2u, server.get()->state->created.size());
+}
+
+
+class OverlayShellTest : public TemporaryDirectoryTest {};
+
+
+// Tests that the commands run by the overlay modules are killed with
+// their children once they time out, that they fail once their output
+// exceeds the limit, and that only a bounded number of them run at
+// the same time.
+TEST_F(OverlayShellTest, Limits)
+{
+  Future<string> echo = runCommand("echo", {"echo", "overlay"});
+  AWAIT_EXPECT_EQ("overlay\n", echo);
+
+  Future<string> exit = runScriptCommand("echo failed >&2; exit 3");
+  AWAIT_EXPECT_FAILED(exit);
+  EXPECT_TRUE(strings::contains(exit.failure(), "failed"));
+
+  // The background `sleep` keeps stdout open, so the command only
+  // completes once its process group has been killed. The shell runs
+  // in a session of its own, hence its PID is the process group ID.
+  const string pgidPath = path::join(sandbox.get(), "pgid");
+
+  Future<string> sleep = runScriptCommand(
+      "echo $$ > " + pgidPath + "; sleep 1000 & sleep 1000",
+      Milliseconds(100));
+
+  AWAIT_EXPECT_FAILED(sleep);
+  EXPECT_TRUE(strings::contains(sleep.failure(), "timed out"));
+
+  Try<string> read = os::read(pgidPath);
+  ASSERT_SOME(read);
+
+  Try<pid_t> pgid = numify<pid_t>(strings::trim(read.get()));
+  ASSERT_SOME(pgid);
+
+  // The processes of the group are gone once they have been reaped.
+  int killed = ::kill(-pgid.get(), 0);
+  for (int i = 0; i < 1000 && killed == 0; i++) {
+    os::sleep(Milliseconds(10));
+    killed = ::kill(-pgid.get(), 0);
+  }
+
+  const int error = errno;
+
+  EXPECT_EQ(-1, killed);
+  EXPECT_EQ(ESRCH, error);
+
+  Future<string> output = runCommand(
+      "head",
+      {"head", "-c", stringify(MAX_COMMAND_OUTPUT.bytes() + 1), "/dev/zero"});
+
+  AWAIT_EXPECT_FAILED(output);
+  EXPECT_TRUE(strings::contains(output.failure(), "exceeds"));
+
+  // Twice as many commands as can run at the same time take at least
+  // twice as long as a single command.
+  Stopwatch watch;
+  watch.start();
+
+  std::list<Future<string>> sleeps;
+  for (size_t i = 0; i < 2 * MAX_CONCURRENT_COMMANDS; i++) {
+    sleeps.push_back(runCommand("sleep", {"sleep", "0.2"}));
+  }
+
+  AWAIT_READY(process::collect(sleeps));
+
+  watch.stop();
+
+  EXPECT_LE(Milliseconds(400), watch.elapsed());
+}
+
+
+class OverlayIpamTest : public TemporaryDirectoryTest {};
+
+
+// Builds a request of the `mesos-overlay-ipam` plugin to the `Ipam`.
+static http::Request ipamRequest(
+    const string& path,
+    const string& containerId,
+    const Option<string>& subnet = None())
+{
+  JSON::Object body;
+  body.values["network"] = "dcos";
+  body.values["container_id"] = containerId;
+  body.values["ifname"] = "eth0";
+
+  if (subnet.isSome()) {
+    body.values["subnet"] = subnet.get();
+  }
+
+  http::Request request;
+  request.method = "POST";
+  request.url = http::URL("http", "localhost", 80, path);
+  request.keepAlive = true;
+  request.headers["Content-Type"] = "application/json";
+  request.body = stringify(body);
+
+  return request;
+}
+
+
+// Tests that the `Ipam` allocates an IP per interface, reuses the
+// released IPs last, and recovers its allocations from its journal.
+TEST_F(OverlayIpamTest, AllocateRelease)
+{
+  const string directory = path::join(sandbox.get(), "ipam");
+  const string socket = path::join(sandbox.get(), "ipam.sock");
+
+  Try<Network> subnet = Network::parse("192.168.0.0/25", AF_INET);
+  ASSERT_SOME(subnet);
+
+  Try<Owned<Ipam>> ipam = Ipam::create(directory, socket);
+  ASSERT_SOME(ipam);
+
+  Future<Network> ip = ipam.get()->allocate("dcos", subnet.get(), "c1", "eth0");
+  AWAIT_READY(ip);
+  EXPECT_EQ("192.168.0.2/25", stringify(ip.get()));
+
+  ip = ipam.get()->allocate("dcos", subnet.get(), "c2", "eth0");
+  AWAIT_READY(ip);
+  EXPECT_EQ("192.168.0.3/25", stringify(ip.get()));
+
+  // An interface that already has an IP gets the same IP.
+  ip = ipam.get()->allocate("dcos", subnet.get(), "c1", "eth0");
+  AWAIT_READY(ip);
+  EXPECT_EQ("192.168.0.2/25", stringify(ip.get()));
+
+  AWAIT_READY(ipam.get()->release("dcos", "c1", "eth0"));
+
+  // Releasing an interface without an IP is not an error.
+  AWAIT_READY(ipam.get()->release("dcos", "c1", "eth0"));
+
+  // The IPs that were never allocated are used before the released
+  // ones.
+  ip = ipam.get()->allocate("dcos", subnet.get(), "c3", "eth0");
+  AWAIT_READY(ip);
+  EXPECT_EQ("192.168.0.4/25", stringify(ip.get()));
 
-  // Verify that the `IPMASQ` rules have been installed.
-  Future<string> iptables = runCommand("iptables",
-      {"iptables",
-      "-t", "nat",
-      "-C", "POSTROUTING",
-      "-s", OVERLAY_SUBNET,
-      "-m", "set",
-      "--match-set", stringify(IPSET_OVERLAY), "dst",
-      "-j", "MASQUERADE",
-      });
+  // The allocations are recovered from the journal.
+  ipam->reset();
 
-  AWAIT_READY(iptables);
+  ipam = Ipam::create(directory, socket);
+  ASSERT_SOME(ipam);
 
-  // Delete the IPMASQ rules.
-  iptables = runCommand("iptables",
-      {"iptables",
-      "-t", "nat",
-      "-D", "POSTROUTING",
-      "-s", OVERLAY_SUBNET,
-      "-m", "set",
-      "--match-set", stringify(IPSET_OVERLAY), "dst",
-      "-j", "MASQUERADE",
-      });
+  ip = ipam.get()->allocate("dcos", subnet.get(), "c2", "eth0");
+  AWAIT_READY(ip);
+  EXPECT_EQ("192.168.0.3/25", stringify(ip.get()));
 
-  AWAIT_READY(iptables);
+  ip = ipam.get()->allocate("dcos", subnet.get(), "c4", "eth0");
+  AWAIT_READY(ip);
+  EXPECT_EQ("192.168.0.5/25", stringify(ip.get()));
 
-  // Re-start the agent and wait for the agent to re-register.
-  Future<AgentRegisteredAcknowledgement> agentReRegisteredAcknowledgement =
-    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+  // A network can have a subnet larger than a /16, whose IPs are
+  // tracked as they are allocated.
+  Try<Network> large = Network::parse("10.0.0.0/8", AF_INET);
+  ASSERT_SOME(large);
 
-  // Kill the agent.
-  Try<Nothing> stop = stopOverlayAgent();
-  ASSERT_SOME(stop);
+  ip = ipam.get()->allocate("large", large.get(), "c1", "eth0");
+  AWAIT_READY(ip);
+  EXPECT_EQ("10.0.0.2/8", stringify(ip.get()));
 
-  // Reset the `mesos_bridge` and `docker_bridge` before restarting.
-  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(false);
-  agentOverlayConfig.mutable_network_config()->set_docker_bridge(false);
+  // The plugin reaches the `Ipam` over HTTP on the Unix socket.
+  Try<network::unix::Address> address =
+    network::unix::Address::create(socket);
+  ASSERT_SOME(address);
 
-  // re-start the agent.
-  agentModule = startOverlayAgent(agentOverlayConfig);
-  ASSERT_SOME(agentModule);
+  Future<http::Connection> connection = http::connect(address.get());
+  AWAIT_READY(connection);
 
-  AWAIT_READY(agentReRegisteredAcknowledgement);
+  Future<http::Response> response = connection->send(
+      ipamRequest("/allocate", "c5", string("192.168.0.0/25")));
 
-  // With the `mesos_bridge` and the `docker_bridge` disabled there
-  // should be no IPMASQ rules installed. Check IPMASQ rules don't exist.
-  iptables = runCommand("iptables",
-      {"iptables",
-      "-t", "nat",
-      "-C", "POSTROUTING",
-      "-s", OVERLAY_SUBNET,
-      "-m", "set",
-      "--match-set", stringify(IPSET_OVERLAY), "dst",
-      "-j", "MASQUERADE",
-      });
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
 
-  AWAIT_FAILED(iptables);
+  Try<JSON::Object> allocation = JSON::parse<JSON::Object>(response->body);
+  ASSERT_SOME(allocation);
 
-  // Hit the agent end-point again.
-  agentResponse = process::http::get(
-      overlayAgent,
-      "overlay");
+  EXPECT_SOME_EQ(
+      JSON::String("192.168.0.6/25"),
+      allocation->find<JSON::String>("ip"));
+  EXPECT_SOME_EQ(
+      JSON::String("192.168.0.1"),
+      allocation->find<JSON::String>("gateway"));
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      agentResponse);
+  response = connection->send(ipamRequest("/release", "c5"));
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
 
-  Try<AgentInfo> reRegisterInfo = parseAgentOverlay(agentResponse->body);
-  ASSERT_SOME(reRegisterInfo);
+  // The subnet is needed to allocate an IP.
+  response = connection->send(ipamRequest("/allocate", "c6"));
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(http::BadRequest().status, response);
 
-  // Though the `mesos_bridge` and `docker_bridge` have been disabled
-  // in the `AgentNetworkConfig`, the Master still has them enabled in
-  // this agents overlay configuration. So the overlay configuration
-  // reflected on the agent should also reflect the same configuration
-  // that the Master has tried to applied, i.e. the `mesos_bridge` and
-  // `docker_bridge` should have been enabled.
-  ASSERT_EQ(1, reRegisterInfo->overlays_size());
-  EXPECT_TRUE(reRegisterInfo->overlays(0).has_mesos_bridge());
-  EXPECT_TRUE(reRegisterInfo->overlays(0).has_docker_bridge());
+  AWAIT_READY(connection->disconnect());
 }
 
 
-// Tests if reserved network names are correctly rejected by the
-// master overlay module.
-TEST_F(OverlayTest, checkReservedNetworks)
+// Measures the time taken by the `Ipam` to allocate, and release, the
+// IPs of many containers launched at the same time, with the requests
+// of the plugins spread over a few connections.
+TEST_F(OverlayIpamTest, BENCHMARK_ConcurrentAllocations)
 {
-  // Try creating a master module with an overlay network that has a
-  // reserved name. The creation should fail.
-  foreach(const string& networkName, RESERVED_NETWORKS) {
-    // Whatever `MasterConfig` is given to the fixture is "merged"
-    // with the existing `MasterConfig`. So need to clear the existing
-    // overlays to test the reserved overlay network. Otherwise any
-    // "reserved" network that was added in the previous iteration
-    // would persist and would make this test void.
-    clearOverlays();
+  const size_t CONTAINERS = 1000;
+  const size_t CONNECTIONS = 16;
 
-    OverlayInfo overlay;
-    overlay.set_name(networkName);
-    overlay.set_subnet("9.0.0.0/8");
-    overlay.set_prefix(24);
+  const string socket = path::join(sandbox.get(), "ipam.sock");
 
-    MasterConfig masterOverlayConfig;
-    masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+  Try<Owned<Ipam>> ipam =
+    Ipam::create(path::join(sandbox.get(), "ipam"), socket);
+  ASSERT_SOME(ipam);
 
-    Try<Owned<Anonymous>> masterModule = startOverlayMaster(
-        masterOverlayConfig);
+  Try<network::unix::Address> address =
+    network::unix::Address::create(socket);
+  ASSERT_SOME(address);
 
-    ASSERT_ERROR(masterModule);
+  vector<http::Connection> connections;
+  for (size_t i = 0; i < CONNECTIONS; i++) {
+    Future<http::Connection> connection = http::connect(address.get());
+    AWAIT_READY(connection);
+
+    connections.push_back(connection.get());
   }
-}
 
+  const vector<string> paths = {"/allocate", "/release"};
 
-// Tests the ability of the overlay to add virtual networks.
-TEST_F(OverlayTest, ROOT_checkAddVirtualNetworks)
-{
-  Try<Owned<cluster::Master>> master = StartMaster();
-  ASSERT_SOME(master);
+  foreach (const string& path, paths) {
+    Stopwatch watch;
+    watch.start();
 
-  LOG(INFO) << "Master PID: " << master.get()->pid;
+    std::list<Future<http::Response>> responses;
+    for (size_t i = 0; i < CONTAINERS; i++) {
+      responses.push_back(connections[i % CONNECTIONS].send(
+          ipamRequest(path, "container" + stringify(i), string("9.0.0.0/21"))));
+    }
 
-  // Ask overlay Master to use the replicated log by setting
-  // `replicated_log_dir`. We are not specifying `zk` configuration so
-  // the `quorum` will default to "1".
-  MasterConfig masterOverlayConfig;
-  masterOverlayConfig
-    .set_replicated_log_dir("overlay_replicated_log");
+    Future<std::list<http::Response>> collected = process::collect(responses);
+    AWAIT_READY(collected);
 
-  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
-  ASSERT_SOME(masterModule);
+    watch.stop();
 
-  // Master `Anonymous` module created successfully. Lets see if we
-  // can hit the `state` endpoint of the Master.
-  UPID overlayMaster = UPID(master.get()->pid);
-  overlayMaster.id = MASTER_MANAGER_PROCESS_ID;
+    foreach (const http::Response& response, collected.get()) {
+      EXPECT_EQ(OK().status, response.status);
+    }
 
-  AgentConfig agentOverlayConfig;
-  agentOverlayConfig.set_master(stringify(overlayMaster.address));
-  // Enable Mesos network.
-  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
-  // Enable Docker network.
-  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+    cout << "Served " << CONTAINERS << " '" << path << "' requests in "
+         << watch.elapsed() << endl;
+  }
 
-  // Setup a future to notify the test that Agent overlay module has
-  // registered.
-  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
-    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+  foreach (http::Connection& connection, connections) {
+    AWAIT_READY(connection.disconnect());
+  }
+}
 
-  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
-      agentOverlayConfig);
 
-  ASSERT_SOME(agentModule );
+class OverlayNetworkTest : public ::testing::Test {};
 
-  AWAIT_READY(agentRegisteredAcknowledgement);
 
-  // Check the agent is allowed to progress.
-  AWAIT_READY(agentModule.get()->ready());
+// Returns the bytes of `ip`, in network byte order.
+static vector<uint8_t> toBytes(const net::IP& ip)
+{
+  switch (ip.family()) {
+    case AF_INET: {
+      const in_addr in = ip.in().get();
+      const uint8_t* data = (const uint8_t*) &in.s_addr;
+      return vector<uint8_t>(data, data + sizeof(in.s_addr));
+    }
+    case AF_INET6: {
+      const in6_addr in6 = ip.in6().get();
+      return vector<uint8_t>(in6.s6_addr, in6.s6_addr + sizeof(in6.s6_addr));
+    }
+    default:
+      UNREACHABLE();
+  }
+}
 
-  // Kill the master.
-  masterModule->reset();
 
-  // Add an overlay network to the master configuration.
-  //
-  // NOTE: Since the `masterOverlayConfig` is "merged" with the stored
-  // `masterOverlayConfig` ensure this is the only overlay network
-  // delcared in the `masterOverlayConfig` object being passed into
-  // `startOverlayMaster`.
-  OverlayInfo overlay;
-  overlay.set_name("mz-test-add");
-  overlay.set_subnet("11.0.0.0/8");
-  overlay.set_subnet6("fd04::/64");
-  overlay.set_prefix(OVERLAY_PREFIX);
-  overlay.set_prefix6(OVERLAY_PREFIX6);
+// Returns the IP of the same family as `ip` holding `bytes`.
+static net::IP fromBytes(const net::IP& ip, const vector<uint8_t>& bytes)
+{
+  switch (ip.family()) {
+    case AF_INET: {
+      in_addr in;
+      memcpy(&in.s_addr, bytes.data(), sizeof(in.s_addr));
+      return net::IP(in);
+    }
+    case AF_INET6: {
+      in6_addr in6;
+      memcpy(in6.s6_addr, bytes.data(), sizeof(in6.s6_addr));
+      return net::IP(in6);
+    }
+    default:
+      UNREACHABLE();
+  }
+}
 
-  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
 
-  masterModule = startOverlayMaster(masterOverlayConfig);
-  ASSERT_SOME(masterModule);
+// Verifies that a `Network` agrees with the `net::IP::Network` of the
+// same address and prefix for every prefix length, and that its first
+// and last addresses, and the networks before and after it, match the
+// ones computed byte by byte from the netmask of the
+// `net::IP::Network`.
+TEST_F(OverlayNetworkTest, RoundTrip)
+{
+  const vector<string> addresses = {
+    "0.0.0.0",
+    "10.1.2.3",
+    "192.168.255.255",
+    "255.255.255.255",
+    "::",
+    "fd00::1",
+    "2001:db8:ffff:ffff:ffff:ffff:ffff:ffff",
+    "2001:db8:0:1:8000::",
+    "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"
+  };
+
+  foreach (const string& value, addresses) {
+    Try<net::IP> address = net::IP::parse(value, AF_UNSPEC);
+    ASSERT_SOME(address);
+
+    const int bits = address->family() == AF_INET ? 32 : 128;
+
+    for (int prefix = 0; prefix <= bits; prefix++) {
+      SCOPED_TRACE(value + "/" + stringify(prefix));
+
+      Try<net::IP::Network> expected =
+        net::IP::Network::create(address.get(), prefix);
+      ASSERT_SOME(expected);
+
+      Network network(address.get(), prefix);
+
+      EXPECT_EQ(expected->address(), network.address());
+      EXPECT_EQ(expected->netmask(), network.netmask());
+      EXPECT_EQ(expected->prefix(), network.prefix());
+      EXPECT_EQ(stringify(expected.get()), stringify(network));
+
+      EXPECT_EQ(
+          expected->netmask(),
+          Network::toMask(prefix, address->family()));
+
+      Try<Network> parsed = Network::parse(stringify(expected.get()));
+      ASSERT_SOME(parsed);
+      EXPECT_EQ(network, parsed.get());
+
+      Try<Network> decoded = Network::decode(network.encode());
+      ASSERT_SOME(decoded);
+      EXPECT_EQ(network, decoded.get());
+
+      const vector<uint8_t> bytes = toBytes(address.get());
+      const vector<uint8_t> mask = toBytes(expected->netmask());
+
+      vector<uint8_t> begin(bytes.size());
+      vector<uint8_t> end(bytes.size());
+      for (size_t i = 0; i < bytes.size(); i++) {
+        begin[i] = bytes[i] & mask[i];
+        end[i] = bytes[i] | ~mask[i];
+      }
 
-  // Re-start the master and wait for the Agent to re-register.
-  agentRegisteredAcknowledgement = FUTURE_PROTOBUF(
-      AgentRegisteredAcknowledgement(), _, _);
+      EXPECT_EQ(fromBytes(address.get(), begin), network.begin());
+      EXPECT_EQ(fromBytes(address.get(), end), network.end());
 
-  AWAIT_READY(agentRegisteredAcknowledgement);
+      // The next network starts right after the last address of this
+      // one, and the previous network ends right before the first
+      // address of this one, wrapping around the address space.
+      vector<uint8_t> after = end;
+      for (int i = after.size() - 1; i >= 0; i--) {
+        if (++after[i] != 0) {
+          break;
+        }
+      }
 
-  // Hit the master end-point again.
-  Future<Response> masterResponse = process::http::get(
-      overlayMaster,
-      "state");
+      vector<uint8_t> before = begin;
+      for (int i = before.size() - 1; i >= 0; i--) {
+        if (before[i]-- != 0) {
+          break;
+        }
+      }
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      masterResponse);
+      Network next = network;
+      ++next;
+      EXPECT_EQ(prefix, next.prefix());
+      EXPECT_EQ(fromBytes(address.get(), after), next.begin());
 
-  Try<State> state = parseMasterState(masterResponse->body);
-  ASSERT_SOME(state);
-  ASSERT_EQ(1, state->agents_size());
+      Network previous = network;
+      --previous;
+      EXPECT_EQ(prefix, previous.prefix());
+      EXPECT_EQ(fromBytes(address.get(), before), previous.end());
 
-  ASSERT_TRUE(state->has_network());
-  ASSERT_EQ(2, state->network().overlays_size());
+      --next;
+      EXPECT_EQ(Network(network.begin(), prefix), next);
 
-  Option<OverlayInfo> _overlay;
-  foreach(const OverlayInfo& __overlay, state->network().overlays()) {
-    if (__overlay.name() == "mz-test-add") {
-      _overlay = __overlay;
-      break;
+      ++previous;
+      EXPECT_EQ(Network(network.begin(), prefix), previous);
     }
   }
+}
 
-  ASSERT_SOME(_overlay);
-  ASSERT_EQ(_overlay->subnet(), "11.0.0.0/8");
-  ASSERT_EQ(_overlay->subnet6(), "fd04::/64");
 
-  // Hit the `overlay` endpoint of the agent to check that module is
-  // up and responding.
-  UPID overlayAgent = UPID(master.get()->pid);
-  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+// Adds (or subtracts) 2^(bits - prefix) to the address in `bytes`,
+// i.e., steps to the next (or previous) network of `prefix`, wrapping
+// around the address space.
+static void step(vector<uint8_t>* bytes, int prefix, bool forward)
+{
+  if (prefix == 0) {
+    return;
+  }
 
-  Future<Response> agentResponse = process::http::get(
-      overlayAgent,
-      "overlay");
+  const int bit = bytes->size() * 8 - prefix;
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      agentResponse);
+  int carry = 1 << (bit % 8);
+  for (int i = bytes->size() - 1 - bit / 8; i >= 0 && carry != 0; i--) {
+    const int value = (*bytes)[i] + (forward ? carry : -carry);
+    (*bytes)[i] = value & 0xff;
+    carry = value < 0 || value > 0xff ? 1 : 0;
+  }
+}
 
-  // The `overlay` end-point is backed by the
-  // mesos::modules::overlay::AgentInfo protobuf, so need to parse the
-  // JSON and verify that the correct configuration is being
-  // reflected.
-  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
-  ASSERT_SOME(info);
 
-  // There should be 2 overlays.
-  ASSERT_EQ(2, info->overlays_size());
+// Verifies the IPv6 arithmetic of `IP` and `Network` against the byte
+// by byte arithmetic, on random addresses biased towards the carries
+// between the bytes and the 64-bit halves of the addresses, for every
+// prefix length.
+TEST_F(OverlayNetworkTest, IPv6Arithmetic)
+{
+  const int ADDRESSES = 2000;
 
-  Option<AgentOverlayInfo> agentOverlay;
+  std::mt19937 generator(42);
 
-  foreach(const AgentOverlayInfo& _agentOverlay, info->overlays()) {
-    if (_agentOverlay.info().name() == "mz-test-add") {
-      agentOverlay = _agentOverlay;
-      break;
+  for (int i = 0; i < ADDRESSES; i++) {
+    in6_addr in6;
+    foreach (uint8_t& byte, in6.s6_addr) {
+      switch (generator() % 4) {
+        case 0: byte = 0x00; break;
+        case 1: byte = 0xff; break;
+        default: byte = generator() & 0xff; break;
+      }
+    }
+
+    const net::IP address(in6);
+    const vector<uint8_t> bytes = toBytes(address);
+
+    SCOPED_TRACE(stringify(address));
+
+    vector<uint8_t> after = bytes;
+    step(&after, 128, true);
+
+    vector<uint8_t> before = bytes;
+    step(&before, 128, false);
+
+    mesos::modules::overlay::IP ip(in6);
+
+    ++ip;
+    EXPECT_EQ(fromBytes(address, after), ip);
+
+    --ip;
+    EXPECT_EQ(address, ip);
+
+    --ip;
+    EXPECT_EQ(fromBytes(address, before), ip);
+
+    for (int prefix = 0; prefix <= 128; prefix++) {
+      SCOPED_TRACE("Prefix " + stringify(prefix));
+
+      const Network network(address, prefix);
+      const vector<uint8_t> begin = toBytes(network.begin());
+
+      vector<uint8_t> next = begin;
+      step(&next, prefix, true);
+
+      vector<uint8_t> previous = begin;
+      step(&previous, prefix, false);
+
+      Network _network = network;
+
+      ++_network;
+      EXPECT_EQ(fromBytes(address, next), _network.address());
+
+      --_network;
+      EXPECT_EQ(fromBytes(address, begin), _network.address());
+
+      --_network;
+      EXPECT_EQ(fromBytes(address, previous), _network.address());
     }
   }
+}
 
-  ASSERT_SOME(agentOverlay);
-  ASSERT_EQ(agentOverlay->subnet(), "11.0.0.0/24");
-  ASSERT_EQ(agentOverlay->info().subnet(), "11.0.0.0/8");
-  ASSERT_EQ(agentOverlay->subnet6(), "fd04::/80");
-  ASSERT_EQ(agentOverlay->info().subnet6(), "fd04::/64");
+
+// Measures the time taken to step through, copy and compare a large
+// number of `Network`s, as the master does when it allocates subnets
+// out of the interval sets of the overlays.
+TEST_F(OverlayNetworkTest, BENCHMARK_Iteration)
+{
+  const size_t NETWORKS = 1000000;
+
+  // NOTE: The networks stepped from "fd00::ffff:ffff:ffff:0/112"
+  // carry from the lower into the upper half of the addresses.
+  const vector<string> values = {
+    "10.0.0.0/24",
+    "fd00::/64",
+    "fd00::/120",
+    "fd00::ffff:ffff:ffff:0/112",
+    "fd00::/128"
+  };
+
+  foreach (const string& value, values) {
+    Try<Network> first = Network::parse(value);
+    ASSERT_SOME(first);
+
+    vector<Network> networks;
+    networks.reserve(NETWORKS);
+
+    Stopwatch watch;
+    watch.start();
+
+    Network network = first.get();
+    for (size_t i = 0; i < NETWORKS; i++) {
+      networks.push_back(network);
+      ++network;
+    }
+
+    size_t ordered = 0;
+    for (size_t i = 1; i < networks.size(); i++) {
+      ordered += networks[i - 1] < networks[i];
+    }
+
+    watch.stop();
+
+    EXPECT_EQ(NETWORKS - 1, ordered);
+
+    cout << "Stepped through " << NETWORKS << " networks from " << value
+         << " in " << watch.elapsed() << endl;
+  }
 }
 
 } // namespace tests {
 } // namespace overlay {
 } // namespace mesos {
-